@@ -0,0 +1,411 @@
+#include "aho_corasick.h"
+#include "case_fold.h"
+#include "utf8.h"
+
+#include <stdlib.h> // calloc(), malloc(), realloc(), free()
+#include <string.h> // memcpy(), memcmp(), memset()
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // SSSE3 intrinsics
+#define AHO_CORASICK_X86
+#endif
+
+/* Characters of the last this many matched units are remembered on stack */
+#define AHO_CORASICK_STACK_UNITS 256
+
+/* Folding pattern bytes the same way text bytes will be folded */
+/* Returns folded copy and sets number of units for match positions */
+static unsigned char* fold_pattern(const AhoCorasick* automaton, const char* pattern, size_t length,
+	size_t* folded_length, size_t* units) {
+	unsigned char* folded = malloc(length * UTF8_MAX_LENGTH + 1);
+	if (folded == NULL) { return NULL; }
+	const unsigned char* bytes = (const unsigned char*)pattern;
+
+	if (!automaton->is_unicode_fold) {
+		for (size_t index = 0; index < length; index++) { folded[index] = automaton->fold[bytes[index]]; }
+		*folded_length = length;
+		*units = length;
+		return folded;
+	}
+
+	/* Case folding may change length of characters, so units are characters */
+	size_t position = 0;
+	*folded_length = 0;
+	*units = 0;
+	while (position < length) {
+		wchar_t c;
+		position += utf8_decode(bytes + position, length - position, &c);
+		*folded_length += utf8_encode(case_fold(c), (char*)folded + *folded_length);
+		*units += 1;
+	}
+	return folded;
+}
+
+/* Adding state with all transitions missing, returns its index */
+static int add_state(AhoCorasick* automaton, size_t* state_capacity, uint32_t* state) {
+	if (automaton->state_count == *state_capacity) {
+		size_t capacity = *state_capacity * 2;
+		uint32_t* transitions = realloc(automaton->transitions, capacity * automaton->class_count * sizeof(uint32_t));
+		if (transitions == NULL) { return 0; }
+		automaton->transitions = transitions;
+		uint32_t* outputs = realloc(automaton->outputs, capacity * sizeof(uint32_t));
+		if (outputs == NULL) { return 0; }
+		automaton->outputs = outputs;
+		*state_capacity = capacity;
+	}
+	*state = (uint32_t)automaton->state_count;
+	memset(&automaton->transitions[*state * automaton->class_count], 0, automaton->class_count * sizeof(uint32_t));
+	automaton->outputs[*state] = AHO_CORASICK_NO_PATTERN;
+	automaton->state_count += 1;
+	return 1;
+}
+
+/* Building trie first, then filling failure transitions breadth first */
+/* Every transition ends up stored, so matching never follows failure links */
+static int build_automaton(AhoCorasick* automaton) {
+	size_t state_capacity = 64;
+	automaton->transitions = malloc(state_capacity * automaton->class_count * sizeof(uint32_t));
+	automaton->outputs = malloc(state_capacity * sizeof(uint32_t));
+	if (automaton->transitions == NULL || automaton->outputs == NULL) { return 0; }
+	uint32_t root;
+	if (!add_state(automaton, &state_capacity, &root)) { return 0; }
+
+	size_t class_count = automaton->class_count;
+	for (size_t pattern = 0; pattern < automaton->pattern_count; pattern++) {
+		if (automaton->pattern_lengths[pattern] == 0) { continue; }
+		uint32_t state = root;
+		for (size_t index = 0; index < automaton->pattern_lengths[pattern]; index++) {
+			size_t byte_class = automaton->byte_classes[automaton->patterns[pattern][index]];
+			uint32_t next = automaton->transitions[state * class_count + byte_class];
+			if (next == root) {
+				if (!add_state(automaton, &state_capacity, &next)) { return 0; }
+				automaton->transitions[state * class_count + byte_class] = next;
+			}
+			state = next;
+		}
+		/* Duplicate patterns are reported as the first one */
+		if (automaton->outputs[state] == AHO_CORASICK_NO_PATTERN) { automaton->outputs[state] = (uint32_t)pattern; }
+	}
+
+	/* States are visited in order of depth, so failure states are complete */
+	uint32_t* failures = calloc(automaton->state_count, sizeof(uint32_t));
+	uint32_t* queue = malloc(automaton->state_count * sizeof(uint32_t));
+	if (failures == NULL || queue == NULL) {
+		free(failures); free(queue);
+		return 0;
+	}
+	size_t queue_start = 0;
+	size_t queue_end = 0;
+	queue[queue_end++] = root;
+	while (queue_start < queue_end) {
+		uint32_t state = queue[queue_start++];
+		uint32_t* row = &automaton->transitions[state * class_count];
+		const uint32_t* failure_row = &automaton->transitions[failures[state] * class_count];
+		for (size_t byte_class = 0; byte_class < class_count; byte_class++) {
+			uint32_t child = row[byte_class];
+			if (child == root) {
+				row[byte_class] = (state == root) ? root : failure_row[byte_class];
+				continue;
+			}
+			failures[child] = (state == root) ? root : failure_row[byte_class];
+			if (automaton->outputs[child] == AHO_CORASICK_NO_PATTERN) {
+				automaton->outputs[child] = automaton->outputs[failures[child]];
+			}
+			queue[queue_end++] = child;
+		}
+	}
+	free(failures);
+	free(queue);
+
+	/* Storing row offsets instead of state numbers avoids multiplication */
+	for (size_t index = 0; index < automaton->state_count * class_count; index++) {
+		uint32_t state = automaton->transitions[index];
+		uint32_t next = state * (uint32_t)class_count;
+		if (automaton->outputs[state] != AHO_CORASICK_NO_PATTERN) { next |= AHO_CORASICK_MATCH_BIT; }
+		automaton->transitions[index] = next;
+	}
+	return 1;
+}
+
+/* Preparing nibble masks of leading pattern bytes for Teddy */
+static void build_teddy(AhoCorasick* automaton) {
+	size_t fingerprint_length = AHO_CORASICK_TEDDY_MAX_FINGERPRINT;
+	for (size_t pattern = 0; pattern < automaton->pattern_count; pattern++) {
+		size_t length = automaton->pattern_lengths[pattern];
+		if (length > 0 && length < fingerprint_length) { fingerprint_length = length; }
+	}
+	automaton->teddy.fingerprint_length = fingerprint_length;
+	memset(automaton->teddy.low_masks, 0, sizeof(automaton->teddy.low_masks));
+	memset(automaton->teddy.high_masks, 0, sizeof(automaton->teddy.high_masks));
+
+	for (size_t pattern = 0; pattern < automaton->pattern_count; pattern++) {
+		if (automaton->pattern_lengths[pattern] == 0) { continue; }
+		uint8_t bucket = (uint8_t)(1 << pattern);
+		for (size_t index = 0; index < fingerprint_length; index++) {
+			/* Text bytes are not folded by Teddy, so both cases are added */
+			for (size_t byte = 0; byte < 256; byte++) {
+				if (automaton->fold[byte] != automaton->patterns[pattern][index]) { continue; }
+				automaton->teddy.low_masks[index][byte & 0x0F] |= bucket;
+				automaton->teddy.high_masks[index][byte >> 4] |= bucket;
+			}
+		}
+	}
+}
+
+AhoCorasick* aho_corasick_new(char** patterns, const size_t* pattern_lengths, size_t pattern_count, int ignore_case) {
+	AhoCorasick* automaton = calloc(1, sizeof(AhoCorasick));
+	if (automaton == NULL) { return NULL; }
+	automaton->pattern_count = pattern_count;
+	automaton->ignore_case = ignore_case;
+	for (size_t index = 0; index < 256; index++) { automaton->fold[index] = (unsigned char)index; }
+
+	/* ASCII patterns only need ASCII letters of the text folded */
+	/* Any non-ASCII pattern requires folding decoded text characters */
+	if (ignore_case) {
+		for (size_t index = 'A'; index <= 'Z'; index++) { automaton->fold[index] = (unsigned char)(index + 32); }
+		for (size_t pattern = 0; pattern < pattern_count; pattern++) {
+			for (size_t index = 0; index < pattern_lengths[pattern]; index++) {
+				if ((unsigned char)patterns[pattern][index] >= 0x80) { automaton->is_unicode_fold = 1; }
+			}
+		}
+	}
+	if (automaton->is_unicode_fold) {
+		for (size_t index = 'A'; index <= 'Z'; index++) { automaton->fold[index] = (unsigned char)index; }
+	}
+
+	automaton->patterns = calloc(pattern_count, sizeof(unsigned char*));
+	automaton->pattern_lengths = calloc(pattern_count, sizeof(size_t));
+	automaton->pattern_units = calloc(pattern_count, sizeof(size_t));
+	if (automaton->patterns == NULL || automaton->pattern_lengths == NULL || automaton->pattern_units == NULL) {
+		aho_corasick_free(automaton);
+		return NULL;
+	}
+	for (size_t pattern = 0; pattern < pattern_count; pattern++) {
+		automaton->patterns[pattern] = fold_pattern(automaton, patterns[pattern], pattern_lengths[pattern],
+			&automaton->pattern_lengths[pattern], &automaton->pattern_units[pattern]);
+		if (automaton->patterns[pattern] == NULL) {
+			aho_corasick_free(automaton);
+			return NULL;
+		}
+		if (automaton->pattern_units[pattern] > automaton->max_pattern_units) {
+			automaton->max_pattern_units = automaton->pattern_units[pattern];
+		}
+	}
+
+	/* Bytes used by patterns get their own classes, all others share class 0 */
+	automaton->class_count = 1;
+	for (size_t pattern = 0; pattern < pattern_count; pattern++) {
+		for (size_t index = 0; index < automaton->pattern_lengths[pattern]; index++) {
+			unsigned char byte = automaton->patterns[pattern][index];
+			if (automaton->byte_classes[byte] == 0) {
+				automaton->byte_classes[byte] = (uint8_t)automaton->class_count++;
+			}
+		}
+	}
+	for (size_t index = 0; index < 256; index++) {
+		automaton->byte_classes[index] = automaton->byte_classes[automaton->fold[index]];
+	}
+
+	if (!build_automaton(automaton)) {
+		aho_corasick_free(automaton);
+		return NULL;
+	}
+
+#ifdef AHO_CORASICK_X86
+	/* Teddy needs SSSE3 byte shuffles and works on raw text bytes */
+	__builtin_cpu_init();
+	if (!automaton->is_unicode_fold && pattern_count <= AHO_CORASICK_TEDDY_MAX_PATTERNS
+		&& automaton->max_pattern_units > 0 && __builtin_cpu_supports("ssse3")) {
+		automaton->is_teddy = 1;
+		build_teddy(automaton);
+	}
+#endif
+	return automaton;
+}
+
+/* Remembering leftmost match, or longer match starting at the same place */
+static int update_best_match(size_t start, size_t length, uint32_t pattern,
+	size_t* best_start, size_t* best_length, uint32_t* best_pattern) {
+	if (*best_pattern == AHO_CORASICK_NO_PATTERN || start < *best_start
+		|| (start == *best_start && length > *best_length)) {
+		*best_start = start;
+		*best_length = length;
+		*best_pattern = pattern;
+		return 1;
+	}
+	return 0;
+}
+
+/* Running automaton over raw or ASCII folded bytes */
+/* Scanning continues after first match only while an earlier starting */
+/* match could still end, which is at most longest pattern length later */
+static const char* find_bytes(const AhoCorasick* automaton, const char* text, size_t text_length,
+	size_t* match_length, size_t* pattern_index) {
+	const unsigned char* bytes = (const unsigned char*)text;
+	const uint32_t* transitions = automaton->transitions;
+	const uint8_t* byte_classes = automaton->byte_classes;
+	size_t best_start = 0;
+	size_t best_length = 0;
+	uint32_t best_pattern = AHO_CORASICK_NO_PATTERN;
+
+	uint32_t state = 0;
+	for (size_t index = 0; index < text_length; index++) {
+		uint32_t next = transitions[state + byte_classes[bytes[index]]];
+		state = next & ~AHO_CORASICK_MATCH_BIT;
+		if (next & AHO_CORASICK_MATCH_BIT) {
+			uint32_t pattern = automaton->outputs[state / automaton->class_count];
+			size_t length = automaton->pattern_lengths[pattern];
+			update_best_match(index + 1 - length, length, pattern, &best_start, &best_length, &best_pattern);
+		}
+		if (best_pattern != AHO_CORASICK_NO_PATTERN && index + 1 - best_start >= automaton->max_pattern_units) {
+			break;
+		}
+	}
+
+	if (best_pattern == AHO_CORASICK_NO_PATTERN) { return NULL; }
+	*match_length = best_length;
+	*pattern_index = best_pattern;
+	return text + best_start;
+}
+
+/* Running automaton over decoded, folded and encoded text characters */
+/* Start offsets of recent characters are kept in a ring to map */
+/* character positions of matches back to original text bytes */
+static const char* find_characters(const AhoCorasick* automaton, const char* text, size_t text_length,
+	size_t* match_length, size_t* pattern_index) {
+	size_t stack_offsets[AHO_CORASICK_STACK_UNITS];
+	size_t* offsets = stack_offsets;
+	size_t ring_size = AHO_CORASICK_STACK_UNITS;
+	while (ring_size <= automaton->max_pattern_units) { ring_size *= 2; }
+	if (ring_size > AHO_CORASICK_STACK_UNITS) {
+		offsets = malloc(ring_size * sizeof(size_t));
+		if (offsets == NULL) { return NULL; }
+	}
+
+	const unsigned char* bytes = (const unsigned char*)text;
+	const uint32_t* transitions = automaton->transitions;
+	size_t best_start = 0; // in characters
+	size_t best_offset = 0;
+	size_t best_length = 0;
+	uint32_t best_pattern = AHO_CORASICK_NO_PATTERN;
+
+	uint32_t state = 0;
+	size_t character_index = 0;
+	size_t position = 0;
+	while (position < text_length) {
+		wchar_t c;
+		offsets[character_index & (ring_size - 1)] = position;
+		position += utf8_decode(bytes + position, text_length - position, &c);
+		char folded[UTF8_MAX_LENGTH];
+		size_t folded_length = utf8_encode(case_fold(c), folded);
+
+		for (size_t index = 0; index < folded_length; index++) {
+			uint32_t next = transitions[state + automaton->byte_classes[(unsigned char)folded[index]]];
+			state = next & ~AHO_CORASICK_MATCH_BIT;
+			if (!(next & AHO_CORASICK_MATCH_BIT)) { continue; }
+			uint32_t pattern = automaton->outputs[state / automaton->class_count];
+			size_t start = character_index + 1 - automaton->pattern_units[pattern];
+			size_t offset = offsets[start & (ring_size - 1)];
+			if (update_best_match(start, position - offset, pattern, &best_start, &best_length, &best_pattern)) {
+				best_offset = offset;
+			}
+		}
+
+		character_index += 1;
+		if (best_pattern != AHO_CORASICK_NO_PATTERN && character_index - best_start >= automaton->max_pattern_units) {
+			break;
+		}
+	}
+
+	if (offsets != stack_offsets) { free(offsets); }
+	if (best_pattern == AHO_CORASICK_NO_PATTERN) { return NULL; }
+	*match_length = best_length;
+	*pattern_index = best_pattern;
+	return text + best_offset;
+}
+
+#ifdef AHO_CORASICK_X86
+/* Teddy tests leading bytes of all patterns at 16 positions at once */
+/* Each byte of the result holds bits of patterns that may start there */
+__attribute__((target("ssse3")))
+static const char* find_teddy(const AhoCorasick* automaton, const char* text, size_t text_length,
+	size_t* match_length, size_t* pattern_index) {
+	const AhoCorasickTeddy* teddy = &automaton->teddy;
+	const __m128i low_nibbles = _mm_set1_epi8(0x0F);
+	__m128i low_masks[AHO_CORASICK_TEDDY_MAX_FINGERPRINT];
+	__m128i high_masks[AHO_CORASICK_TEDDY_MAX_FINGERPRINT];
+	for (size_t index = 0; index < teddy->fingerprint_length; index++) {
+		low_masks[index] = _mm_loadu_si128((const __m128i*)teddy->low_masks[index]);
+		high_masks[index] = _mm_loadu_si128((const __m128i*)teddy->high_masks[index]);
+	}
+
+	size_t position = 0;
+	for (; position + 16 + teddy->fingerprint_length - 1 <= text_length; position += 16) {
+		__m128i buckets = _mm_set1_epi8((char)0xFF);
+		for (size_t index = 0; index < teddy->fingerprint_length; index++) {
+			__m128i block = _mm_loadu_si128((const __m128i*)(text + position + index));
+			__m128i low = _mm_and_si128(block, low_nibbles);
+			__m128i high = _mm_and_si128(_mm_srli_epi16(block, 4), low_nibbles);
+			buckets = _mm_and_si128(buckets, _mm_and_si128(
+				_mm_shuffle_epi8(low_masks[index], low), _mm_shuffle_epi8(high_masks[index], high)));
+		}
+		unsigned int candidates = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(buckets, _mm_setzero_si128())) ^ 0xFFFF;
+		if (candidates == 0) { continue; }
+
+		/* Verifying candidates in order, first verified one is leftmost */
+		uint8_t bucket_bytes[16];
+		_mm_storeu_si128((__m128i*)bucket_bytes, buckets);
+		while (candidates != 0) {
+			size_t offset = (size_t)__builtin_ctz(candidates);
+			candidates &= candidates - 1;
+			const unsigned char* candidate = (const unsigned char*)text + position + offset;
+			size_t remaining = text_length - (position + offset);
+
+			uint32_t best_pattern = AHO_CORASICK_NO_PATTERN;
+			for (uint32_t pattern = 0; pattern < automaton->pattern_count; pattern++) {
+				size_t length = automaton->pattern_lengths[pattern];
+				if (!(bucket_bytes[offset] & (1 << pattern)) || length > remaining) { continue; }
+				if (best_pattern != AHO_CORASICK_NO_PATTERN && length <= automaton->pattern_lengths[best_pattern]) { continue; }
+				size_t index = 0;
+				while (index < length && automaton->fold[candidate[index]] == automaton->patterns[pattern][index]) { index++; }
+				if (index == length) { best_pattern = pattern; }
+			}
+			if (best_pattern != AHO_CORASICK_NO_PATTERN) {
+				*match_length = automaton->pattern_lengths[best_pattern];
+				*pattern_index = best_pattern;
+				return (const char*)candidate;
+			}
+		}
+	}
+
+	/* Remaining positions near the end are left to the automaton */
+	return find_bytes(automaton, text + position, text_length - position, match_length, pattern_index);
+}
+#endif
+
+const char* aho_corasick_find(const AhoCorasick* automaton, const char* text, size_t text_length,
+	size_t* match_length, size_t* pattern_index) {
+	if (automaton->max_pattern_units == 0) { return NULL; }
+	if (automaton->is_unicode_fold) {
+		return find_characters(automaton, text, text_length, match_length, pattern_index);
+	}
+#ifdef AHO_CORASICK_X86
+	if (automaton->is_teddy) {
+		return find_teddy(automaton, text, text_length, match_length, pattern_index);
+	}
+#endif
+	return find_bytes(automaton, text, text_length, match_length, pattern_index);
+}
+
+void aho_corasick_free(AhoCorasick* automaton) {
+	if (automaton == NULL) { return; }
+	if (automaton->patterns != NULL) {
+		for (size_t index = 0; index < automaton->pattern_count; index++) { free(automaton->patterns[index]); }
+	}
+	free(automaton->patterns);
+	free(automaton->pattern_lengths);
+	free(automaton->pattern_units);
+	free(automaton->transitions);
+	free(automaton->outputs);
+	free(automaton);
+}
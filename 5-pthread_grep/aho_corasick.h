@@ -0,0 +1,52 @@
+/* All header files need to be protected with preprocessor guards */
+#ifndef AHO_CORASICK_H
+#define AHO_CORASICK_H
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint32_t, uint8_t
+
+/* Small pattern sets are searched with packed SIMD fingerprints first */
+#define AHO_CORASICK_TEDDY_MAX_PATTERNS 8
+#define AHO_CORASICK_TEDDY_MAX_FINGERPRINT 3
+
+/* Transitions to states where some pattern ends have this bit set */
+#define AHO_CORASICK_MATCH_BIT 0x80000000u
+#define AHO_CORASICK_NO_PATTERN 0xFFFFFFFFu
+
+/* Nibble masks for up to 8 patterns, one bit per pattern (Teddy) */
+typedef struct AhoCorasickTeddy {
+	size_t fingerprint_length; // leading pattern bytes tested at once
+	uint8_t low_masks[AHO_CORASICK_TEDDY_MAX_FINGERPRINT][16];
+	uint8_t high_masks[AHO_CORASICK_TEDDY_MAX_FINGERPRINT][16];
+} AhoCorasickTeddy;
+
+/* Deterministic automaton matching many patterns in a single pass */
+/* Transitions are stored in one dense table indexed by state and byte */
+/* class, where bytes not used by any pattern share one class */
+typedef struct AhoCorasick {
+	size_t pattern_count;
+	unsigned char** patterns; // folded when ignoring case
+	size_t* pattern_lengths; // in bytes of folded pattern
+	size_t* pattern_units; // bytes, or characters when folding Unicode
+	size_t max_pattern_units;
+	int ignore_case;
+	int is_unicode_fold; // text characters are folded before matching
+	unsigned char fold[256]; // ASCII folding of text bytes
+	uint8_t byte_classes[256];
+	size_t class_count;
+	uint32_t* transitions; // state_count * class_count entries
+	uint32_t* outputs; // longest pattern ending in each state
+	size_t state_count;
+	int is_teddy; // packed fingerprints are used instead of automaton
+	AhoCorasickTeddy teddy;
+} AhoCorasick;
+
+/* Always prefix functions with header name */
+/* Patterns are UTF-8 strings, empty patterns are never matched */
+AhoCorasick* aho_corasick_new(char** patterns, const size_t* pattern_lengths, size_t pattern_count, int ignore_case);
+/* Finds leftmost match, preferring the longest pattern starting there */
+const char* aho_corasick_find(const AhoCorasick* automaton, const char* text, size_t text_length,
+	size_t* match_length, size_t* pattern_index);
+void aho_corasick_free(AhoCorasick* automaton);
+
+#endif
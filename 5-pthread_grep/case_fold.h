@@ -0,0 +1,16 @@
+/* All header files need to be protected with preprocessor guards */
+#ifndef CASE_FOLD_H
+#define CASE_FOLD_H
+
+#include <stddef.h> // size_t, wchar_t
+
+/* Most characters have at most 3 case variants, like 'k', 'K' and KELVIN SIGN */
+#define CASE_FOLD_MAX_VARIANTS 4
+
+/* Always prefix functions with header name */
+/* Unicode simple case folding that does not depend on current locale */
+wchar_t case_fold(wchar_t character);
+/* Collecting all characters that fold to the same character */
+size_t case_fold_variants(wchar_t character, wchar_t variants[CASE_FOLD_MAX_VARIANTS]);
+
+#endif
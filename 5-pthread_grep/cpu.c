@@ -0,0 +1,232 @@
+#define _GNU_SOURCE // sched_getaffinity(), CPU_ALLOC(), syscall()
+#include "cpu.h"
+
+#include <stdio.h> // snprintf(), sscanf()
+#include <stdlib.h> // strtol(), atoi()
+#include <string.h> // strchr(), strrchr(), strlen(), strncmp(), strcat(), strtok_r()
+#include <stdint.h> // uintptr_t
+#include <limits.h> // PATH_MAX
+#include <errno.h> // errno, EINVAL
+#include <fcntl.h> // open()
+#include <unistd.h> // read(), close(), sysconf(), syscall()
+#include <dirent.h> // opendir(), readdir(), closedir()
+#include <sched.h> // sched_getaffinity(), sched_setaffinity(), cpu_set_t
+#include <sys/mman.h> // mincore()
+#include <sys/syscall.h> // __NR_set_mempolicy, __NR_move_pages
+#include <linux/mempolicy.h> // MPOL_PREFERRED
+
+/* This file implements CPU and NUMA queries for cpu.h */
+/* Other structs and functions declared here are limited to this file! */
+/* Use 'static' to declare local functions and local global variables */
+/* System calls are used directly, so libnuma is not needed */
+
+/* Memory policy masks of set_mempolicy() cover this many nodes */
+#define CPU_MAX_NODES 1024
+
+/* Reads small text file into 'text', returns 0 if it can't be read */
+static int cpu_read_file(const char* path, char* text, size_t size) {
+	int file = open(path, O_RDONLY);
+	if (file < 0) { return 0; }
+	ssize_t length = read(file, text, size - 1);
+	close(file);
+	if (length < 0) { return 0; }
+	text[length] = '\0';
+	return 1;
+}
+
+/* Affinity mask of calling thread, grown until kernel mask fits */
+/* Returns NULL if it can't be read, CPU_FREE() after use */
+static cpu_set_t* cpu_affinity(size_t* set_size) {
+	for (int cpu_count = 1024; cpu_count <= 1024 * 1024; cpu_count *= 2) {
+		cpu_set_t* set = CPU_ALLOC(cpu_count);
+		if (set == NULL) { return NULL; }
+		*set_size = CPU_ALLOC_SIZE(cpu_count);
+		if (sched_getaffinity(0, *set_size, set) == 0) { return set; }
+		CPU_FREE(set);
+		if (errno != EINVAL) { return NULL; }
+	}
+	return NULL;
+}
+
+/* CPUs allowed by quota of a single cgroup directory, 0 when unlimited */
+/* cgroup v2 keeps "QUOTA PERIOD" or "max PERIOD" in cpu.max, while v1 */
+/* keeps them in two files with -1 for no quota */
+static int cpu_cgroup_directory_quota(const char* directory, int is_v2) {
+	char path[PATH_MAX];
+	char text[64];
+	long long quota = -1;
+	long long period = 0;
+	if (is_v2) {
+		snprintf(path, sizeof(path), "%s/cpu.max", directory);
+		if (!cpu_read_file(path, text, sizeof(text)) || sscanf(text, "%lld %lld", &quota, &period) != 2) {
+			return 0;
+		}
+	} else {
+		snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", directory);
+		if (!cpu_read_file(path, text, sizeof(text)) || sscanf(text, "%lld", &quota) != 1) { return 0; }
+		snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", directory);
+		if (!cpu_read_file(path, text, sizeof(text)) || sscanf(text, "%lld", &period) != 1) { return 0; }
+	}
+	if (quota <= 0 || period <= 0) { return 0; }
+	long long cpu_count = (quota + period - 1) / period; // partly used CPU still needs a thread
+	return (cpu_count < CPU_MAX_THREADS) ? (int)cpu_count : CPU_MAX_THREADS;
+}
+
+/* Tells whether comma separated list of v1 controllers has 'cpu' */
+static int cpu_has_cpu_controller(const char* controllers) {
+	const char* controller = controllers;
+	while (controller != NULL) {
+		if (strncmp(controller, "cpu", 3) == 0 && (controller[3] == ',' || controller[3] == '\0')) { return 1; }
+		controller = strchr(controller, ',');
+		if (controller != NULL) { controller += 1; }
+	}
+	return 0;
+}
+
+/* Quota of cgroup of this process and of all its ancestors apply, so */
+/* the smallest one limits threads, 0 when there is none */
+static int cpu_cgroup_quota(void) {
+	char text[4096];
+	if (!cpu_read_file("/proc/self/cgroup", text, sizeof(text))) { return 0; }
+
+	int limit = 0;
+	char* save = NULL;
+	for (char* line = strtok_r(text, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+		/* Lines look like "0::/path" for v2 and "4:cpu,cpuacct:/path" for v1 */
+		char* controllers = strchr(line, ':');
+		if (controllers == NULL) { continue; }
+		controllers += 1;
+		char* cgroup_path = strchr(controllers, ':');
+		if (cgroup_path == NULL) { continue; }
+		*cgroup_path = '\0';
+		cgroup_path += 1;
+
+		char directory[PATH_MAX];
+		int is_v2 = (controllers[0] == '\0');
+		int root_length;
+		if (is_v2) {
+			root_length = snprintf(directory, sizeof(directory), "/sys/fs/cgroup");
+		} else if (cpu_has_cpu_controller(controllers)) {
+			root_length = snprintf(directory, sizeof(directory), "/sys/fs/cgroup/%s", controllers);
+		} else {
+			continue;
+		}
+		if (root_length < 0 || (size_t)root_length + strlen(cgroup_path) >= sizeof(directory)) { continue; }
+		strcat(directory, cgroup_path);
+
+		/* Containers only see their own cgroup at mount point, so paths */
+		/* of the host are walked up until one exists */
+		while (1) {
+			int quota = cpu_cgroup_directory_quota(directory, is_v2);
+			if (quota > 0 && (limit == 0 || quota < limit)) { limit = quota; }
+			char* slash = strrchr(directory + root_length, '/');
+			if (slash == NULL) { break; }
+			*slash = '\0';
+		}
+	}
+	return limit;
+}
+
+int cpu_count_available(void) {
+	int count = 0;
+	size_t set_size = 0;
+	cpu_set_t* set = cpu_affinity(&set_size);
+	if (set != NULL) {
+		count = CPU_COUNT_S(set_size, set);
+		CPU_FREE(set);
+	}
+	if (count < 1) {
+		long online_count = sysconf(_SC_NPROCESSORS_ONLN);
+		count = (online_count > 0) ? (int)online_count : 1;
+	}
+
+	int quota = cpu_cgroup_quota();
+	if (quota > 0 && quota < count) { count = quota; }
+	return (count < CPU_MAX_THREADS) ? count : CPU_MAX_THREADS;
+}
+
+int cpu_list_allowed(int* cpus, int capacity) {
+	size_t set_size = 0;
+	cpu_set_t* set = cpu_affinity(&set_size);
+	if (set == NULL) { return 0; }
+	int count = 0;
+	for (int cpu = 0; cpu < (int)(set_size * 8) && count < capacity; cpu++) {
+		if (CPU_ISSET_S(cpu, set_size, set)) {
+			cpus[count] = cpu;
+			count += 1;
+		}
+	}
+	CPU_FREE(set);
+	return count;
+}
+
+int cpu_node_count(void) {
+	/* Online nodes are listed as ranges, like "0-1" or "0,2-3" */
+	char text[256];
+	if (!cpu_read_file("/sys/devices/system/node/online", text, sizeof(text))) { return 1; }
+	int node_count = 1;
+	char* position = text;
+	while (*position != '\0') {
+		if (*position < '0' || *position > '9') {
+			position += 1;
+			continue;
+		}
+		long node = strtol(position, &position, 10);
+		if (node + 1 > node_count && node < CPU_MAX_NODES) { node_count = (int)node + 1; }
+	}
+	return node_count;
+}
+
+int cpu_node(int cpu) {
+	/* Directory of each CPU links to its node as "nodeN" */
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	DIR* directory = opendir(path);
+	if (directory == NULL) { return 0; }
+	int node = 0;
+	struct dirent* entry;
+	while ((entry = readdir(directory)) != NULL) {
+		if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+			node = atoi(entry->d_name + 4);
+			break;
+		}
+	}
+	closedir(directory);
+	return node;
+}
+
+int cpu_pin_thread(int cpu, int node) {
+	cpu_set_t* set = CPU_ALLOC(cpu + 1);
+	if (set == NULL) { return 0; }
+	size_t set_size = CPU_ALLOC_SIZE(cpu + 1);
+	CPU_ZERO_S(set_size, set);
+	CPU_SET_S(cpu, set_size, set);
+	int is_pinned = (sched_setaffinity(0, set_size, set) == 0);
+	CPU_FREE(set);
+
+	/* Pages are placed on the node of the thread touching them first, */
+	/* but io_uring workers write read buffers from any CPU, so policy */
+	/* that they inherit names the node explicitly */
+	if (is_pinned && node >= 0 && node < CPU_MAX_NODES && cpu_node_count() > 1) {
+		unsigned long node_mask[CPU_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+		node_mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+		syscall(__NR_set_mempolicy, MPOL_PREFERRED, node_mask, (unsigned long)CPU_MAX_NODES);
+	}
+	return is_pinned;
+}
+
+int cpu_page_node(const void* address) {
+	/* Pages of mapped files are only in page table once touched, so */
+	/* page found in page cache is touched first, which maps it without */
+	/* copying, while files on disk are left for workers to read */
+	uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+	void* page = (void*)((uintptr_t)address & ~(page_size - 1));
+	unsigned char is_resident = 0;
+	if (mincore(page, (size_t)page_size, &is_resident) != 0 || !(is_resident & 1)) { return -1; }
+	(void)*(volatile const char*)page;
+
+	/* move_pages() without target nodes only reports where pages are */
+	int status = -1;
+	if (syscall(__NR_move_pages, 0, 1UL, &page, NULL, &status, 0) != 0) { return -1; }
+	return (status >= 0) ? status : -1; // negative errno when page is not in memory
+}
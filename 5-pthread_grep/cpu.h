@@ -0,0 +1,25 @@
+/* All header files need to be protected with preprocessor guards */
+#ifndef CPU_H
+#define CPU_H
+
+/* More threads than this are refused, they would only thrash */
+#define CPU_MAX_THREADS 1024
+
+/* Always prefix functions with header name */
+/* CPUs this process may use, limited by its affinity mask and by CPU */
+/* quota of its cgroup, always at least 1 */
+int cpu_count_available(void);
+/* Stores CPUs of affinity mask in ascending order, returns their count */
+int cpu_list_allowed(int* cpus, int capacity);
+/* Highest NUMA node number plus one, 1 on machines without NUMA */
+int cpu_node_count(void);
+/* NUMA node of CPU, 0 when it is not known */
+int cpu_node(int cpu);
+/* Runs calling thread only on 'cpu' and prefers memory of 'node' for */
+/* its allocations, returns 0 if thread could not be pinned */
+int cpu_pin_thread(int cpu, int node);
+/* NUMA node holding page at address, -1 when page is not in memory */
+/* Page of a mapped file is mapped when it is already in page cache */
+int cpu_page_node(const void* address);
+
+#endif
@@ -0,0 +1,598 @@
+#define _GNU_SOURCE // RTLD_LOCAL
+#include "decompress.h"
+
+#include <stdlib.h> // malloc(), realloc(), free()
+#include <string.h> // memcpy(), memset(), memcmp()
+#include <stdio.h> // fprintf()
+#include <stdint.h> // uint32_t, uint64_t, UINT64_MAX
+#include <limits.h> // UINT_MAX
+#include <errno.h> // errno, EINTR, EIO
+#include <unistd.h> // read()
+#include <pthread.h> // pthread_create(), pthread_once(), pthread_setcancelstate()
+#include <dlfcn.h> // dlopen(), dlsym()
+#include <zlib.h> // inflateInit2(), inflate(), inflateReset(), inflateEnd()
+#include <lzma.h> // lzma_stream_decoder(), lzma_code(), lzma_end()
+
+/* This file implements decompression for decompress.h */
+/* Other structs and functions declared here are limited to this file! */
+/* Use 'static' to declare local functions and local global variables */
+
+/* Compressed files are read in blocks of this size */
+#define DECOMPRESS_INPUT_SIZE (256 * 1024)
+/* Independent frames are grouped into segments of at least this many */
+/* compressed bytes, each decoded by one thread into its own buffer */
+#define DECOMPRESS_SEGMENT_SIZE (1024 * 1024)
+/* Decoded segments not read yet, per thread, bounding memory usage */
+#define DECOMPRESS_SEGMENTS_PER_THREAD 2
+/* Decoded bytes are copied by a single reader, more threads don't help */
+#define DECOMPRESS_MAX_THREADS 8
+
+/* Results of a single decoding step */
+enum { DECOMPRESS_STEP_FAILED = -1, DECOMPRESS_STEP_MORE, DECOMPRESS_STEP_END };
+
+/* States of a segment, changed holding mutex */
+enum { DECOMPRESS_SEGMENT_WAITING, DECOMPRESS_SEGMENT_DONE, DECOMPRESS_SEGMENT_FAILED };
+
+/* Buffers of zstd.h streaming API, which is stable across versions */
+typedef struct DecompressZstdInput {
+	const void* source;
+	size_t size;
+	size_t position;
+} DecompressZstdInput;
+
+typedef struct DecompressZstdOutput {
+	void* destination;
+	size_t size;
+	size_t position;
+} DecompressZstdOutput;
+
+/* Functions of libzstd, loaded with dlopen() on first zstd file so that */
+/* grep neither needs zstd headers to build nor the library to run */
+typedef struct DecompressZstd {
+	int is_loaded;
+	void* (*create_stream)(void);
+	size_t (*free_stream)(void* stream);
+	size_t (*init_stream)(void* stream);
+	size_t (*decompress_stream)(void* stream, DecompressZstdOutput* output, DecompressZstdInput* input);
+	unsigned (*is_error)(size_t code);
+	size_t (*find_frame_size)(const void* source, size_t size);
+} DecompressZstd;
+
+static pthread_once_t decompress_zstd_once_G = PTHREAD_ONCE_INIT;
+static DecompressZstd decompress_zstd_G;
+
+/* Streaming decoder of one format, reused for all segments of a thread */
+typedef struct DecompressDecoder {
+	DecompressFormat format;
+	int is_initialized;
+	int is_in_stream; // input of a member or frame was consumed, but its end not found yet
+	z_stream gzip;
+	lzma_stream xz;
+	void* zstd;
+} DecompressDecoder;
+
+/* Independent frames decoded by one thread into a buffer of their own */
+typedef struct DecompressSegment {
+	const unsigned char* data;
+	size_t size;
+	char* output;
+	size_t output_length;
+	int state;
+} DecompressSegment;
+
+struct Decompress {
+	DecompressFormat format;
+	DecompressDecoder decoder; // used when there are no segments
+	int file; // -1 when input is in memory
+	unsigned char* input_buffer; // only for files
+	const unsigned char* input; // not decoded yet
+	size_t input_length;
+	int is_input_ended;
+	int is_between_members; // last member or frame ended, next one may follow
+	int is_ended;
+
+	/* Segments are taken in order by threads and read in order */
+	DecompressSegment* segments;
+	size_t segment_count;
+	size_t next_segment; // next one taken by a thread
+	size_t read_segment; // one decompress_read() copies from
+	size_t read_position;
+	size_t window; // segments decoded ahead of the reader
+	int is_stopped;
+	pthread_t* threads;
+	int thread_count;
+	pthread_mutex_t mutex;
+	pthread_cond_t condition;
+};
+
+/* zstd */
+
+static void decompress_zstd_load(void) {
+	void* library = dlopen("libzstd.so.1", RTLD_NOW | RTLD_LOCAL);
+	if (library == NULL) { library = dlopen("libzstd.so", RTLD_NOW | RTLD_LOCAL); }
+	if (library == NULL) {
+		fprintf(stderr, "grep: searching zstd compressed files needs libzstd.so.1\n");
+		return;
+	}
+
+	/* Library stays loaded until exit, functions are used by all threads */
+	DecompressZstd* zstd = &decompress_zstd_G;
+	zstd->create_stream = (void* (*)(void))dlsym(library, "ZSTD_createDStream");
+	zstd->free_stream = (size_t (*)(void*))dlsym(library, "ZSTD_freeDStream");
+	zstd->init_stream = (size_t (*)(void*))dlsym(library, "ZSTD_initDStream");
+	zstd->decompress_stream = (size_t (*)(void*, DecompressZstdOutput*, DecompressZstdInput*))dlsym(library,
+		"ZSTD_decompressStream");
+	zstd->is_error = (unsigned (*)(size_t))dlsym(library, "ZSTD_isError");
+	zstd->find_frame_size = (size_t (*)(const void*, size_t))dlsym(library, "ZSTD_findFrameCompressedSize");
+	zstd->is_loaded = zstd->create_stream != NULL && zstd->free_stream != NULL && zstd->init_stream != NULL
+		&& zstd->decompress_stream != NULL && zstd->is_error != NULL && zstd->find_frame_size != NULL;
+}
+
+static int decompress_zstd_is_loaded(void) {
+	pthread_once(&decompress_zstd_once_G, &decompress_zstd_load);
+	return decompress_zstd_G.is_loaded;
+}
+
+/* Decoders */
+
+/* Multithreaded xz decoder splits streams compressed with 'xz -T' into */
+/* blocks, older liblzma only decodes with calling thread */
+static int decompress_xz_init(lzma_stream* stream, int thread_count) {
+#if LZMA_VERSION >= 50040002
+	if (thread_count > 1) {
+		lzma_mt options;
+		memset(&options, 0, sizeof(options));
+		options.flags = LZMA_CONCATENATED;
+		options.threads = (uint32_t)((thread_count < DECOMPRESS_MAX_THREADS) ? thread_count : DECOMPRESS_MAX_THREADS);
+		options.memlimit_stop = UINT64_MAX;
+		options.memlimit_threading = lzma_physmem() / 4;
+		if (options.memlimit_threading == 0) { options.memlimit_threading = 1024 * 1024 * 1024; }
+		return lzma_stream_decoder_mt(stream, &options) == LZMA_OK;
+	}
+#endif
+	return lzma_stream_decoder(stream, UINT64_MAX, LZMA_CONCATENATED) == LZMA_OK;
+}
+
+static int decompress_decoder_init(DecompressDecoder* decoder, DecompressFormat format, int thread_count) {
+	memset(decoder, 0, sizeof(*decoder));
+	decoder->format = format;
+	if (format == DECOMPRESS_FORMAT_GZIP) {
+		/* Adding 16 to window bits expects gzip header instead of zlib one */
+		decoder->is_initialized = (inflateInit2(&decoder->gzip, 15 + 16) == Z_OK);
+	} else if (format == DECOMPRESS_FORMAT_XZ) {
+		decoder->xz = (lzma_stream)LZMA_STREAM_INIT;
+		decoder->is_initialized = decompress_xz_init(&decoder->xz, thread_count);
+	} else if (format == DECOMPRESS_FORMAT_ZSTD && decompress_zstd_is_loaded()) {
+		decoder->zstd = decompress_zstd_G.create_stream();
+		decoder->is_initialized = decoder->zstd != NULL
+			&& !decompress_zstd_G.is_error(decompress_zstd_G.init_stream(decoder->zstd));
+		if (!decoder->is_initialized && decoder->zstd != NULL) { decompress_zstd_G.free_stream(decoder->zstd); }
+	}
+	return decoder->is_initialized;
+}
+
+/* Preparing decoder for next gzip member or zstd frame, xz decoder */
+/* handles concatenated streams itself */
+static void decompress_decoder_reset(DecompressDecoder* decoder) {
+	if (decoder->format == DECOMPRESS_FORMAT_GZIP) {
+		inflateReset(&decoder->gzip);
+	} else if (decoder->format == DECOMPRESS_FORMAT_ZSTD) {
+		decompress_zstd_G.init_stream(decoder->zstd);
+	}
+	decoder->is_in_stream = 0;
+}
+
+static void decompress_decoder_end(DecompressDecoder* decoder) {
+	if (!decoder->is_initialized) { return; }
+	if (decoder->format == DECOMPRESS_FORMAT_GZIP) {
+		inflateEnd(&decoder->gzip);
+	} else if (decoder->format == DECOMPRESS_FORMAT_XZ) {
+		lzma_end(&decoder->xz);
+	} else if (decoder->format == DECOMPRESS_FORMAT_ZSTD) {
+		decompress_zstd_G.free_stream(decoder->zstd);
+	}
+	decoder->is_initialized = 0;
+}
+
+/* Decodes as much input into output as fits, advancing both */
+/* Returns DECOMPRESS_STEP_END once a gzip member, zstd frame or all xz */
+/* streams ended, xz decoder needs to know when input ends */
+static int decompress_decoder_step(DecompressDecoder* decoder, const unsigned char** input, size_t* input_length,
+	int is_input_ended, unsigned char** output, size_t* output_length) {
+	size_t consumed = 0;
+	size_t produced = 0;
+	int step = DECOMPRESS_STEP_FAILED;
+	if (decoder->format == DECOMPRESS_FORMAT_GZIP) {
+		/* zlib counts bytes with unsigned int */
+		uInt input_size = (*input_length < UINT_MAX) ? (uInt)*input_length : UINT_MAX;
+		uInt output_size = (*output_length < UINT_MAX) ? (uInt)*output_length : UINT_MAX;
+		decoder->gzip.next_in = (Bytef*)*input;
+		decoder->gzip.avail_in = input_size;
+		decoder->gzip.next_out = *output;
+		decoder->gzip.avail_out = output_size;
+		int status = inflate(&decoder->gzip, Z_NO_FLUSH);
+		consumed = input_size - decoder->gzip.avail_in;
+		produced = output_size - decoder->gzip.avail_out;
+		step = (status == Z_STREAM_END) ? DECOMPRESS_STEP_END
+			: (status == Z_OK || status == Z_BUF_ERROR) ? DECOMPRESS_STEP_MORE : DECOMPRESS_STEP_FAILED;
+	} else if (decoder->format == DECOMPRESS_FORMAT_XZ) {
+		decoder->xz.next_in = *input;
+		decoder->xz.avail_in = *input_length;
+		decoder->xz.next_out = *output;
+		decoder->xz.avail_out = *output_length;
+		lzma_ret status = lzma_code(&decoder->xz, is_input_ended ? LZMA_FINISH : LZMA_RUN);
+		consumed = *input_length - decoder->xz.avail_in;
+		produced = *output_length - decoder->xz.avail_out;
+		step = (status == LZMA_STREAM_END) ? DECOMPRESS_STEP_END
+			: (status == LZMA_OK || status == LZMA_BUF_ERROR) ? DECOMPRESS_STEP_MORE : DECOMPRESS_STEP_FAILED;
+	} else if (decoder->format == DECOMPRESS_FORMAT_ZSTD) {
+		DecompressZstdInput zstd_input = { *input, *input_length, 0 };
+		DecompressZstdOutput zstd_output = { *output, *output_length, 0 };
+		size_t hint = decompress_zstd_G.decompress_stream(decoder->zstd, &zstd_output, &zstd_input);
+		consumed = zstd_input.position;
+		produced = zstd_output.position;
+		step = decompress_zstd_G.is_error(hint) ? DECOMPRESS_STEP_FAILED
+			: (hint == 0) ? DECOMPRESS_STEP_END : DECOMPRESS_STEP_MORE; // 0 once frame is decoded and flushed
+	}
+	*input += consumed;
+	*input_length -= consumed;
+	*output += produced;
+	*output_length -= produced;
+	if (consumed > 0) { decoder->is_in_stream = 1; }
+	if (step == DECOMPRESS_STEP_END) { decoder->is_in_stream = 0; }
+	if (step == DECOMPRESS_STEP_MORE && consumed == 0 && produced == 0 && *input_length == 0 && is_input_ended
+		&& decoder->is_in_stream) {
+		step = DECOMPRESS_STEP_FAILED; // input ended inside a member or frame
+	}
+	return step;
+}
+
+/* Segments */
+
+/* Size of gzip member whose header records it in "BC" extra field, like */
+/* members written by bgzip, 0 when member does not tell its size */
+static size_t decompress_gzip_member_size(const unsigned char* data, size_t size) {
+	/* ID1 ID2 CM FLG MTIME(4) XFL OS XLEN(2), then XLEN bytes of fields */
+	if (size < 12 || data[0] != 0x1f || data[1] != 0x8b || data[2] != 8 || !(data[3] & 4)) { return 0; }
+	size_t extra_length = (size_t)data[10] | ((size_t)data[11] << 8);
+	if (12 + extra_length > size) { return 0; }
+	const unsigned char* field = data + 12;
+	const unsigned char* end = field + extra_length;
+	while (end - field >= 4) {
+		size_t field_length = (size_t)field[2] | ((size_t)field[3] << 8);
+		if (field[0] == 'B' && field[1] == 'C' && field_length == 2 && end - field >= 6) {
+			size_t member_size = ((size_t)field[4] | ((size_t)field[5] << 8)) + 1;
+			return (member_size <= size) ? member_size : 0;
+		}
+		field += 4 + field_length;
+	}
+	return 0;
+}
+
+/* Size of zstd frame or of gzip member, 0 when it is not known */
+static size_t decompress_frame_size(DecompressFormat format, const unsigned char* data, size_t size) {
+	if (format == DECOMPRESS_FORMAT_GZIP) { return decompress_gzip_member_size(data, size); }
+	if (format == DECOMPRESS_FORMAT_ZSTD) {
+		size_t frame_size = decompress_zstd_G.find_frame_size(data, size);
+		return decompress_zstd_G.is_error(frame_size) ? 0 : frame_size;
+	}
+	return 0;
+}
+
+/* Splitting input into segments of whole frames, returns 0 unless all */
+/* frame sizes are known and there are at least two segments */
+static int decompress_split(Decompress* decompress, const unsigned char* data, size_t size) {
+	size_t capacity = 0;
+	size_t position = 0;
+	size_t segment_start = 0;
+	while (position < size) {
+		size_t frame_size = decompress_frame_size(decompress->format, data + position, size - position);
+		if (frame_size == 0) { break; }
+		position += frame_size;
+		if (position - segment_start < DECOMPRESS_SEGMENT_SIZE && position < size) { continue; }
+
+		if (decompress->segment_count == capacity) {
+			capacity = (capacity > 0) ? capacity * 2 : 16;
+			DecompressSegment* segments_copy = realloc(decompress->segments, capacity * sizeof(DecompressSegment));
+			if (segments_copy == NULL) { break; }
+			decompress->segments = segments_copy;
+		}
+		DecompressSegment* segment = &decompress->segments[decompress->segment_count];
+		memset(segment, 0, sizeof(*segment));
+		segment->data = data + segment_start;
+		segment->size = position - segment_start;
+		segment->state = DECOMPRESS_SEGMENT_WAITING;
+		decompress->segment_count += 1;
+		segment_start = position;
+	}
+	if (position < size || decompress->segment_count < 2) {
+		free(decompress->segments);
+		decompress->segments = NULL;
+		decompress->segment_count = 0;
+		return 0;
+	}
+	return 1;
+}
+
+/* Decoding all frames of a segment into its growing output buffer */
+static int decompress_segment(DecompressDecoder* decoder, DecompressSegment* segment) {
+	const unsigned char* input = segment->data;
+	size_t input_length = segment->size;
+	size_t capacity = (segment->size < 64 * 1024) ? 256 * 1024 : segment->size * 4;
+	char* output = malloc(capacity);
+	if (output == NULL) { return 0; }
+	size_t length = 0;
+	decompress_decoder_reset(decoder);
+	while (1) {
+		if (length == capacity) {
+			char* output_copy = realloc(output, capacity * 2);
+			if (output_copy == NULL) { break; }
+			output = output_copy;
+			capacity *= 2;
+		}
+		unsigned char* output_position = (unsigned char*)output + length;
+		size_t output_length = capacity - length;
+		int step = decompress_decoder_step(decoder, &input, &input_length, 1, &output_position, &output_length);
+		length = capacity - output_length;
+		if (step == DECOMPRESS_STEP_FAILED) { break; }
+		if (step == DECOMPRESS_STEP_END) {
+			if (input_length == 0) {
+				segment->output = output;
+				segment->output_length = length;
+				return 1;
+			}
+			decompress_decoder_reset(decoder); // next frame of segment
+		}
+	}
+	free(output);
+	return 0;
+}
+
+/* Thread decoding segments in order, at most a few ahead of reader */
+static void* decompress_thread(void* arguments) {
+	Decompress* decompress = (Decompress*)arguments;
+	DecompressDecoder decoder;
+	int is_ready = decompress_decoder_init(&decoder, decompress->format, 1);
+
+	pthread_mutex_lock(&decompress->mutex);
+	while (1) {
+		while (!decompress->is_stopped && decompress->next_segment < decompress->segment_count
+			&& decompress->next_segment >= decompress->read_segment + decompress->window) {
+			pthread_cond_wait(&decompress->condition, &decompress->mutex);
+		}
+		if (decompress->is_stopped || decompress->next_segment == decompress->segment_count) { break; }
+		DecompressSegment* segment = &decompress->segments[decompress->next_segment];
+		decompress->next_segment += 1;
+		pthread_mutex_unlock(&decompress->mutex);
+
+		int is_decoded = is_ready && decompress_segment(&decoder, segment);
+
+		pthread_mutex_lock(&decompress->mutex);
+		segment->state = is_decoded ? DECOMPRESS_SEGMENT_DONE : DECOMPRESS_SEGMENT_FAILED;
+		pthread_cond_broadcast(&decompress->condition);
+	}
+	pthread_mutex_unlock(&decompress->mutex);
+	decompress_decoder_end(&decoder);
+	return NULL;
+}
+
+/* Starting threads for segments, returns 0 if none could start */
+static int decompress_start(Decompress* decompress, int thread_count) {
+	if ((size_t)thread_count > decompress->segment_count) { thread_count = (int)decompress->segment_count; }
+	if (thread_count > DECOMPRESS_MAX_THREADS) { thread_count = DECOMPRESS_MAX_THREADS; }
+	decompress->threads = malloc((size_t)thread_count * sizeof(pthread_t));
+	if (decompress->threads == NULL) { return 0; }
+	if (pthread_mutex_init(&decompress->mutex, NULL) != 0) {
+		free(decompress->threads);
+		decompress->threads = NULL;
+		return 0;
+	}
+	pthread_cond_init(&decompress->condition, NULL);
+
+	/* Window is fixed before any thread starts */
+	decompress->window = (size_t)thread_count * DECOMPRESS_SEGMENTS_PER_THREAD;
+	int started_count = 0;
+	for (int index = 0; index < thread_count; index++) {
+		if (pthread_create(&decompress->threads[started_count], NULL, &decompress_thread, decompress) == 0) {
+			started_count += 1;
+		}
+	}
+	decompress->thread_count = started_count;
+	if (started_count == 0) {
+		pthread_cond_destroy(&decompress->condition);
+		pthread_mutex_destroy(&decompress->mutex);
+		free(decompress->threads);
+		decompress->threads = NULL;
+		return 0;
+	}
+	return 1;
+}
+
+/* Copying decoded segments in order, waiting for the next one */
+static ssize_t decompress_read_segments(Decompress* decompress, char* data, size_t size) {
+	while (1) {
+		pthread_mutex_lock(&decompress->mutex);
+		while (decompress->read_segment < decompress->segment_count
+			&& decompress->segments[decompress->read_segment].state == DECOMPRESS_SEGMENT_WAITING) {
+			pthread_cond_wait(&decompress->condition, &decompress->mutex);
+		}
+		if (decompress->read_segment == decompress->segment_count) {
+			pthread_mutex_unlock(&decompress->mutex);
+			return 0;
+		}
+		DecompressSegment* segment = &decompress->segments[decompress->read_segment];
+		int state = segment->state;
+		pthread_mutex_unlock(&decompress->mutex);
+		if (state == DECOMPRESS_SEGMENT_FAILED) {
+			errno = EIO;
+			return -1;
+		}
+
+		size_t length = segment->output_length - decompress->read_position;
+		if (length > size) { length = size; }
+		memcpy(data, segment->output + decompress->read_position, length);
+		decompress->read_position += length;
+		if (decompress->read_position == segment->output_length) {
+			free(segment->output);
+			segment->output = NULL;
+			pthread_mutex_lock(&decompress->mutex);
+			decompress->read_segment += 1;
+			decompress->read_position = 0;
+			pthread_cond_broadcast(&decompress->condition); // window moved
+			pthread_mutex_unlock(&decompress->mutex);
+		}
+		if (length > 0) { return (ssize_t)length; }
+	}
+}
+
+/* Decoding input with a single decoder, reading file when needed */
+static ssize_t decompress_read_stream(Decompress* decompress, char* data, size_t size) {
+	while (!decompress->is_ended) {
+		if (decompress->input_length == 0 && !decompress->is_input_ended) {
+			/* Caller may cancel thread while it waits for input */
+			int cancel_state;
+			pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &cancel_state);
+			ssize_t read_length = read(decompress->file, decompress->input_buffer, DECOMPRESS_INPUT_SIZE);
+			pthread_setcancelstate(cancel_state, NULL);
+			if (read_length < 0) {
+				if (errno == EINTR) { continue; }
+				return -1;
+			}
+			decompress->input = decompress->input_buffer;
+			decompress->input_length = (size_t)read_length;
+			decompress->is_input_ended = (read_length == 0);
+		}
+
+		/* Another member or frame may follow, like in concatenated files */
+		/* Other bytes after last gzip member are trailing garbage, which */
+		/* gzip also warns about, xz decoder checks its own padding */
+		if (decompress->is_between_members) {
+			if (decompress->input_length == 0) {
+				decompress->is_ended = decompress->is_input_ended;
+				continue;
+			}
+			if (decompress->format == DECOMPRESS_FORMAT_XZ) {
+				decompress->is_ended = 1;
+				continue;
+			}
+			if (decompress->format == DECOMPRESS_FORMAT_GZIP && decompress->input[0] != 0x1f) {
+				errno = EIO;
+				return -1;
+			}
+			decompress_decoder_reset(&decompress->decoder);
+			decompress->is_between_members = 0;
+		}
+
+		unsigned char* output = (unsigned char*)data;
+		size_t output_length = size;
+		int step = decompress_decoder_step(&decompress->decoder, &decompress->input, &decompress->input_length,
+			decompress->is_input_ended, &output, &output_length);
+		if (step == DECOMPRESS_STEP_FAILED) {
+			errno = EIO;
+			return -1;
+		}
+		if (step == DECOMPRESS_STEP_END) { decompress->is_between_members = 1; }
+		if (output_length < size) { return (ssize_t)(size - output_length); }
+		if (decompress->input_length == 0 && decompress->is_input_ended && !decompress->decoder.is_in_stream) {
+			decompress->is_ended = 1;
+		}
+	}
+	return 0;
+}
+
+/* Public functions */
+
+DecompressFormat decompress_detect(const void* header, size_t header_length) {
+	const unsigned char* bytes = (const unsigned char*)header;
+	if (header_length >= 2 && bytes[0] == 0x1f && bytes[1] == 0x8b) { return DECOMPRESS_FORMAT_GZIP; }
+	if (header_length >= 6 && memcmp(bytes, "\xfd" "7zXZ\0", 6) == 0) { return DECOMPRESS_FORMAT_XZ; }
+	if (header_length >= 4 && memcmp(bytes, "\x28\xb5\x2f\xfd", 4) == 0) { return DECOMPRESS_FORMAT_ZSTD; }
+	return DECOMPRESS_FORMAT_NONE;
+}
+
+int decompress_is_magic_prefix(const void* header, size_t header_length) {
+	static const char* magics[] = { "\x1f\x8b", "\xfd" "7zXZ", "\x28\xb5\x2f\xfd" };
+	static const size_t magic_lengths[] = { 2, 6, 4 };
+	for (size_t index = 0; index < sizeof(magic_lengths) / sizeof(size_t); index++) {
+		size_t length = (header_length < magic_lengths[index]) ? header_length : magic_lengths[index];
+		if (memcmp(header, magics[index], length) == 0) { return 1; }
+	}
+	return 0;
+}
+
+Decompress* decompress_new_file(DecompressFormat format, int file, const void* header, size_t header_length,
+	int thread_count) {
+	Decompress* decompress = calloc(1, sizeof(Decompress));
+	if (decompress == NULL) { return NULL; }
+	decompress->format = format;
+	decompress->file = file;
+	decompress->input_buffer = malloc(DECOMPRESS_INPUT_SIZE);
+	if (decompress->input_buffer == NULL || header_length > DECOMPRESS_INPUT_SIZE
+		|| !decompress_decoder_init(&decompress->decoder, format, thread_count)) {
+		decompress_free(decompress);
+		return NULL;
+	}
+
+	/* Bytes read while detecting format are decoded first */
+	memcpy(decompress->input_buffer, header, header_length);
+	decompress->input = decompress->input_buffer;
+	decompress->input_length = header_length;
+	return decompress;
+}
+
+Decompress* decompress_new_memory(DecompressFormat format, const void* data, size_t size, int thread_count) {
+	Decompress* decompress = calloc(1, sizeof(Decompress));
+	if (decompress == NULL) { return NULL; }
+	decompress->format = format;
+	decompress->file = -1;
+	decompress->input = (const unsigned char*)data;
+	decompress->input_length = size;
+	decompress->is_input_ended = 1;
+	if (format == DECOMPRESS_FORMAT_ZSTD && !decompress_zstd_is_loaded()) {
+		free(decompress);
+		return NULL;
+	}
+
+	/* Frames with known sizes are decoded by several threads at once */
+	if (thread_count > 1 && format != DECOMPRESS_FORMAT_XZ
+		&& decompress_split(decompress, decompress->input, size)) {
+		if (decompress_start(decompress, thread_count)) { return decompress; }
+		free(decompress->segments);
+		decompress->segments = NULL;
+		decompress->segment_count = 0;
+	}
+	if (!decompress_decoder_init(&decompress->decoder, format, thread_count)) {
+		free(decompress);
+		return NULL;
+	}
+	return decompress;
+}
+
+ssize_t decompress_read(Decompress* decompress, char* data, size_t size) {
+	if (size == 0) { return 0; }
+	if (decompress->threads != NULL) { return decompress_read_segments(decompress, data, size); }
+	return decompress_read_stream(decompress, data, size);
+}
+
+void decompress_free(Decompress* decompress) {
+	if (decompress == NULL) { return; }
+	if (decompress->threads != NULL) {
+		pthread_mutex_lock(&decompress->mutex);
+		decompress->is_stopped = 1;
+		pthread_cond_broadcast(&decompress->condition);
+		pthread_mutex_unlock(&decompress->mutex);
+		for (int index = 0; index < decompress->thread_count; index++) {
+			pthread_join(decompress->threads[index], NULL);
+		}
+		pthread_cond_destroy(&decompress->condition);
+		pthread_mutex_destroy(&decompress->mutex);
+		free(decompress->threads);
+	}
+	for (size_t index = 0; index < decompress->segment_count; index++) {
+		free(decompress->segments[index].output);
+	}
+	free(decompress->segments);
+	decompress_decoder_end(&decompress->decoder);
+	free(decompress->input_buffer);
+	free(decompress);
+}
@@ -0,0 +1,48 @@
+/* All header files need to be protected with preprocessor guards */
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include <stddef.h> // size_t
+#include <sys/types.h> // ssize_t
+
+/* Bytes read from start of a file to recognize its format */
+#define DECOMPRESS_MAGIC_SIZE 6
+
+/* Compressed formats recognized by magic bytes */
+typedef enum DecompressFormat {
+	DECOMPRESS_FORMAT_NONE, // plain file, searched as it is
+	DECOMPRESS_FORMAT_GZIP, // one or more gzip members, like zcat
+	DECOMPRESS_FORMAT_XZ, // one or more xz streams
+	DECOMPRESS_FORMAT_ZSTD, // one or more zstd frames, libzstd is loaded when needed
+} DecompressFormat;
+
+/* Always prefix structs with header name */
+/* Decompressor of a single file, used by one thread at a time */
+/* Contents are private to decompress.c, callers only keep the pointer */
+typedef struct Decompress Decompress;
+
+/* Always prefix functions with header name */
+/* Format of data starting with 'header', which may be shorter than */
+/* DECOMPRESS_MAGIC_SIZE bytes */
+DecompressFormat decompress_detect(const void* header, size_t header_length);
+/* Tells whether 'header' may still start a compressed file, so that pipes */
+/* are only read until format is decided */
+int decompress_is_magic_prefix(const void* header, size_t header_length);
+/* Decompresses file from its current offset, 'header' are bytes already */
+/* read from it, up to 'thread_count' threads decode xz blocks */
+/* Returns NULL when format is not supported or memory is exhausted */
+Decompress* decompress_new_file(DecompressFormat format, int file, const void* header, size_t header_length,
+	int thread_count);
+/* Decompresses data kept in memory until decompress_free(), independent */
+/* zstd frames and gzip members with sizes are decoded by up to */
+/* 'thread_count' threads at once */
+Decompress* decompress_new_memory(DecompressFormat format, const void* data, size_t size, int thread_count);
+/* Fills up to 'size' bytes, returns 0 at end and -1 with errno set when */
+/* input can't be read, EIO when it is truncated, corrupted or followed */
+/* by trailing garbage */
+/* Only read() of a file is a cancellation point, state stays consistent */
+/* for decompress_free() when thread is cancelled there */
+ssize_t decompress_read(Decompress* decompress, char* data, size_t size);
+void decompress_free(Decompress* decompress);
+
+#endif
@@ -11,43 +11,170 @@
 #define ANSI_COLOR_RESET "\x1b[0m"
 
 #include <stddef.h> // size_t
+#include <stdatomic.h> // atomic_int
+#include "literal.h"
+#include "aho_corasick.h"
+#include "regexp.h"
+#include "stats.h"
+#include "trigram.h"
 
 typedef int bool;
 
+/* File name standing for standard input, like in other greps */
+#define GREP_STDIN_NAME "-"
+#define GREP_STDIN_LABEL "(standard input)"
+
 /* Declaring global variable, check grep_file.c */
 /* Use global variables to store internal options */
 extern bool grep_file_quiet_G;
+/* Set by any thread to make all threads stop searching as soon as possible */
+extern atomic_int grep_file_cancel_G;
+
+/* What is printed for each searched file */
+typedef enum GrepOutputMode {
+	GREP_OUTPUT_MATCH_COUNTS, // colored match count, lines with -n
+	GREP_OUTPUT_COUNTS_ONLY, // plain match count, lines are never rendered
+	GREP_OUTPUT_FILES_WITH_MATCHES, // file name if file matches
+	GREP_OUTPUT_FILES_WITHOUT_MATCH, // file name if file does not match
+	GREP_OUTPUT_QUIET, // nothing, search stops at first match in any file
+} GrepOutputMode;
+
+/* Matcher used by compiled pattern, chosen once when compiling it */
+typedef enum GrepEngine {
+	GREP_ENGINE_NONE, // empty search string, or none at all, never matches
+	GREP_ENGINE_LITERAL, // single search string, Two-Way with prefilter
+	GREP_ENGINE_MULTI, // several search strings, Aho-Corasick or Teddy
+	GREP_ENGINE_REGEXP, // regular expression, lazy DFA behind literal prefilter
+} GrepEngine;
 
 /* Always prefix structs with header name */
+/* Search strings compiled once in main.c, then only read by all threads */
+typedef struct GrepPattern {
+	GrepEngine engine;
+	LiteralPattern* literal;
+	AhoCorasick* multi;
+	Regexp* regexp;
+	size_t pattern_count;
+	bool* is_prefix_alpha; // search string starts with a letter, for -w
+	bool* is_suffix_alpha; // search string ends with a letter, for -w
+} GrepPattern;
+
 typedef struct GrepOptions {
 	bool ignore_case;
 	bool match_whole_words;
-	wchar_t* search_string;
+	bool extended_regexp; // search string is a regular expression
+	bool print_lines; // printing matching lines when searching several files
+	bool unordered_output; // writing results of files as soon as they are ready
+	bool recursive; // searching files in directories given instead of files
+	bool one_file_system; // not descending into directories of other file systems
+	GrepOutputMode output_mode;
+	size_t max_count; // matching lines searched in each file, 0 for all
+	char** patterns; // UTF-8 encoded search strings
+	size_t* pattern_lengths;
+	size_t pattern_count;
+	GrepPattern* pattern; // compiled from patterns
 	int available_threads;
+	bool pin_threads; // binding each worker to one CPU of affinity mask
+	StatsFormat stats_format; // collecting counters of all threads when set
+	bool verbose; // printing expected and measured time of each task to stderr
+	TrigramIndex* index; // skips walked files that can't match, NULL without --index
 } GrepOptions;
 
+/* Byte range of a single match inside searched string */
+typedef struct GrepMatchSpan {
+	size_t offset;
+	size_t length;
+	size_t pattern_index; // which of several patterns matched
+} GrepMatchSpan;
+
+/* Growable array reused between lines, allocated on first match */
+typedef struct GrepMatchSpans {
+	GrepMatchSpan* spans;
+	size_t length;
+	size_t capacity;
+} GrepMatchSpans;
+
+/* Growable output buffer reused between lines */
+typedef struct GrepBuffer {
+	char* data;
+	size_t length;
+	size_t capacity;
+} GrepBuffer;
+
+/* Matching line rendered without its line number */
+typedef struct GrepLineRecord {
+	size_t line_number; // counted from start of searched chunk
+	size_t offset; // where rendered line starts in text
+} GrepLineRecord;
+
+/* Matching lines kept in memory until their line numbers are known */
+/* Chunks of a file are searched in parallel, so line numbers of later */
+/* chunks depend on how many lines all earlier chunks have */
+typedef struct GrepLines {
+	GrepBuffer text;
+	GrepLineRecord* records;
+	size_t length;
+	size_t capacity;
+} GrepLines;
+
 /* Use typedef for structs to improve readability */
 typedef struct GrepStringResult {
-	char* colored_string; // free() after use
 	size_t match_count;
 	int exit_code;
 } GrepStringResult;
 
 typedef struct GrepFileResult {
 	size_t match_count;
+	size_t line_count; // only counted when lines are printed
+	size_t* pattern_match_counts; // only for several patterns, reused by next search of thread
 	int exit_code;
 } GrepFileResult;
 
 typedef struct GrepFilesResult {
 	size_t match_count;
+	size_t* pattern_match_counts; // only for several patterns, free() after use
+	Stats stats; // totals of all threads, only with stats_format
 	int exit_code;
 } GrepFilesResult;
 
 wchar_t* convert_string(const char* string);
+char* encode_string(const wchar_t* string);
+
+void grep_match_spans_free(GrepMatchSpans* spans);
+bool grep_buffer_append(GrepBuffer* buffer, const char* data, size_t length);
+void grep_buffer_free(GrepBuffer* buffer);
 
 /* Always prefix functions with header name */
-GrepStringResult grep_string(const char* string, const GrepOptions* options);
-GrepFileResult grep_file(const char* file_name, const GrepOptions* options);
+/* Search strings are UTF-8 encoded, case folding is done when compiling */
+/* Regular expression must be a single search string, 'error' tells why */
+/* it could not be compiled */
+GrepPattern* grep_pattern_new(char** patterns, const size_t* pattern_lengths, size_t pattern_count,
+	bool ignore_case, bool is_regexp, const char** error);
+/* Marks indexed files containing text every match requires */
+bool grep_pattern_select_files(const GrepPattern* pattern, TrigramIndex* index, bool ignore_case);
+void grep_pattern_free(GrepPattern* pattern);
+/* Finds next match of any pattern without checking word boundaries */
+/* Regular expressions only find start of the line containing a match */
+const char* grep_find(const char* text, size_t text_length, const GrepOptions* options,
+	size_t* match_length, size_t* pattern_index);
+/* Match spans and counts per pattern are only collected when not NULL */
+GrepStringResult grep_string(const char* string, size_t string_length,
+	const GrepOptions* options, GrepMatchSpans* spans, size_t* pattern_match_counts);
+bool grep_render_string(GrepBuffer* buffer, const char* string, size_t string_length,
+	const GrepMatchSpans* spans);
+/* Renders line numbers in front of lines, after 'line_offset' earlier lines */
+bool grep_lines_render(GrepBuffer* buffer, const GrepLines* lines, size_t line_offset);
+void grep_lines_free(GrepLines* lines);
+/* Matching lines are printed right away when 'output' is NULL */
+GrepFileResult grep_file(const char* file_name, const GrepOptions* options, GrepBuffer* output);
+/* Searches whole file already read into memory, 'file_name' is only */
+/* used in error messages */
+GrepFileResult grep_file_data(const char* file_name, const char* data, size_t size, const GrepOptions* options,
+	GrepBuffer* output);
+/* Searches newline aligned part of a file, counting lines from its start */
+GrepFileResult grep_chunk(const char* data, size_t size, const GrepOptions* options, GrepLines* lines);
 GrepFilesResult grep_files(char** file_names, int file_names_length, const GrepOptions* options);
+/* Releases buffers grep_file() keeps for the calling thread between files */
+void grep_file_scratch_free(void);
 
 #endif
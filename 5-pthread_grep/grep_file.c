@@ -1,44 +1,710 @@
+#define _GNU_SOURCE // memrchr()
 #include "grep.h"
+#include "decompress.h"
 
-#include <stdlib.h> // EXIT_SUCCESS, EXIT_FAILURE
-#include <stdio.h> // fopen(), getline(), printf(), fclose()
+#include <stdlib.h> // EXIT_SUCCESS, EXIT_FAILURE, malloc(), realloc(), free(), posix_memalign()
+#include <stdio.h> // snprintf(), fwrite(), fflush(), fprintf()
+#include <string.h> // memchr(), memrchr(), memcpy(), memmove(), memset(), strcmp(), strerror()
+#include <errno.h> // errno, EINTR, EIO
+#include <fcntl.h> // open()
+#include <unistd.h> // read(), pread(), close(), sysconf(), STDIN_FILENO
+#include <pthread.h> // pthread_create(), pthread_cancel(), pthread_join()
+#include <sys/mman.h> // mmap(), madvise(), munmap()
+#include <sys/stat.h> // fstat(), S_ISREG()
 
-/* Initializing global variable declared in grep.h */
+/* Initializing global variables declared in grep.h */
 bool grep_file_quiet_G = 0;
+atomic_int grep_file_cancel_G = 0;
 
-GrepFileResult grep_file(const char* file_name, const GrepOptions* options) {
+/* Files smaller than this are cheaper to read() than to map */
+#define GREP_FILE_MMAP_MIN_SIZE (64 * 1024)
+
+/* Mapped files up to this size are paged in at once with MAP_POPULATE */
+/* Larger files are only hinted with MADV_SEQUENTIAL to bound memory usage */
+#define GREP_FILE_POPULATE_MAX_SIZE (64 * 1024 * 1024)
+
+/* Buffered read() fallback reads files in blocks of this size */
+#define GREP_FILE_READ_BLOCK_SIZE (64 * 1024)
+/* Read buffers grown beyond this size for very long lines are not kept */
+#define GREP_FILE_READ_BUFFER_MAX_SIZE (16 * GREP_FILE_READ_BLOCK_SIZE)
+
+/* Pipes, standard input and decompressed files are read ahead into a */
+/* ring of this many blocks of this size */
+#define GREP_FILE_STREAM_BLOCK_SIZE (1024 * 1024)
+#define GREP_FILE_STREAM_BLOCK_COUNT 4
+
+/* Mapped files are searched in blocks of this size, checking between */
+/* blocks whether another thread cancelled the search */
+#define GREP_FILE_SEARCH_BLOCK_SIZE (4 * 1024 * 1024)
+
+/* Rendered lines are written to stdout in blocks of this size */
+#define GREP_FILE_OUTPUT_BLOCK_SIZE (64 * 1024)
+
+/* Buffers each thread keeps between files, so that once they are large */
+/* enough, searching another file allocates nothing */
+typedef struct GrepFileScratch {
+	GrepMatchSpans spans;
+	GrepBuffer stdout_buffer;
+	char* read_buffer;
+	size_t read_buffer_size;
+	size_t* pattern_match_counts;
+	size_t pattern_count;
+} GrepFileScratch;
+
+/* Buffers of calling thread, released by grep_file_scratch_free() */
+static _Thread_local GrepFileScratch grep_file_scratch_G;
+
+/* State of a single file search shared by mmap() and read() paths */
+typedef struct GrepFileScan {
+	size_t line_number;
+	size_t matching_line_count;
+	bool is_stopped; // enough lines matched or search was cancelled
+	GrepMatchSpans spans; // reused between lines, borrowed from thread scratch
+	GrepBuffer stdout_buffer; // reused between lines, borrowed from thread scratch
+	GrepBuffer* output; // either stdout buffer or caller's buffer
+	GrepLines* lines; // keeping lines without numbers instead of rendering them
+	GrepFileResult* grep_file_result;
+	const GrepOptions* options;
+	const char* file_name; // named in error messages
+} GrepFileScan;
+
+/* Writing rendered lines to stdout and reusing output buffer */
+/* Caller's buffer keeps all lines until the caller writes them */
+static void grep_file_flush(GrepFileScan* scan) {
+	if (scan->output == &scan->stdout_buffer && scan->output->length > 0) {
+		fwrite(scan->output->data, 1, scan->output->length, stdout);
+		scan->output->length = 0;
+	}
+}
+
+/* Remembering where line starts, its number is added when it is written */
+static bool grep_file_record_line(GrepLines* lines, size_t line_number) {
+	if (lines->length == lines->capacity) {
+		size_t capacity = (lines->capacity > 0) ? lines->capacity * 2 : 16;
+		GrepLineRecord* records_copy = realloc(lines->records, capacity * sizeof(GrepLineRecord));
+		if (records_copy == NULL) { return 0; }
+		lines->records = records_copy;
+		lines->capacity = capacity;
+	}
+	lines->records[lines->length].line_number = line_number;
+	lines->records[lines->length].offset = lines->text.length;
+	lines->length += 1;
+	return 1;
+}
+
+/* Rendering line number and colored line into output buffer */
+static void grep_file_render_line(GrepFileScan* scan, const char* line, size_t line_length) {
+	if (scan->lines != NULL) {
+		bool is_recorded = grep_file_record_line(scan->lines, scan->line_number);
+		is_recorded = is_recorded && grep_render_string(&scan->lines->text, line, line_length, &scan->spans);
+		if (!is_recorded) { scan->grep_file_result->exit_code = EXIT_FAILURE; }
+		return;
+	}
+
+	char line_number[64];
+	int line_number_length = snprintf(line_number, sizeof(line_number), "%s%zu%s:%s",
+		ANSI_COLOR_GREEN, scan->line_number, ANSI_COLOR_CYAN, ANSI_COLOR_RESET);
+
+	bool is_rendered = grep_buffer_append(scan->output, line_number, (size_t)line_number_length);
+	is_rendered = is_rendered && grep_render_string(scan->output, line, line_length, &scan->spans);
+	if (!is_rendered) { scan->grep_file_result->exit_code = EXIT_FAILURE; }
+	if (scan->output->length >= GREP_FILE_OUTPUT_BLOCK_SIZE) { grep_file_flush(scan); }
+}
+
+/* Counting newlines in skipped bytes to keep line numbers correct */
+static size_t count_lines(const char* data, size_t size) {
+	size_t line_count = 0;
+	const char* end = data + size;
+	while ((data = memchr(data, '\n', (size_t)(end - data))) != NULL) {
+		line_count += 1;
+		data += 1;
+	}
+	return line_count;
+}
+
+/* Searching complete lines of a buffer in place without copying them */
+/* Returns how many bytes were consumed, incomplete last line is left */
+/* unless 'is_final' is set, because more bytes may still be read */
+static size_t grep_lines(GrepFileScan* scan, const char* data, size_t size, bool is_final) {
+	/* Match spans and line numbers are not needed when lines are not printed */
+	GrepMatchSpans* spans = grep_file_quiet_G ? NULL : &scan->spans; // using internal option
+
+	/* Lines are also counted for statistics */
+	bool is_counting_lines = (spans != NULL || stats_enabled_G);
+
+	size_t position = 0;
+	while (position < size) {
+		if (atomic_load_explicit(&grep_file_cancel_G, memory_order_relaxed)) {
+			scan->is_stopped = 1;
+			return position;
+		}
+
+		/* Jumping straight to the line containing next candidate */
+		/* instead of calling grep_string() for every single line */
+		size_t match_length = 0;
+		size_t pattern_index = 0;
+		const char* match = grep_find(data + position, size - position, scan->options, &match_length, &pattern_index);
+		if (match == NULL) {
+			/* Consuming all complete lines, none of them can match */
+			size_t skip_end = size;
+			if (!is_final) {
+				const char* newline = memrchr(data + position, '\n', size - position);
+				skip_end = (newline != NULL) ? (size_t)(newline - data) + 1 : position;
+			}
+			if (is_counting_lines) { scan->line_number += count_lines(data + position, skip_end - position); }
+			return skip_end;
+		}
+		stats_local_G.candidate_count += 1;
+		const char* previous_newline = memrchr(data + position, '\n', (size_t)(match - (data + position)));
+		size_t line_start = (previous_newline != NULL) ? (size_t)(previous_newline - data) + 1 : position;
+		if (is_counting_lines) { scan->line_number += count_lines(data + position, line_start - position); }
+
+		const char* newline = memchr(data + line_start, '\n', size - line_start);
+		if (newline == NULL && !is_final) { return line_start; }
+		size_t line_end = (newline != NULL) ? (size_t)(newline - data) + 1 : size;
+
+		scan->line_number += 1;
+		GrepStringResult grep_string_result;
+		grep_string_result = grep_string(data + line_start, line_end - line_start, scan->options,
+			spans, scan->grep_file_result->pattern_match_counts);
+		scan->grep_file_result->match_count += grep_string_result.match_count;
+		if (grep_string_result.exit_code != EXIT_SUCCESS) {
+			scan->grep_file_result->exit_code = grep_string_result.exit_code;
+		} else if (grep_string_result.match_count > 0 && spans != NULL) {
+			grep_file_render_line(scan, data + line_start, line_end - line_start);
+		}
+		position = line_end;
+
+		/* Rest of file is not needed after enough matching lines */
+		if (grep_string_result.match_count > 0) {
+			scan->matching_line_count += 1;
+			stats_local_G.matching_line_count += 1;
+			if (scan->options->output_mode == GREP_OUTPUT_QUIET) {
+				atomic_store(&grep_file_cancel_G, 1); // any match decides the result
+			}
+			if (scan->options->max_count > 0 && scan->matching_line_count >= scan->options->max_count) {
+				scan->is_stopped = 1;
+				return position;
+			}
+		}
+	}
+	return position;
+}
+
+/* Measuring time spent searching lines for statistics */
+static size_t grep_lines_measured(GrepFileScan* scan, const char* data, size_t size, bool is_final) {
+	uint64_t start = stats_now();
+	size_t consumed = grep_lines(scan, data, size, is_final);
+	stats_local_G.search_nanoseconds += stats_now() - start;
+	return consumed;
+}
+
+/* Mapping regular file into memory and searching mapped bytes in place */
+/* Returns 0 if mapping failed so that caller can fall back to read() */
+static bool grep_file_mmap(GrepFileScan* scan, int file, size_t file_size) {
+	int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+	if (file_size <= GREP_FILE_POPULATE_MAX_SIZE) { flags |= MAP_POPULATE; }
+#endif
+
+	uint64_t start = stats_now();
+	void* data = mmap(NULL, file_size, PROT_READ, flags, file, 0);
+	stats_local_G.read_nanoseconds += stats_now() - start;
+	if (data == MAP_FAILED) { return 0; }
+	if (file_size > GREP_FILE_POPULATE_MAX_SIZE) {
+		madvise(data, file_size, MADV_SEQUENTIAL); // only a hint
+	}
+	stats_local_G.byte_count += file_size;
+
+	/* Block grows only when a single line does not fit into it */
+	const char* file_data = (const char*)data;
+	size_t position = 0;
+	size_t block_size = GREP_FILE_SEARCH_BLOCK_SIZE;
+	while (position < file_size && !scan->is_stopped) {
+		bool is_final = (file_size - position <= block_size);
+		size_t size = is_final ? file_size - position : block_size;
+		size_t consumed = grep_lines_measured(scan, file_data + position, size, is_final);
+		if (consumed == 0 && !is_final && !scan->is_stopped) {
+			block_size *= 2;
+			continue;
+		}
+		position += consumed;
+		block_size = GREP_FILE_SEARCH_BLOCK_SIZE;
+	}
+
+	start = stats_now();
+	munmap(data, file_size);
+	stats_local_G.read_nanoseconds += stats_now() - start;
+	return 1;
+}
+
+/* Input of read() and stream paths, plain file or its decompressed bytes */
+typedef struct GrepFileSource {
+	int file;
+	Decompress* decompress; // NULL for plain files
+	char header[DECOMPRESS_MAGIC_SIZE]; // read from pipe to detect format, searched first
+	size_t header_length;
+} GrepFileSource;
+
+/* Giving out bytes read while detecting format first */
+static ssize_t grep_file_source_read(GrepFileSource* source, char* data, size_t size) {
+	if (source->header_length > 0) {
+		size_t length = (source->header_length < size) ? source->header_length : size;
+		memcpy(data, source->header, length);
+		memmove(source->header, source->header + length, source->header_length - length);
+		source->header_length -= length;
+		return (ssize_t)length;
+	}
+	if (source->decompress != NULL) { return decompress_read(source->decompress, data, size); }
+	return read(source->file, data, size);
+}
+
+/* Reporting file that could not be read to its end, lines found before */
+/* are still printed, but the whole search fails */
+/* Decompressor fails with EIO when input is truncated or corrupted */
+static void grep_file_report(GrepFileScan* scan, const GrepFileSource* source, int error) {
+	const char* reason = (source->decompress != NULL && error == EIO)
+		? "compressed data is truncated or corrupted" : strerror(error);
+	fprintf(stderr, "grep: %s: %s\n", scan->file_name, reason);
+	scan->grep_file_result->exit_code = EXIT_FAILURE;
+}
+
+/* Reading pipes, special files and small files block by block */
+/* Buffer only grows when a single line does not fit into it */
+static void grep_file_read(GrepFileScan* scan, GrepFileSource* source) {
+	GrepFileScratch* scratch = &grep_file_scratch_G;
+	if (scratch->read_buffer == NULL) {
+		scratch->read_buffer = malloc(GREP_FILE_READ_BLOCK_SIZE);
+		scratch->read_buffer_size = GREP_FILE_READ_BLOCK_SIZE;
+	}
+	char* buffer = scratch->read_buffer;
+	size_t buffer_size = scratch->read_buffer_size;
+	if (buffer == NULL) {
+		scan->grep_file_result->exit_code = EXIT_FAILURE;
+		return;
+	}
+
+	size_t buffer_length = 0;
+	while (1) {
+		if (buffer_length == buffer_size) {
+			char* new_buffer = realloc(buffer, buffer_size * 2);
+			if (new_buffer == NULL) {
+				scan->grep_file_result->exit_code = EXIT_FAILURE;
+				break;
+			}
+			buffer = new_buffer;
+			buffer_size *= 2;
+		}
+
+		uint64_t start = stats_now();
+		ssize_t read_length = grep_file_source_read(source, buffer + buffer_length, buffer_size - buffer_length);
+		stats_local_G.read_nanoseconds += stats_now() - start;
+		if (read_length < 0) {
+			if (errno == EINTR) { continue; }
+			grep_file_report(scan, source, errno);
+			break;
+		}
+		if (read_length == 0) { // end of file, searching last line
+			grep_lines_measured(scan, buffer, buffer_length, 1);
+			break;
+		}
+		buffer_length += (size_t)read_length;
+		stats_local_G.byte_count += (size_t)read_length;
+
+		/* Moving incomplete last line to the beginning of the buffer */
+		size_t consumed = grep_lines_measured(scan, buffer, buffer_length, 0);
+		if (scan->is_stopped) { break; }
+		memmove(buffer, buffer + consumed, buffer_length - consumed);
+		buffer_length -= consumed;
+	}
+
+	/* Buffer is kept for next file unless a very long line grew it */
+	if (buffer_size > GREP_FILE_READ_BUFFER_MAX_SIZE) {
+		free(buffer);
+		buffer = NULL;
+		buffer_size = 0;
+	}
+	scratch->read_buffer = buffer;
+	scratch->read_buffer_size = buffer_size;
+}
+
+/* Block filled by read-ahead thread while earlier ones are searched */
+/* Blocks are page aligned, like buffers given to vmsplice() */
+typedef struct GrepFileStreamBlock {
+	char* data;
+	size_t length;
+	bool is_ready; // filled and waiting to be searched
+} GrepFileStreamBlock;
+
+/* Ring of blocks shared by read-ahead thread and searching thread */
+/* Mutex protects flags only, each block is owned by one thread at a time */
+typedef struct GrepFileStream {
+	GrepFileSource* source;
+	pthread_mutex_t mutex;
+	pthread_cond_t condition;
+	GrepFileStreamBlock blocks[GREP_FILE_STREAM_BLOCK_COUNT];
+	bool is_waiting; // searching thread has nothing to search
+	bool is_ended; // no blocks follow the ready ones
+	int error; // errno of failed read() or decompression, 0 otherwise
+	bool is_stopped; // searching thread needs no more input
+} GrepFileStream;
+
+/* Read-ahead thread, blocks are handed over once full, or right away */
+/* when searching thread waits for input, so that slow pipes like */
+/* 'tail -f' are searched as soon as lines arrive */
+/* Decompressing here lets a separate core decode while lines are searched */
+static void* grep_file_stream_read(void* arguments) {
+	GrepFileStream* stream = (GrepFileStream*)arguments;
+
+	/* Thread is only cancelled while blocked in read(), never holding mutex */
+	/* Decompressor enables cancelling around its own read() */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	bool is_plain = (stream->source->decompress == NULL);
+	size_t block_index = 0;
+	bool is_ended = 0;
+	while (!is_ended) {
+		GrepFileStreamBlock* block = &stream->blocks[block_index];
+		pthread_mutex_lock(&stream->mutex);
+		while (block->is_ready && !stream->is_stopped) {
+			pthread_cond_wait(&stream->condition, &stream->mutex);
+		}
+		bool is_stopped = stream->is_stopped;
+		pthread_mutex_unlock(&stream->mutex);
+		if (is_stopped) { break; }
+
+		block->length = 0;
+		bool is_handed_over = 0;
+		while (!is_handed_over) {
+			if (is_plain) { pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL); }
+			ssize_t read_length = grep_file_source_read(stream->source, block->data + block->length,
+				GREP_FILE_STREAM_BLOCK_SIZE - block->length);
+			if (is_plain) { pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL); }
+			if (read_length < 0 && errno == EINTR) { continue; }
+			int error = (read_length < 0) ? errno : 0;
+
+			pthread_mutex_lock(&stream->mutex);
+			if (read_length <= 0) {
+				is_ended = 1;
+				stream->is_ended = 1;
+				stream->error = error;
+			} else {
+				block->length += (size_t)read_length;
+			}
+			if (is_ended || block->length == GREP_FILE_STREAM_BLOCK_SIZE || stream->is_waiting) {
+				block->is_ready = (block->length > 0);
+				is_handed_over = 1;
+				pthread_cond_broadcast(&stream->condition);
+			}
+			pthread_mutex_unlock(&stream->mutex);
+		}
+		block_index = (block_index + 1) % GREP_FILE_STREAM_BLOCK_COUNT;
+	}
+	return NULL;
+}
+
+/* Searching block whose first bytes may continue last line of earlier */
+/* blocks, only such lines are copied into 'carry' */
+static void grep_file_stream_search(GrepFileScan* scan, GrepBuffer* carry, const char* data, size_t size) {
+	stats_local_G.byte_count += size;
+	if (carry->length > 0) {
+		const char* newline = memchr(data, '\n', size);
+		size_t head_length = (newline != NULL) ? (size_t)(newline - data) + 1 : size;
+		if (!grep_buffer_append(carry, data, head_length)) {
+			scan->grep_file_result->exit_code = EXIT_FAILURE;
+			scan->is_stopped = 1;
+			return;
+		}
+		if (newline == NULL) { return; }
+		grep_lines_measured(scan, carry->data, carry->length, 1);
+		carry->length = 0;
+		data += head_length;
+		size -= head_length;
+		if (scan->is_stopped) { return; }
+	}
+	size_t consumed = grep_lines_measured(scan, data, size, 0);
+	if (!scan->is_stopped && !grep_buffer_append(carry, data + consumed, size - consumed)) {
+		scan->grep_file_result->exit_code = EXIT_FAILURE;
+		scan->is_stopped = 1;
+	}
+}
+
+static void grep_file_stream_blocks_free(GrepFileStream* stream) {
+	for (size_t index = 0; index < GREP_FILE_STREAM_BLOCK_COUNT; index++) {
+		free(stream->blocks[index].data);
+	}
+}
+
+/* Reading pipes, standard input and decompressed files in a separate */
+/* thread, so that reading next blocks overlaps with searching current one */
+static void grep_file_stream(GrepFileScan* scan, GrepFileSource* source) {
+	GrepFileStream stream = {0};
+	stream.source = source;
+	size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	bool is_allocated = 1;
+	for (size_t index = 0; index < GREP_FILE_STREAM_BLOCK_COUNT && is_allocated; index++) {
+		is_allocated = posix_memalign((void**)&stream.blocks[index].data, page_size, GREP_FILE_STREAM_BLOCK_SIZE) == 0;
+	}
+	pthread_t reader;
+	if (!is_allocated || pthread_mutex_init(&stream.mutex, NULL) != 0) {
+		grep_file_stream_blocks_free(&stream);
+		grep_file_read(scan, source);
+		return;
+	}
+	pthread_cond_init(&stream.condition, NULL);
+	if (pthread_create(&reader, NULL, &grep_file_stream_read, &stream) != 0) {
+		pthread_cond_destroy(&stream.condition);
+		pthread_mutex_destroy(&stream.mutex);
+		grep_file_stream_blocks_free(&stream);
+		grep_file_read(scan, source);
+		return;
+	}
+
+	GrepBuffer carry = {0};
+	size_t block_index = 0;
+	while (!scan->is_stopped) {
+		GrepFileStreamBlock* block = &stream.blocks[block_index];
+		uint64_t start = stats_now();
+		pthread_mutex_lock(&stream.mutex);
+		while (!block->is_ready && !stream.is_ended) {
+			stream.is_waiting = 1;
+			pthread_cond_wait(&stream.condition, &stream.mutex);
+		}
+		stream.is_waiting = 0;
+		bool is_ready = block->is_ready;
+		pthread_mutex_unlock(&stream.mutex);
+		stats_local_G.read_nanoseconds += stats_now() - start;
+		if (!is_ready) { break; }
+
+		grep_file_stream_search(scan, &carry, block->data, block->length);
+
+		pthread_mutex_lock(&stream.mutex);
+		block->is_ready = 0;
+		pthread_cond_broadcast(&stream.condition);
+		pthread_mutex_unlock(&stream.mutex);
+		block_index = (block_index + 1) % GREP_FILE_STREAM_BLOCK_COUNT;
+
+		/* Lines of slow pipes are shown as soon as they are found */
+		if (scan->output == &scan->stdout_buffer) {
+			grep_file_flush(scan);
+			fflush(stdout);
+		}
+	}
+	if (!scan->is_stopped && carry.length > 0) {
+		grep_lines_measured(scan, carry.data, carry.length, 1);
+	}
+
+	/* Reader may still be waiting for input nobody needs anymore */
+	pthread_mutex_lock(&stream.mutex);
+	stream.is_stopped = 1;
+	pthread_cond_broadcast(&stream.condition);
+	pthread_mutex_unlock(&stream.mutex);
+	pthread_cancel(reader);
+	pthread_join(reader, NULL);
+	if (stream.error != 0) { grep_file_report(scan, source, stream.error); }
+
+	grep_buffer_free(&carry);
+	pthread_cond_destroy(&stream.condition);
+	pthread_mutex_destroy(&stream.mutex);
+	grep_file_stream_blocks_free(&stream);
+}
+
+/* Reading first bytes of file to recognize compressed files */
+/* Regular files are read with pread(), pipes keep bytes in 'source' */
+static DecompressFormat grep_file_detect(GrepFileSource* source, bool is_seekable) {
+	if (is_seekable) {
+		ssize_t length = pread(source->file, source->header, DECOMPRESS_MAGIC_SIZE, 0);
+		return (length > 0) ? decompress_detect(source->header, (size_t)length) : DECOMPRESS_FORMAT_NONE;
+	}
+
+	/* Slow pipes are only waited for while their bytes may be a magic */
+	while (source->header_length < DECOMPRESS_MAGIC_SIZE
+		&& decompress_is_magic_prefix(source->header, source->header_length)) {
+		ssize_t length = read(source->file, source->header + source->header_length,
+			DECOMPRESS_MAGIC_SIZE - source->header_length);
+		if (length < 0 && errno == EINTR) { continue; }
+		if (length <= 0) { break; }
+		source->header_length += (size_t)length;
+	}
+	return decompress_detect(source->header, source->header_length);
+}
+
+/* Decompressing in read-ahead thread while lines are searched */
+/* Regular files are mapped, so that independent frames can be decoded */
+/* by several threads, other files are decompressed as they are read */
+static void grep_file_decompress(GrepFileScan* scan, GrepFileSource* source, DecompressFormat format,
+	size_t file_size) {
+	void* data = MAP_FAILED;
+	if (file_size > 0) {
+		uint64_t start = stats_now();
+		data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, source->file, 0);
+		if (data != MAP_FAILED) { madvise(data, file_size, MADV_SEQUENTIAL); }
+		stats_local_G.read_nanoseconds += stats_now() - start;
+	}
+	int thread_count = scan->options->available_threads;
+	source->decompress = (data != MAP_FAILED) ? decompress_new_memory(format, data, file_size, thread_count)
+		: decompress_new_file(format, source->file, source->header, source->header_length, thread_count);
+	source->header_length = 0; // decompressor decodes these bytes first
+	if (source->decompress == NULL) {
+		scan->grep_file_result->exit_code = EXIT_FAILURE;
+	} else {
+		grep_file_stream(scan, source);
+		decompress_free(source->decompress);
+		source->decompress = NULL;
+	}
+	if (data != MAP_FAILED) { munmap(data, file_size); }
+}
+
+/* Counting matches of each pattern separately */
+static GrepFileResult grep_file_result_new(const GrepOptions* options) {
 	GrepFileResult grep_file_result;
 	grep_file_result.match_count = 0;
+	grep_file_result.line_count = 0;
+	grep_file_result.pattern_match_counts = NULL;
 	grep_file_result.exit_code = EXIT_SUCCESS;
 
-	FILE *file = fopen(file_name, "r");
-	if (file == NULL) {
+	/* Counts are added to totals before the thread searches again */
+	GrepFileScratch* scratch = &grep_file_scratch_G;
+	if (options->pattern_count > 1) {
+		if (scratch->pattern_count < options->pattern_count) {
+			size_t* counts_copy = realloc(scratch->pattern_match_counts, options->pattern_count * sizeof(size_t));
+			if (counts_copy == NULL) {
+				grep_file_result.exit_code = EXIT_FAILURE;
+				return grep_file_result;
+			}
+			scratch->pattern_match_counts = counts_copy;
+			scratch->pattern_count = options->pattern_count;
+		}
+		memset(scratch->pattern_match_counts, 0, options->pattern_count * sizeof(size_t));
+		grep_file_result.pattern_match_counts = scratch->pattern_match_counts;
+	}
+	return grep_file_result;
+}
+
+/* Borrowing buffers of calling thread for a single search */
+static void grep_file_scan_start(GrepFileScan* scan, const char* file_name, GrepFileResult* grep_file_result,
+	const GrepOptions* options, GrepBuffer* output) {
+	*scan = (GrepFileScan){0};
+	scan->spans = grep_file_scratch_G.spans;
+	scan->spans.length = 0;
+	scan->stdout_buffer = grep_file_scratch_G.stdout_buffer;
+	scan->stdout_buffer.length = 0;
+	scan->output = (output != NULL) ? output : &scan->stdout_buffer;
+	scan->grep_file_result = grep_file_result;
+	scan->options = options;
+	scan->file_name = file_name;
+}
+
+/* Giving buffers back to the thread, they keep their capacity */
+static void grep_file_scan_end(GrepFileScan* scan) {
+	grep_file_flush(scan);
+	grep_file_scratch_G.spans = scan->spans;
+	grep_file_scratch_G.stdout_buffer = scan->stdout_buffer;
+	scan->grep_file_result->line_count = scan->line_number;
+	stats_local_G.line_count += scan->line_number;
+}
+
+void grep_file_scratch_free(void) {
+	GrepFileScratch* scratch = &grep_file_scratch_G;
+	grep_match_spans_free(&scratch->spans);
+	grep_buffer_free(&scratch->stdout_buffer);
+	free(scratch->read_buffer);
+	free(scratch->pattern_match_counts);
+	*scratch = (GrepFileScratch){0};
+}
+
+GrepFileResult grep_file(const char* file_name, const GrepOptions* options, GrepBuffer* output) {
+	GrepFileResult grep_file_result = grep_file_result_new(options);
+	if (grep_file_result.exit_code != EXIT_SUCCESS) { return grep_file_result; }
+
+	/* Standard input is searched from its current offset and never closed */
+	uint64_t start = stats_now();
+	bool is_stdin = (strcmp(file_name, GREP_STDIN_NAME) == 0);
+	int file = is_stdin ? STDIN_FILENO : open(file_name, O_RDONLY);
+	stats_local_G.open_nanoseconds += stats_now() - start;
+	if (file == -1) {
+		fprintf(stderr, "grep: %s: %s\n", file_name, strerror(errno));
 		grep_file_result.exit_code = EXIT_FAILURE;
 		return grep_file_result;
 	}
+	stats_local_G.file_count += 1;
 
-	char* line = NULL;
-	size_t line_size = 0;
-	ssize_t line_length;
-	size_t line_number = 0;
-
-	while ((line_length = getline(&line, &line_size, file)) != -1) {
-		line_number += 1;
-		GrepStringResult grep_string_result = grep_string(line, options);
-		grep_file_result.match_count += grep_string_result.match_count;
-		if (grep_string_result.colored_string != NULL) {
-			if (!grep_file_quiet_G) { // using internal option
-				printf("%s", ANSI_COLOR_GREEN);
-				printf("%zu", line_number);
-				printf("%s:%s", ANSI_COLOR_CYAN, ANSI_COLOR_RESET);
-				printf("%s", grep_string_result.colored_string);
-			}
-			free(grep_string_result.colored_string);
+	GrepFileScan scan;
+	grep_file_scan_start(&scan, is_stdin ? GREP_STDIN_LABEL : file_name, &grep_file_result, options, output);
+
+	/* Only regular files large enough are worth mapping into memory */
+	/* Pipes and standard input are read ahead by another thread */
+	struct stat file_stat;
+	bool is_mapped = 0;
+	start = stats_now();
+	bool is_stat_known = (fstat(file, &file_stat) == 0);
+	stats_local_G.open_nanoseconds += stats_now() - start;
+	bool is_regular = is_stat_known && S_ISREG(file_stat.st_mode);
+	bool is_seekable = is_regular && !is_stdin;
+
+	/* gzip, xz and zstd files are searched as their decompressed text */
+	GrepFileSource source = { file, NULL, {0}, 0 };
+	DecompressFormat format = grep_file_detect(&source, is_seekable);
+	if (format != DECOMPRESS_FORMAT_NONE) {
+		grep_file_decompress(&scan, &source, format, is_seekable ? (size_t)file_stat.st_size : 0);
+	} else {
+		if (is_seekable && file_stat.st_size >= GREP_FILE_MMAP_MIN_SIZE) {
+			is_mapped = grep_file_mmap(&scan, file, (size_t)file_stat.st_size);
+		}
+		if (!is_mapped && (is_stdin || (is_stat_known && !is_regular))) {
+			grep_file_stream(&scan, &source);
+		} else if (!is_mapped) {
+			grep_file_read(&scan, &source);
 		}
 	}
 
-	if (line != NULL) { free(line); }
-	fclose(file);
+	grep_file_scan_end(&scan);
+	start = stats_now();
+	if (!is_stdin) { close(file); }
+	stats_local_G.open_nanoseconds += stats_now() - start;
+	return grep_file_result;
+}
+
+GrepFileResult grep_file_data(const char* file_name, const char* data, size_t size, const GrepOptions* options,
+	GrepBuffer* output) {
+	GrepFileResult grep_file_result = grep_file_result_new(options);
+	if (grep_file_result.exit_code != EXIT_SUCCESS) { return grep_file_result; }
+	stats_local_G.file_count += 1;
+
+	GrepFileScan scan;
+	grep_file_scan_start(&scan, file_name, &grep_file_result, options, output);
+
+	/* Prefetched compressed files are small, so they are decoded inline */
+	DecompressFormat format = decompress_detect(data, size);
+	if (format != DECOMPRESS_FORMAT_NONE) {
+		GrepFileSource source = { -1, decompress_new_memory(format, data, size, 1), {0}, 0 };
+		if (source.decompress == NULL) {
+			grep_file_result.exit_code = EXIT_FAILURE;
+		} else {
+			grep_file_read(&scan, &source);
+			decompress_free(source.decompress);
+		}
+	} else {
+		stats_local_G.byte_count += size;
+		grep_lines_measured(&scan, data, size, 1);
+	}
+
+	grep_file_scan_end(&scan);
+	return grep_file_result;
+}
+
+GrepFileResult grep_chunk(const char* data, size_t size, const GrepOptions* options, GrepLines* lines) {
+	GrepFileResult grep_file_result = grep_file_result_new(options);
+	if (grep_file_result.exit_code != EXIT_SUCCESS) { return grep_file_result; }
+
+	GrepFileScan scan;
+	grep_file_scan_start(&scan, NULL, &grep_file_result, options, NULL); // output never used, lines are recorded
+	scan.lines = lines;
+
+	/* Chunk ends right after a newline, so every line of it is complete */
+	/* and lines counted while searching are all newlines of the chunk */
+	stats_local_G.byte_count += size;
+	grep_lines_measured(&scan, data, size, 1);
 
+	grep_file_scan_end(&scan);
 	return grep_file_result;
 }
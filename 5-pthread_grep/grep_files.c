@@ -3,134 +3,1422 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include "job_queue.h"
-#include <stdio.h> // printf()
+#include "walker.h"
+#include "prefetch.h"
+#include "cpu.h"
+#include "decompress.h"
+#include <stdio.h> // printf(), snprintf(), fflush()
+#include <string.h> // memchr(), strlen(), strcmp()
+#include <errno.h> // errno, EINTR
+#include <fcntl.h> // open()
+#include <unistd.h> // close(), STDOUT_FILENO
+#include <sys/uio.h> // writev()
+#include <sys/mman.h> // mmap(), munmap()
+#include <sys/stat.h> // fstat(), S_ISREG()
+#include <stdint.h> // SIZE_MAX, UINT64_MAX
 
 /* This file implements grep_files() for grep.h */
 /* Other structs and functions declared here are limited to this file! */
 /* Use 'static' to declare local functions and local global variables */
 
+/* Files are split into chunks of roughly this size for several threads */
+/* Files smaller than two chunks are searched whole by a single thread */
+#define GREP_FILES_CHUNK_SIZE (8 * 1024 * 1024)
+
+/* Directories are read by up to this many threads besides searching ones */
+#define GREP_FILES_MAX_WALKER_THREADS 4
+
+/* Each worker keeps up to this many upcoming small files being read */
+/* by io_uring while it searches the current one */
+#define GREP_FILES_PREFETCH_DEPTH 8
+/* Only files up to this size are read ahead, bounding worker memory */
+#define GREP_FILES_PREFETCH_MAX_SIZE (1024 * 1024)
+/* Threads hinting page cache when io_uring is unavailable */
+#define GREP_FILES_PREFETCH_THREADS 2
+
+/* Results of up to this many files are written with one writev() */
+/* POSIX only guarantees at least 16, Linux allows 1024 */
+#define GREP_FILES_MAX_VECTORS 256
+
+/* Outputs waiting for earlier files are copied into blocks of this */
+/* size, larger outputs get a block of their own, freed once written */
+#define GREP_FILES_BLOCK_SIZE (256 * 1024)
+
+/* Tasks are allocated this many at once and recycled afterwards */
+#define GREP_FILES_TASK_BLOCK_SIZE 64
+
+/* Files named on command line are stat()ed by several threads when */
+/* there are at least this many of them */
+#define GREP_FILES_PARALLEL_STAT_MIN_COUNT 512
+#define GREP_FILES_MAX_STAT_THREADS 8
+
+/* Files up to this size are packed into batch tasks of about this many */
+/* bytes, so that each task is worth its queue overhead */
+#define GREP_FILES_BATCH_MAX_FILE_SIZE (64 * 1024)
+#define GREP_FILES_BATCH_BYTES (1024 * 1024)
+#define GREP_FILES_BATCH_MAX_FILES 64
+
+/* Cost model of scheduler, used to order tasks and shown by --verbose */
+#define GREP_FILES_FILE_NANOSECONDS 20000 // opening, reading and closing a file
+#define GREP_FILES_BYTE_PICOSECONDS 500 // searching a byte already in memory
+/* Expected time of files whose size is not known, scheduled first */
+#define GREP_FILES_UNKNOWN_COST UINT64_MAX
+
+/* Storage of outputs waiting to be written, reused once all of them are */
+typedef struct GrepFilesBlock {
+	struct GrepFilesBlock* next; // links free blocks
+	size_t length;
+	size_t capacity;
+	size_t waiting_count; // parts copied here and not written yet
+	_Alignas(16) char data[];
+} GrepFilesBlock;
+
+/* Rendered results waiting for their turn to be written, kept in a */
+/* block right in front of their data */
+typedef struct GrepFilesPart {
+	struct GrepFilesPart* next;
+	const char* data;
+	size_t length;
+	GrepFilesBlock* block; // NULL when still in buffer of writing thread
+	bool is_ready; // copying into block is finished
+} GrepFilesPart;
+
+/* Results of a file, handed to writer in one or more parts */
+/* Large files give a part for each chunk as soon as it is rendered */
+typedef struct GrepFilesOutput {
+	GrepFilesPart* parts; // not written yet, in order
+	GrepFilesPart* last_part;
+	bool is_done; // last part was handed over
+} GrepFilesOutput;
+
+/* Reorder stage writing file results to stdout in command-line order */
+/* Without ordering, results are appended in the order files finish */
+/* Thread that finds next output ready keeps writing following ones, */
+/* while other threads copy their outputs and continue searching */
+/* Threads keep their own buffers, so searching does not allocate however */
+/* many outputs wait for earlier files */
+typedef struct GrepFilesWriter {
+	pthread_mutex_t mutex;
+	GrepFilesOutput* outputs; // one per file when ordered, in write order
+	size_t output_count;
+	size_t output_capacity;
+	size_t next_index; // next output to be written
+	bool is_writing;
+	bool is_ordered;
+	GrepFilesBlock* block; // block outputs are copied into
+	GrepFilesBlock* free_blocks; // written, empty and ready for reuse
+} GrepFilesWriter;
+
 /* Generic thread arguments for functions that use job queue */
 typedef struct ThreadArguments {
 	JobQueue* job_queue;
 	pthread_mutex_t* mutex;
+	GrepFilesWriter* writer;
 	int thread_index;
+	size_t* pattern_match_counts; // shared, only updated holding mutex
+	Stats stats; // counters of this thread are copied here before exiting
+	size_t match_count; // set before exiting
+	int exit_code; // EXIT_FAILURE once any file could not be searched
+	PrefetchPool* prefetch_pool; // only when io_uring is unavailable
+	uint64_t expected_nanoseconds; // summed over tasks of known cost, with --verbose
+	uint64_t task_nanoseconds; // measured time of those tasks, with --verbose
+	int cpu; // worker is pinned to this CPU, -1 when it is not pinned
+	int node; // NUMA node of that CPU
+	bool verbose;
 } ThreadArguments;
 
+/* Newline aligned part of a mapped file and results of searching it */
+typedef struct GrepFileChunk {
+	size_t offset;
+	size_t size;
+	size_t line_count; // newlines in chunk, known after searching it
+	size_t line_offset; // lines of all earlier chunks, known once they are searched
+	GrepLines lines;
+	GrepBuffer rendered; // lines with their numbers, waiting to be handed to writer
+	bool is_searched;
+	bool is_rendered;
+} GrepFileChunk;
+
+/* Large file shared by all of its chunk tasks */
+/* Each chunk is rendered as soon as all earlier ones are searched, and */
+/* handed to writer as soon as all earlier ones are, so only results of */
+/* chunks waiting for earlier ones are kept */
+/* Counters and flags are only used holding writer mutex */
+typedef struct GrepFileChunks {
+	const char* data;
+	size_t size;
+	GrepFileChunk* chunks;
+	size_t chunk_count;
+	size_t match_count;
+	size_t numbered_count; // leading chunks that are searched, so their line offsets are known
+	size_t line_offset; // lines of those chunks
+	size_t next_chunk; // first chunk not handed to writer yet
+	bool is_streaming; // a thread is handing chunks to writer
+	size_t output_index; // where writer keeps results, SIZE_MAX until first unordered part
+} GrepFileChunks;
+
 /* Task structure for grep_file() job */
 typedef struct GrepFileTask {
 	const char* file_name;
+	bool is_file_name_owned; // found by walker, freed once file is done
+	size_t file_index; // position on command line
 	const GrepOptions* options;
+	GrepFileChunks* file_chunks; // NULL when file is searched whole
+	size_t chunk_index;
+	size_t prefetch_size; // size of small regular file, 0 when not read ahead
+	PrefetchRequest request;
+	bool is_prefetched; // file is being read into request
+	bool is_known_empty; // index proves file has no match, so it is not read
+	struct GrepFileTask* batch_next; // next small file searched by the same worker
+	size_t byte_count; // bytes of file, chunk or whole batch
+	size_t file_count; // files of batch, 1 otherwise
+	uint64_t expected_nanoseconds; // estimated by scheduler for whole batch
+	struct GrepFileTask* next; // links free tasks, or tasks being scheduled
 } GrepFileTask;
 
+typedef struct GrepFilesTaskBlock {
+	GrepFileTask tasks[GREP_FILES_TASK_BLOCK_SIZE];
+	struct GrepFilesTaskBlock* next;
+} GrepFilesTaskBlock;
+
+/* Tasks are created by threads pushing files and finished by workers */
+/* Each thread keeps free tasks in its own list, whole lists are moved */
+/* through the shared one, so the mutex is rarely taken */
+typedef struct GrepFilesTaskPool {
+	pthread_mutex_t mutex;
+	GrepFileTask* tasks; // shared list of free tasks
+	size_t task_count;
+	GrepFilesTaskBlock* blocks; // every block, freed after threads are joined
+} GrepFilesTaskPool;
+
+/* Global variables are marked with _G suffix */
+static GrepFilesTaskPool grep_files_task_pool_G = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, NULL };
+/* Free tasks of calling thread */
+static _Thread_local GrepFileTask* grep_files_free_tasks_G = NULL;
+static _Thread_local size_t grep_files_free_task_count_G = 0;
+
+/* Taking free task of calling thread, or all tasks of the shared list */
+/* when it has none, new block is only allocated if both are empty */
+static GrepFileTask* grep_files_task_new(void) {
+	if (grep_files_free_tasks_G == NULL) {
+		GrepFilesTaskPool* pool = &grep_files_task_pool_G;
+		pthread_mutex_lock(&pool->mutex);
+		if (pool->tasks == NULL) {
+			GrepFilesTaskBlock* block = malloc(sizeof(GrepFilesTaskBlock));
+			if (block != NULL) {
+				for (size_t index = 0; index < GREP_FILES_TASK_BLOCK_SIZE; index++) {
+					block->tasks[index].next = (index + 1 < GREP_FILES_TASK_BLOCK_SIZE)
+						? &block->tasks[index + 1] : NULL;
+				}
+				block->next = pool->blocks;
+				pool->blocks = block;
+				pool->tasks = block->tasks;
+				pool->task_count = GREP_FILES_TASK_BLOCK_SIZE;
+			}
+		}
+		grep_files_free_tasks_G = pool->tasks;
+		grep_files_free_task_count_G = pool->task_count;
+		pool->tasks = NULL;
+		pool->task_count = 0;
+		pthread_mutex_unlock(&pool->mutex);
+		if (grep_files_free_tasks_G == NULL) { return NULL; }
+	}
+	GrepFileTask* task = grep_files_free_tasks_G;
+	grep_files_free_tasks_G = task->next;
+	grep_files_free_task_count_G -= 1;
+	return task;
+}
+
+/* Moving free tasks of calling thread to the shared list */
+static void grep_files_task_return(void) {
+	GrepFileTask* last = grep_files_free_tasks_G;
+	if (last == NULL) { return; }
+	while (last->next != NULL) { last = last->next; }
+	GrepFilesTaskPool* pool = &grep_files_task_pool_G;
+	pthread_mutex_lock(&pool->mutex);
+	last->next = pool->tasks;
+	pool->tasks = grep_files_free_tasks_G;
+	pool->task_count += grep_files_free_task_count_G;
+	pthread_mutex_unlock(&pool->mutex);
+	grep_files_free_tasks_G = NULL;
+	grep_files_free_task_count_G = 0;
+}
+
+static void grep_files_task_free(GrepFileTask* task) {
+	task->next = grep_files_free_tasks_G;
+	grep_files_free_tasks_G = task;
+	grep_files_free_task_count_G += 1;
+	if (grep_files_free_task_count_G >= GREP_FILES_TASK_BLOCK_SIZE) { grep_files_task_return(); }
+}
+
+/* Freeing all blocks once no thread uses tasks anymore */
+static void grep_files_task_pool_free(void) {
+	GrepFilesTaskPool* pool = &grep_files_task_pool_G;
+	while (pool->blocks != NULL) {
+		GrepFilesTaskBlock* block = pool->blocks;
+		pool->blocks = block->next;
+		free(block);
+	}
+	pool->tasks = NULL;
+	pool->task_count = 0;
+	grep_files_free_tasks_G = NULL;
+	grep_files_free_task_count_G = 0;
+}
+
+/* Adding per-pattern counts of a file to the total counts */
+/* Counts of a file belong to searching thread and are reused */
+static void add_pattern_match_counts(size_t* total_counts, GrepFileResult* grep_file_result, size_t pattern_count) {
+	if (grep_file_result->pattern_match_counts == NULL) { return; }
+	if (total_counts != NULL) {
+		for (size_t index = 0; index < pattern_count; index++) {
+			total_counts[index] += grep_file_result->pattern_match_counts[index];
+		}
+	}
+	grep_file_result->pattern_match_counts = NULL;
+}
+
+/* Locking writer mutex, time it is held is counted for statistics */
+static uint64_t grep_files_lock(pthread_mutex_t* mutex) {
+	pthread_mutex_lock(mutex);
+	return stats_now();
+}
+
+static void grep_files_unlock(pthread_mutex_t* mutex, uint64_t lock_time) {
+	stats_local_G.writer_hold_nanoseconds += stats_now() - lock_time;
+	pthread_mutex_unlock(mutex);
+}
+
+/* Expected time of searching files of given total size */
+static uint64_t grep_files_cost(size_t file_count, size_t byte_count) {
+	return (uint64_t)file_count * GREP_FILES_FILE_NANOSECONDS
+		+ (uint64_t)byte_count * GREP_FILES_BYTE_PICOSECONDS / 1000;
+}
+
+/* Mapping large regular file and cutting it after newlines */
+/* Returns NULL when file should be searched whole by grep_file(), and */
+/* sets 'prefetch_size' when file is small enough to be read ahead */
+/* 'file_size' is SIZE_MAX when file is not regular, so size is unknown */
+/* File is only stat()ed when 'known_stat' is NULL */
+static GrepFileChunks* grep_files_split(const char* file_name, const struct stat* known_stat,
+	bool is_split_allowed, size_t* prefetch_size, size_t* file_size) {
+	*prefetch_size = 0;
+	*file_size = SIZE_MAX;
+	if (strcmp(file_name, GREP_STDIN_NAME) == 0) { return NULL; }
+	uint64_t start = stats_now();
+	struct stat file_stat;
+	if (known_stat != NULL) {
+		file_stat = *known_stat;
+	} else if (stat(file_name, &file_stat) != 0) {
+		file_stat.st_mode = 0;
+	}
+	if (!S_ISREG(file_stat.st_mode)) {
+		stats_local_G.open_nanoseconds += stats_now() - start;
+		return NULL;
+	}
+	*file_size = (size_t)file_stat.st_size;
+	if ((size_t)file_stat.st_size <= GREP_FILES_PREFETCH_MAX_SIZE) { *prefetch_size = (size_t)file_stat.st_size; }
+	if (!is_split_allowed || file_stat.st_size < 2 * GREP_FILES_CHUNK_SIZE) {
+		stats_local_G.open_nanoseconds += stats_now() - start;
+		return NULL;
+	}
+	int file = open(file_name, O_RDONLY);
+	if (file == -1 || fstat(file, &file_stat) != 0) {
+		if (file != -1) { close(file); }
+		stats_local_G.open_nanoseconds += stats_now() - start;
+		return NULL;
+	}
+
+	/* Pages are faulted in by threads searching them, not populated here */
+	size_t size = (size_t)file_stat.st_size;
+	void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+	close(file); // mapping stays valid after closing file
+	stats_local_G.open_nanoseconds += stats_now() - start;
+	if (data == MAP_FAILED) { return NULL; }
+
+	/* Compressed files can't be split at newlines, they are searched whole */
+	if (decompress_detect(data, size) != DECOMPRESS_FORMAT_NONE) {
+		munmap(data, size);
+		return NULL;
+	}
+
+	GrepFileChunks* file_chunks = calloc(1, sizeof(GrepFileChunks));
+	size_t max_chunk_count = size / GREP_FILES_CHUNK_SIZE + 1;
+	GrepFileChunk* chunks = calloc(max_chunk_count, sizeof(GrepFileChunk));
+	if (file_chunks == NULL || chunks == NULL) {
+		free(file_chunks);
+		free(chunks);
+		munmap(data, size);
+		return NULL;
+	}
+	file_chunks->data = (const char*)data;
+	file_chunks->size = size;
+	file_chunks->chunks = chunks;
+
+	/* Each chunk ends right after the first newline past its nominal end */
+	/* Very long lines make chunks larger, but never split a line */
+	size_t offset = 0;
+	while (offset < size) {
+		size_t end = offset + GREP_FILES_CHUNK_SIZE;
+		if (end >= size) {
+			end = size;
+		} else {
+			const char* newline = memchr(file_chunks->data + end - 1, '\n', size - (end - 1));
+			end = (newline != NULL) ? (size_t)(newline - file_chunks->data) + 1 : size;
+		}
+		chunks[file_chunks->chunk_count].offset = offset;
+		chunks[file_chunks->chunk_count].size = end - offset;
+		file_chunks->chunk_count += 1;
+		offset = end;
+	}
+	return file_chunks;
+}
+
+/* Rendering the line that ends results of each file, depending on mode */
+/* Thread index is only shown when it is not negative */
+static bool grep_files_render_result(GrepBuffer* output, int thread_index, const char* file_name,
+	size_t match_count, GrepOutputMode output_mode) {
+	bool is_rendered = 1;
+	if (strcmp(file_name, GREP_STDIN_NAME) == 0) { file_name = GREP_STDIN_LABEL; }
+	switch (output_mode) {
+		case GREP_OUTPUT_MATCH_COUNTS: {
+			char thread[64];
+			int thread_length = 0;
+			if (thread_index >= 0) {
+				thread_length = snprintf(thread, sizeof(thread), "%s[%d]%s ",
+					ANSI_COLOR_YELLOW, thread_index + 1, ANSI_COLOR_RESET);
+			}
+			char count[64];
+			int count_length = snprintf(count, sizeof(count), "%s:%s %zu\n",
+				ANSI_COLOR_CYAN, ANSI_COLOR_RESET, match_count);
+			is_rendered &= grep_buffer_append(output, thread, (size_t)thread_length);
+			is_rendered &= grep_buffer_append(output, ANSI_COLOR_MAGENTA, sizeof(ANSI_COLOR_MAGENTA) - 1);
+			is_rendered &= grep_buffer_append(output, file_name, strlen(file_name));
+			is_rendered &= grep_buffer_append(output, count, (size_t)count_length);
+			break;
+		}
+		case GREP_OUTPUT_COUNTS_ONLY: {
+			char count[64];
+			int count_length = snprintf(count, sizeof(count), ":%zu\n", match_count);
+			is_rendered &= grep_buffer_append(output, file_name, strlen(file_name));
+			is_rendered &= grep_buffer_append(output, count, (size_t)count_length);
+			break;
+		}
+		case GREP_OUTPUT_FILES_WITH_MATCHES:
+		case GREP_OUTPUT_FILES_WITHOUT_MATCH:
+			if ((match_count > 0) == (output_mode == GREP_OUTPUT_FILES_WITH_MATCHES)) {
+				is_rendered &= grep_buffer_append(output, file_name, strlen(file_name));
+				is_rendered &= grep_buffer_append(output, "\n", 1);
+			}
+			break;
+		case GREP_OUTPUT_QUIET:
+			break;
+	}
+	return is_rendered;
+}
+
+/* Writing all buffers to stdout, retrying after partial writes */
+static void grep_files_writev(struct iovec* vectors, int vector_count) {
+	while (vector_count > 0) {
+		ssize_t written = writev(STDOUT_FILENO, vectors, vector_count);
+		if (written < 0) {
+			if (errno == EINTR) { continue; }
+			return; // nothing more can be done about failed stdout
+		}
+		while (vector_count > 0 && (size_t)written >= vectors->iov_len) {
+			written -= (ssize_t)vectors->iov_len;
+			vectors += 1;
+			vector_count -= 1;
+		}
+		if (vector_count > 0) {
+			vectors->iov_base = (char*)vectors->iov_base + written;
+			vectors->iov_len -= (size_t)written;
+		}
+	}
+}
+
+/* Reserving room for part in current block, or in a new one when it */
+/* is full, called holding writer mutex */
+/* Returns NULL when memory is exhausted */
+static GrepFilesPart* grep_files_block_reserve(GrepFilesWriter* writer, size_t length) {
+	/* Parts stay aligned, so each one can start right after the last */
+	size_t size = (sizeof(GrepFilesPart) + length + 15) & ~(size_t)15;
+	GrepFilesBlock* block = writer->block;
+	if (block == NULL || block->capacity - block->length < size) {
+		if (size > GREP_FILES_BLOCK_SIZE) {
+			block = malloc(sizeof(GrepFilesBlock) + size);
+			if (block == NULL) { return NULL; }
+			block->capacity = size;
+		} else if (writer->free_blocks != NULL) {
+			block = writer->free_blocks;
+			writer->free_blocks = block->next;
+		} else {
+			block = malloc(sizeof(GrepFilesBlock) + GREP_FILES_BLOCK_SIZE);
+			if (block == NULL) { return NULL; }
+			block->capacity = GREP_FILES_BLOCK_SIZE;
+		}
+		block->next = NULL;
+		block->length = 0;
+		block->waiting_count = 0;
+
+		/* Full block is released by its last part, large one by its only part */
+		if (size <= GREP_FILES_BLOCK_SIZE) {
+			if (writer->block != NULL && writer->block->waiting_count == 0) {
+				writer->block->next = writer->free_blocks;
+				writer->free_blocks = writer->block;
+			}
+			writer->block = block;
+		}
+	}
+	GrepFilesPart* part = (GrepFilesPart*)(block->data + block->length);
+	block->length += size;
+	block->waiting_count += 1;
+	*part = (GrepFilesPart){ NULL, (const char*)(part + 1), length, block, 0 };
+	return part;
+}
+
+/* Releasing block of written part, called holding writer mutex */
+static void grep_files_block_release(GrepFilesWriter* writer, GrepFilesBlock* block) {
+	if (block == NULL || --block->waiting_count > 0) { return; }
+	if (block == writer->block) {
+		block->length = 0; // filled again from start
+	} else if (block->capacity > GREP_FILES_BLOCK_SIZE) {
+		free(block);
+	} else {
+		block->next = writer->free_blocks;
+		writer->free_blocks = block;
+	}
+}
+
+/* Handing part of file results to reorder stage */
+/* Writing happens outside of mutex, so threads finishing other files */
+/* are not blocked by stdout */
+/* 'index' is position of file in write order, or SIZE_MAX for first part */
+/* of unordered results, then it is set for following parts */
+/* Buffer stays with caller, it is either written right away or copied */
+/* to wait for earlier results, and is empty afterwards */
+static void grep_files_write_part(GrepFilesWriter* writer, size_t* index, GrepBuffer* buffer, bool is_last) {
+	uint64_t lock_time = grep_files_lock(&writer->mutex);
+	if (*index == SIZE_MAX) {
+		/* Unordered outputs are appended, array is reused once written */
+		if (writer->output_count == writer->output_capacity) {
+			size_t capacity = (writer->output_capacity > 0) ? writer->output_capacity * 2 : 64;
+			GrepFilesOutput* outputs_copy = realloc(writer->outputs, capacity * sizeof(GrepFilesOutput));
+			if (outputs_copy == NULL) {
+				grep_files_unlock(&writer->mutex, lock_time);
+				buffer->length = 0; // results are lost, but nothing leaks
+				return;
+			}
+			writer->outputs = outputs_copy;
+			writer->output_capacity = capacity;
+		}
+		*index = writer->output_count;
+		writer->outputs[*index] = (GrepFilesOutput){ NULL, NULL, 0 };
+		writer->output_count += 1;
+	}
+	GrepFilesOutput* output = &writer->outputs[*index];
+	output->is_done = is_last;
+
+	/* Part that can't be written now is copied outside of mutex, its */
+	/* room is reserved first, so that no other part overwrites it */
+	GrepFilesPart own_part = { NULL, buffer->data, buffer->length, NULL, 1 };
+	GrepFilesPart* part = (buffer->length > 0) ? &own_part : NULL;
+	bool is_copied = (part != NULL && (writer->is_writing || *index != writer->next_index || output->parts != NULL));
+	if (is_copied) {
+		part = grep_files_block_reserve(writer, buffer->length); // results are lost when NULL
+	}
+	if (part != NULL) {
+		if (output->parts == NULL) {
+			output->parts = part;
+		} else {
+			output->last_part->next = part;
+		}
+		output->last_part = part;
+	}
+	if (is_copied && part != NULL) {
+		grep_files_unlock(&writer->mutex, lock_time);
+		memcpy((char*)part->data, buffer->data, buffer->length);
+		lock_time = grep_files_lock(&writer->mutex);
+		part->is_ready = 1;
+	}
+	if (writer->is_writing) {
+		grep_files_unlock(&writer->mutex, lock_time);
+		buffer->length = 0;
+		return; // thread that is writing will also write this part
+	}
+	writer->is_writing = 1;
+
+	/* Own part is first in line when it was not copied, so it is written */
+	/* by the first writev() below */
+	struct iovec vectors[GREP_FILES_MAX_VECTORS];
+	GrepFilesBlock* blocks[GREP_FILES_MAX_VECTORS];
+	while (1) {
+		/* Collecting consecutive ready parts into a single writev() */
+		int vector_count = 0;
+		while (writer->next_index < writer->output_count && vector_count < GREP_FILES_MAX_VECTORS) {
+			GrepFilesOutput* next_output = &writer->outputs[writer->next_index];
+			GrepFilesPart* next_part = next_output->parts;
+			if (next_part == NULL) {
+				if (!next_output->is_done) { break; } // more parts will follow
+				writer->next_index += 1;
+				continue;
+			}
+			if (!next_part->is_ready) { break; }
+			vectors[vector_count].iov_base = (void*)next_part->data;
+			vectors[vector_count].iov_len = next_part->length;
+			blocks[vector_count] = next_part->block; // released after writing
+			vector_count += 1;
+			next_output->parts = next_part->next;
+		}
+		if (!writer->is_ordered && writer->next_index == writer->output_count) {
+			writer->next_index = 0;
+			writer->output_count = 0;
+		}
+		if (vector_count == 0) { break; }
+		grep_files_unlock(&writer->mutex, lock_time);
+
+		/* Written parts were taken off their outputs, array may grow meanwhile */
+		grep_files_writev(vectors, vector_count);
+		lock_time = grep_files_lock(&writer->mutex);
+		for (int written_index = 0; written_index < vector_count; written_index++) {
+			grep_files_block_release(writer, blocks[written_index]);
+		}
+	}
+	writer->is_writing = 0;
+	grep_files_unlock(&writer->mutex, lock_time);
+	buffer->length = 0;
+}
+
+/* Handing whole results of a finished file to reorder stage */
+static void grep_files_write(GrepFilesWriter* writer, size_t file_index, GrepBuffer* buffer) {
+	size_t index = writer->is_ordered ? file_index : SIZE_MAX;
+	grep_files_write_part(writer, &index, buffer, 1);
+}
+
+/* File that gets no task is written empty, so later files are still */
+/* written in order */
+static void grep_files_skip(GrepFilesWriter* writer, const char* file_name, bool is_file_name_owned,
+	size_t file_index) {
+	GrepBuffer output = {0};
+	grep_files_write(writer, file_index, &output);
+	grep_buffer_free(&output);
+	if (is_file_name_owned) { free((char*)file_name); }
+}
+
+/* Creating a task for each chunk of file, or single task for whole file */
+/* Large files are split so that all threads can search them */
+/* Tasks are linked through 'next', NULL when none could be created */
+static GrepFileTask* grep_files_prepare(GrepFilesWriter* writer, const char* file_name,
+	const struct stat* known_stat, bool is_file_name_owned, size_t file_index, const GrepOptions* options) {
+	/* Only first matching lines of a file are needed with limits, and */
+	/* those are most likely found before searching many chunks */
+	size_t prefetch_size = 0;
+	size_t file_size = SIZE_MAX;
+	GrepFileChunks* file_chunks = grep_files_split(file_name, known_stat, options->max_count == 0,
+		&prefetch_size, &file_size);
+	size_t chunk_count = (file_chunks != NULL) ? file_chunks->chunk_count : 1;
+
+	/* Tasks of all chunks are taken first, file is pushed whole or not at all */
+	GrepFileTask* tasks = NULL;
+	for (size_t chunk_index = 0; chunk_index < chunk_count; chunk_index++) {
+		GrepFileTask* task = grep_files_task_new();
+		if (task == NULL) {
+			while (tasks != NULL) {
+				GrepFileTask* next = tasks->next;
+				grep_files_task_free(tasks);
+				tasks = next;
+			}
+			if (file_chunks != NULL) {
+				munmap((void*)file_chunks->data, file_chunks->size);
+				free(file_chunks->chunks);
+				free(file_chunks);
+			}
+			grep_files_skip(writer, file_name, is_file_name_owned, file_index);
+			return NULL;
+		}
+		task->next = tasks;
+		tasks = task;
+	}
+
+	if (file_chunks != NULL) { file_chunks->output_index = writer->is_ordered ? file_index : SIZE_MAX; }
+
+	/* First chunk also pays for opening the file */
+	GrepFileTask* task = tasks;
+	for (size_t chunk_index = 0; chunk_index < chunk_count; chunk_index++) {
+		task->file_name = file_name;
+		task->is_file_name_owned = is_file_name_owned;
+		task->file_index = file_index;
+		task->options = options;
+		task->file_chunks = file_chunks;
+		task->chunk_index = chunk_index;
+		task->prefetch_size = (file_chunks == NULL) ? prefetch_size : 0;
+		task->is_prefetched = 0;
+		task->is_known_empty = 0;
+		task->batch_next = NULL;
+		task->byte_count = (file_chunks != NULL) ? file_chunks->chunks[chunk_index].size
+			: (file_size != SIZE_MAX) ? file_size : 0;
+		task->file_count = 1;
+		task->expected_nanoseconds = (file_size == SIZE_MAX) ? GREP_FILES_UNKNOWN_COST
+			: grep_files_cost(chunk_index == 0, task->byte_count);
+		task = task->next;
+	}
+	return tasks;
+}
+
+/* Chunks of mapped files already in page cache go to workers of the */
+/* NUMA node holding their pages, other chunks are spread over nodes */
+/* Node rings are taken one task at a time in the order tasks were */
+/* pushed, so each chunk is written soon after it is searched, unlike */
+/* batches of shared ring that other workers steal from the end */
+/* Other tasks go to shared ring */
+static void grep_files_push_task(JobQueue* job_queue, GrepFileTask* task) {
+	if (task->file_chunks != NULL && job_queue->node_rings != NULL) {
+		GrepFileChunk* chunk = &task->file_chunks->chunks[task->chunk_index];
+		int node = (job_queue->node_count > 1) ? cpu_page_node(task->file_chunks->data + chunk->offset) : 0;
+		if (node < 0 || node >= job_queue->node_count) { node = (int)(task->chunk_index % (size_t)job_queue->node_count); }
+		job_queue_push_node(job_queue, node, (void*)task);
+		return;
+	}
+	job_queue_push(job_queue, (void*)task);
+}
+
+/* Pushing all tasks of a file in the order they were found */
+static void grep_files_push(JobQueue* job_queue, GrepFilesWriter* writer, const char* file_name,
+	bool is_file_name_owned, size_t file_index, const GrepOptions* options) {
+	GrepFileTask* tasks = grep_files_prepare(writer, file_name, NULL, is_file_name_owned, file_index, options);
+	while (tasks != NULL) {
+		GrepFileTask* next = tasks->next;
+		grep_files_push_task(job_queue, tasks);
+		tasks = next;
+	}
+}
+
+/* File named on command line, stat()ed before any task is pushed */
+typedef struct GrepFilesEntry {
+	const char* file_name;
+	size_t file_index;
+	struct stat file_stat;
+	bool is_stat_known; // stat() succeeded, never for standard input
+} GrepFilesEntry;
+
+typedef struct GrepFilesStatArguments {
+	GrepFilesEntry* entries;
+	size_t entry_count;
+	size_t first_index; // thread stat()s every 'step'th entry from here
+	size_t step;
+} GrepFilesStatArguments;
+
+static void* grep_files_stat_thread(void* arguments) {
+	GrepFilesStatArguments* args = (GrepFilesStatArguments*)arguments;
+	for (size_t index = args->first_index; index < args->entry_count; index += args->step) {
+		GrepFilesEntry* entry = &args->entries[index];
+		entry->is_stat_known = strcmp(entry->file_name, GREP_STDIN_NAME) != 0
+			&& stat(entry->file_name, &entry->file_stat) == 0;
+	}
+	return NULL;
+}
+
+/* Long lists are stat()ed by several threads, because each stat() may */
+/* wait for disk or network file system, calling thread also takes part */
+static void grep_files_stat_all(GrepFilesEntry* entries, size_t entry_count, int available_threads) {
+	int thread_count = 1;
+	if (entry_count >= GREP_FILES_PARALLEL_STAT_MIN_COUNT) {
+		thread_count = available_threads < GREP_FILES_MAX_STAT_THREADS
+			? available_threads : GREP_FILES_MAX_STAT_THREADS;
+	}
+	uint64_t start = stats_now();
+	pthread_t threads[GREP_FILES_MAX_STAT_THREADS];
+	GrepFilesStatArguments thread_arguments[GREP_FILES_MAX_STAT_THREADS];
+	int started_count = 0;
+	for (int index = 1; index < thread_count; index++) {
+		thread_arguments[started_count] = (GrepFilesStatArguments){ entries, entry_count, (size_t)index,
+			(size_t)thread_count };
+		if (pthread_create(&threads[started_count], NULL, &grep_files_stat_thread,
+			&thread_arguments[started_count])) {
+			break; // remaining entries are stat()ed by calling thread below
+		}
+		started_count += 1;
+	}
+	GrepFilesStatArguments own_arguments = { entries, entry_count, 0, (size_t)thread_count };
+	grep_files_stat_thread(&own_arguments);
+	for (int index = 0; index < started_count; index++) { pthread_join(threads[index], NULL); }
+
+	/* Entries of threads that failed to start */
+	for (int index = started_count + 1; index < thread_count; index++) {
+		own_arguments.first_index = (size_t)index;
+		grep_files_stat_thread(&own_arguments);
+	}
+	stats_local_G.open_nanoseconds += stats_now() - start;
+}
+
+/* Unknown sizes first, then largest files, argument order breaks ties */
+static int grep_files_compare_entries(const void* first, const void* second) {
+	const GrepFilesEntry* first_entry = (const GrepFilesEntry*)first;
+	const GrepFilesEntry* second_entry = (const GrepFilesEntry*)second;
+	bool is_first_sized = first_entry->is_stat_known && S_ISREG(first_entry->file_stat.st_mode);
+	bool is_second_sized = second_entry->is_stat_known && S_ISREG(second_entry->file_stat.st_mode);
+	if (is_first_sized != is_second_sized) { return is_first_sized ? 1 : -1; }
+	if (is_first_sized && first_entry->file_stat.st_size != second_entry->file_stat.st_size) {
+		return (first_entry->file_stat.st_size > second_entry->file_stat.st_size) ? -1 : 1;
+	}
+	return (first_entry->file_index > second_entry->file_index) - (first_entry->file_index < second_entry->file_index);
+}
+
+/* Chunks are ordered by cost of their whole file, so that chunks of a */
+/* file are searched together and in order, then each one is written */
+/* soon after it is searched */
+static uint64_t grep_files_order_cost(const GrepFileTask* task) {
+	return (task->file_chunks != NULL) ? grep_files_cost(1, task->file_chunks->size) : task->expected_nanoseconds;
+}
+
+/* Longest tasks first, so that no thread starts a long task last */
+static int grep_files_compare_tasks(const void* first, const void* second) {
+	const GrepFileTask* first_task = *(GrepFileTask* const*)first;
+	const GrepFileTask* second_task = *(GrepFileTask* const*)second;
+	uint64_t first_cost = grep_files_order_cost(first_task);
+	uint64_t second_cost = grep_files_order_cost(second_task);
+	if (first_cost != second_cost) { return (first_cost > second_cost) ? -1 : 1; }
+	if (first_task->file_index != second_task->file_index) {
+		return (first_task->file_index > second_task->file_index) ? 1 : -1;
+	}
+	return (first_task->chunk_index > second_task->chunk_index) - (first_task->chunk_index < second_task->chunk_index);
+}
+
+/* Growable array of tasks waiting to be sorted */
+typedef struct GrepFilesPlan {
+	GrepFileTask** tasks;
+	size_t length;
+	size_t capacity;
+} GrepFilesPlan;
+
+/* Task that does not fit is pushed right away, it is only out of order */
+static void grep_files_plan_add(GrepFilesPlan* plan, JobQueue* job_queue, GrepFileTask* task) {
+	if (plan->length == plan->capacity) {
+		size_t capacity = (plan->capacity > 0) ? plan->capacity * 2 : 256;
+		GrepFileTask** tasks_copy = realloc(plan->tasks, capacity * sizeof(GrepFileTask*));
+		if (tasks_copy == NULL) {
+			grep_files_push_task(job_queue, task);
+			return;
+		}
+		plan->tasks = tasks_copy;
+		plan->capacity = capacity;
+	}
+	plan->tasks[plan->length] = task;
+	plan->length += 1;
+}
+
+/* Ordering files named on command line before searching them */
+/* Greedy longest-processing-time-first keeps threads finishing together, */
+/* and small files are packed into batches of about the same size */
+/* Output is still written in argument order by the writer */
+static void grep_files_schedule(JobQueue* job_queue, GrepFilesWriter* writer, char** file_names,
+	size_t file_count, const GrepOptions* options) {
+	GrepFilesEntry* entries = calloc(file_count, sizeof(GrepFilesEntry));
+	if (entries == NULL) {
+		for (size_t index = 0; index < file_count; index++) {
+			grep_files_push(job_queue, writer, file_names[index], 0, index, options);
+		}
+		return;
+	}
+	for (size_t index = 0; index < file_count; index++) {
+		entries[index].file_name = file_names[index];
+		entries[index].file_index = index;
+	}
+	grep_files_stat_all(entries, file_count, options->available_threads);
+	qsort(entries, file_count, sizeof(GrepFilesEntry), &grep_files_compare_entries);
+
+	GrepFilesPlan plan = {0};
+	GrepFileTask* batch = NULL; // head of batch being filled
+	GrepFileTask* batch_last = NULL;
+	for (size_t index = 0; index < file_count; index++) {
+		GrepFilesEntry* entry = &entries[index];
+		bool is_small = entry->is_stat_known && S_ISREG(entry->file_stat.st_mode)
+			&& (size_t)entry->file_stat.st_size <= GREP_FILES_BATCH_MAX_FILE_SIZE;
+		if (!is_small) {
+			GrepFileTask* tasks = grep_files_prepare(writer, entry->file_name,
+				entry->is_stat_known ? &entry->file_stat : NULL, 0, entry->file_index, options);
+			while (tasks != NULL) {
+				GrepFileTask* next = tasks->next;
+				grep_files_plan_add(&plan, job_queue, tasks);
+				tasks = next;
+			}
+			continue;
+		}
+
+		/* Files are sorted by size, so batches hold files of similar size */
+		GrepFileTask* task = grep_files_task_new();
+		if (task == NULL) {
+			grep_files_skip(writer, entry->file_name, 0, entry->file_index);
+			continue;
+		}
+		task->file_name = entry->file_name;
+		task->is_file_name_owned = 0;
+		task->file_index = entry->file_index;
+		task->options = options;
+		task->file_chunks = NULL;
+		task->chunk_index = 0;
+		task->prefetch_size = (size_t)entry->file_stat.st_size;
+		task->is_prefetched = 0;
+		task->is_known_empty = 0;
+		task->batch_next = NULL;
+		task->byte_count = (size_t)entry->file_stat.st_size;
+		task->file_count = 1;
+		if (batch == NULL) {
+			batch = task;
+		} else {
+			batch_last->batch_next = task;
+			batch->byte_count += task->byte_count;
+			batch->file_count += 1;
+		}
+		batch_last = task;
+		if (batch->byte_count >= GREP_FILES_BATCH_BYTES || batch->file_count == GREP_FILES_BATCH_MAX_FILES
+			|| index + 1 == file_count) {
+			batch->expected_nanoseconds = grep_files_cost(batch->file_count, batch->byte_count);
+			grep_files_plan_add(&plan, job_queue, batch);
+			batch = NULL;
+		}
+	}
+	free(entries);
+
+	if (plan.length > 1) { qsort(plan.tasks, plan.length, sizeof(GrepFileTask*), &grep_files_compare_tasks); }
+	for (size_t index = 0; index < plan.length; index++) {
+		grep_files_push_task(job_queue, plan.tasks[index]);
+	}
+	free(plan.tasks);
+}
+
+/* Walker pushes files while they are already being searched */
+typedef struct GrepFilesWalk {
+	JobQueue* job_queue;
+	GrepFilesWriter* writer;
+	const GrepOptions* options;
+} GrepFilesWalk;
+
+static void grep_files_visit(void* context, char* path) {
+	GrepFilesWalk* walk = (GrepFilesWalk*)context;
+
+	/* Files index proves not to match are reported without reading them */
+	/* Workers still render their results, so lines look the same */
+	TrigramIndexLookup lookup = (walk->options->index != NULL)
+		? trigram_index_lookup(walk->options->index, path) : TRIGRAM_INDEX_SEARCH;
+	if (lookup == TRIGRAM_INDEX_SKIP) {
+		free(path);
+		return;
+	}
+	if (lookup == TRIGRAM_INDEX_NO_MATCH) {
+		GrepFileTask* task = grep_files_task_new();
+		if (task == NULL) {
+			grep_files_skip(walk->writer, path, 1, 0);
+			return;
+		}
+		task->file_name = path;
+		task->is_file_name_owned = 1;
+		task->file_index = 0; // unused, unordered
+		task->options = walk->options;
+		task->file_chunks = NULL;
+		task->chunk_index = 0;
+		task->prefetch_size = 0;
+		task->is_prefetched = 0;
+		task->is_known_empty = 1;
+		task->batch_next = NULL;
+		task->byte_count = 0;
+		task->file_count = 1;
+		task->expected_nanoseconds = 0; // nothing is read
+		grep_files_push_task(walk->job_queue, task);
+		return;
+	}
+	grep_files_push(walk->job_queue, walk->writer, path, 1, 0, walk->options); // index unused, unordered
+}
+
+/* Searching file read ahead, or reading it now when that failed or */
+/* the file grew since it was found */
+static GrepFileResult grep_files_search(GrepFileTask* task, Prefetch* prefetch, GrepBuffer* output) {
+	if (!task->is_prefetched) { return grep_file(task->file_name, task->options, output); }
+	uint64_t start = stats_now();
+	bool is_read = prefetch_wait(prefetch, &task->request);
+	stats_local_G.read_nanoseconds += stats_now() - start;
+	GrepFileResult grep_file_result;
+	if (is_read && task->request.length <= task->prefetch_size) {
+		grep_file_result = grep_file_data(task->file_name, task->request.data, task->request.length,
+			task->options, output);
+	} else {
+		grep_file_result = grep_file(task->file_name, task->options, output);
+	}
+	prefetch_release(prefetch, &task->request);
+	task->is_prefetched = 0;
+	return grep_file_result;
+}
+
+/* Starting to read file of task ahead, unless search was cancelled */
+/* Returns 0 when file is read by searching thread later */
+static bool grep_files_prefetch(Prefetch* prefetch, GrepFileTask* task) {
+	if (task->prefetch_size == 0 || atomic_load_explicit(&grep_file_cancel_G, memory_order_relaxed)) { return 0; }
+	task->request.path = task->file_name;
+	task->request.size = task->prefetch_size;
+	task->is_prefetched = prefetch_submit(prefetch, &task->request);
+	return task->is_prefetched;
+}
+
+/* Reading following files of a batch ahead while io_uring has free */
+/* slots, page cache hints of thread pool never run out of slots */
+/* Returns first file whose reading was not started yet */
+static GrepFileTask* grep_files_prefetch_batch(Prefetch* prefetch, GrepFileTask* task) {
+	if (prefetch == NULL) { return NULL; }
+	while (task != NULL) {
+		if (!grep_files_prefetch(prefetch, task) && prefetch->engine == PREFETCH_ENGINE_IO_URING) { break; }
+		task = task->batch_next;
+	}
+	prefetch_flush(prefetch);
+	return task;
+}
+
+/* Taking next tasks of the queue into worker window and starting to */
+/* read their files, all of them are submitted with one system call */
+/* Window stops at tasks of large files, so their chunks stay stealable */
+static void grep_files_fill_window(ThreadArguments* args, Prefetch* prefetch, GrepFileTask** window,
+	size_t* window_start, size_t* window_length) {
+	while (*window_length < GREP_FILES_PREFETCH_DEPTH) {
+		if (*window_length > 0 && window[(*window_start + *window_length - 1) % GREP_FILES_PREFETCH_DEPTH]
+			->file_chunks != NULL) {
+			break;
+		}
+		GrepFileTask* task = (GrepFileTask*)job_queue_try_pop(args->job_queue, args->thread_index);
+		if (task == NULL) { break; }
+		if (prefetch != NULL) { grep_files_prefetch(prefetch, task); }
+		window[(*window_start + *window_length) % GREP_FILES_PREFETCH_DEPTH] = task;
+		*window_length += 1;
+	}
+	if (prefetch != NULL) { prefetch_flush(prefetch); }
+}
+
+/* Handing rendered chunks of a file to writer in order, results of the */
+/* file are completed with the last one and its mapping is released */
+/* Only thread that set 'is_streaming' calls this, other threads rendering */
+/* chunks meanwhile leave them to it */
+static void grep_files_stream(ThreadArguments* args, GrepFileTask* task) {
+	GrepFileChunks* file_chunks = task->file_chunks;
+	uint64_t lock_time = grep_files_lock(args->mutex);
+	while (file_chunks->next_chunk < file_chunks->chunk_count
+		&& file_chunks->chunks[file_chunks->next_chunk].is_rendered) {
+		GrepFileChunk* chunk = &file_chunks->chunks[file_chunks->next_chunk];
+		file_chunks->next_chunk += 1;
+		bool is_last = (file_chunks->next_chunk == file_chunks->chunk_count);
+		size_t file_match_count = file_chunks->match_count; // final once last chunk is rendered
+		grep_files_unlock(args->mutex, lock_time);
+
+		if (is_last) {
+			stats_local_G.file_count += 1;
+			grep_files_render_result(&chunk->rendered, args->thread_index, task->file_name, file_match_count,
+				task->options->output_mode);
+		}
+		if (chunk->rendered.length > 0 || is_last) {
+			grep_files_write_part(args->writer, &file_chunks->output_index, &chunk->rendered, is_last);
+		}
+		grep_buffer_free(&chunk->rendered);
+		if (is_last) {
+			munmap((void*)file_chunks->data, file_chunks->size);
+			free(file_chunks->chunks);
+			free(file_chunks);
+			if (task->is_file_name_owned) { free((char*)task->file_name); }
+			return;
+		}
+		lock_time = grep_files_lock(args->mutex);
+	}
+	file_chunks->is_streaming = 0;
+	grep_files_unlock(args->mutex, lock_time);
+}
+
+/* Rendering chunks whose line offsets became known, including those other */
+/* threads searched and left waiting for earlier chunks */
+/* Chunks from 'first' up to 'end' belong to calling thread then */
+static void grep_files_render_chunks(ThreadArguments* args, GrepFileTask* task, size_t first, size_t end) {
+	GrepFileChunks* file_chunks = task->file_chunks;
+	for (size_t index = first; index < end; index++) {
+		GrepFileChunk* chunk = &file_chunks->chunks[index];
+		grep_lines_render(&chunk->rendered, &chunk->lines, chunk->line_offset);
+		grep_lines_free(&chunk->lines);
+	}
+
+	uint64_t lock_time = grep_files_lock(args->mutex);
+	for (size_t index = first; index < end; index++) { file_chunks->chunks[index].is_rendered = 1; }
+	bool is_streaming = !file_chunks->is_streaming;
+	file_chunks->is_streaming = 1;
+	grep_files_unlock(args->mutex, lock_time);
+	if (is_streaming) { grep_files_stream(args, task); }
+}
+
+/* Searching a single file or chunk, writing results of finished file */
+/* and recycling its task */
+static void grep_files_process(ThreadArguments* args, Prefetch* prefetch, GrepFileTask* task, GrepBuffer* output) {
+	/* Files left after search was cancelled are not even opened */
+	/* Queue is still emptied, because producers may be waiting */
+	if (task->file_chunks == NULL && atomic_load_explicit(&grep_file_cancel_G, memory_order_relaxed)) {
+		if (task->is_prefetched) {
+			prefetch_wait(prefetch, &task->request); // kernel may still write into buffer
+			prefetch_release(prefetch, &task->request);
+		}
+		if (task->is_file_name_owned) { free((char*)task->file_name); }
+		grep_files_task_free(task);
+		return;
+	}
+
+	/* Each thread renders results into its own buffer, reused for */
+	/* every file, writer copies it when it has to wait */
+	GrepBuffer* output_pointer = task->options->print_lines ? output : NULL;
+
+	/* Multithreaded grep_file() logic */
+	GrepFileResult grep_file_result;
+	GrepFileChunks* file_chunks = task->file_chunks;
+	if (file_chunks != NULL) {
+		GrepFileChunk* chunk = &file_chunks->chunks[task->chunk_index];
+		GrepLines* lines_pointer = task->options->print_lines ? &chunk->lines : NULL;
+		grep_file_result = grep_chunk(file_chunks->data + chunk->offset, chunk->size,
+			task->options, lines_pointer);
+		chunk->line_count = grep_file_result.line_count;
+	} else if (task->is_known_empty) {
+		grep_file_result = (GrepFileResult){ 0, 0, NULL, EXIT_SUCCESS };
+	} else {
+		grep_file_result = grep_files_search(task, prefetch, output_pointer);
+	}
+	args->match_count += grep_file_result.match_count;
+	if (grep_file_result.exit_code != EXIT_SUCCESS) { args->exit_code = EXIT_FAILURE; }
+
+	/* Mutex here protects counts shared by threads */
+	uint64_t lock_time = grep_files_lock(args->mutex);
+	add_pattern_match_counts(args->pattern_match_counts, &grep_file_result, task->options->pattern_count);
+	size_t first_numbered = 0;
+	size_t end_numbered = 0;
+	if (file_chunks != NULL) {
+		/* Line numbers of each chunk start after lines of all earlier chunks */
+		file_chunks->match_count += grep_file_result.match_count;
+		file_chunks->chunks[task->chunk_index].is_searched = 1;
+		first_numbered = file_chunks->numbered_count;
+		while (file_chunks->numbered_count < file_chunks->chunk_count
+			&& file_chunks->chunks[file_chunks->numbered_count].is_searched) {
+			GrepFileChunk* chunk = &file_chunks->chunks[file_chunks->numbered_count];
+			chunk->line_offset = file_chunks->line_offset;
+			file_chunks->line_offset += chunk->line_count;
+			file_chunks->numbered_count += 1;
+		}
+		end_numbered = file_chunks->numbered_count;
+	}
+	grep_files_unlock(args->mutex, lock_time);
+
+	if (file_chunks == NULL) {
+		grep_files_render_result(output, args->thread_index, task->file_name, grep_file_result.match_count,
+			task->options->output_mode);
+		grep_files_write(args->writer, task->file_index, output); // empties buffer
+		if (task->is_file_name_owned) { free((char*)task->file_name); }
+	} else if (first_numbered < end_numbered) {
+		grep_files_render_chunks(args, task, first_numbered, end_numbered);
+	}
+
+	grep_files_task_free(task); // recycling consumed task
+}
+
 /* Generic thread function that calls grep_file() */
 static void* thread_grep_file(void* arguments) {
 	ThreadArguments* args = (ThreadArguments*)arguments;
 
-	/* Variables returned from this function must be heap allocated */
-	int* match_count = malloc(sizeof(int));
-	*match_count = 0;
+	/* Pinning before anything is allocated, so that buffers of this */
+	/* thread are placed on its own NUMA node when first touched */
+	if (args->cpu >= 0) {
+		bool is_pinned = cpu_pin_thread(args->cpu, args->node);
+		if (args->verbose) {
+			fprintf(stderr, is_pinned ? "[%d] pinned to CPU %d on node %d\n"
+				: "[%d] failed pinning to CPU %d on node %d\n", args->thread_index, args->cpu, args->node);
+		}
+	}
+
+	/* Allocations after the first file show buffers not being reused */
+	size_t file_count = 0;
+	size_t warm_allocation_count = 0;
+
+	/* Files of upcoming tasks are read while current one is searched */
+	Prefetch* prefetch = prefetch_new(GREP_FILES_PREFETCH_DEPTH, args->prefetch_pool);
+	GrepFileTask* window[GREP_FILES_PREFETCH_DEPTH];
+	size_t window_start = 0;
+	size_t window_length = 0;
 
 	GrepFileTask* task = NULL;
-	while ((task = (GrepFileTask*)job_queue_pop(args->job_queue)) != NULL) {
-		/* Multithreaded grep_file() logic */
-		GrepFileResult grep_file_result;
-		grep_file_result = grep_file(task->file_name, task->options);
-		*match_count += grep_file_result.match_count;
+	GrepBuffer output = {0};
+	uint64_t wait_start = stats_now();
+	while (1) {
+		grep_files_fill_window(args, prefetch, window, &window_start, &window_length);
+		if (window_length > 0) {
+			task = window[window_start];
+			window_start = (window_start + 1) % GREP_FILES_PREFETCH_DEPTH;
+			window_length -= 1;
+		} else if ((task = (GrepFileTask*)job_queue_pop(args->job_queue, args->thread_index)) == NULL) {
+			break;
+		}
+		uint64_t task_start = stats_now();
+		stats_local_G.queue_wait_nanoseconds += task_start - wait_start;
+
+		/* Task is recycled by searching it, so it is described first */
+		bool verbose = task->options->verbose;
+		size_t task_file_count = task->file_count;
+		size_t task_byte_count = task->byte_count;
+		uint64_t expected_nanoseconds = task->expected_nanoseconds;
+		char task_name[256];
+		if (verbose) {
+			snprintf(task_name, sizeof(task_name), "%s%s", task->file_name,
+				(task->file_chunks != NULL) ? " (chunk)" : (task_file_count > 1) ? " (batch)" : "");
+		}
 
-		/* Mutex here ensures that threads don't print over each other */
-		pthread_mutex_lock(args->mutex);
-		printf("%s[%d]", ANSI_COLOR_YELLOW, args->thread_index + 1);
-		printf("%s ", ANSI_COLOR_RESET);
-		printf("%s%s", ANSI_COLOR_MAGENTA, task->file_name);
-		printf("%s:%s", ANSI_COLOR_CYAN, ANSI_COLOR_RESET);
-		printf(" %zu\n", grep_file_result.match_count);
-		pthread_mutex_unlock(args->mutex);
+		/* Small files of a batch are searched one after another */
+		GrepFileTask* unsubmitted = task->batch_next; // first member not being read ahead
+		while (task != NULL) {
+			GrepFileTask* next = task->batch_next;
+			if (unsubmitted == task) { unsubmitted = next; } // reading it now instead
+			unsubmitted = grep_files_prefetch_batch(prefetch, unsubmitted);
+			grep_files_process(args, prefetch, task, &output);
+			task = next;
 
-		free(task); // freeing consumed task
+			file_count += 1;
+			if (file_count == 1) { warm_allocation_count = stats_local_G.allocation_count; }
+		}
+
+		wait_start = stats_now();
+		if (verbose) {
+			uint64_t task_nanoseconds = wait_start - task_start;
+			if (expected_nanoseconds == GREP_FILES_UNKNOWN_COST) {
+				fprintf(stderr, "[%d] %zu files, size unknown, expected unknown, took %.3f ms: %s\n",
+					args->thread_index, task_file_count, task_nanoseconds / 1e6, task_name);
+			} else {
+				args->expected_nanoseconds += expected_nanoseconds;
+				args->task_nanoseconds += task_nanoseconds;
+				fprintf(stderr, "[%d] %zu files, %zu bytes, expected %.3f ms, took %.3f ms: %s\n",
+					args->thread_index, task_file_count, task_byte_count, expected_nanoseconds / 1e6,
+					task_nanoseconds / 1e6, task_name);
+			}
+		}
+	}
+	stats_local_G.queue_wait_nanoseconds += stats_now() - wait_start;
+	if (file_count > 0) {
+		stats_local_G.steady_allocation_count = stats_local_G.allocation_count - warm_allocation_count;
+	}
+	prefetch_free(prefetch);
+	grep_buffer_free(&output);
+	grep_file_scratch_free();
+	grep_files_task_return();
+
+	args->stats = stats_local_G; // summed after joining
+	return NULL;
+}
+
+/* Choosing CPU and NUMA node of each worker, arrays stay NULL when */
+/* allowed CPUs can't be listed, then workers are not pinned */
+static void grep_files_place_workers(JobQueue* job_queue, int worker_count, int** worker_cpus, int** worker_nodes) {
+	int* cpus = malloc(CPU_MAX_THREADS * sizeof(int));
+	*worker_cpus = malloc((size_t)worker_count * sizeof(int));
+	*worker_nodes = malloc((size_t)worker_count * sizeof(int));
+	int cpu_count = (cpus != NULL) ? cpu_list_allowed(cpus, CPU_MAX_THREADS) : 0;
+	if (cpu_count == 0 || *worker_cpus == NULL || *worker_nodes == NULL) {
+		free(*worker_cpus);
+		free(*worker_nodes);
+		*worker_cpus = NULL;
+		*worker_nodes = NULL;
+		free(cpus);
+		return;
+	}
+
+	/* More workers than CPUs share them in turn */
+	for (int worker = 0; worker < worker_count; worker++) {
+		(*worker_cpus)[worker] = cpus[worker % cpu_count];
+		(*worker_nodes)[worker] = cpu_node(cpus[worker % cpu_count]);
 	}
+	free(cpus);
 
-	free(args); // freeing consumed arguments
-	return (void*)match_count;
+	/* Without node rings chunks simply go to shared ring */
+	int node_count = cpu_node_count();
+	if (node_count > 1) { job_queue_set_nodes(job_queue, *worker_nodes, node_count); }
 }
 
 GrepFilesResult grep_files(char** file_names, int file_names_length, const GrepOptions* options) {
 	GrepFilesResult grep_files_result;
 	grep_files_result.match_count = 0;
+	grep_files_result.pattern_match_counts = NULL;
+	grep_files_result.stats = (Stats){0};
 	grep_files_result.exit_code = EXIT_SUCCESS;
 
+	/* Calling thread also counts, it opens files split into chunks */
+	/* Verbose mode needs the same clock to time each task */
+	stats_enabled_G = (options->stats_format != STATS_FORMAT_NONE || options->verbose);
+	stats_local_G = (Stats){0};
+	uint64_t start = stats_now();
+
+	if (options->pattern_count > 1) {
+		grep_files_result.pattern_match_counts = calloc(options->pattern_count, sizeof(size_t));
+		if (grep_files_result.pattern_match_counts == NULL) {
+			grep_files_result.exit_code = EXIT_FAILURE;
+			return grep_files_result;
+		}
+	}
+
 	/* Enabling internal option to disable line printing */
-	grep_file_quiet_G = 1;
+	grep_file_quiet_G = !options->print_lines;
+	atomic_store(&grep_file_cancel_G, 0);
 
 	/* Not using multithreaded logic if only 1 thread is available */
-	if (options->available_threads == 1) {
-		for (int index = 0; index < file_names_length; index++) {
+	/* Directories are always walked by separate threads */
+	if (options->available_threads == 1 && !options->recursive) {
+		GrepBuffer output = {0};
+		for (int index = 0; index < file_names_length && !atomic_load(&grep_file_cancel_G); index++) {
 			GrepFileResult grep_file_result;
-			grep_file_result = grep_file(file_names[index], options);
+			grep_file_result = grep_file(file_names[index], options, NULL);
 			grep_files_result.match_count += grep_file_result.match_count;
+			if (grep_file_result.exit_code != EXIT_SUCCESS) { grep_files_result.exit_code = EXIT_FAILURE; }
 
-			printf("%s%s", ANSI_COLOR_MAGENTA, file_names[index]);
-			printf("%s:%s", ANSI_COLOR_CYAN, ANSI_COLOR_RESET);
-			printf(" %zu\n", grep_file_result.match_count);
+			output.length = 0;
+			grep_files_render_result(&output, -1, file_names[index], grep_file_result.match_count,
+				options->output_mode);
+			fwrite(output.data, 1, output.length, stdout);
+			add_pattern_match_counts(grep_files_result.pattern_match_counts, &grep_file_result, options->pattern_count);
 		}
+		grep_buffer_free(&output);
+		grep_file_scratch_free();
 		grep_file_quiet_G = 0; // restoring internal option
+		grep_files_result.stats = stats_local_G;
+		grep_files_result.stats.thread_count = 1;
+		grep_files_result.stats.elapsed_nanoseconds = stats_now() - start;
 		return grep_files_result;
 	}
 
-	/* Another mutex is required to print results */
-	pthread_mutex_t print_mutex;
-	if (pthread_mutex_init(&print_mutex, NULL)) {
+	/* Reorder stage with its own mutex is required to print results */
+	/* Files found in directories are written in the order they finish */
+	GrepFilesWriter writer = {0};
+	writer.is_ordered = !options->unordered_output && !options->recursive;
+	if (writer.is_ordered) {
+		writer.outputs = calloc((size_t)file_names_length, sizeof(GrepFilesOutput));
+		writer.output_count = (size_t)file_names_length;
+		writer.output_capacity = (size_t)file_names_length;
+	}
+	if ((writer.is_ordered && writer.outputs == NULL) || pthread_mutex_init(&writer.mutex, NULL)) {
+		free(writer.outputs);
 		grep_files_result.exit_code = EXIT_FAILURE;
 		grep_file_quiet_G = 0; // restoring internal option
 		return grep_files_result;
 	}
+	fflush(stdout); // results are written around stdio buffer
 
-	/* Creating job queue with tasks for threads to process */
-	JobQueue* job_queue = job_queue_new();
+	/* Creating job queue with a deque for each thread */
+	/* Tasks live in blocks of task pool, which are freed all at once */
+	JobQueue* job_queue = job_queue_new(options->available_threads, NULL);
 	if (job_queue == NULL) {
+		pthread_mutex_destroy(&writer.mutex);
+		free(writer.outputs);
 		grep_files_result.exit_code = EXIT_FAILURE;
 		grep_file_quiet_G = 0; // restoring internal option
 		return grep_files_result;
 	}
 
-	for (int index = 0; index < file_names_length; index++) {
-		GrepFileTask* task = malloc(sizeof(GrepFileTask));
-		task->file_name = file_names[index];
-		task->options = options;
-		job_queue_push(job_queue, (void*)task);
+	/* Without io_uring, workers only hint upcoming files to a few threads */
+	PrefetchPool* prefetch_pool = prefetch_is_io_uring_available() ? NULL
+		: prefetch_pool_new(GREP_FILES_PREFETCH_THREADS);
+
+	/* Workers are pinned to allowed CPUs in turn, and workers of each */
+	/* NUMA node take chunks whose pages are on that node first */
+	int* worker_cpus = NULL;
+	int* worker_nodes = NULL;
+	if (options->pin_threads) { grep_files_place_workers(job_queue, options->available_threads, &worker_cpus, &worker_nodes); }
+
+	/* Without several NUMA nodes, chunks still get a ring of their own */
+	if (job_queue->node_rings == NULL) {
+		int* single_nodes = calloc((size_t)options->available_threads, sizeof(int));
+		if (single_nodes != NULL) { job_queue_set_nodes(job_queue, single_nodes, 1); }
+		free(single_nodes);
 	}
 
-	/* Creating and starting threads */
+	/* Creating and starting threads before pushing any tasks, */
+	/* so that they search files while others are still being split */
 	pthread_t* threads = malloc(options->available_threads * sizeof(pthread_t));
-	for (int index = 0; index < options->available_threads; index++) {
+	ThreadArguments* thread_arguments = calloc((size_t)options->available_threads, sizeof(ThreadArguments));
+	int thread_count = 0;
+	for (int index = 0; threads != NULL && thread_arguments != NULL && index < options->available_threads; index++) {
 		/* Preparing generic thread arguments */
-		ThreadArguments* args = malloc(sizeof(ThreadArguments));
+		ThreadArguments* args = &thread_arguments[thread_count];
 		args->job_queue = job_queue;
-		args->mutex = &print_mutex;
-		args->thread_index = index;
+		args->mutex = &writer.mutex;
+		args->writer = &writer;
+		args->thread_index = thread_count;
+		args->pattern_match_counts = grep_files_result.pattern_match_counts;
+		args->exit_code = EXIT_SUCCESS;
+		args->prefetch_pool = prefetch_pool;
+		args->cpu = (worker_cpus != NULL) ? worker_cpus[thread_count] : -1;
+		args->node = (worker_nodes != NULL) ? worker_nodes[thread_count] : 0;
+		args->verbose = options->verbose;
 
-		/* Freeing thread arguments if thread failed to start */
-		if (pthread_create(&threads[index], NULL, &thread_grep_file, (void*)args)) {
-			free(args);
-			continue;
+		/* Arguments are reused by next thread if thread failed to start */
+		if (pthread_create(&threads[thread_count], NULL, &thread_grep_file, (void*)args)) { continue; }
+		thread_count += 1;
+	}
+	if (thread_count == 0) { grep_files_result.exit_code = EXIT_FAILURE; }
+
+	if (thread_count > 0 && options->recursive) {
+		/* Walking directories until all files are pushed */
+		GrepFilesWalk walk = { job_queue, &writer, options };
+		int walker_thread_count = options->available_threads < GREP_FILES_MAX_WALKER_THREADS
+			? options->available_threads : GREP_FILES_MAX_WALKER_THREADS;
+		if (!walker_walk(file_names, file_names_length, walker_thread_count, options->one_file_system,
+			&grep_file_cancel_G, &grep_files_visit, &walk)) {
+			grep_files_result.exit_code = EXIT_FAILURE;
 		}
+	} else {
+		if (thread_count > 0) { grep_files_schedule(job_queue, &writer, file_names, (size_t)file_names_length, options); }
 	}
+	job_queue_close(job_queue); // threads exit once queue is empty
 
 	/* Waiting for threads to finish */
-	for (int index = 0; index < options->available_threads; index++) {
-		int* match_count;
-
+	uint64_t expected_nanoseconds = 0;
+	uint64_t task_nanoseconds = 0;
+	for (int index = 0; index < thread_count; index++) {
 		/* Ignoring threads that failed to join */
-		if (pthread_join(threads[index], (void*)&match_count)) { continue; }
+		if (pthread_join(threads[index], NULL)) { continue; }
 
-		grep_files_result.match_count += *match_count;
-		free(match_count);
+		grep_files_result.match_count += thread_arguments[index].match_count;
+		if (thread_arguments[index].exit_code != EXIT_SUCCESS) { grep_files_result.exit_code = EXIT_FAILURE; }
+		stats_add(&grep_files_result.stats, &thread_arguments[index].stats);
+		expected_nanoseconds += thread_arguments[index].expected_nanoseconds;
+		task_nanoseconds += thread_arguments[index].task_nanoseconds;
+	}
+	if (options->verbose && thread_count > 0) {
+		/* Ideal schedule would finish when each thread did its share */
+		fprintf(stderr, "%d threads, expected %.3f ms, took %.3f ms of tasks, "
+			"%.3f ms per thread, elapsed %.3f ms\n", thread_count, expected_nanoseconds / 1e6,
+			task_nanoseconds / 1e6, task_nanoseconds / 1e6 / thread_count, (stats_now() - start) / 1e6);
+	}
+
+	/* Outputs of cancelled search can still wait for earlier files */
+	for (size_t index = 0; index < writer.output_count; index++) {
+		GrepFilesPart* part = writer.outputs[index].parts;
+		while (part != NULL) {
+			GrepFilesPart* next = part->next; // part may be freed with its block
+			grep_files_block_release(&writer, part->block);
+			part = next;
+		}
+	}
+	free(writer.block);
+	while (writer.free_blocks != NULL) {
+		GrepFilesBlock* block = writer.free_blocks;
+		writer.free_blocks = block->next;
+		free(block);
 	}
 
 	/* Freeing threads and job queue */
+	free(worker_cpus);
+	free(worker_nodes);
+	prefetch_pool_free(prefetch_pool);
 	free(threads);
+	free(thread_arguments);
 	job_queue_free(job_queue);
-	pthread_mutex_destroy(&print_mutex);
+	grep_files_task_pool_free();
+	pthread_mutex_destroy(&writer.mutex);
+	free(writer.outputs);
 	grep_file_quiet_G = 0; // restoring internal option
 
+	stats_add(&grep_files_result.stats, &stats_local_G);
+	grep_files_result.stats.thread_count = thread_count;
+	grep_files_result.stats.elapsed_nanoseconds = stats_now() - start;
+
 	return grep_files_result;
 }
@@ -0,0 +1,98 @@
+#include "grep.h"
+#include "utf8.h"
+
+#include <stdlib.h> // calloc(), free()
+#include <wchar.h> // wchar_t
+#include <wctype.h> // iswalpha()
+
+/* This file implements compiled patterns for grep.h */
+/* Everything that only depends on search strings is computed here once, */
+/* instead of for every line or match */
+
+GrepPattern* grep_pattern_new(char** patterns, const size_t* pattern_lengths, size_t pattern_count,
+	bool ignore_case, bool is_regexp, const char** error) {
+	*error = "out of memory";
+	GrepPattern* pattern = calloc(1, sizeof(GrepPattern));
+	if (pattern == NULL) { return NULL; }
+	pattern->pattern_count = pattern_count;
+	pattern->is_prefix_alpha = calloc(pattern_count, sizeof(bool));
+	pattern->is_suffix_alpha = calloc(pattern_count, sizeof(bool));
+	if (pattern->is_prefix_alpha == NULL || pattern->is_suffix_alpha == NULL) {
+		grep_pattern_free(pattern);
+		return NULL;
+	}
+
+	/* Case variants of letters are letters too, so matched text starts */
+	/* and ends with letters exactly where search string does */
+	for (size_t index = 0; index < pattern_count; index++) {
+		if (pattern_lengths[index] == 0) { continue; }
+		const unsigned char* bytes = (const unsigned char*)patterns[index];
+		wchar_t c;
+		utf8_decode(bytes, pattern_lengths[index], &c);
+		pattern->is_prefix_alpha[index] = iswalpha(c) != 0;
+		pattern->is_suffix_alpha[index] = iswalpha(utf8_decode_previous(bytes, pattern_lengths[index])) != 0;
+	}
+
+	/* Choosing matcher, several search strings are matched in one pass */
+	/* Matches of regular expressions are checked for letters when found */
+	if (is_regexp && pattern_count > 0) {
+		pattern->engine = GREP_ENGINE_REGEXP;
+		pattern->regexp = regexp_new(patterns[0], pattern_lengths[0], ignore_case, error);
+		if (pattern->regexp == NULL) {
+			grep_pattern_free(pattern);
+			return NULL;
+		}
+	} else if (pattern_count > 1) {
+		pattern->engine = GREP_ENGINE_MULTI;
+		pattern->multi = aho_corasick_new(patterns, pattern_lengths, pattern_count, ignore_case);
+		if (pattern->multi == NULL) {
+			grep_pattern_free(pattern);
+			return NULL;
+		}
+	} else if (pattern_count == 1 && pattern_lengths[0] > 0) {
+		pattern->engine = GREP_ENGINE_LITERAL;
+		pattern->literal = literal_new(patterns[0], pattern_lengths[0], ignore_case);
+		if (pattern->literal == NULL) {
+			grep_pattern_free(pattern);
+			return NULL;
+		}
+	} else {
+		pattern->engine = GREP_ENGINE_NONE;
+	}
+	return pattern;
+}
+
+/* Text every match has to contain decides which indexed files are read */
+/* Regular expressions without required literals can match any file */
+bool grep_pattern_select_files(const GrepPattern* pattern, TrigramIndex* index, bool ignore_case) {
+	const unsigned char* const* strings = NULL;
+	const size_t* lengths = NULL;
+	size_t count = 0;
+	const LiteralPattern* literal = pattern->literal;
+	const AhoCorasick* multi = pattern->multi;
+	if (pattern->engine == GREP_ENGINE_REGEXP) {
+		literal = pattern->regexp->literal;
+		multi = pattern->regexp->literals;
+		if (literal == NULL && multi == NULL) { return 1; }
+	}
+	if (literal != NULL) {
+		strings = (const unsigned char* const*)&literal->bytes;
+		lengths = &literal->length;
+		count = 1;
+	} else if (multi != NULL) {
+		strings = (const unsigned char* const*)multi->patterns;
+		lengths = multi->pattern_lengths;
+		count = multi->pattern_count;
+	}
+	return trigram_index_select(index, strings, lengths, count, ignore_case);
+}
+
+void grep_pattern_free(GrepPattern* pattern) {
+	if (pattern == NULL) { return; }
+	if (pattern->literal != NULL) { literal_free(pattern->literal); }
+	if (pattern->multi != NULL) { aho_corasick_free(pattern->multi); }
+	if (pattern->regexp != NULL) { regexp_free(pattern->regexp); }
+	free(pattern->is_prefix_alpha);
+	free(pattern->is_suffix_alpha);
+	free(pattern);
+}
@@ -0,0 +1,82 @@
+#include "grep.h"
+
+#include <stdlib.h> // realloc(), free()
+#include <string.h> // memcpy()
+#include <stdio.h> // snprintf()
+
+/* This file implements output rendering for grep.h */
+/* Rendering is separated from matching so lines without matches */
+/* and results that are never printed do not cost any allocations */
+
+void grep_match_spans_free(GrepMatchSpans* spans) {
+	free(spans->spans);
+	spans->spans = NULL;
+	spans->length = 0;
+	spans->capacity = 0;
+}
+
+bool grep_buffer_append(GrepBuffer* buffer, const char* data, size_t length) {
+	if (length == 0) { return 1; } // buffer may not be allocated yet
+
+	/* Growing buffer geometrically keeps appending amortized O(1) */
+	if (buffer->length + length > buffer->capacity) {
+		size_t capacity = (buffer->capacity > 0) ? buffer->capacity : 256;
+		while (capacity < buffer->length + length) { capacity *= 2; }
+		char* data_copy = realloc(buffer->data, capacity);
+		if (data_copy == NULL) { return 0; }
+		buffer->data = data_copy;
+		buffer->capacity = capacity;
+	}
+	memcpy(buffer->data + buffer->length, data, length);
+	buffer->length += length;
+	return 1;
+}
+
+void grep_buffer_free(GrepBuffer* buffer) {
+	free(buffer->data);
+	buffer->data = NULL;
+	buffer->length = 0;
+	buffer->capacity = 0;
+}
+
+bool grep_render_string(GrepBuffer* buffer, const char* string, size_t string_length,
+	const GrepMatchSpans* spans) {
+	/* Copying original bytes between matches and coloring matches */
+	size_t position = 0;
+	bool is_rendered = 1;
+	for (size_t index = 0; index < spans->length; index++) {
+		const GrepMatchSpan* span = &spans->spans[index];
+		if (span->length == 0) { continue; } // line only had empty matches, nothing to color
+		is_rendered &= grep_buffer_append(buffer, string + position, span->offset - position);
+		is_rendered &= grep_buffer_append(buffer, ANSI_COLOR_RED, sizeof(ANSI_COLOR_RED) - 1);
+		is_rendered &= grep_buffer_append(buffer, string + span->offset, span->length);
+		is_rendered &= grep_buffer_append(buffer, ANSI_COLOR_RESET, sizeof(ANSI_COLOR_RESET) - 1);
+		position = span->offset + span->length;
+	}
+	is_rendered &= grep_buffer_append(buffer, string + position, string_length - position);
+	return is_rendered;
+}
+
+bool grep_lines_render(GrepBuffer* buffer, const GrepLines* lines, size_t line_offset) {
+	/* Line numbers are inserted in front of each rendered line */
+	bool is_rendered = 1;
+	for (size_t index = 0; index < lines->length; index++) {
+		const GrepLineRecord* record = &lines->records[index];
+		size_t end = (index + 1 < lines->length) ? lines->records[index + 1].offset : lines->text.length;
+
+		char line_number[64];
+		int line_number_length = snprintf(line_number, sizeof(line_number), "%s%zu%s:%s",
+			ANSI_COLOR_GREEN, line_offset + record->line_number, ANSI_COLOR_CYAN, ANSI_COLOR_RESET);
+		is_rendered &= grep_buffer_append(buffer, line_number, (size_t)line_number_length);
+		is_rendered &= grep_buffer_append(buffer, lines->text.data + record->offset, end - record->offset);
+	}
+	return is_rendered;
+}
+
+void grep_lines_free(GrepLines* lines) {
+	grep_buffer_free(&lines->text);
+	free(lines->records);
+	lines->records = NULL;
+	lines->length = 0;
+	lines->capacity = 0;
+}
@@ -1,11 +1,11 @@
 #include "grep.h"
+#include "utf8.h"
 
-#include <stdlib.h> // calloc(), mbstowcs(), free()
+#include <stdlib.h> // calloc(), malloc(), realloc(), mbstowcs(), wcstombs(), free()
 #include <string.h> // strlen()
 
-#include <wchar.h> // wcslen(), wcsdup()
-#include <wctype.h> // towupper(), iswalpha()
-#include <stdio.h> // asprintf()
+#include <wchar.h> // wchar_t
+#include <wctype.h> // iswalpha()
 
 wchar_t* convert_string(const char* string) {
 	size_t string_size = strlen(string) + 1;
@@ -18,122 +18,150 @@ wchar_t* convert_string(const char* string) {
 	return wide_character_string;
 }
 
-/* asprintf() macro for repeated usage without memory leaks */
-/* First use of this macro requires a heap allocated string */
-#define ASPRINTF(destination_string,  ...) {\
-	char* previous_string = destination_string;\
-	asprintf(&(destination_string), __VA_ARGS__);\
-	free(previous_string);\
+char* encode_string(const wchar_t* string) {
+	size_t string_size = wcstombs(NULL, string, 0);
+	if (string_size == (size_t)-1) { return NULL; }
+	char* multibyte_string = malloc(string_size + 1);
+	if (multibyte_string == NULL) { return NULL; }
+	wcstombs(multibyte_string, string, string_size + 1);
+	return multibyte_string;
 }
 
-GrepStringResult grep_string(const char* string, const GrepOptions* options) {
-	/* This time also returning how many matches occured */
-	GrepStringResult grep_string_result;
-	grep_string_result.colored_string = NULL;
-	grep_string_result.match_count = 0;
-	grep_string_result.exit_code = EXIT_SUCCESS;
-
-	size_t search_string_length = wcslen(options->search_string);
-	if (search_string_length == 0) {
-		grep_string_result.exit_code = EXIT_SUCCESS;
-		return grep_string_result;
-	}
-
-	/* Converting source string to wide character string */
-	wchar_t* source_string = convert_string(string);
-	if (source_string == NULL) {
-		grep_string_result.exit_code = EXIT_FAILURE;
-		return grep_string_result;
-	}
-
-	wchar_t* matching_substring = wcsdup(options->search_string);
-	if (matching_substring == NULL) {
-		free(source_string);
-		grep_string_result.exit_code = EXIT_FAILURE; // setting error code
-		return grep_string_result;
+/* Appending match span, array grows geometrically and is never shrunk */
+static bool push_match_span(GrepMatchSpans* spans, size_t offset, size_t length, size_t pattern_index) {
+	if (spans->length == spans->capacity) {
+		size_t capacity = (spans->capacity > 0) ? spans->capacity * 2 : 16;
+		GrepMatchSpan* spans_copy = realloc(spans->spans, capacity * sizeof(GrepMatchSpan));
+		if (spans_copy == NULL) { return 0; }
+		spans->spans = spans_copy;
+		spans->capacity = capacity;
 	}
-	size_t match_index = 0;
+	spans->spans[spans->length].offset = offset;
+	spans->spans[spans->length].length = length;
+	spans->spans[spans->length].pattern_index = pattern_index;
+	spans->length += 1;
+	return 1;
+}
 
-	wchar_t* search_string = options->search_string;
-	if (options->ignore_case) {
-		search_string = wcsdup(options->search_string);
-		if (search_string == NULL) {
-			free(matching_substring); free(source_string);
-			grep_string_result.exit_code = EXIT_FAILURE;
-			return grep_string_result;
-		}
-		for (size_t index = 0; index < search_string_length; index++) {
-			search_string[index] = (wchar_t)towupper(search_string[index]);
-		}
+/* Tells whether line has any letter, decoding its characters */
+static bool grep_string_has_letter(const unsigned char* string, size_t string_length) {
+	size_t position = 0;
+	while (position < string_length) {
+		wchar_t c;
+		position += utf8_decode(string + position, string_length - position, &c);
+		if (iswalpha(c)) { return 1; }
 	}
+	return 0;
+}
 
-	bool is_before_alpha = 0;
-	bool is_prefix_alpha = iswalpha(search_string[0]);;
-	bool is_suffix_alpha = iswalpha(search_string[search_string_length - 1]);
-
-	/* C strings usually end with '\0' terminator */
-	/* Consuming string character by character until '\0' terminator */
-	bool is_colored_string = 0;
-	char* colored_string = strdup(""); // so free() works
-	if (colored_string == NULL) {
-		if (options->ignore_case) { free(search_string); }
-		free(matching_substring); free(source_string);
-		grep_string_result.exit_code = EXIT_FAILURE; // setting error code
-		return grep_string_result;
+const char* grep_find(const char* text, size_t text_length, const GrepOptions* options,
+	size_t* match_length, size_t* pattern_index) {
+	const GrepPattern* pattern = options->pattern;
+	*pattern_index = 0;
+	switch (pattern->engine) {
+		case GREP_ENGINE_LITERAL:
+			return literal_find(pattern->literal, text, text_length, match_length);
+		case GREP_ENGINE_MULTI:
+			return aho_corasick_find(pattern->multi, text, text_length, match_length, pattern_index);
+		case GREP_ENGINE_REGEXP:
+			*match_length = 0; // exact match is found by grep_string()
+			return regexp_find_line(pattern->regexp, text, text_length);
+		case GREP_ENGINE_NONE:
+			break;
 	}
-	size_t source_string_index = 0;
-	size_t match_count = 0;
-
-	wchar_t c;
-	do {
-		c = source_string[source_string_index]; source_string_index++;
-		wchar_t c_toupper = (wchar_t)(options->ignore_case ? towupper(c) : c);
-		bool c_is_alpha = iswalpha(c);
+	return NULL;
+}
 
-		/* asprintf() provides a very convenient way to create strings */
-		/* Each call to asprintf() will allocate a new string */
-		/* Special macro is used to free previous strings */
+GrepStringResult grep_string(const char* string, size_t string_length,
+	const GrepOptions* options, GrepMatchSpans* spans, size_t* pattern_match_counts) {
+	/* This time also returning how many matches occured */
+	GrepStringResult grep_string_result;
+	grep_string_result.match_count = 0;
+	grep_string_result.exit_code = EXIT_SUCCESS;
 
-		if (match_index > 0 && match_index == search_string_length) {
-			bool is_matching = !(is_before_alpha && is_prefix_alpha);
-			is_matching = is_matching && !(is_suffix_alpha && c_is_alpha);
-			is_matching = options->match_whole_words ? is_matching : 1;
-			if (is_matching) { is_colored_string = 1; match_count++; }
+	/* Matching raw UTF-8 bytes without converting them to wide characters */
+	/* Characters are only decoded for word boundaries */
+	const unsigned char* source_string = (const unsigned char*)string;
 
-			if (is_matching) { ASPRINTF(colored_string, "%s%s", colored_string, ANSI_COLOR_RED); }
-			ASPRINTF(colored_string, "%s%ls", colored_string, matching_substring);
-			if (is_matching) { ASPRINTF(colored_string, "%s%s", colored_string, ANSI_COLOR_RESET); }
+	/* Previous line spans are discarded, but their memory is reused */
+	if (spans != NULL) { spans->length = 0; }
+	size_t match_count = 0;
 
-			is_before_alpha = is_suffix_alpha;
-			match_index = 0;
+	/* Regular expressions are matched within the line, so that ^ keeps */
+	/* referring to its start after earlier matches */
+	const GrepPattern* pattern = options->pattern;
+	bool is_regexp = (pattern->engine == GREP_ENGINE_REGEXP);
+	size_t line_length = string_length;
+	if (is_regexp && line_length > 0 && string[line_length - 1] == '\n') { line_length -= 1; }
+
+	size_t position = 0;
+	while (position < string_length) {
+		/* Finding next match and its length in bytes, which may differ */
+		/* from search string length for case variants of characters */
+		size_t match_length = 0;
+		size_t pattern_index = 0;
+		if (is_regexp) {
+			if (!regexp_find_in_line(pattern->regexp, string, line_length, position, &position, &match_length)) { break; }
+		} else {
+			const char* match = grep_find(string + position, string_length - position,
+				options, &match_length, &pattern_index);
+			if (match == NULL) { break; }
+			position = (size_t)(match - string);
 		}
 
-		if (c_toupper == search_string[match_index] && c != L'\0') {
-			matching_substring[match_index] = c;
-			match_index += 1;
-		} else {
-			for (size_t index = 0; index < match_index; index++) {
-				ASPRINTF(colored_string, "%s%lc", colored_string, matching_substring[index]);
+		/* Checking characters around the match only when necessary */
+		/* Matched text starts and ends with letters where pattern does, */
+		/* matches of regular expressions have to be decoded */
+		if (options->match_whole_words) {
+			wchar_t c;
+			bool is_prefix_alpha = pattern->is_prefix_alpha[pattern_index];
+			bool is_suffix_alpha = pattern->is_suffix_alpha[pattern_index];
+			if (is_regexp) {
+				utf8_decode(source_string + position, match_length, &c);
+				is_prefix_alpha = iswalpha(c);
+				is_suffix_alpha = iswalpha(utf8_decode_previous(source_string, position + match_length));
 			}
-			if (c != L'\0') { ASPRINTF(colored_string, "%s%lc", colored_string, c); }
 
-			is_before_alpha = c_is_alpha;
-			match_index = 0;
+			bool is_matching = 1;
+			if (is_prefix_alpha) {
+				is_matching = !iswalpha(utf8_decode_previous(source_string, position));
+			}
+			if (is_matching && is_suffix_alpha && position + match_length < string_length) {
+				utf8_decode(source_string + position + match_length,
+					string_length - (position + match_length), &c);
+				is_matching = !iswalpha(c);
+			}
+			if (!is_matching) {
+				position += utf8_decode(source_string + position, string_length - position, &c);
+				continue;
+			}
 		}
-	} while (c != L'\0');
 
-	/* Freeing colored string if no matches were found */
-	if (!is_colored_string) {
-		free(colored_string);
-		colored_string = NULL;
+		/* Only remembering where the match is, rendering happens later */
+		if (spans != NULL && !push_match_span(spans, position, match_length, pattern_index)) {
+			grep_string_result.exit_code = EXIT_FAILURE; // setting error code
+			break;
+		}
+		if (pattern_match_counts != NULL) { pattern_match_counts[pattern_index] += 1; }
+		match_count++;
+		position += match_length;
 	}
 
-	if (options->ignore_case) { free(search_string); }
-	free(matching_substring);
-	free(source_string);
+	/* Line having only empty matches is selected once with an empty span */
+	/* Whole words are approximated by lines without any letters, where */
+	/* no letter can touch the empty match */
+	if (is_regexp && match_count == 0 && grep_string_result.exit_code == EXIT_SUCCESS
+		&& (!options->match_whole_words || !grep_string_has_letter(source_string, line_length))
+		&& regexp_matches_line(pattern->regexp, string, line_length)) {
+		if (spans != NULL && !push_match_span(spans, 0, 0, 0)) {
+			grep_string_result.exit_code = EXIT_FAILURE;
+		} else {
+			if (pattern_match_counts != NULL) { pattern_match_counts[0] += 1; }
+			match_count = 1;
+		}
+	}
 
 	/* Preparing to return grep string result */
-	grep_string_result.colored_string = colored_string;
 	grep_string_result.match_count = match_count;
 	return grep_string_result;
 }
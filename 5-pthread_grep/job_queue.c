@@ -1,62 +1,378 @@
 #include "job_queue.h"
 
-#include <stdlib.h> // malloc(), free()
+#include <stdlib.h> // malloc(), calloc(), free()
+#include <sched.h> // sched_yield()
 
-JobQueue* job_queue_new() {
-	JobQueue* queue = malloc(sizeof(JobQueue));
+/* This file implements lock-free job queue for job_queue.h */
+/* Shared ring follows Dmitry Vyukov's bounded MPMC queue and worker */
+/* deques follow "Correct and Efficient Work-Stealing for Weak Memory */
+/* Models" by Le, Pop, Cohen and Zappa Nardelli */
+
+/* Idle workers and producers yield this many times before sleeping */
+/* until another thread wakes them */
+#define JOB_QUEUE_SPIN_COUNT 64
+
+static JobQueueArray* job_queue_array_new(size_t capacity) {
+	JobQueueArray* array = malloc(sizeof(JobQueueArray) + capacity * sizeof(_Atomic(void*)));
+	if (array == NULL) { return NULL; }
+	array->capacity = capacity;
+	array->previous = NULL;
+	return array;
+}
+
+static int job_queue_ring_init(JobQueueRing* ring) {
+	ring->slots = malloc(JOB_QUEUE_CAPACITY * sizeof(JobQueueSlot));
+	if (ring->slots == NULL) { return 0; }
+
+	/* Slot sequence equal to ring position means slot is free to write */
+	for (size_t index = 0; index < JOB_QUEUE_CAPACITY; index++) {
+		atomic_init(&ring->slots[index].sequence, index);
+		ring->slots[index].task = NULL;
+	}
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	return 1;
+}
+
+JobQueue* job_queue_new(int worker_count, JobQueueFreeTask free_task) {
+	JobQueue* queue = calloc(1, sizeof(JobQueue));
 	if (queue == NULL) { return NULL; }
-	if (pthread_mutex_init(&queue->mutex, NULL)) {
-		free(queue);
+	queue->free_task = free_task;
+	queue->deques = calloc((size_t)worker_count, sizeof(JobQueueDeque));
+	if (!job_queue_ring_init(&queue->ring) || queue->deques == NULL) {
+		job_queue_free(queue);
 		return NULL;
 	}
-	queue->head = NULL;
-	queue->tail = NULL;
+	queue->worker_count = worker_count;
+	atomic_init(&queue->pending_count, 0);
+	atomic_init(&queue->is_closed, 0);
+	atomic_init(&queue->sleeping_worker_count, 0);
+	atomic_init(&queue->sleeping_producer_count, 0);
+	pthread_mutex_init(&queue->mutex, NULL);
+	pthread_cond_init(&queue->task_condition, NULL);
+	pthread_cond_init(&queue->room_condition, NULL);
+
+	for (int worker = 0; worker < worker_count; worker++) {
+		JobQueueArray* array = job_queue_array_new(JOB_QUEUE_DEQUE_CAPACITY);
+		if (array == NULL) {
+			job_queue_free(queue);
+			return NULL;
+		}
+		atomic_init(&queue->deques[worker].top, 0);
+		atomic_init(&queue->deques[worker].bottom, 0);
+		atomic_init(&queue->deques[worker].array, array);
+	}
 	return queue;
 }
 
-void job_queue_push(JobQueue* queue, void* task) {
-	if (queue->tail == NULL) {
-		queue->tail = malloc(sizeof(Job));
-		if (queue->tail == NULL) { return; }
-		queue->tail->task = task;
-		queue->tail->next = NULL;
-		queue->head = queue->tail;
-	} else {
-		queue->tail->next = malloc(sizeof(Job));
-		if (queue->tail->next == NULL) { return; }
-		queue->tail = queue->tail->next;
-		queue->tail->task = task;
-		queue->tail->next = NULL;
+/* Claiming next free slot of ring, returns 0 when ring is full */
+static int job_queue_ring_push(JobQueueRing* ring, void* task) {
+	size_t position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	while (1) {
+		JobQueueSlot* slot = &ring->slots[position & (JOB_QUEUE_CAPACITY - 1)];
+		size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+		long difference = (long)(sequence - position);
+		if (difference == 0) {
+			if (atomic_compare_exchange_weak_explicit(&ring->tail, &position, position + 1,
+				memory_order_relaxed, memory_order_relaxed)) {
+				slot->task = task;
+				atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+				return 1;
+			}
+		} else if (difference < 0) {
+			return 0; // slot from previous lap was not read yet
+		} else {
+			position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		}
 	}
 }
 
-void* job_queue_pop(JobQueue* queue) {
-	pthread_mutex_lock(&queue->mutex);
-	void* task = NULL;
-	if (queue->head != NULL) {
-		Job* job = queue->head;
-		task = queue->head->task;
-		if (queue->head == queue->tail) {
-			queue->head = NULL;
-			queue->tail = NULL;
+/* Taking oldest task of ring, returns NULL when ring is empty */
+static void* job_queue_ring_pop(JobQueueRing* ring) {
+	size_t position = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	while (1) {
+		JobQueueSlot* slot = &ring->slots[position & (JOB_QUEUE_CAPACITY - 1)];
+		size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+		long difference = (long)(sequence - (position + 1));
+		if (difference == 0) {
+			if (atomic_compare_exchange_weak_explicit(&ring->head, &position, position + 1,
+				memory_order_relaxed, memory_order_relaxed)) {
+				void* task = slot->task;
+				atomic_store_explicit(&slot->sequence, position + JOB_QUEUE_CAPACITY, memory_order_release);
+				return task;
+			}
+		} else if (difference < 0) {
+			return NULL; // slot was not written yet
 		} else {
-			queue->head = queue->head->next;
+			position = atomic_load_explicit(&ring->head, memory_order_relaxed);
+		}
+	}
+}
+
+/* Pushing to bottom of own deque, growing its array when full */
+static void job_queue_deque_push(JobQueueDeque* deque, void* task) {
+	long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+	long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+	JobQueueArray* array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+	if (bottom - top > (long)array->capacity - 1) {
+		JobQueueArray* new_array = job_queue_array_new(array->capacity * 2);
+		if (new_array == NULL) { abort(); } // task can not be dropped
+		for (long index = top; index < bottom; index++) {
+			void* moved_task = atomic_load_explicit(&array->tasks[index % (long)array->capacity], memory_order_relaxed);
+			atomic_store_explicit(&new_array->tasks[index % (long)new_array->capacity], moved_task, memory_order_relaxed);
+		}
+		new_array->previous = array;
+		atomic_store_explicit(&deque->array, new_array, memory_order_release);
+		array = new_array;
+	}
+	atomic_store_explicit(&array->tasks[bottom % (long)array->capacity], task, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+/* Popping newest task from bottom of own deque */
+static void* job_queue_deque_take(JobQueueDeque* deque) {
+	long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+	JobQueueArray* array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+	atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+	void* task = NULL;
+	if (top <= bottom) {
+		task = atomic_load_explicit(&array->tasks[bottom % (long)array->capacity], memory_order_relaxed);
+		if (top == bottom) {
+			/* Last task, racing with thieves for it */
+			if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+				memory_order_seq_cst, memory_order_relaxed)) {
+				task = NULL;
+			}
+			atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
 		}
-		free(job);
+	} else {
+		atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+	}
+	return task;
+}
+
+/* Stealing oldest task from top of another worker's deque */
+static void* job_queue_deque_steal(JobQueueDeque* deque) {
+	long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+	if (top >= bottom) { return NULL; }
+
+	JobQueueArray* array = atomic_load_explicit(&deque->array, memory_order_acquire);
+	void* task = atomic_load_explicit(&array->tasks[top % (long)array->capacity], memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+		memory_order_seq_cst, memory_order_relaxed)) {
+		return NULL; // another thief or owner was faster
+	}
+	return task;
+}
+
+/* Waking threads sleeping on condition after publishing what they wait */
+/* for, sleepers count themselves before checking it for the last time, */
+/* so the fences make sure either sleeper or waker sees the other */
+static void job_queue_wake(JobQueue* queue, atomic_int* sleeping_count, pthread_cond_t* condition,
+	int is_everyone) {
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(sleeping_count, memory_order_relaxed) == 0) { return; }
+	pthread_mutex_lock(&queue->mutex);
+	if (is_everyone) {
+		pthread_cond_broadcast(condition);
+	} else {
+		pthread_cond_signal(condition);
 	}
 	pthread_mutex_unlock(&queue->mutex);
+}
+
+/* Pushing to any ring of the queue, shared one or one of a node */
+static void job_queue_push_ring(JobQueue* queue, JobQueueRing* ring, void* task) {
+	/* Counting task before it is visible, so that it is never missed */
+	atomic_fetch_add(&queue->pending_count, 1);
+	int spin_count = 0;
+	while (!job_queue_ring_push(ring, task)) {
+		/* Waiting for workers to make room, ring does not grow */
+		if (++spin_count < JOB_QUEUE_SPIN_COUNT) {
+			sched_yield();
+			continue;
+		}
+		pthread_mutex_lock(&queue->mutex);
+		atomic_fetch_add(&queue->sleeping_producer_count, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		int is_pushed = job_queue_ring_push(ring, task);
+		if (!is_pushed) { pthread_cond_wait(&queue->room_condition, &queue->mutex); }
+		atomic_fetch_sub(&queue->sleeping_producer_count, 1);
+		pthread_mutex_unlock(&queue->mutex);
+		if (is_pushed) { break; }
+		spin_count = 0;
+	}
+	job_queue_wake(queue, &queue->sleeping_worker_count, &queue->task_condition, 0);
+}
+
+void job_queue_push(JobQueue* queue, void* task) {
+	job_queue_push_ring(queue, &queue->ring, task);
+}
+
+int job_queue_set_nodes(JobQueue* queue, const int* worker_nodes, int node_count) {
+	queue->worker_nodes = malloc((size_t)queue->worker_count * sizeof(int));
+	queue->node_rings = calloc((size_t)node_count, sizeof(JobQueueRing));
+	int is_set = (queue->worker_nodes != NULL && queue->node_rings != NULL);
+	for (int node = 0; is_set && node < node_count; node++) {
+		is_set = job_queue_ring_init(&queue->node_rings[node]);
+		queue->node_count = node + is_set; // only initialized rings are freed
+	}
+	if (!is_set) {
+		for (int node = 0; node < queue->node_count; node++) { free(queue->node_rings[node].slots); }
+		free(queue->node_rings);
+		free(queue->worker_nodes);
+		queue->node_rings = NULL;
+		queue->worker_nodes = NULL;
+		queue->node_count = 0;
+		return 0;
+	}
+	for (int worker = 0; worker < queue->worker_count; worker++) {
+		queue->worker_nodes[worker] = (worker_nodes[worker] >= 0 && worker_nodes[worker] < node_count)
+			? worker_nodes[worker] : 0;
+	}
+	return 1;
+}
+
+void job_queue_push_node(JobQueue* queue, int node, void* task) {
+	if (queue->node_rings == NULL || node < 0 || node >= queue->node_count) {
+		job_queue_push_ring(queue, &queue->ring, task);
+		return;
+	}
+	job_queue_push_ring(queue, &queue->node_rings[node], task);
+}
+
+void job_queue_push_local(JobQueue* queue, int worker, void* task) {
+	atomic_fetch_add(&queue->pending_count, 1);
+	job_queue_deque_push(&queue->deques[worker], task);
+	job_queue_wake(queue, &queue->sleeping_worker_count, &queue->task_condition, 0); // sleepers can steal it
+}
+
+void* job_queue_try_pop(JobQueue* queue, int worker) {
+	/* Own deque first, it is not touched by others unless they steal */
+	JobQueueDeque* deque = &queue->deques[worker];
+	void* task = job_queue_deque_take(deque);
+
+	/* Tasks of own node are taken one at a time, because they are large */
+	/* and other workers of the node take them from the same ring */
+	if (task == NULL && queue->node_rings != NULL) {
+		task = job_queue_ring_pop(&queue->node_rings[queue->worker_nodes[worker]]);
+	}
+
+	/* Taking a batch from shared ring, keeping rest in own deque */
+	/* where idle workers can steal it */
+	if (task == NULL && (task = job_queue_ring_pop(&queue->ring)) != NULL) {
+		void* batch_tasks[JOB_QUEUE_BATCH_SIZE];
+		int batch_length = 0;
+		while (batch_length < JOB_QUEUE_BATCH_SIZE - 1
+			&& (batch_tasks[batch_length] = job_queue_ring_pop(&queue->ring)) != NULL) {
+			batch_length += 1;
+		}
+
+		/* Pushed in reverse, so owner still takes tasks in the order */
+		/* producer pushed them, and thieves take the last ones */
+		while (batch_length > 0) {
+			batch_length -= 1;
+			job_queue_deque_push(deque, batch_tasks[batch_length]);
+		}
+	}
+
+	/* Stealing from other workers, starting with the next one */
+	for (int index = 1; task == NULL && index < queue->worker_count; index++) {
+		task = job_queue_deque_steal(&queue->deques[(worker + index) % queue->worker_count]);
+	}
+
+	/* Remote memory is slower, but still faster than staying idle */
+	for (int node = 0; task == NULL && node < queue->node_count; node++) {
+		task = job_queue_ring_pop(&queue->node_rings[node]);
+	}
+
+	if (task == NULL) { return NULL; }
+	atomic_fetch_sub(&queue->pending_count, 1);
+
+	/* Producers may wait for room in a ring, any pop may have made some */
+	job_queue_wake(queue, &queue->sleeping_producer_count, &queue->room_condition, 1);
 	return task;
 }
 
+void* job_queue_pop(JobQueue* queue, int worker) {
+	int spin_count = 0;
+	while (1) {
+		void* task = job_queue_try_pop(queue, worker);
+		if (task != NULL) { return task; }
+
+		/* Every pushed task was popped and nothing more will be pushed */
+		if (atomic_load(&queue->is_closed) && atomic_load(&queue->pending_count) == 0) {
+			return NULL;
+		}
+		if (++spin_count < JOB_QUEUE_SPIN_COUNT) {
+			sched_yield();
+			continue;
+		}
+
+		/* Sleeping until a task is pushed or queue is closed, checking */
+		/* once more after counting itself, so that no wake up is lost */
+		/* Pending tasks are counted before they are visible, so they are */
+		/* retried instead of waited for */
+		pthread_mutex_lock(&queue->mutex);
+		atomic_fetch_add(&queue->sleeping_worker_count, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (atomic_load(&queue->pending_count) == 0 && !atomic_load(&queue->is_closed)) {
+			pthread_cond_wait(&queue->task_condition, &queue->mutex);
+		}
+		atomic_fetch_sub(&queue->sleeping_worker_count, 1);
+		pthread_mutex_unlock(&queue->mutex);
+		spin_count = 0;
+	}
+}
+
+void job_queue_close(JobQueue* queue) {
+	atomic_store(&queue->is_closed, 1);
+	job_queue_wake(queue, &queue->sleeping_worker_count, &queue->task_condition, 1);
+}
+
+/* Freeing task that was never popped, if queue owns it */
+static void job_queue_free_task(JobQueue* queue, void* task) {
+	if (queue->free_task != NULL) { queue->free_task(task); }
+}
+
 void job_queue_free(JobQueue* queue) {
 	if (queue == NULL) { return; }
-	while (queue->head != NULL) {
-		Job* job = queue->head;
-		void* task = queue->head->task;
-		if (task != NULL) { free(task); };
-		queue->head = queue->head->next;
-		free(job);
+
+	/* Freeing tasks that were never popped */
+	if (queue->ring.slots != NULL) {
+		void* task;
+		while ((task = job_queue_ring_pop(&queue->ring)) != NULL) { job_queue_free_task(queue, task); }
+		free(queue->ring.slots);
+	}
+	for (int node = 0; node < queue->node_count; node++) {
+		void* task;
+		while ((task = job_queue_ring_pop(&queue->node_rings[node])) != NULL) { job_queue_free_task(queue, task); }
+		free(queue->node_rings[node].slots);
+	}
+	free(queue->node_rings);
+	free(queue->worker_nodes);
+	if (queue->deques != NULL) {
+		for (int worker = 0; worker < queue->worker_count; worker++) {
+			JobQueueDeque* deque = &queue->deques[worker];
+			void* task;
+			while ((task = job_queue_deque_take(deque)) != NULL) { job_queue_free_task(queue, task); }
+			JobQueueArray* array = atomic_load(&deque->array);
+			while (array != NULL) {
+				JobQueueArray* previous = array->previous;
+				free(array);
+				array = previous;
+			}
+		}
+		free(queue->deques);
 	}
+	pthread_cond_destroy(&queue->room_condition);
+	pthread_cond_destroy(&queue->task_condition);
 	pthread_mutex_destroy(&queue->mutex);
 	free(queue);
 }
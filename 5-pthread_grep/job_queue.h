@@ -2,25 +2,96 @@
 #ifndef JOB_QUEUE_H
 #define JOB_QUEUE_H
 
-#include <pthread.h> // pthread_mutex_t
+#include <stddef.h> // size_t
+#include <stdatomic.h> // atomic_size_t, _Atomic
+#include <pthread.h> // pthread_mutex_t, pthread_cond_t
+
+/* Shared queue has this many preallocated slots, must be a power of 2 */
+#define JOB_QUEUE_CAPACITY 4096
+/* Worker deques start with this many slots and grow when full */
+#define JOB_QUEUE_DEQUE_CAPACITY 64
+/* Tasks moved from shared queue to worker deque at once */
+#define JOB_QUEUE_BATCH_SIZE 16
 
 /* Always prefix structs with header name */
-typedef struct Job {
+/* Slot of bounded multi-producer multi-consumer ring */
+/* Sequence number tells whether slot is ready to be written or read */
+typedef struct JobQueueSlot {
+	atomic_size_t sequence;
 	void* task;
-	struct Job* next;
-} Job;
+} JobQueueSlot;
+
+/* Circular array of a worker deque, replaced by a larger one when full */
+/* Replaced arrays are only freed with the queue, because thieves may */
+/* still be reading from them */
+typedef struct JobQueueArray {
+	size_t capacity;
+	struct JobQueueArray* previous;
+	_Atomic(void*) tasks[];
+} JobQueueArray;
+
+/* Chase-Lev deque, only its owner pushes and pops at the bottom */
+/* while other workers steal from the top */
+typedef struct JobQueueDeque {
+	_Atomic(long) top;
+	_Atomic(long) bottom;
+	_Atomic(JobQueueArray*) array;
+} JobQueueDeque;
+
+/* Bounded ring of JOB_QUEUE_CAPACITY slots, any thread pushes and pops */
+typedef struct JobQueueRing {
+	JobQueueSlot* slots;
+	atomic_size_t head;
+	atomic_size_t tail;
+} JobQueueRing;
+
+/* Frees task that was never popped, when queue is freed */
+typedef void (*JobQueueFreeTask)(void* task);
 
 /* Use typedef for structs to improve readability */
+/* Producers push to shared ring, workers take batches from it into */
+/* their own deques, so most pops do not touch any shared cache line */
+/* Tasks whose memory lives on a NUMA node can be pushed to a ring of */
+/* that node, which its workers check before shared ring */
 typedef struct JobQueue {
-	struct Job* head;
-	struct Job* tail;
-	pthread_mutex_t mutex; /* Mutex prevents race conditions */
+	JobQueueRing ring; // shared by all workers
+	JobQueueDeque* deques; // one per worker
+	int worker_count;
+	JobQueueRing* node_rings; // one per node, NULL until job_queue_set_nodes()
+	int* worker_nodes; // node of each worker
+	int node_count;
+	atomic_size_t pending_count; // pushed tasks not popped yet
+	atomic_int is_closed; // no more tasks will be pushed
+	JobQueueFreeTask free_task; // NULL when tasks are owned by someone else
+
+	/* Idle workers and producers waiting for room sleep here, mutex is */
+	/* only taken by threads about to sleep and by those waking them */
+	pthread_mutex_t mutex;
+	pthread_cond_t task_condition; // task was pushed or queue closed
+	pthread_cond_t room_condition; // task was taken from a ring
+	atomic_int sleeping_worker_count;
+	atomic_int sleeping_producer_count;
 } JobQueue;
 
 /* Always prefix functions with header name */
-JobQueue* job_queue_new();
+/* Tasks left in queue are passed to 'free_task' by job_queue_free(), */
+/* unless it is NULL */
+JobQueue* job_queue_new(int worker_count, JobQueueFreeTask free_task);
+/* Any thread can push, waits while shared ring is full */
 void job_queue_push(JobQueue* queue, void* task);
-void* job_queue_pop(JobQueue* queue);
+/* Workers of a node take tasks pushed to that node before any others */
+/* Called before workers start, returns 0 if memory can't be allocated */
+int job_queue_set_nodes(JobQueue* queue, const int* worker_nodes, int node_count);
+/* Any thread can push, waits while ring of node is full */
+void job_queue_push_node(JobQueue* queue, int node, void* task);
+/* Only worker owning the deque can push to it */
+void job_queue_push_local(JobQueue* queue, int worker, void* task);
+/* Returns NULL right away when no task is available */
+void* job_queue_try_pop(JobQueue* queue, int worker);
+/* Waits for tasks until queue is closed and empty, then returns NULL */
+void* job_queue_pop(JobQueue* queue, int worker);
+/* Called once all producers are done pushing */
+void job_queue_close(JobQueue* queue);
 void job_queue_free(JobQueue* queue);
 
 #endif
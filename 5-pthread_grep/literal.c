@@ -0,0 +1,341 @@
+#include "literal.h"
+#include "case_fold.h"
+#include "utf8.h"
+
+#include <stdlib.h> // calloc(), malloc(), free()
+#include <string.h> // memcpy(), memcmp(), memchr()
+
+#ifdef __SSE2__
+#include <emmintrin.h> // SSE2 intrinsics
+#endif
+
+/* Prefilter gives up after this many false positives if they are */
+/* on average closer to each other than the minimum distance below */
+#define LITERAL_PREFILTER_MAX_FALSE_POSITIVES 64
+#define LITERAL_PREFILTER_MIN_DISTANCE 16
+
+/* Finding maximal suffix of the pattern for given byte order */
+/* Returns start of the suffix minus one, wrapping around for -1 */
+static size_t maximal_suffix(const unsigned char* bytes, size_t length, int is_reversed, size_t* period) {
+	size_t suffix = (size_t)-1;
+	size_t index = 0;
+	size_t offset = 1;
+	*period = 1;
+	while (index + offset < length) {
+		unsigned char a = bytes[suffix + offset];
+		unsigned char b = bytes[index + offset];
+		if (a == b) {
+			if (offset == *period) {
+				index += *period;
+				offset = 1;
+			} else {
+				offset += 1;
+			}
+		} else if ((a > b) != is_reversed) {
+			index += offset;
+			offset = 1;
+			*period = index - suffix;
+		} else {
+			suffix = index;
+			index += 1;
+			offset = 1;
+			*period = 1;
+		}
+	}
+	return suffix;
+}
+
+/* Comparing text with pattern bytes folded to lower case */
+/* ASCII letters of 16 bytes are folded and compared at once */
+static int equal_ignore_case(const LiteralPattern* pattern, const unsigned char* text) {
+	const unsigned char* bytes = pattern->bytes;
+	size_t length = pattern->length;
+	size_t index = 0;
+#ifdef __SSE2__
+	const __m128i before_upper = _mm_set1_epi8('A' - 1);
+	const __m128i after_upper = _mm_set1_epi8('Z' + 1);
+	const __m128i case_bit = _mm_set1_epi8(0x20);
+	for (; index + 16 <= length; index += 16) {
+		/* Bytes above 0x7F are negative and never considered upper case */
+		__m128i block = _mm_loadu_si128((const __m128i*)(text + index));
+		__m128i is_upper = _mm_and_si128(_mm_cmpgt_epi8(block, before_upper), _mm_cmplt_epi8(block, after_upper));
+		__m128i folded = _mm_or_si128(block, _mm_and_si128(is_upper, case_bit));
+		__m128i expected = _mm_loadu_si128((const __m128i*)(bytes + index));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(folded, expected)) != 0xFFFF) { return 0; }
+	}
+#endif
+	for (; index < length; index++) {
+		if (pattern->fold[text[index]] != bytes[index]) { return 0; }
+	}
+	return 1;
+}
+
+/* Expanding non-ASCII case insensitive pattern into all of its variants */
+/* Pattern without any cased characters is simply matched exactly */
+static int compile_variants(LiteralPattern* pattern) {
+	size_t character_count = 0;
+	wchar_t (*characters)[CASE_FOLD_MAX_VARIANTS] = malloc(pattern->length * sizeof(*characters));
+	size_t* variant_counts = malloc(pattern->length * sizeof(size_t));
+	pattern->folded_characters = malloc(pattern->length * sizeof(wchar_t));
+	if (characters == NULL || variant_counts == NULL || pattern->folded_characters == NULL) {
+		free(characters); free(variant_counts);
+		return 0;
+	}
+
+	/* Decoding pattern and multiplying numbers of character variants */
+	size_t variant_count = 1;
+	size_t position = 0;
+	while (position < pattern->length) {
+		wchar_t c;
+		position += utf8_decode(pattern->bytes + position, pattern->length - position, &c);
+		variant_counts[character_count] = case_fold_variants(c, characters[character_count]);
+		pattern->folded_characters[character_count] = case_fold(c);
+		if (variant_count <= LITERAL_MAX_VARIANTS) { variant_count *= variant_counts[character_count]; }
+		character_count += 1;
+	}
+	pattern->folded_length = character_count;
+
+	/* Variants of first character tell where a match can start */
+	for (size_t index = 0; index < variant_counts[0]; index++) {
+		char bytes[UTF8_MAX_LENGTH];
+		utf8_encode(characters[0][index], bytes);
+		pattern->is_first_byte[(unsigned char)bytes[0]] = 1;
+	}
+
+	int is_compiled = 1;
+	if (variant_count == 1) {
+		pattern->mode = LITERAL_MODE_EXACT;
+	} else if (variant_count > LITERAL_MAX_VARIANTS) {
+		pattern->mode = LITERAL_MODE_UNICODE_FOLD;
+	} else {
+		/* Enumerating variants like an odometer, last character changes first */
+		pattern->mode = LITERAL_MODE_VARIANTS;
+		pattern->variants = calloc(variant_count, sizeof(char*));
+		pattern->variant_lengths = calloc(variant_count, sizeof(size_t));
+		size_t* digits = calloc(character_count, sizeof(size_t));
+		is_compiled = pattern->variants != NULL && pattern->variant_lengths != NULL && digits != NULL;
+		for (size_t variant = 0; is_compiled && variant < variant_count; variant++) {
+			char* bytes = malloc(character_count * UTF8_MAX_LENGTH);
+			if (bytes == NULL) { is_compiled = 0; break; }
+			size_t length = 0;
+			for (size_t index = 0; index < character_count; index++) {
+				length += utf8_encode(characters[index][digits[index]], bytes + length);
+			}
+			pattern->variants[variant] = bytes;
+			pattern->variant_lengths[variant] = length;
+			pattern->variant_count += 1;
+
+			for (size_t index = character_count; index-- > 0;) {
+				digits[index] += 1;
+				if (digits[index] < variant_counts[index]) { break; }
+				digits[index] = 0;
+			}
+		}
+		free(digits);
+	}
+
+	free(characters);
+	free(variant_counts);
+	return is_compiled;
+}
+
+LiteralPattern* literal_new(const char* bytes, size_t length, int ignore_case) {
+	LiteralPattern* pattern = calloc(1, sizeof(LiteralPattern));
+	if (pattern == NULL) { return NULL; }
+	pattern->bytes = malloc(length + 1);
+	if (pattern->bytes == NULL) {
+		free(pattern);
+		return NULL;
+	}
+	memcpy(pattern->bytes, bytes, length);
+	pattern->length = length;
+	pattern->mode = LITERAL_MODE_EXACT;
+	for (size_t index = 0; index < 256; index++) { pattern->fold[index] = (unsigned char)index; }
+
+	/* ASCII patterns only need folding ASCII letters of the text */
+	/* Non-ASCII characters folding to ASCII, like KELVIN SIGN, are not matched */
+	if (ignore_case) {
+		int is_ascii = 1;
+		for (size_t index = 0; index < length; index++) {
+			if (pattern->bytes[index] >= 0x80) { is_ascii = 0; }
+		}
+		if (is_ascii) {
+			pattern->mode = LITERAL_MODE_ASCII_FOLD;
+			for (size_t index = 'A'; index <= 'Z'; index++) { pattern->fold[index] = (unsigned char)(index + 32); }
+			for (size_t index = 0; index < length; index++) {
+				pattern->bytes[index] = pattern->fold[pattern->bytes[index]];
+			}
+		} else if (!compile_variants(pattern)) {
+			literal_free(pattern);
+			return NULL;
+		}
+	}
+	if (pattern->mode != LITERAL_MODE_EXACT && pattern->mode != LITERAL_MODE_ASCII_FOLD) {
+		return pattern;
+	}
+
+	/* Bytes missing from the pattern allow skipping whole pattern length */
+	for (size_t index = 0; index < 256; index++) { pattern->shift[index] = length; }
+	for (size_t index = 0; index < length; index++) {
+		pattern->shift[pattern->bytes[index]] = length - index - 1;
+	}
+	for (size_t index = 0; index < 256; index++) {
+		pattern->shift[index] = pattern->shift[pattern->fold[index]];
+	}
+
+	/* Critical factorization is the larger of two maximal suffixes */
+	size_t period = 0;
+	size_t reversed_period = 0;
+	size_t suffix = maximal_suffix(pattern->bytes, length, 0, &period);
+	size_t reversed_suffix = maximal_suffix(pattern->bytes, length, 1, &reversed_period);
+	if (reversed_suffix + 1 > suffix + 1) {
+		suffix = reversed_suffix;
+		period = reversed_period;
+	}
+	pattern->critical_position = suffix + 1;
+
+	/* Periodic patterns remember matched prefix after shifting by period */
+	if (period <= length && memcmp(pattern->bytes, pattern->bytes + period, pattern->critical_position) == 0) {
+		pattern->period = period;
+		pattern->memory = length - period;
+	} else {
+		size_t left = (pattern->critical_position > 0) ? pattern->critical_position - 1 : 0;
+		size_t right = length - pattern->critical_position;
+		pattern->period = ((left > right) ? left : right) + 1;
+		pattern->memory = 0;
+	}
+
+	if (length >= 1) {
+		prefilter_init(&pattern->prefilter, pattern->bytes, length, pattern->mode == LITERAL_MODE_ASCII_FOLD);
+	}
+	return pattern;
+}
+
+/* Two-Way string matching with bad character shifts */
+static const char* two_way_find(const LiteralPattern* pattern, const char* text, size_t text_length) {
+	size_t length = pattern->length;
+	const unsigned char* bytes = pattern->bytes;
+	const unsigned char* haystack = (const unsigned char*)text;
+	const unsigned char* haystack_end = haystack + text_length;
+	const unsigned char* fold = pattern->fold;
+	size_t critical_position = pattern->critical_position;
+	size_t memory = 0;
+
+	while ((size_t)(haystack_end - haystack) >= length) {
+		/* Checking last aligned byte first, skipping on mismatch */
+		size_t shift = pattern->shift[haystack[length - 1]];
+		if (shift > 0) {
+			haystack += (shift < memory) ? memory : shift;
+			memory = 0;
+			continue;
+		}
+
+		/* Comparing right half, shifting past the mismatch */
+		size_t index = (critical_position > memory) ? critical_position : memory;
+		while (index < length && bytes[index] == fold[haystack[index]]) { index++; }
+		if (index < length) {
+			haystack += index - critical_position + 1;
+			memory = 0;
+			continue;
+		}
+
+		/* Comparing left half, shifting by period on mismatch */
+		index = critical_position;
+		while (index > memory && bytes[index - 1] == fold[haystack[index - 1]]) { index--; }
+		if (index <= memory) { return (const char*)haystack; }
+		haystack += pattern->period;
+		memory = pattern->memory;
+	}
+	return NULL;
+}
+
+/* Trying every case variant at positions where any of them can start */
+static const char* variants_find(const LiteralPattern* pattern, const char* text, size_t text_length,
+	size_t* match_length) {
+	const unsigned char* position = (const unsigned char*)text;
+	const unsigned char* text_end = position + text_length;
+	for (; position < text_end; position++) {
+		if (!pattern->is_first_byte[*position]) { continue; }
+		for (size_t index = 0; index < pattern->variant_count; index++) {
+			size_t length = pattern->variant_lengths[index];
+			if (length <= (size_t)(text_end - position) && memcmp(position, pattern->variants[index], length) == 0) {
+				*match_length = length;
+				return (const char*)position;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* Decoding and folding text characters at positions where match can start */
+static const char* unicode_fold_find(const LiteralPattern* pattern, const char* text, size_t text_length,
+	size_t* match_length) {
+	const unsigned char* start = (const unsigned char*)text;
+	const unsigned char* text_end = start + text_length;
+	for (; start < text_end; start++) {
+		if (!pattern->is_first_byte[*start]) { continue; }
+		const unsigned char* position = start;
+		size_t index = 0;
+		while (index < pattern->folded_length && position < text_end) {
+			wchar_t c;
+			position += utf8_decode(position, (size_t)(text_end - position), &c);
+			if (case_fold(c) != pattern->folded_characters[index]) { break; }
+			index += 1;
+		}
+		if (index == pattern->folded_length) {
+			*match_length = (size_t)(position - start);
+			return (const char*)start;
+		}
+	}
+	return NULL;
+}
+
+const char* literal_find(const LiteralPattern* pattern, const char* text, size_t text_length,
+	size_t* match_length) {
+	if (pattern->mode == LITERAL_MODE_VARIANTS) {
+		return variants_find(pattern, text, text_length, match_length);
+	} else if (pattern->mode == LITERAL_MODE_UNICODE_FOLD) {
+		return unicode_fold_find(pattern, text, text_length, match_length);
+	}
+
+	size_t length = pattern->length;
+	*match_length = length;
+	if (length == 0) { return text; }
+	if (length == 1 && pattern->mode == LITERAL_MODE_EXACT) {
+		return memchr(text, pattern->bytes[0], text_length);
+	}
+
+	/* Verifying only positions where prefilter found both rare bytes */
+	const char* text_end = text + text_length;
+	const char* search_start = text;
+	size_t false_positive_count = 0;
+	while (1) {
+		const char* candidate = prefilter_find(&pattern->prefilter, search_start, (size_t)(text_end - search_start));
+		if (candidate == NULL) { return NULL; }
+		int is_equal = (pattern->mode == LITERAL_MODE_EXACT)
+			? memcmp(candidate, pattern->bytes, length) == 0
+			: equal_ignore_case(pattern, (const unsigned char*)candidate);
+		if (is_equal) { return candidate; }
+		search_start = candidate + 1;
+
+		/* Rare bytes are not rare in this text, Two-Way is faster here */
+		false_positive_count += 1;
+		if (false_positive_count >= LITERAL_PREFILTER_MAX_FALSE_POSITIVES) {
+			size_t distance = (size_t)(search_start - text);
+			if (distance < false_positive_count * LITERAL_PREFILTER_MIN_DISTANCE) { break; }
+		}
+	}
+	return two_way_find(pattern, search_start, (size_t)(text_end - search_start));
+}
+
+void literal_free(LiteralPattern* pattern) {
+	if (pattern == NULL) { return; }
+	for (size_t index = 0; index < pattern->variant_count; index++) {
+		free(pattern->variants[index]);
+	}
+	free(pattern->variants);
+	free(pattern->variant_lengths);
+	free(pattern->folded_characters);
+	free(pattern->bytes);
+	free(pattern);
+}
@@ -0,0 +1,49 @@
+/* All header files need to be protected with preprocessor guards */
+#ifndef LITERAL_H
+#define LITERAL_H
+
+#include <stddef.h> // size_t, wchar_t
+#include "prefilter.h"
+
+/* Case insensitive patterns with more variants are matched by decoding */
+#define LITERAL_MAX_VARIANTS 64
+
+/* How search string is compared with text, chosen when compiling it */
+typedef enum LiteralMode {
+	LITERAL_MODE_EXACT, // bytes are compared as they are
+	LITERAL_MODE_ASCII_FOLD, // ASCII letters are compared ignoring case
+	LITERAL_MODE_VARIANTS, // every case variant of non-ASCII pattern is tried
+	LITERAL_MODE_UNICODE_FOLD, // text characters are decoded and folded
+} LiteralMode;
+
+/* Search string preprocessed once for Two-Way string matching */
+/* Two-Way guarantees linear worst case, while bad character shifts */
+/* let the search skip over text that cannot contain the last byte */
+typedef struct LiteralPattern {
+	LiteralMode mode;
+	unsigned char* bytes; // folded to lower case in ASCII mode
+	size_t length;
+	unsigned char fold[256]; // byte mapping applied to text before comparing
+	size_t critical_position; // start of the right half of the pattern
+	size_t period; // shift after the left half fails to match
+	size_t memory; // bytes known to match after shifting by period
+	size_t shift[256]; // bad character shift for the last aligned byte
+	Prefilter prefilter; // vectorized candidate finder tried first
+
+	/* Non-ASCII case insensitive patterns are expanded into variants */
+	char** variants; // UTF-8 encoded case variants of the pattern
+	size_t* variant_lengths;
+	size_t variant_count;
+	wchar_t* folded_characters; // used when there are too many variants
+	size_t folded_length;
+	unsigned char is_first_byte[256]; // bytes any variant can start with
+} LiteralPattern;
+
+/* Always prefix functions with header name */
+LiteralPattern* literal_new(const char* bytes, size_t length, int ignore_case);
+/* Matches of case insensitive patterns may differ in length from pattern */
+const char* literal_find(const LiteralPattern* pattern, const char* text, size_t text_length,
+	size_t* match_length);
+void literal_free(LiteralPattern* pattern);
+
+#endif
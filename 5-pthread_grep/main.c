@@ -1,22 +1,193 @@
-#include <stdlib.h> // EXIT_SUCCESS, EXIT_FAILURE, atoi(), free()
+#include <stdlib.h> // EXIT_SUCCESS, EXIT_FAILURE, strtol(), strtoull(), realloc(), free()
 #include <locale.h> // setlocale()
-#include <unistd.h> // getopt()
-#include <stdio.h> // printf()
+#include <getopt.h> // getopt(), getopt_long()
+#include <stdio.h> // printf(), sprintf(), fopen(), getline(), fclose()
+#include <string.h> // strlen(), strdup(), strcmp()
+#include <wchar.h> // wchar_t
+#include <errno.h> // errno
+#include <stdint.h> // SIZE_MAX
 
 #include "grep.h"
+#include "cpu.h"
+
+/* Search strings given with -e and -f, in order they were given */
+typedef struct PatternArguments {
+	char** patterns;
+	size_t length;
+	size_t capacity;
+} PatternArguments;
+
+static bool add_pattern_argument(PatternArguments* arguments, const char* pattern) {
+	if (arguments->length == arguments->capacity) {
+		size_t capacity = (arguments->capacity > 0) ? arguments->capacity * 2 : 8;
+		char** patterns_copy = realloc(arguments->patterns, capacity * sizeof(char*));
+		if (patterns_copy == NULL) { return 0; }
+		arguments->patterns = patterns_copy;
+		arguments->capacity = capacity;
+	}
+	arguments->patterns[arguments->length] = strdup(pattern);
+	if (arguments->patterns[arguments->length] == NULL) { return 0; }
+	arguments->length += 1;
+	return 1;
+}
+
+/* Reading one search string per line, empty lines are skipped */
+static bool add_pattern_file(PatternArguments* arguments, const char* file_name) {
+	FILE* file = fopen(file_name, "r");
+	if (file == NULL) { return 0; }
+	char* line = NULL;
+	size_t line_capacity = 0;
+	ssize_t line_length;
+	bool is_success = 1;
+	while (is_success && (line_length = getline(&line, &line_capacity, file)) != -1) {
+		if (line_length > 0 && line[line_length - 1] == '\n') { line[--line_length] = '\0'; }
+		if (line_length == 0) { continue; }
+		is_success = add_pattern_argument(arguments, line);
+	}
+	free(line);
+	fclose(file);
+	return is_success;
+}
+
+/* Several regular expressions are searched as one alternation */
+static bool join_pattern_arguments(PatternArguments* arguments) {
+	size_t length = 0;
+	for (size_t index = 0; index < arguments->length; index++) {
+		length += strlen(arguments->patterns[index]) + 3; // "(...)|"
+	}
+	char* joined = malloc(length + 1);
+	if (joined == NULL) { return 0; }
+	size_t position = 0;
+	for (size_t index = 0; index < arguments->length; index++) {
+		position += (size_t)sprintf(joined + position, "%s(%s)", (index > 0) ? "|" : "", arguments->patterns[index]);
+		free(arguments->patterns[index]);
+	}
+	arguments->patterns[0] = joined;
+	arguments->length = 1;
+	return 1;
+}
+
+static void free_patterns(char** patterns, size_t pattern_count) {
+	if (patterns == NULL) { return; }
+	for (size_t index = 0; index < pattern_count; index++) {
+		free(patterns[index]);
+	}
+	free(patterns);
+}
+
+/* Validating search strings and encoding them to UTF-8 once */
+static bool encode_patterns(GrepOptions* options, char** arguments, size_t argument_count) {
+	options->patterns = calloc(argument_count, sizeof(char*));
+	options->pattern_lengths = calloc(argument_count, sizeof(size_t));
+	if (options->patterns == NULL || options->pattern_lengths == NULL) { return 0; }
+	for (size_t index = 0; index < argument_count; index++) {
+		wchar_t* search_string = convert_string(arguments[index]);
+		if (search_string == NULL) { return 0; }
+		options->patterns[index] = encode_string(search_string);
+		free(search_string);
+		if (options->patterns[index] == NULL) { return 0; }
+		options->pattern_lengths[index] = strlen(options->patterns[index]);
+		options->pattern_count += 1;
+	}
+	return 1;
+}
+
+/* Thread count given with -t, 0 or "auto" uses every CPU this process */
+/* may run on, returns 0 when count is not valid */
+static int parse_thread_count(const char* text) {
+	if (strcmp(text, "auto") == 0) { return cpu_count_available(); }
+	char* end = NULL;
+	errno = 0;
+	long thread_count = strtol(text, &end, 10);
+	if (end == text || *end != '\0' || errno != 0 || thread_count < 0 || thread_count > CPU_MAX_THREADS) {
+		return 0;
+	}
+	return (thread_count == 0) ? cpu_count_available() : (int)thread_count;
+}
+
+/* Matching lines searched in each file, 0 searches all of them */
+/* strtoull() would accept "-1" and wrap it around, so digits are required */
+static bool parse_max_count(const char* text, size_t* max_count) {
+	if (text[0] < '0' || text[0] > '9') { return 0; }
+	char* end = NULL;
+	errno = 0;
+	unsigned long long count = strtoull(text, &end, 10);
+	if (*end != '\0' || errno != 0 || count > SIZE_MAX) { return 0; }
+	*max_count = (size_t)count;
+	return 1;
+}
+
+/* Usage: grep index build [-t THREADS] DIRECTORY */
+/* Arguments start with 'build', which getopt skips like program name */
+static int build_index(int argc, char** argv) {
+	int thread_count = 1;
+	int c;
+	while ((c = getopt(argc, argv, "t:")) != -1) {
+		if (c != 't') { return EXIT_FAILURE; }
+		thread_count = parse_thread_count(optarg);
+		if (thread_count == 0) {
+			printf("Error: Bad thread count %s.\n", optarg);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind + 1 != argc) {
+		printf("Error: Bad arguments.\n");
+		return EXIT_FAILURE;
+	}
+	size_t file_count = 0;
+	if (!trigram_index_build(argv[optind], thread_count, &file_count)) {
+		printf("Error: Failed building index of %s.\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+	printf("Indexed files: %zu\n", file_count);
+	return EXIT_SUCCESS;
+}
 
 int main(int argc, char **argv) {
 	struct GrepOptions options;
 	options.ignore_case = 0;
 	options.match_whole_words = 0;
-	char* search_string_argument = NULL;
-	options.search_string = NULL;
+	options.extended_regexp = 0;
+	options.print_lines = 0;
+	options.unordered_output = 0;
+	options.recursive = 0;
+	options.one_file_system = 0;
+	options.output_mode = GREP_OUTPUT_MATCH_COUNTS;
+	options.max_count = 0;
+	options.patterns = NULL;
+	options.pattern_lengths = NULL;
+	options.pattern_count = 0;
+	options.pattern = NULL;
 	options.available_threads = 1;
+	options.pin_threads = 0;
+	options.stats_format = STATS_FORMAT_NONE;
+	options.verbose = 0;
+	options.index = NULL;
+	bool is_indexed = 0;
+	bool is_pattern_given = 0; // -e or -f, even when file had no search strings
+
+	PatternArguments pattern_arguments = { NULL, 0, 0 };
 
 	setlocale(LC_ALL, "C.UTF8");
 
+	/* Index is built by its own command instead of searching */
+	if (argc >= 3 && strcmp(argv[1], "index") == 0 && strcmp(argv[2], "build") == 0) {
+		return build_index(argc - 2, argv + 2);
+	}
+
+	/* Long options without short form return values above 255 */
+	enum { OPTION_ONE_FILE_SYSTEM = 256, OPTION_STATS, OPTION_INDEX, OPTION_VERBOSE, OPTION_PIN };
+	static struct option long_options[] = {
+		{ "one-file-system", no_argument, NULL, OPTION_ONE_FILE_SYSTEM },
+		{ "index", no_argument, NULL, OPTION_INDEX },
+		{ "stats", optional_argument, NULL, OPTION_STATS },
+		{ "verbose", no_argument, NULL, OPTION_VERBOSE },
+		{ "pin", no_argument, NULL, OPTION_PIN },
+		{ NULL, 0, NULL, 0 }
+	};
+
 	int c;
-	while ((c = getopt (argc, argv, "hiwt:")) != -1) {
+	while ((c = getopt_long (argc, argv, "hiwEnurclLqm:t:e:f:", long_options, NULL)) != -1) {
 		switch (c) {
 			case 'i':
 				options.ignore_case = 1;
@@ -24,46 +195,201 @@ int main(int argc, char **argv) {
 			case 'w':
 				options.match_whole_words = 1;
 				break;
-			case 't': // requires an argument after -t
-				options.available_threads = atoi(optarg);
-				if (options.available_threads < 1) {
-					options.available_threads = 1;
+			case 'E': // search strings are regular expressions
+				options.extended_regexp = 1;
+				break;
+			case 'n': // printing matching lines with line numbers
+				options.print_lines = 1;
+				break;
+			case 'u': // writing results as soon as files are searched
+				options.unordered_output = 1;
+				break;
+			case 'r': // searching directories instead of files
+				options.recursive = 1;
+				break;
+			case OPTION_ONE_FILE_SYSTEM: // only used with -r
+				options.one_file_system = 1;
+				break;
+			case OPTION_INDEX: // searching indexed directory, implies -r
+				is_indexed = 1;
+				options.recursive = 1;
+				break;
+			case OPTION_STATS: // --stats or --stats=json, printed to stderr
+				if (optarg == NULL) {
+					options.stats_format = STATS_FORMAT_TEXT;
+				} else if (strcmp(optarg, "json") == 0) {
+					options.stats_format = STATS_FORMAT_JSON;
+				} else {
+					printf("Error: Unknown statistics format %s.\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case OPTION_VERBOSE: // expected and measured time of each task, printed to stderr
+				options.verbose = 1;
+				break;
+			case OPTION_PIN: // each worker runs on its own CPU, buffers on its NUMA node
+				options.pin_threads = 1;
+				break;
+			case 'c': // counts without any colors or lines
+				options.output_mode = GREP_OUTPUT_COUNTS_ONLY;
+				break;
+			case 'l':
+				options.output_mode = GREP_OUTPUT_FILES_WITH_MATCHES;
+				break;
+			case 'L':
+				options.output_mode = GREP_OUTPUT_FILES_WITHOUT_MATCH;
+				break;
+			case 'q': // exit code tells whether anything matched
+				options.output_mode = GREP_OUTPUT_QUIET;
+				break;
+			case 'm': // requires an argument after -m
+				if (!parse_max_count(optarg, &options.max_count)) {
+					printf("Error: Bad match count %s, expected a number of lines.\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 't': // requires an argument after -t, 0 or auto for all CPUs
+				options.available_threads = parse_thread_count(optarg);
+				if (options.available_threads == 0) {
+					printf("Error: Bad thread count %s, expected 0 to %d or auto.\n", optarg, CPU_MAX_THREADS);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'e': // can be given several times
+				is_pattern_given = 1;
+				if (!add_pattern_argument(&pattern_arguments, optarg)) {
+					printf("Error: Failed adding search string.\n");
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'f':
+				is_pattern_given = 1;
+				if (!add_pattern_file(&pattern_arguments, optarg)) {
+					printf("Error: Failed reading search strings from %s.\n", optarg);
+					return EXIT_FAILURE;
 				}
 				break;
 			case 'h':
 				printf("Search for PATTERN in FILE.\n");
-				printf("Usage: grep [OPTIONS] PATTERN FILE\n");
+				printf("Usage: grep [OPTIONS] PATTERN [FILE]\n");
+				printf("       grep [OPTIONS] -e PATTERN [-e PATTERN] FILE\n");
+				printf("       grep [OPTIONS] -f PATTERNFILE FILE\n");
+				printf("       grep [OPTIONS] -r [--one-file-system] PATTERN DIRECTORY\n");
+				printf("       grep [OPTIONS] --index PATTERN DIRECTORY\n");
+				printf("       grep index build [-t THREADS] DIRECTORY\n");
+				printf("Options: -i -w -E -n -u -r -c -l -L -q -m NUM -t THREADS|auto --pin --stats[=json] --verbose --index\n");
 				printf("Example: grep -i 'hello world' main.c\n");
+				printf("         grep -E '^(int|void) [a-z_]+\\(' main.c\n");
 				return EXIT_SUCCESS;
 		}
 	}
 
-	char** file_names = NULL;
-	int file_names_length = 0;
-	if (optind + 1 < argc) {
-		search_string_argument = argv[optind + 0];
+	/* Only first matching line of each file decides these modes */
+	if (options.output_mode == GREP_OUTPUT_FILES_WITH_MATCHES
+		|| options.output_mode == GREP_OUTPUT_FILES_WITHOUT_MATCH
+		|| options.output_mode == GREP_OUTPUT_QUIET) {
+		options.max_count = 1;
+	}
+	if (options.output_mode != GREP_OUTPUT_MATCH_COUNTS) { options.print_lines = 0; }
 
-		/* Extracting multiple input files into an array */
-		file_names_length = argc - (optind + 1);
-		file_names = malloc(file_names_length * sizeof(char*));
-		for (int index = (optind + 1); index < argc; index++) {
-			file_names[index - (optind + 1)] = argv[index];
+	/* Without -e or -f the first argument is the search string */
+	/* Empty -f file leaves no search strings, so nothing matches */
+	if (!is_pattern_given && optind < argc) {
+		if (!add_pattern_argument(&pattern_arguments, argv[optind])) {
+			printf("Error: Failed adding search string.\n");
+			return EXIT_FAILURE;
 		}
-	} else {
+		optind += 1;
+	}
+
+	if (options.extended_regexp && pattern_arguments.length > 1
+		&& !join_pattern_arguments(&pattern_arguments)) {
+		printf("Error: Failed adding search string.\n");
+		free_patterns(pattern_arguments.patterns, pattern_arguments.length);
+		return EXIT_FAILURE;
+	}
+
+	if (!is_pattern_given && pattern_arguments.length == 0) {
 		printf("Error: Bad arguments.\n");
 		return EXIT_FAILURE;
 	}
 
-	options.search_string = convert_string(search_string_argument);
-	if (options.search_string == NULL) {
+	/* Extracting multiple input files into an array */
+	/* Without files standard input is searched, or working directory with -r */
+	char* default_file_name = options.recursive ? "." : GREP_STDIN_NAME;
+	int file_names_length = (optind < argc) ? argc - optind : 1;
+	char** file_names = malloc(file_names_length * sizeof(char*));
+	if (file_names == NULL) {
+		printf("Error: Failed adding input files.\n");
+		free_patterns(pattern_arguments.patterns, pattern_arguments.length);
+		return EXIT_FAILURE;
+	}
+	for (int index = 0; index < file_names_length; index++) {
+		file_names[index] = (optind < argc) ? argv[optind + index] : default_file_name;
+	}
+
+	/* Encoding search strings to UTF-8 once instead of decoding every line */
+	bool is_encoded = encode_patterns(&options, pattern_arguments.patterns, pattern_arguments.length);
+	free_patterns(pattern_arguments.patterns, pattern_arguments.length);
+	if (!is_encoded) {
 		printf("Error: Failed converting search string.");
+		free_patterns(options.patterns, options.pattern_count);
+		free(options.pattern_lengths);
+		free(file_names);
 		return EXIT_FAILURE;
 	}
 
+	/* Preparing skip tables or automaton once for all lines, files and threads */
+	const char* pattern_error = NULL;
+	options.pattern = grep_pattern_new(options.patterns, options.pattern_lengths, options.pattern_count,
+		options.ignore_case, options.extended_regexp, &pattern_error);
+	if (options.pattern == NULL) {
+		printf("Error: Failed preparing search string, %s.\n", pattern_error);
+		free_patterns(options.patterns, options.pattern_count);
+		free(options.pattern_lengths);
+		free(file_names);
+		return EXIT_FAILURE;
+	}
+
+	/* Only files containing text every match requires are read */
+	if (is_indexed) {
+		options.index = (file_names_length == 1) ? trigram_index_open(file_names[0]) : NULL;
+		if (options.index == NULL) {
+			printf("Error: Failed opening index, build it with 'grep index build DIRECTORY'.\n");
+			grep_pattern_free(options.pattern);
+			free_patterns(options.patterns, options.pattern_count);
+			free(options.pattern_lengths);
+			free(file_names);
+			return EXIT_FAILURE;
+		}
+		grep_pattern_select_files(options.pattern, options.index, options.ignore_case);
+	}
+
 	GrepFilesResult grep_files_result = grep_files(file_names, file_names_length, &options);
-	printf("Matches found: %zu\n", grep_files_result.match_count);
-	free(options.search_string);
+	bool is_summary_printed = (options.output_mode == GREP_OUTPUT_MATCH_COUNTS
+		|| options.output_mode == GREP_OUTPUT_COUNTS_ONLY);
+	if (is_summary_printed) { printf("Matches found: %zu\n", grep_files_result.match_count); }
+	if (is_summary_printed && grep_files_result.pattern_match_counts != NULL) {
+		for (size_t index = 0; index < options.pattern_count; index++) {
+			printf(ANSI_COLOR_MAGENTA "%s" ANSI_COLOR_RESET, options.patterns[index]);
+			printf(ANSI_COLOR_CYAN ":" ANSI_COLOR_RESET);
+			printf(" %zu\n", grep_files_result.pattern_match_counts[index]);
+		}
+	}
+	if (options.stats_format != STATS_FORMAT_NONE) {
+		stats_print(&grep_files_result.stats, options.stats_format);
+	}
+	free(grep_files_result.pattern_match_counts);
+	trigram_index_close(options.index);
+	grep_pattern_free(options.pattern);
+	free_patterns(options.patterns, options.pattern_count);
+	free(options.pattern_lengths);
 	free(file_names); // freeing input files array
 
+	/* Like other greps, quiet search fails when nothing matched, and */
+	/* succeeds on any match even when some file could not be read */
+	if (options.output_mode == GREP_OUTPUT_QUIET) {
+		return (grep_files_result.match_count > 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
 	return grep_files_result.exit_code;
 }
@@ -0,0 +1,367 @@
+#define _GNU_SOURCE // syscall()
+#include "prefetch.h"
+
+#include <stdlib.h> // malloc(), calloc(), realloc(), free()
+#include <string.h> // memset(), memcpy(), strlen()
+#include <stdint.h> // uintptr_t
+#include <stdatomic.h> // atomic_load_explicit(), atomic_store_explicit()
+#include <errno.h> // errno, EINTR
+#include <fcntl.h> // open(), posix_fadvise(), AT_FDCWD
+#include <unistd.h> // syscall(), close()
+#include <sys/mman.h> // mmap(), munmap()
+#include <sys/syscall.h> // __NR_io_uring_setup, __NR_io_uring_enter, __NR_io_uring_register
+#include <linux/io_uring.h> // struct io_uring_params, struct io_uring_sqe, struct io_uring_cqe
+
+/* This file implements prefetching for prefetch.h */
+/* Other structs and functions declared here are limited to this file! */
+/* Use 'static' to declare local functions and local global variables */
+
+/* Smallest read buffer, enough for most source files */
+#define PREFETCH_BUFFER_MIN_SIZE (64 * 1024)
+
+/* Every request is opened, read and closed by three linked operations */
+#define PREFETCH_OPERATION_COUNT 3
+
+/* Operation of a completion is kept in low bits of request pointer */
+enum { PREFETCH_OPEN, PREFETCH_READ, PREFETCH_CLOSE };
+
+/* Ring indexes are shared with kernel, which reads and writes them */
+/* concurrently, so they are accessed atomically */
+static unsigned prefetch_load(unsigned* pointer) {
+	return atomic_load_explicit((_Atomic(unsigned)*)pointer, memory_order_acquire);
+}
+
+static void prefetch_store(unsigned* pointer, unsigned value) {
+	atomic_store_explicit((_Atomic(unsigned)*)pointer, value, memory_order_release);
+}
+
+/* Thread pool */
+
+static void* prefetch_pool_thread(void* arguments) {
+	PrefetchPool* pool = (PrefetchPool*)arguments;
+	while (1) {
+		pthread_mutex_lock(&pool->mutex);
+		while (pool->length == 0 && !pool->is_closed) {
+			pthread_cond_wait(&pool->condition, &pool->mutex);
+		}
+		if (pool->length == 0) { // closed and empty
+			pthread_mutex_unlock(&pool->mutex);
+			return NULL;
+		}
+		char path[PREFETCH_POOL_PATH_SIZE];
+		memcpy(path, pool->paths[pool->head], PREFETCH_POOL_PATH_SIZE);
+		pool->head = (pool->head + 1) % PREFETCH_POOL_CAPACITY;
+		pool->length -= 1;
+		pthread_mutex_unlock(&pool->mutex);
+
+		/* Kernel reads file into page cache while this thread moves on */
+		int file = open(path, O_RDONLY | O_CLOEXEC);
+		if (file != -1) {
+			posix_fadvise(file, 0, 0, POSIX_FADV_WILLNEED);
+			close(file);
+		}
+	}
+}
+
+PrefetchPool* prefetch_pool_new(int thread_count) {
+	PrefetchPool* pool = calloc(1, sizeof(PrefetchPool));
+	if (pool == NULL) { return NULL; }
+	pool->threads = malloc((size_t)thread_count * sizeof(pthread_t));
+	if (pool->threads == NULL || pthread_mutex_init(&pool->mutex, NULL) != 0) {
+		free(pool->threads);
+		free(pool);
+		return NULL;
+	}
+	pthread_cond_init(&pool->condition, NULL);
+	for (int index = 0; index < thread_count; index++) {
+		if (pthread_create(&pool->threads[pool->thread_count], NULL, &prefetch_pool_thread, pool) == 0) {
+			pool->thread_count += 1;
+		}
+	}
+	if (pool->thread_count == 0) {
+		prefetch_pool_free(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+void prefetch_pool_free(PrefetchPool* pool) {
+	if (pool == NULL) { return; }
+	pthread_mutex_lock(&pool->mutex);
+	pool->is_closed = 1;
+	pthread_cond_broadcast(&pool->condition);
+	pthread_mutex_unlock(&pool->mutex);
+	for (int index = 0; index < pool->thread_count; index++) {
+		pthread_join(pool->threads[index], NULL);
+	}
+	pthread_cond_destroy(&pool->condition);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+	free(pool);
+}
+
+/* Hints are dropped when threads fall behind, reading still works */
+static void prefetch_pool_push(PrefetchPool* pool, const char* path) {
+	size_t path_length = strlen(path);
+	if (path_length >= PREFETCH_POOL_PATH_SIZE) { return; }
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->length < PREFETCH_POOL_CAPACITY) {
+		memcpy(pool->paths[(pool->head + pool->length) % PREFETCH_POOL_CAPACITY], path, path_length + 1);
+		pool->length += 1;
+		pthread_cond_signal(&pool->condition);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/* io_uring */
+
+/* Creating ring and mapping its memory, without liburing */
+static int prefetch_ring_init(PrefetchRing* ring, unsigned entry_count) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	memset(ring, 0, sizeof(PrefetchRing));
+	ring->file = (int)syscall(__NR_io_uring_setup, entry_count, &params);
+	if (ring->file < 0) { return 0; }
+
+	ring->submission_memory_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->completion_memory_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	int is_single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (is_single_mmap && ring->completion_memory_size > ring->submission_memory_size) {
+		ring->submission_memory_size = ring->completion_memory_size;
+	}
+	ring->submission_memory = mmap(NULL, ring->submission_memory_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->file, IORING_OFF_SQ_RING);
+	if (ring->submission_memory == MAP_FAILED) {
+		close(ring->file);
+		return 0;
+	}
+	ring->completion_memory = ring->submission_memory;
+	if (!is_single_mmap) {
+		ring->completion_memory = mmap(NULL, ring->completion_memory_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->file, IORING_OFF_CQ_RING);
+	}
+	ring->entries_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->entries = mmap(NULL, ring->entries_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->file, IORING_OFF_SQES);
+	if (ring->completion_memory == MAP_FAILED || ring->entries == MAP_FAILED) {
+		if (ring->entries != MAP_FAILED) { munmap(ring->entries, ring->entries_size); }
+		if (ring->completion_memory != MAP_FAILED && !is_single_mmap) {
+			munmap(ring->completion_memory, ring->completion_memory_size);
+		}
+		munmap(ring->submission_memory, ring->submission_memory_size);
+		close(ring->file);
+		return 0;
+	}
+
+	char* submission = (char*)ring->submission_memory;
+	ring->submission_head = (unsigned*)(submission + params.sq_off.head);
+	ring->submission_tail = (unsigned*)(submission + params.sq_off.tail);
+	ring->submission_array = (unsigned*)(submission + params.sq_off.array);
+	ring->submission_mask = *(unsigned*)(submission + params.sq_off.ring_mask);
+	char* completion = (char*)ring->completion_memory;
+	ring->completion_head = (unsigned*)(completion + params.cq_off.head);
+	ring->completion_tail = (unsigned*)(completion + params.cq_off.tail);
+	ring->completions = (struct io_uring_cqe*)(completion + params.cq_off.cqes);
+	ring->completion_mask = *(unsigned*)(completion + params.cq_off.ring_mask);
+	return 1;
+}
+
+static void prefetch_ring_free(PrefetchRing* ring) {
+	munmap(ring->entries, ring->entries_size);
+	if (ring->completion_memory != ring->submission_memory) {
+		munmap(ring->completion_memory, ring->completion_memory_size);
+	}
+	munmap(ring->submission_memory, ring->submission_memory_size);
+	close(ring->file);
+}
+
+/* Submitting queued entries and optionally waiting for a completion */
+static int prefetch_ring_enter(PrefetchRing* ring, unsigned wait_count) {
+	unsigned flags = (wait_count > 0) ? IORING_ENTER_GETEVENTS : 0;
+	while (1) {
+		long submitted = syscall(__NR_io_uring_enter, ring->file, ring->pending_count, wait_count, flags, NULL, 0);
+		if (submitted >= 0) {
+			ring->pending_count -= ((unsigned)submitted < ring->pending_count) ? (unsigned)submitted
+				: ring->pending_count;
+			return 1;
+		}
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY) { return 0; }
+	}
+}
+
+/* Entries are taken in order, ring never holds more than depth requests */
+static struct io_uring_sqe* prefetch_ring_next(PrefetchRing* ring, PrefetchRequest* request, int operation) {
+	unsigned tail = *ring->submission_tail; // only written by this thread
+	unsigned index = tail & ring->submission_mask;
+	struct io_uring_sqe* entry = &ring->entries[index];
+	memset(entry, 0, sizeof(struct io_uring_sqe));
+	entry->user_data = (unsigned long long)(uintptr_t)request | (unsigned long long)operation;
+	ring->submission_array[index] = index;
+	prefetch_store(ring->submission_tail, tail + 1);
+	ring->pending_count += 1;
+	return entry;
+}
+
+/* Recording results of finished operations in their requests */
+static void prefetch_ring_reap(Prefetch* prefetch) {
+	PrefetchRing* ring = &prefetch->ring;
+	unsigned head = *ring->completion_head;
+	unsigned tail = prefetch_load(ring->completion_tail);
+	for (; head != tail; head++) {
+		struct io_uring_cqe* completion = &ring->completions[head & ring->completion_mask];
+		PrefetchRequest* request = (PrefetchRequest*)(uintptr_t)(completion->user_data & ~3ull);
+		int operation = (int)(completion->user_data & 3);
+		if (operation == PREFETCH_OPEN && completion->res < 0) {
+			request->error = -completion->res;
+		} else if (operation == PREFETCH_READ && request->error == 0) {
+			if (completion->res < 0) {
+				request->error = -completion->res;
+			} else {
+				request->length = (size_t)completion->res;
+			}
+		}
+		request->completion_count -= 1;
+		if (request->completion_count == 0) { prefetch->is_slot_used[request->slot] = 0; }
+	}
+	prefetch_store(ring->completion_head, head);
+}
+
+/* Prefetcher */
+
+int prefetch_is_io_uring_available(void) {
+	static atomic_int availability = 0; // 0 unknown, 1 available, 2 unavailable
+	int known = atomic_load(&availability);
+	if (known != 0) { return known == 1; }
+	PrefetchRing ring;
+	int is_available = prefetch_ring_init(&ring, 4);
+	if (is_available) { prefetch_ring_free(&ring); }
+	atomic_store(&availability, is_available ? 1 : 2);
+	return is_available;
+}
+
+Prefetch* prefetch_new(unsigned depth, PrefetchPool* pool) {
+	Prefetch* prefetch = calloc(1, sizeof(Prefetch));
+	if (prefetch == NULL) { return NULL; }
+	prefetch->is_slot_used = calloc(depth, 1);
+	prefetch->slot_count = depth;
+
+	/* One buffer for each slot, allocated when first lent */
+	prefetch->buffers = calloc(depth, sizeof(PrefetchBuffer));
+	prefetch->buffer_count = (prefetch->buffers != NULL) ? depth : 0;
+
+	/* Files opened by ring go straight into its own descriptor table, */
+	/* so that linked read and close can refer to them */
+	if (prefetch->is_slot_used != NULL && prefetch_ring_init(&prefetch->ring, depth * PREFETCH_OPERATION_COUNT)) {
+		int* files = malloc(depth * sizeof(int));
+		for (unsigned index = 0; files != NULL && index < depth; index++) { files[index] = -1; }
+		if (files != NULL && syscall(__NR_io_uring_register, prefetch->ring.file, IORING_REGISTER_FILES,
+			files, depth) == 0) {
+			prefetch->engine = PREFETCH_ENGINE_IO_URING;
+		} else {
+			prefetch_ring_free(&prefetch->ring);
+		}
+		free(files);
+	}
+	if (prefetch->engine == PREFETCH_ENGINE_NONE && pool != NULL) {
+		prefetch->engine = PREFETCH_ENGINE_THREADS;
+		prefetch->pool = pool;
+	}
+	return prefetch;
+}
+
+int prefetch_submit(Prefetch* prefetch, PrefetchRequest* request) {
+	request->data = NULL;
+	request->length = 0;
+	request->error = 0;
+	request->completion_count = 0;
+	if (prefetch->engine == PREFETCH_ENGINE_THREADS) {
+		prefetch_pool_push(prefetch->pool, request->path);
+		return 0;
+	}
+	if (prefetch->engine != PREFETCH_ENGINE_IO_URING) { return 0; }
+
+	unsigned slot = 0;
+	while (slot < prefetch->slot_count && prefetch->is_slot_used[slot]) { slot++; }
+	if (slot == prefetch->slot_count) { return 0; }
+	if (prefetch->buffer_count == 0) { return 0; }
+
+	/* Buffers grow geometrically, so that they soon fit every file and */
+	/* are then only reused */
+	PrefetchBuffer* buffer = &prefetch->buffers[prefetch->buffer_count - 1];
+	if (buffer->capacity < request->size + 1) {
+		size_t capacity = (buffer->capacity > 0) ? buffer->capacity * 2 : PREFETCH_BUFFER_MIN_SIZE;
+		while (capacity < request->size + 1) { capacity *= 2; }
+		char* data = realloc(buffer->data, capacity);
+		if (data == NULL) { return 0; }
+		buffer->data = data;
+		buffer->capacity = capacity;
+	}
+	request->data = buffer->data;
+	request->capacity = buffer->capacity;
+	*buffer = (PrefetchBuffer){0};
+	prefetch->buffer_count -= 1;
+	prefetch->is_slot_used[slot] = 1;
+	request->slot = slot;
+	request->completion_count = PREFETCH_OPERATION_COUNT;
+
+	/* Hard links keep the chain going after failures, so that the */
+	/* descriptor is always closed, even after a short read */
+	struct io_uring_sqe* open_entry = prefetch_ring_next(&prefetch->ring, request, PREFETCH_OPEN);
+	open_entry->opcode = IORING_OP_OPENAT;
+	open_entry->fd = AT_FDCWD;
+	open_entry->addr = (unsigned long long)(uintptr_t)request->path;
+	open_entry->open_flags = O_RDONLY | O_CLOEXEC;
+	open_entry->file_index = slot + 1;
+	open_entry->flags = IOSQE_IO_HARDLINK;
+
+	struct io_uring_sqe* read_entry = prefetch_ring_next(&prefetch->ring, request, PREFETCH_READ);
+	read_entry->opcode = IORING_OP_READ;
+	read_entry->fd = (int)slot;
+	read_entry->addr = (unsigned long long)(uintptr_t)request->data;
+	read_entry->len = (unsigned)(request->size + 1);
+	read_entry->off = 0;
+	read_entry->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+
+	struct io_uring_sqe* close_entry = prefetch_ring_next(&prefetch->ring, request, PREFETCH_CLOSE);
+	close_entry->opcode = IORING_OP_CLOSE;
+	close_entry->file_index = slot + 1;
+	return 1;
+}
+
+void prefetch_flush(Prefetch* prefetch) {
+	if (prefetch->engine == PREFETCH_ENGINE_IO_URING && prefetch->ring.pending_count > 0) {
+		prefetch_ring_enter(&prefetch->ring, 0);
+	}
+}
+
+int prefetch_wait(Prefetch* prefetch, PrefetchRequest* request) {
+	prefetch_ring_reap(prefetch);
+	while (request->completion_count > 0) {
+		if (!prefetch_ring_enter(&prefetch->ring, 1)) {
+			/* Ring is broken, kernel may still write into the buffer, */
+			/* so it is leaked instead of being freed by caller */
+			request->data = NULL;
+			request->error = EIO;
+			return 0;
+		}
+		prefetch_ring_reap(prefetch);
+	}
+	return request->error == 0;
+}
+
+void prefetch_release(Prefetch* prefetch, PrefetchRequest* request) {
+	if (request->data == NULL) { return; } // never lent, or leaked by broken ring
+	prefetch->buffers[prefetch->buffer_count].data = request->data;
+	prefetch->buffers[prefetch->buffer_count].capacity = request->capacity;
+	prefetch->buffer_count += 1;
+	request->data = NULL;
+}
+
+void prefetch_free(Prefetch* prefetch) {
+	if (prefetch == NULL) { return; }
+	if (prefetch->engine == PREFETCH_ENGINE_IO_URING) { prefetch_ring_free(&prefetch->ring); }
+	for (unsigned index = 0; index < prefetch->buffer_count; index++) { free(prefetch->buffers[index].data); }
+	free(prefetch->buffers);
+	free(prefetch->is_slot_used);
+	free(prefetch);
+}
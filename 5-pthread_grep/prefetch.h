@@ -0,0 +1,104 @@
+/* All header files need to be protected with preprocessor guards */
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stddef.h> // size_t
+#include <pthread.h> // pthread_t, pthread_mutex_t, pthread_cond_t
+
+/* Paths waiting for prefetch threads, more are dropped since they are */
+/* only hints */
+#define PREFETCH_POOL_CAPACITY 256
+/* Longer paths are not hinted, so that queued paths need no allocation */
+#define PREFETCH_POOL_PATH_SIZE 256
+
+/* How files are prefetched, chosen once when prefetcher is created */
+typedef enum PrefetchEngine {
+	PREFETCH_ENGINE_NONE,
+	PREFETCH_ENGINE_IO_URING, // files are opened, read and closed by kernel
+	PREFETCH_ENGINE_THREADS, // pool threads only fill page cache
+} PrefetchEngine;
+
+/* Always prefix structs with header name */
+/* Threads asking kernel to read files ahead with posix_fadvise() */
+/* Used when io_uring is unavailable, shared by all workers */
+typedef struct PrefetchPool {
+	pthread_t* threads;
+	int thread_count;
+	pthread_mutex_t mutex;
+	pthread_cond_t condition;
+	char paths[PREFETCH_POOL_CAPACITY][PREFETCH_POOL_PATH_SIZE]; // circular copies
+	size_t head;
+	size_t length;
+	int is_closed;
+} PrefetchPool;
+
+/* Memory mapped submission and completion rings of io_uring */
+typedef struct PrefetchRing {
+	int file;
+	void* submission_memory;
+	size_t submission_memory_size;
+	void* completion_memory; // same as submission memory on newer kernels
+	size_t completion_memory_size;
+	struct io_uring_sqe* entries;
+	size_t entries_size;
+	unsigned* submission_head;
+	unsigned* submission_tail;
+	unsigned* submission_array;
+	unsigned submission_mask;
+	unsigned* completion_head;
+	unsigned* completion_tail;
+	struct io_uring_cqe* completions;
+	unsigned completion_mask;
+	unsigned pending_count; // queued entries not yet submitted
+} PrefetchRing;
+
+/* File read ahead, owned by caller until prefetch_wait() returns */
+typedef struct PrefetchRequest {
+	const char* path;
+	size_t size; // expected size, one more byte is read to notice growth
+	char* data; // buffer of prefetcher, lent until prefetch_release()
+	size_t capacity;
+	size_t length; // bytes read
+	int error; // errno of failed open or read, 0 on success
+	int completion_count; // completions of linked operations still owed
+	unsigned slot; // registered file descriptor used by the request
+} PrefetchRequest;
+
+/* Read buffer kept by prefetcher, it only grows for larger files */
+typedef struct PrefetchBuffer {
+	char* data;
+	size_t capacity;
+} PrefetchBuffer;
+
+/* Prefetcher of a single worker thread, never shared */
+typedef struct Prefetch {
+	PrefetchEngine engine;
+	PrefetchRing ring;
+	unsigned slot_count;
+	unsigned char* is_slot_used;
+	PrefetchBuffer* buffers; // buffers not lent to requests
+	unsigned buffer_count;
+	PrefetchPool* pool;
+} Prefetch;
+
+/* Always prefix functions with header name */
+/* Tells once whether io_uring can be used at all */
+int prefetch_is_io_uring_available(void);
+PrefetchPool* prefetch_pool_new(int thread_count);
+void prefetch_pool_free(PrefetchPool* pool);
+/* Uses io_uring for up to 'depth' requests at once, or 'pool' when */
+/* io_uring is unavailable and 'pool' is not NULL */
+Prefetch* prefetch_new(unsigned depth, PrefetchPool* pool);
+/* Returns 1 if file will be read into request, 0 if it was at most */
+/* hinted, then caller reads it itself */
+int prefetch_submit(Prefetch* prefetch, PrefetchRequest* request);
+/* Submits queued requests with a single system call */
+void prefetch_flush(Prefetch* prefetch);
+/* Waits until submitted request is read, 0 if reading failed */
+/* Caller releases request afterwards in both cases */
+int prefetch_wait(Prefetch* prefetch, PrefetchRequest* request);
+/* Returns buffer of a finished request for later requests */
+void prefetch_release(Prefetch* prefetch, PrefetchRequest* request);
+void prefetch_free(Prefetch* prefetch);
+
+#endif
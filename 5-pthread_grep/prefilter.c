@@ -0,0 +1,168 @@
+#include "prefilter.h"
+
+#include <string.h> // memchr()
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // SSE2 and AVX2 intrinsics
+#define PREFILTER_X86
+#endif
+
+/* Approximate byte frequency ranks, 0 is the rarest and 255 the most */
+/* common byte, measured on a mix of English text, C source code and */
+/* Hebrew UTF-8 text. Control characters and unused UTF-8 lead bytes */
+/* are the rarest, space and lowercase vowels are the most common. */
+static const unsigned char prefilter_byte_ranks[256] = {
+	  0,   1,   2,   3,   4,   5,   6,   7,   8, 235, 243,   9,  10,  11,  12,  13,
+	 14,  15,  16,  17,  18,  19,  20,  21,  22,  23,  24,  25,  26,  27,  28,  29,
+	255, 161, 187, 174, 140, 154, 175, 184, 224, 225, 217, 179, 236, 205, 227, 216,
+	207, 222, 218, 211, 198, 182, 181, 178, 180, 177, 230, 229, 171, 221, 204, 158,
+	141, 223, 172, 183, 200, 212, 185, 199, 159, 215, 173, 147, 220, 186, 196, 213,
+	176, 148, 214, 206, 208, 188, 146, 157, 162, 149, 150, 169, 160, 167, 142, 234,
+	143, 252, 232, 240, 245, 254, 242, 238, 250, 247, 166, 219, 244, 239, 251, 249,
+	237, 168, 246, 248, 253, 241, 226, 233, 210, 231, 197, 201, 145, 202, 144,  30,
+	 31,  32,  33,  34,  35,  36,  37,  38,  39,  40,  41, 189,  42,  43,  44, 190,
+	209, 203,  45,  46, 163, 170,  47,  48,  49, 164,  50,  51, 151, 155, 152, 191,
+	 52,  53,  54,  55,  56, 153,  57,  58, 165, 156, 195,  59,  60,  61,  62,  63,
+	 64,  65,  66,  67,  68,  69,  70,  71, 192,  72,  73,  74,  75,  76,  77,  78,
+	 79,  80,  81,  82,  83,  84,  85,  86,  87,  88,  89,  90,  91,  92,  93,  94,
+	 95,  96,  97,  98,  99, 100, 101, 228, 102, 103, 104, 105, 106, 107, 108, 109,
+	110, 111, 112, 113, 114, 115, 116, 117, 118, 119, 120, 121, 122, 123, 124, 193,
+	194, 125, 126, 127, 128, 129, 130, 131, 132, 133, 134, 135, 136, 137, 138, 139,
+};
+
+/* Returns candidate if both bytes are present at their offsets */
+static int prefilter_is_candidate(const Prefilter* prefilter, const char* candidate) {
+	unsigned char first = (unsigned char)candidate[prefilter->first_offset] | prefilter->first_mask;
+	unsigned char second = (unsigned char)candidate[prefilter->second_offset] | prefilter->second_mask;
+	return first == prefilter->first_byte && second == prefilter->second_byte;
+}
+
+/* Portable implementation relying on memchr() for the rarest byte */
+static const char* prefilter_find_scalar(const Prefilter* prefilter, const char* text, size_t text_length) {
+	if (text_length < prefilter->pattern_length) { return NULL; }
+	const char* search_start = text + prefilter->first_offset;
+	const char* search_end = text + (text_length - prefilter->pattern_length) + prefilter->first_offset + 1;
+	/* Letters ignoring case can be upper or lower case, memchr() finds only one */
+	if (prefilter->first_mask != 0) {
+		for (; search_start < search_end; search_start++) {
+			if (prefilter_is_candidate(prefilter, search_start - prefilter->first_offset)) {
+				return search_start - prefilter->first_offset;
+			}
+		}
+		return NULL;
+	}
+	while (search_start < search_end) {
+		const char* found = memchr(search_start, prefilter->first_byte, (size_t)(search_end - search_start));
+		if (found == NULL) { return NULL; }
+		const char* candidate = found - prefilter->first_offset;
+		if (prefilter_is_candidate(prefilter, candidate)) { return candidate; }
+		search_start = found + 1;
+	}
+	return NULL;
+}
+
+#ifdef PREFILTER_X86
+/* Comparing 16 candidate positions at once, SSE2 is always present on x86-64 */
+__attribute__((target("sse2")))
+static const char* prefilter_find_sse2(const Prefilter* prefilter, const char* text, size_t text_length) {
+	if (text_length < prefilter->pattern_length) { return NULL; }
+	size_t candidate_count = text_length - prefilter->pattern_length + 1;
+	const __m128i first_bytes = _mm_set1_epi8((char)prefilter->first_byte);
+	const __m128i second_bytes = _mm_set1_epi8((char)prefilter->second_byte);
+	const __m128i first_mask = _mm_set1_epi8((char)prefilter->first_mask);
+	const __m128i second_mask = _mm_set1_epi8((char)prefilter->second_mask);
+
+	size_t position = 0;
+	for (; position + 16 <= candidate_count; position += 16) {
+		__m128i first = _mm_loadu_si128((const __m128i*)(text + position + prefilter->first_offset));
+		__m128i second = _mm_loadu_si128((const __m128i*)(text + position + prefilter->second_offset));
+		first = _mm_or_si128(first, first_mask);
+		second = _mm_or_si128(second, second_mask);
+		__m128i matches = _mm_and_si128(_mm_cmpeq_epi8(first, first_bytes), _mm_cmpeq_epi8(second, second_bytes));
+		int mask = _mm_movemask_epi8(matches);
+		if (mask != 0) { return text + position + __builtin_ctz((unsigned int)mask); }
+	}
+	for (; position < candidate_count; position++) {
+		if (prefilter_is_candidate(prefilter, text + position)) { return text + position; }
+	}
+	return NULL;
+}
+
+/* Comparing 32 candidate positions at once on CPUs supporting AVX2 */
+__attribute__((target("avx2")))
+static const char* prefilter_find_avx2(const Prefilter* prefilter, const char* text, size_t text_length) {
+	if (text_length < prefilter->pattern_length) { return NULL; }
+	size_t candidate_count = text_length - prefilter->pattern_length + 1;
+	const __m256i first_bytes = _mm256_set1_epi8((char)prefilter->first_byte);
+	const __m256i second_bytes = _mm256_set1_epi8((char)prefilter->second_byte);
+	const __m256i first_mask = _mm256_set1_epi8((char)prefilter->first_mask);
+	const __m256i second_mask = _mm256_set1_epi8((char)prefilter->second_mask);
+
+	size_t position = 0;
+	for (; position + 32 <= candidate_count; position += 32) {
+		__m256i first = _mm256_loadu_si256((const __m256i*)(text + position + prefilter->first_offset));
+		__m256i second = _mm256_loadu_si256((const __m256i*)(text + position + prefilter->second_offset));
+		first = _mm256_or_si256(first, first_mask);
+		second = _mm256_or_si256(second, second_mask);
+		__m256i matches = _mm256_and_si256(_mm256_cmpeq_epi8(first, first_bytes), _mm256_cmpeq_epi8(second, second_bytes));
+		unsigned int mask = (unsigned int)_mm256_movemask_epi8(matches);
+		if (mask != 0) { return text + position + __builtin_ctz(mask); }
+	}
+	/* Finishing remaining positions with narrower vectors */
+	return prefilter_find_sse2(prefilter, text + position, text_length - position);
+}
+#endif
+
+/* Letters ignoring case are as common as both of their cases together */
+static unsigned char prefilter_byte_rank(unsigned char byte, int ignore_case) {
+	unsigned char rank = prefilter_byte_ranks[byte];
+	if (ignore_case && byte >= 'a' && byte <= 'z' && prefilter_byte_ranks[byte - 32] > rank) {
+		rank = prefilter_byte_ranks[byte - 32];
+	}
+	return rank;
+}
+
+void prefilter_init(Prefilter* prefilter, const unsigned char* bytes, size_t length, int ignore_case) {
+	prefilter->pattern_length = length;
+
+	/* Picking the rarest byte, and the rarest byte at a different offset */
+	/* Single byte patterns simply test the same byte twice */
+	size_t first_offset = 0;
+	for (size_t index = 1; index < length; index++) {
+		if (prefilter_byte_rank(bytes[index], ignore_case) < prefilter_byte_rank(bytes[first_offset], ignore_case)) {
+			first_offset = index;
+		}
+	}
+	size_t second_offset = (first_offset == 0) ? length - 1 : 0;
+	for (size_t index = 0; index < length; index++) {
+		if (index == first_offset) { continue; }
+		if (prefilter_byte_rank(bytes[index], ignore_case) < prefilter_byte_rank(bytes[second_offset], ignore_case)) {
+			second_offset = index;
+		}
+	}
+	prefilter->first_byte = bytes[first_offset];
+	prefilter->first_offset = first_offset;
+	prefilter->second_byte = bytes[second_offset];
+	prefilter->second_offset = second_offset;
+
+	/* Upper case ASCII letters only differ from lower case in 0x20 bit */
+	int is_first_letter = bytes[first_offset] >= 'a' && bytes[first_offset] <= 'z';
+	int is_second_letter = bytes[second_offset] >= 'a' && bytes[second_offset] <= 'z';
+	prefilter->first_mask = (ignore_case && is_first_letter) ? 0x20 : 0;
+	prefilter->second_mask = (ignore_case && is_second_letter) ? 0x20 : 0;
+
+	/* __builtin_cpu_supports() checks CPUID bits cached at startup */
+	prefilter->find = &prefilter_find_scalar;
+#ifdef PREFILTER_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		prefilter->find = &prefilter_find_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		prefilter->find = &prefilter_find_sse2;
+	}
+#endif
+}
+
+const char* prefilter_find(const Prefilter* prefilter, const char* text, size_t text_length) {
+	return prefilter->find(prefilter, text, text_length);
+}
@@ -0,0 +1,26 @@
+/* All header files need to be protected with preprocessor guards */
+#ifndef PREFILTER_H
+#define PREFILTER_H
+
+#include <stddef.h> // size_t
+
+/* Candidate finder testing two rare pattern bytes at their offsets */
+/* Only positions where both bytes are present need full verification */
+typedef struct Prefilter {
+	size_t pattern_length;
+	unsigned char first_byte; // rarest byte of the pattern
+	unsigned char first_mask; // case bit of ASCII letters ignoring case
+	size_t first_offset;
+	unsigned char second_byte; // second rarest byte at another offset
+	unsigned char second_mask;
+	size_t second_offset;
+	/* Implementation chosen at runtime depending on CPU features */
+	const char* (*find)(const struct Prefilter* prefilter, const char* text, size_t text_length);
+} Prefilter;
+
+/* Always prefix functions with header name */
+/* Ignoring case requires pattern bytes to be folded to lower case */
+void prefilter_init(Prefilter* prefilter, const unsigned char* bytes, size_t length, int ignore_case);
+const char* prefilter_find(const Prefilter* prefilter, const char* text, size_t text_length);
+
+#endif
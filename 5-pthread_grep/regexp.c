@@ -0,0 +1,1329 @@
+#define _GNU_SOURCE // memrchr()
+#include "regexp.h"
+#include "utf8.h"
+#include "case_fold.h"
+
+#include <stdlib.h> // malloc(), calloc(), realloc(), free(), qsort(), abort()
+#include <string.h> // memchr(), memrchr(), memcpy(), memset()
+#include <wchar.h> // wchar_t, wint_t
+#include <wctype.h> // iswalnum(), iswalpha(), iswdigit(), iswspace(), ...
+
+/* This file implements regular expressions for regexp.h */
+/* Expressions are parsed into a syntax tree, compiled into Thompson NFA */
+/* programs reading UTF-8 bytes and searched with lazily built DFAs: */
+/* a forward DFA tells whether a line matches, a reverse DFA finds where */
+/* leftmost match starts and an anchored DFA finds where it ends */
+/* Empty matches are not reported as matches, but a line having only */
+/* empty matches is still selected, like GNU grep does */
+
+/* Characters above this have no case variants */
+#define REGEXP_MAX_CASED_CHARACTER 0x1E943
+#define REGEXP_MAX_CHARACTER 0x10FFFF
+
+/* Syntax tree node kinds */
+typedef enum RegexpNodeKind {
+	REGEXP_NODE_EMPTY,
+	REGEXP_NODE_CHARACTER,
+	REGEXP_NODE_CLASS,
+	REGEXP_NODE_CONCAT,
+	REGEXP_NODE_ALTERNATE,
+	REGEXP_NODE_REPEAT,
+	REGEXP_NODE_LINE_BEGIN,
+	REGEXP_NODE_LINE_END,
+} RegexpNodeKind;
+
+/* Inclusive range of characters */
+typedef struct RegexpRange {
+	uint32_t low;
+	uint32_t high;
+} RegexpRange;
+
+/* Growable set of character ranges, sorted and merged once complete */
+typedef struct RegexpClass {
+	RegexpRange* ranges;
+	size_t length;
+	size_t capacity;
+} RegexpClass;
+
+typedef struct RegexpNode {
+	RegexpNodeKind kind;
+	uint32_t character;
+	RegexpClass class;
+	int min; // repeat counts, 'max' is -1 when unbounded
+	int max;
+	struct RegexpNode** children;
+	size_t child_count;
+	size_t child_capacity;
+} RegexpNode;
+
+typedef struct RegexpParser {
+	const unsigned char* pattern;
+	size_t length;
+	size_t position;
+	int ignore_case;
+	int depth;
+	const char* error;
+} RegexpParser;
+
+/* Byte sequence matching a range of characters of equal UTF-8 length */
+typedef struct RegexpSequence {
+	size_t length;
+	uint8_t low[UTF8_MAX_LENGTH];
+	uint8_t high[UTF8_MAX_LENGTH];
+} RegexpSequence;
+
+typedef struct RegexpSequences {
+	RegexpSequence* sequences;
+	size_t length;
+	size_t capacity;
+} RegexpSequences;
+
+/* Alternative strings, every match contains at least one of them */
+typedef struct RegexpLiterals {
+	char** strings;
+	size_t* lengths;
+	size_t count; // 0 when nothing is known
+} RegexpLiterals;
+
+/* DFA state flags, computed from NFA states before consuming next byte */
+#define REGEXP_DFA_MATCH 1 // match ends right before next byte
+#define REGEXP_DFA_MATCH_AT_END 2 // same, if line ends here
+#define REGEXP_DFA_DEAD 4 // no NFA state is left
+#define REGEXP_DFA_EMPTY_MATCH 8 // start state only, empty match right here
+#define REGEXP_DFA_EMPTY_AT_END 16 // some match, maybe empty, ends here if line ends
+
+/* Lazily built DFA, each state is a sorted set of NFA instructions */
+/* Unanchored DFAs start a new NFA thread before every byte */
+typedef struct RegexpDfa {
+	const RegexpProgram* program;
+	const uint8_t* byte_classes;
+	size_t class_count;
+	int is_unanchored;
+	int32_t* transitions; // state_count * class_count, -1 until computed
+	uint8_t* flags;
+	size_t* set_offsets;
+	size_t* set_lengths;
+	uint32_t* sets; // NFA instructions of all states
+	size_t sets_length;
+	size_t sets_capacity;
+	size_t state_count;
+	size_t max_state_count;
+	int32_t* table; // hash table of state indices, -1 when free
+	size_t table_capacity;
+	int32_t start_states[2]; // inside line and at line start
+	size_t flush_count;
+
+	/* Scratch space for computing sets */
+	uint32_t* visited;
+	uint32_t generation;
+	uint32_t* stack;
+	uint32_t* set;
+	size_t set_length;
+} RegexpDfa;
+
+/* DFAs of a single thread */
+typedef struct RegexpCache {
+	RegexpDfa forward; // unanchored, tells whether line matches
+	RegexpDfa reverse; // unanchored, finds where matches start
+	RegexpDfa anchored; // finds longest match from start
+	uint8_t* starts; // whether a match starts at each byte of last line
+	size_t starts_capacity;
+} RegexpCache;
+
+/* Syntax tree */
+
+static RegexpNode* regexp_node_new(RegexpNodeKind kind) {
+	RegexpNode* node = calloc(1, sizeof(RegexpNode));
+	if (node != NULL) { node->kind = kind; }
+	return node;
+}
+
+static void regexp_node_free(RegexpNode* node) {
+	if (node == NULL) { return; }
+	for (size_t index = 0; index < node->child_count; index++) {
+		regexp_node_free(node->children[index]);
+	}
+	free(node->children);
+	free(node->class.ranges);
+	free(node);
+}
+
+static int regexp_node_append(RegexpNode* node, RegexpNode* child) {
+	if (node->child_count == node->child_capacity) {
+		size_t capacity = (node->child_capacity > 0) ? node->child_capacity * 2 : 4;
+		RegexpNode** children_copy = realloc(node->children, capacity * sizeof(RegexpNode*));
+		if (children_copy == NULL) { return 0; }
+		node->children = children_copy;
+		node->child_capacity = capacity;
+	}
+	node->children[node->child_count] = child;
+	node->child_count += 1;
+	return 1;
+}
+
+/* Character classes */
+
+static int regexp_class_add(RegexpClass* class, uint32_t low, uint32_t high) {
+	if (class->length == class->capacity) {
+		size_t capacity = (class->capacity > 0) ? class->capacity * 2 : 8;
+		RegexpRange* ranges_copy = realloc(class->ranges, capacity * sizeof(RegexpRange));
+		if (ranges_copy == NULL) { return 0; }
+		class->ranges = ranges_copy;
+		class->capacity = capacity;
+	}
+	class->ranges[class->length].low = low;
+	class->ranges[class->length].high = high;
+	class->length += 1;
+	return 1;
+}
+
+static int regexp_range_compare(const void* first, const void* second) {
+	const RegexpRange* first_range = (const RegexpRange*)first;
+	const RegexpRange* second_range = (const RegexpRange*)second;
+	return (first_range->low > second_range->low) - (first_range->low < second_range->low);
+}
+
+/* Sorting ranges and merging overlapping or adjacent ones */
+static void regexp_class_normalize(RegexpClass* class) {
+	if (class->length == 0) { return; }
+	qsort(class->ranges, class->length, sizeof(RegexpRange), &regexp_range_compare);
+	size_t length = 1;
+	for (size_t index = 1; index < class->length; index++) {
+		RegexpRange* last = &class->ranges[length - 1];
+		RegexpRange* range = &class->ranges[index];
+		if (range->low <= last->high + 1) {
+			if (range->high > last->high) { last->high = range->high; }
+		} else {
+			class->ranges[length++] = *range;
+		}
+	}
+	class->length = length;
+}
+
+/* Adding case variants of every character, before negating the class */
+static int regexp_class_fold(RegexpClass* class) {
+	size_t length = class->length;
+	for (size_t index = 0; index < length; index++) {
+		uint32_t high = class->ranges[index].high;
+		if (high > REGEXP_MAX_CASED_CHARACTER) { high = REGEXP_MAX_CASED_CHARACTER; }
+		for (uint32_t c = class->ranges[index].low; c <= high; c++) {
+			wchar_t variants[CASE_FOLD_MAX_VARIANTS];
+			size_t variant_count = case_fold_variants((wchar_t)c, variants);
+			for (size_t variant = 0; variant < variant_count; variant++) {
+				if ((uint32_t)variants[variant] == c) { continue; }
+				if (!regexp_class_add(class, (uint32_t)variants[variant], (uint32_t)variants[variant])) { return 0; }
+			}
+		}
+	}
+	regexp_class_normalize(class);
+	return 1;
+}
+
+/* Replacing normalized ranges with the characters they do not contain */
+static int regexp_class_negate(RegexpClass* class) {
+	RegexpClass negated = { NULL, 0, 0 };
+	uint32_t next = 0;
+	for (size_t index = 0; index < class->length; index++) {
+		if (class->ranges[index].low > next && !regexp_class_add(&negated, next, class->ranges[index].low - 1)) {
+			free(negated.ranges);
+			return 0;
+		}
+		next = class->ranges[index].high + 1;
+	}
+	if (next <= REGEXP_MAX_CHARACTER && !regexp_class_add(&negated, next, REGEXP_MAX_CHARACTER)) {
+		free(negated.ranges);
+		return 0;
+	}
+	free(class->ranges);
+	*class = negated;
+	return 1;
+}
+
+/* Lines never contain newlines, removing it keeps automata smaller */
+static int regexp_class_remove_newline(RegexpClass* class) {
+	for (size_t index = 0; index < class->length; index++) {
+		RegexpRange range = class->ranges[index];
+		if (range.low > '\n' || range.high < '\n') { continue; }
+		if (range.low == '\n' && range.high == '\n') {
+			memmove(&class->ranges[index], &class->ranges[index + 1],
+				(class->length - index - 1) * sizeof(RegexpRange));
+			class->length -= 1;
+		} else if (range.low == '\n') {
+			class->ranges[index].low = '\n' + 1;
+		} else if (range.high == '\n') {
+			class->ranges[index].high = '\n' - 1;
+		} else {
+			class->ranges[index].high = '\n' - 1;
+			if (!regexp_class_add(class, '\n' + 1, range.high)) { return 0; }
+			regexp_class_normalize(class);
+		}
+		break;
+	}
+	return 1;
+}
+
+static int regexp_is_word(wint_t c) {
+	return iswalnum(c) || c == L'_';
+}
+
+/* Adding all characters for which 'predicate' differs from 'is_inverted' */
+static int regexp_class_add_predicate(RegexpClass* class, int (*predicate)(wint_t), int is_inverted) {
+	uint32_t low = 0;
+	int is_inside = 0;
+	for (uint32_t c = 0; c <= REGEXP_MAX_CHARACTER + 1; c++) {
+		int is_member = (c <= REGEXP_MAX_CHARACTER) && ((predicate((wint_t)c) != 0) != is_inverted);
+		if (is_member && !is_inside) {
+			low = c;
+			is_inside = 1;
+		} else if (!is_member && is_inside) {
+			if (!regexp_class_add(class, low, c - 1)) { return 0; }
+			is_inside = 0;
+		}
+	}
+	return 1;
+}
+
+/* Parser */
+
+static RegexpNode* regexp_parse_alternate(RegexpParser* parser);
+
+static int regexp_parser_peek(const RegexpParser* parser) {
+	return (parser->position < parser->length) ? parser->pattern[parser->position] : -1;
+}
+
+/* Decoding next pattern character, invalid bytes become replacement characters */
+static uint32_t regexp_parser_next(RegexpParser* parser) {
+	wchar_t c;
+	parser->position += utf8_decode(parser->pattern + parser->position, parser->length - parser->position, &c);
+	return (uint32_t)c;
+}
+
+/* Parsing escapes usable both inside and outside of brackets */
+/* Returns 1 and fills class for class escapes, 0 for single characters */
+static int regexp_parse_escape(RegexpParser* parser, RegexpClass* class, uint32_t* character) {
+	uint32_t c = regexp_parser_next(parser);
+	int (*predicate)(wint_t) = NULL;
+	switch (c) {
+		case 'd': case 'D': predicate = &iswdigit; break;
+		case 'w': case 'W': predicate = &regexp_is_word; break;
+		case 's': case 'S': predicate = &iswspace; break;
+		case 't': *character = '\t'; return 0;
+		case 'n': *character = '\n'; return 0;
+		default: *character = c; return 0;
+	}
+	if (!regexp_class_add_predicate(class, predicate, c == 'D' || c == 'W' || c == 'S')) {
+		parser->error = "out of memory";
+	}
+	return 1;
+}
+
+/* Bracket expression like [a-z_], [^0-9] or [[:alpha:]] */
+static RegexpNode* regexp_parse_class(RegexpParser* parser) {
+	static const struct { const char* name; int (*predicate)(wint_t); } named_classes[] = {
+		{ "[:alpha:]", &iswalpha }, { "[:digit:]", &iswdigit }, { "[:alnum:]", &iswalnum },
+		{ "[:space:]", &iswspace }, { "[:upper:]", &iswupper }, { "[:lower:]", &iswlower },
+		{ "[:punct:]", &iswpunct }, { "[:xdigit:]", &iswxdigit },
+	};
+	RegexpNode* node = regexp_node_new(REGEXP_NODE_CLASS);
+	if (node == NULL) {
+		parser->error = "out of memory";
+		return NULL;
+	}
+	int is_negated = 0;
+	if (regexp_parser_peek(parser) == '^') {
+		is_negated = 1;
+		parser->position += 1;
+	}
+
+	/* Closing bracket right at the start is an ordinary character */
+	int is_first = 1;
+	while (parser->error == NULL) {
+		int c = regexp_parser_peek(parser);
+		if (c == -1) {
+			parser->error = "missing ]";
+			break;
+		}
+		if (c == ']' && !is_first) {
+			parser->position += 1;
+			break;
+		}
+		is_first = 0;
+
+		if (c == '[' && parser->position + 1 < parser->length && parser->pattern[parser->position + 1] == ':') {
+			size_t named_index = 0;
+			size_t count = sizeof(named_classes) / sizeof(named_classes[0]);
+			for (; named_index < count; named_index++) {
+				size_t name_length = strlen(named_classes[named_index].name);
+				if (parser->length - parser->position >= name_length
+					&& memcmp(parser->pattern + parser->position, named_classes[named_index].name, name_length) == 0) {
+					break;
+				}
+			}
+			if (named_index == count) {
+				parser->error = "unknown character class";
+				break;
+			}
+			parser->position += strlen(named_classes[named_index].name);
+			if (!regexp_class_add_predicate(&node->class, named_classes[named_index].predicate, 0)) {
+				parser->error = "out of memory";
+			}
+			continue;
+		}
+
+		uint32_t low;
+		if (c == '\\') {
+			parser->position += 1;
+			if (regexp_parser_peek(parser) == -1) {
+				parser->error = "trailing backslash";
+				break;
+			}
+			if (regexp_parse_escape(parser, &node->class, &low)) { continue; }
+		} else {
+			low = regexp_parser_next(parser);
+		}
+
+		/* Range unless dash is the last character before closing bracket */
+		uint32_t high = low;
+		if (regexp_parser_peek(parser) == '-' && parser->position + 1 < parser->length
+			&& parser->pattern[parser->position + 1] != ']') {
+			parser->position += 1;
+			if (regexp_parser_peek(parser) == '\\') {
+				parser->position += 1;
+				if (regexp_parser_peek(parser) == -1) {
+					parser->error = "trailing backslash";
+					break;
+				}
+			}
+			high = regexp_parser_next(parser);
+			if (high < low) {
+				parser->error = "invalid character range";
+				break;
+			}
+		}
+		if (!regexp_class_add(&node->class, low, high)) { parser->error = "out of memory"; }
+	}
+	if (parser->error != NULL) {
+		regexp_node_free(node);
+		return NULL;
+	}
+
+	regexp_class_normalize(&node->class);
+	int is_built = !parser->ignore_case || regexp_class_fold(&node->class);
+	is_built = is_built && (!is_negated || regexp_class_negate(&node->class));
+	is_built = is_built && regexp_class_remove_newline(&node->class);
+	if (!is_built) {
+		parser->error = "out of memory";
+		regexp_node_free(node);
+		return NULL;
+	}
+	return node;
+}
+
+/* Single character, group, class, dot or anchor */
+static RegexpNode* regexp_parse_atom(RegexpParser* parser) {
+	int c = regexp_parser_peek(parser);
+	RegexpNode* node = NULL;
+	switch (c) {
+		case '(':
+			parser->position += 1;
+			if (++parser->depth > REGEXP_MAX_DEPTH) {
+				parser->error = "too deeply nested";
+				return NULL;
+			}
+			node = regexp_parse_alternate(parser);
+			parser->depth -= 1;
+			if (node == NULL) { return NULL; }
+			if (regexp_parser_peek(parser) != ')') {
+				parser->error = "missing )";
+				regexp_node_free(node);
+				return NULL;
+			}
+			parser->position += 1;
+			return node;
+		case '*':
+		case '+':
+		case '?':
+			parser->error = "nothing to repeat";
+			return NULL;
+		case '[':
+			parser->position += 1;
+			return regexp_parse_class(parser);
+		case '.':
+			parser->position += 1;
+			node = regexp_node_new(REGEXP_NODE_CLASS);
+			if (node != NULL && (!regexp_class_add(&node->class, 0, REGEXP_MAX_CHARACTER)
+				|| !regexp_class_remove_newline(&node->class))) {
+				regexp_node_free(node);
+				node = NULL;
+			}
+			break;
+		case '^':
+			parser->position += 1;
+			node = regexp_node_new(REGEXP_NODE_LINE_BEGIN);
+			break;
+		case '$':
+			parser->position += 1;
+			node = regexp_node_new(REGEXP_NODE_LINE_END);
+			break;
+		case '\\': {
+			parser->position += 1;
+			if (regexp_parser_peek(parser) == -1) {
+				parser->error = "trailing backslash";
+				return NULL;
+			}
+			RegexpClass class = { NULL, 0, 0 };
+			uint32_t character;
+			if (regexp_parse_escape(parser, &class, &character)) {
+				if (parser->error != NULL) {
+					free(class.ranges);
+					return NULL;
+				}
+				node = regexp_node_new(REGEXP_NODE_CLASS);
+				if (node == NULL) {
+					free(class.ranges);
+					break;
+				}
+				node->class = class;
+				regexp_class_normalize(&node->class);
+				if (!regexp_class_remove_newline(&node->class)) {
+					regexp_node_free(node);
+					node = NULL;
+				}
+			} else {
+				node = regexp_node_new(REGEXP_NODE_CHARACTER);
+				if (node != NULL) { node->character = character; }
+			}
+			break;
+		}
+		default:
+			node = regexp_node_new(REGEXP_NODE_CHARACTER);
+			if (node != NULL) { node->character = regexp_parser_next(parser); }
+			break;
+	}
+	if (node == NULL) { parser->error = "out of memory"; }
+	return node;
+}
+
+/* Parsing '{m}', '{m,}' or '{m,n}', brace without counts is a character */
+static int regexp_parse_bounds(RegexpParser* parser, int* min, int* max) {
+	size_t position = parser->position + 1;
+	long numbers[2] = { -1, -1 };
+	int number_count = 0;
+	int has_comma = 0;
+	while (position < parser->length) {
+		unsigned char c = parser->pattern[position];
+		if (c >= '0' && c <= '9') {
+			long* number = &numbers[has_comma];
+			*number = (*number < 0 ? 0 : *number) * 10 + (c - '0');
+			if (*number > REGEXP_MAX_REPEAT) {
+				parser->error = "repetition count too large";
+				return 0;
+			}
+		} else if (c == ',' && !has_comma) {
+			has_comma = 1;
+		} else if (c == '}') {
+			break;
+		} else {
+			return 0;
+		}
+		position += 1;
+	}
+	number_count = (numbers[0] >= 0) + (numbers[1] >= 0);
+	if (position == parser->length || numbers[0] < 0 || number_count == 0) { return 0; }
+	*min = (int)numbers[0];
+	*max = has_comma ? (int)numbers[1] : (int)numbers[0];
+	if (*max >= 0 && *max < *min) {
+		parser->error = "invalid repetition count";
+		return 0;
+	}
+	parser->position = position + 1;
+	return 1;
+}
+
+/* Atom followed by any number of repetition operators */
+static RegexpNode* regexp_parse_repeat(RegexpParser* parser) {
+	RegexpNode* node = regexp_parse_atom(parser);
+	while (node != NULL) {
+		int c = regexp_parser_peek(parser);
+		int min, max;
+		if (c == '*') {
+			min = 0;
+			max = -1;
+		} else if (c == '+') {
+			min = 1;
+			max = -1;
+		} else if (c == '?') {
+			min = 0;
+			max = 1;
+		} else if (c == '{' && regexp_parse_bounds(parser, &min, &max)) {
+			parser->position -= 1; // bounds were consumed, closing brace is skipped below
+		} else {
+			break;
+		}
+		parser->position += 1;
+
+		RegexpNode* repeat = regexp_node_new(REGEXP_NODE_REPEAT);
+		if (repeat == NULL || !regexp_node_append(repeat, node)) {
+			regexp_node_free(repeat);
+			regexp_node_free(node);
+			parser->error = "out of memory";
+			return NULL;
+		}
+		repeat->min = min;
+		repeat->max = max;
+		node = repeat;
+	}
+	if (node != NULL && parser->error != NULL) {
+		regexp_node_free(node);
+		return NULL;
+	}
+	return node;
+}
+
+static RegexpNode* regexp_parse_concat(RegexpParser* parser) {
+	RegexpNode* node = regexp_node_new(REGEXP_NODE_CONCAT);
+	if (node == NULL) {
+		parser->error = "out of memory";
+		return NULL;
+	}
+	while (parser->position < parser->length && regexp_parser_peek(parser) != '|'
+		&& regexp_parser_peek(parser) != ')') {
+		RegexpNode* child = regexp_parse_repeat(parser);
+		if (child == NULL || !regexp_node_append(node, child)) {
+			if (child != NULL) { parser->error = "out of memory"; }
+			regexp_node_free(child);
+			regexp_node_free(node);
+			return NULL;
+		}
+	}
+	if (node->child_count == 0) { node->kind = REGEXP_NODE_EMPTY; }
+	return node;
+}
+
+static RegexpNode* regexp_parse_alternate(RegexpParser* parser) {
+	RegexpNode* node = regexp_node_new(REGEXP_NODE_ALTERNATE);
+	if (node == NULL) {
+		parser->error = "out of memory";
+		return NULL;
+	}
+	while (1) {
+		RegexpNode* child = regexp_parse_concat(parser);
+		if (child == NULL || !regexp_node_append(node, child)) {
+			if (child != NULL) { parser->error = "out of memory"; }
+			regexp_node_free(child);
+			regexp_node_free(node);
+			return NULL;
+		}
+		if (regexp_parser_peek(parser) != '|') { break; }
+		parser->position += 1;
+	}
+	return node;
+}
+
+/* Byte sequences of character ranges */
+
+static int regexp_sequences_add(RegexpSequences* sequences, uint32_t low, uint32_t high) {
+	if (sequences->length == sequences->capacity) {
+		size_t capacity = (sequences->capacity > 0) ? sequences->capacity * 2 : 8;
+		RegexpSequence* sequences_copy = realloc(sequences->sequences, capacity * sizeof(RegexpSequence));
+		if (sequences_copy == NULL) { return 0; }
+		sequences->sequences = sequences_copy;
+		sequences->capacity = capacity;
+	}
+	char low_bytes[UTF8_MAX_LENGTH];
+	char high_bytes[UTF8_MAX_LENGTH];
+	RegexpSequence* sequence = &sequences->sequences[sequences->length];
+	sequence->length = utf8_encode((wchar_t)low, low_bytes);
+	utf8_encode((wchar_t)high, high_bytes);
+	for (size_t index = 0; index < sequence->length; index++) {
+		sequence->low[index] = (uint8_t)low_bytes[index];
+		sequence->high[index] = (uint8_t)high_bytes[index];
+	}
+	sequences->length += 1;
+	return 1;
+}
+
+/* Splitting character range until every part is a sequence of byte */
+/* ranges, following the approach of RE2 and Rust's utf8-ranges */
+static int regexp_sequences_split(RegexpSequences* sequences, uint32_t low, uint32_t high) {
+	if (low > high) { return 1; }
+	/* Surrogates are not valid characters in UTF-8 */
+	if (low <= 0xDFFF && high >= 0xD800) {
+		return (low >= 0xD800 || regexp_sequences_split(sequences, low, 0xD7FF))
+			&& (high <= 0xDFFF || regexp_sequences_split(sequences, 0xE000, high));
+	}
+	/* Encoded length must be the same at both ends */
+	static const uint32_t length_limits[] = { 0x7F, 0x7FF, 0xFFFF };
+	for (size_t index = 0; index < 3; index++) {
+		uint32_t limit = length_limits[index];
+		if (low <= limit && limit < high) {
+			return regexp_sequences_split(sequences, low, limit)
+				&& regexp_sequences_split(sequences, limit + 1, high);
+		}
+	}
+	if (high <= 0x7F) { return regexp_sequences_add(sequences, low, high); }
+	/* Continuation bytes must cover their full range except in the first */
+	/* byte that differs */
+	for (uint32_t index = 1; index < UTF8_MAX_LENGTH; index++) {
+		uint32_t mask = (1u << (6 * index)) - 1;
+		if ((low & ~mask) != (high & ~mask)) {
+			if ((low & mask) != 0) {
+				return regexp_sequences_split(sequences, low, low | mask)
+					&& regexp_sequences_split(sequences, (low | mask) + 1, high);
+			}
+			if ((high & mask) != mask) {
+				return regexp_sequences_split(sequences, low, (high & ~mask) - 1)
+					&& regexp_sequences_split(sequences, high & ~mask, high);
+			}
+		}
+	}
+	return regexp_sequences_add(sequences, low, high);
+}
+
+/* Compiler, instructions are emitted backwards from where they continue */
+
+static uint32_t regexp_emit(RegexpProgram* program, RegexpOperation operation, uint8_t low, uint8_t high,
+	uint32_t next, uint32_t alternative) {
+	if (program->is_failed) { return 0; }
+	if (program->length == program->capacity) {
+		size_t capacity = (program->capacity > 0) ? program->capacity * 2 : 64;
+		RegexpInstruction* instructions_copy = NULL;
+		if (capacity <= REGEXP_MAX_INSTRUCTIONS) {
+			instructions_copy = realloc(program->instructions, capacity * sizeof(RegexpInstruction));
+		}
+		if (instructions_copy == NULL) {
+			program->is_failed = 1;
+			return 0;
+		}
+		program->instructions = instructions_copy;
+		program->capacity = capacity;
+	}
+	RegexpInstruction* instruction = &program->instructions[program->length];
+	instruction->operation = operation;
+	instruction->low = low;
+	instruction->high = high;
+	instruction->next = next;
+	instruction->alternative = alternative;
+	return (uint32_t)program->length++;
+}
+
+/* Alternation of byte sequences, reversed programs read them backwards */
+static uint32_t regexp_compile_class(RegexpProgram* program, const RegexpClass* class, uint32_t next,
+	int is_reverse) {
+	RegexpSequences sequences = { NULL, 0, 0 };
+	for (size_t index = 0; index < class->length; index++) {
+		if (!regexp_sequences_split(&sequences, class->ranges[index].low, class->ranges[index].high)) {
+			program->is_failed = 1;
+		}
+	}
+	if (sequences.length == 0) {
+		/* Empty class never matches, an empty byte range keeps no thread */
+		free(sequences.sequences);
+		return regexp_emit(program, REGEXP_BYTE_RANGE, 1, 0, next, 0);
+	}
+	uint32_t start = 0;
+	for (size_t index = 0; index < sequences.length; index++) {
+		const RegexpSequence* sequence = &sequences.sequences[index];
+		uint32_t sequence_start = next;
+		for (size_t byte = 0; byte < sequence->length; byte++) {
+			size_t byte_index = is_reverse ? byte : sequence->length - 1 - byte;
+			sequence_start = regexp_emit(program, REGEXP_BYTE_RANGE, sequence->low[byte_index],
+				sequence->high[byte_index], sequence_start, 0);
+		}
+		start = (index == 0) ? sequence_start : regexp_emit(program, REGEXP_SPLIT, 0, 0, sequence_start, start);
+	}
+	free(sequences.sequences);
+	return start;
+}
+
+static uint32_t regexp_compile_node(RegexpProgram* program, const RegexpNode* node, uint32_t next,
+	int is_reverse, int ignore_case) {
+	switch (node->kind) {
+		case REGEXP_NODE_EMPTY:
+			return next;
+		case REGEXP_NODE_CHARACTER: {
+			RegexpClass class = { NULL, 0, 0 };
+			if (!regexp_class_add(&class, node->character, node->character)
+				|| (ignore_case && !regexp_class_fold(&class))) {
+				program->is_failed = 1;
+			}
+			uint32_t start = regexp_compile_class(program, &class, next, is_reverse);
+			free(class.ranges);
+			return start;
+		}
+		case REGEXP_NODE_CLASS:
+			return regexp_compile_class(program, &node->class, next, is_reverse);
+		case REGEXP_NODE_CONCAT:
+			for (size_t index = 0; index < node->child_count; index++) {
+				size_t child_index = is_reverse ? index : node->child_count - 1 - index;
+				next = regexp_compile_node(program, node->children[child_index], next, is_reverse, ignore_case);
+			}
+			return next;
+		case REGEXP_NODE_ALTERNATE: {
+			uint32_t start = regexp_compile_node(program, node->children[0], next, is_reverse, ignore_case);
+			for (size_t index = 1; index < node->child_count; index++) {
+				uint32_t child_start = regexp_compile_node(program, node->children[index], next, is_reverse, ignore_case);
+				start = regexp_emit(program, REGEXP_SPLIT, 0, 0, child_start, start);
+			}
+			return start;
+		}
+		case REGEXP_NODE_REPEAT: {
+			const RegexpNode* child = node->children[0];
+			uint32_t start = next;
+			if (node->max < 0) {
+				/* Loop back to a split choosing between another round and leaving */
+				uint32_t split = regexp_emit(program, REGEXP_SPLIT, 0, 0, next, next);
+				uint32_t child_start = regexp_compile_node(program, child, split, is_reverse, ignore_case);
+				if (!program->is_failed) { program->instructions[split].next = child_start; }
+				start = split;
+			} else {
+				for (int count = node->min; count < node->max; count++) {
+					uint32_t child_start = regexp_compile_node(program, child, start, is_reverse, ignore_case);
+					start = regexp_emit(program, REGEXP_SPLIT, 0, 0, child_start, start);
+				}
+			}
+			for (int count = 0; count < node->min; count++) {
+				start = regexp_compile_node(program, child, start, is_reverse, ignore_case);
+			}
+			return start;
+		}
+		case REGEXP_NODE_LINE_BEGIN:
+			return regexp_emit(program, is_reverse ? REGEXP_LINE_END : REGEXP_LINE_BEGIN, 0, 0, next, 0);
+		case REGEXP_NODE_LINE_END:
+			return regexp_emit(program, is_reverse ? REGEXP_LINE_BEGIN : REGEXP_LINE_END, 0, 0, next, 0);
+	}
+	return next;
+}
+
+static int regexp_compile(RegexpProgram* program, const RegexpNode* root, int is_reverse, int ignore_case) {
+	uint32_t match = regexp_emit(program, REGEXP_MATCH, 0, 0, 0, 0);
+	program->start = regexp_compile_node(program, root, match, is_reverse, ignore_case);
+	return !program->is_failed;
+}
+
+/* Bytes at which any byte range starts or ends begin a new class */
+static void regexp_compute_byte_classes(Regexp* regexp) {
+	uint8_t is_boundary[257] = {0};
+	const RegexpProgram* programs[2] = { &regexp->forward, &regexp->reverse };
+	for (size_t program_index = 0; program_index < 2; program_index++) {
+		const RegexpProgram* program = programs[program_index];
+		for (size_t index = 0; index < program->length; index++) {
+			const RegexpInstruction* instruction = &program->instructions[index];
+			if (instruction->operation != REGEXP_BYTE_RANGE || instruction->low > instruction->high) { continue; }
+			is_boundary[instruction->low] = 1;
+			is_boundary[instruction->high + 1] = 1;
+		}
+	}
+	size_t class = 0;
+	for (size_t byte = 0; byte < 256; byte++) {
+		if (byte > 0 && is_boundary[byte]) { class += 1; }
+		regexp->byte_classes[byte] = (uint8_t)class;
+	}
+	regexp->class_count = class + 1;
+}
+
+/* Required literals */
+
+static void regexp_literals_free(RegexpLiterals* literals) {
+	for (size_t index = 0; index < literals->count; index++) {
+		free(literals->strings[index]);
+	}
+	free(literals->strings);
+	free(literals->lengths);
+	literals->strings = NULL;
+	literals->lengths = NULL;
+	literals->count = 0;
+}
+
+static RegexpLiterals regexp_literals_single(const char* string, size_t length) {
+	RegexpLiterals literals = { malloc(sizeof(char*)), malloc(sizeof(size_t)), 1 };
+	if (literals.strings != NULL) { literals.strings[0] = malloc(length); }
+	if (literals.strings == NULL || literals.lengths == NULL || literals.strings[0] == NULL) {
+		if (literals.strings != NULL) { free(literals.strings[0]); }
+		free(literals.strings);
+		free(literals.lengths);
+		return (RegexpLiterals){ NULL, NULL, 0 };
+	}
+	memcpy(literals.strings[0], string, length);
+	literals.lengths[0] = length;
+	return literals;
+}
+
+/* Shortest alternative decides how selective literals are */
+static size_t regexp_literals_score(const RegexpLiterals* literals) {
+	if (literals->count == 0) { return 0; }
+	size_t score = literals->lengths[0];
+	for (size_t index = 1; index < literals->count; index++) {
+		if (literals->lengths[index] < score) { score = literals->lengths[index]; }
+	}
+	return score;
+}
+
+/* Keeping better of two literal sets in 'best', freeing the other */
+static void regexp_literals_keep_better(RegexpLiterals* best, RegexpLiterals* candidate) {
+	size_t best_score = regexp_literals_score(best);
+	size_t candidate_score = regexp_literals_score(candidate);
+	if (candidate_score > best_score || (candidate_score == best_score && candidate->count < best->count
+		&& candidate->count > 0)) {
+		regexp_literals_free(best);
+		*best = *candidate;
+	} else {
+		regexp_literals_free(candidate);
+	}
+}
+
+/* Finding strings at least one of which every match must contain */
+static RegexpLiterals regexp_extract_literals(const RegexpNode* node) {
+	RegexpLiterals none = { NULL, NULL, 0 };
+	switch (node->kind) {
+		case REGEXP_NODE_CHARACTER: {
+			char bytes[UTF8_MAX_LENGTH];
+			size_t length = utf8_encode((wchar_t)node->character, bytes);
+			return regexp_literals_single(bytes, length);
+		}
+		case REGEXP_NODE_CONCAT: {
+			/* Consecutive characters are joined into one longer string */
+			RegexpLiterals best = none;
+			char* run = malloc(node->child_count * UTF8_MAX_LENGTH);
+			if (run == NULL) { return none; }
+			size_t run_length = 0;
+			for (size_t index = 0; index <= node->child_count; index++) {
+				const RegexpNode* child = (index < node->child_count) ? node->children[index] : NULL;
+				if (child != NULL && child->kind == REGEXP_NODE_CHARACTER) {
+					run_length += utf8_encode((wchar_t)child->character, run + run_length);
+					continue;
+				}
+				if (run_length > 0) {
+					RegexpLiterals candidate = regexp_literals_single(run, run_length);
+					regexp_literals_keep_better(&best, &candidate);
+					run_length = 0;
+				}
+				if (child != NULL) {
+					RegexpLiterals candidate = regexp_extract_literals(child);
+					regexp_literals_keep_better(&best, &candidate);
+				}
+			}
+			free(run);
+			return best;
+		}
+		case REGEXP_NODE_ALTERNATE: {
+			RegexpLiterals literals = none;
+			for (size_t index = 0; index < node->child_count; index++) {
+				RegexpLiterals child = regexp_extract_literals(node->children[index]);
+				size_t count = literals.count + child.count;
+				char** strings = NULL;
+				size_t* lengths = NULL;
+				if (child.count > 0 && count <= REGEXP_MAX_LITERALS) {
+					strings = realloc(literals.strings, count * sizeof(char*));
+					if (strings != NULL) { literals.strings = strings; }
+					lengths = realloc(literals.lengths, count * sizeof(size_t));
+					if (lengths != NULL) { literals.lengths = lengths; }
+				}
+				if (strings == NULL || lengths == NULL) {
+					/* Any alternative without literals can match anything */
+					regexp_literals_free(&child);
+					regexp_literals_free(&literals);
+					return none;
+				}
+				memcpy(literals.strings + literals.count, child.strings, child.count * sizeof(char*));
+				memcpy(literals.lengths + literals.count, child.lengths, child.count * sizeof(size_t));
+				literals.count = count;
+				free(child.strings);
+				free(child.lengths);
+			}
+			return literals;
+		}
+		case REGEXP_NODE_REPEAT:
+			return (node->min > 0) ? regexp_extract_literals(node->children[0]) : none;
+		default:
+			return none;
+	}
+}
+
+/* Lazy DFA */
+
+static void regexp_dfa_free(RegexpDfa* dfa) {
+	free(dfa->transitions);
+	free(dfa->flags);
+	free(dfa->set_offsets);
+	free(dfa->set_lengths);
+	free(dfa->sets);
+	free(dfa->table);
+	free(dfa->visited);
+	free(dfa->stack);
+	free(dfa->set);
+}
+
+/* Emptying all states, used once the cache is full */
+static void regexp_dfa_flush(RegexpDfa* dfa) {
+	dfa->state_count = 0;
+	dfa->sets_length = 0;
+	memset(dfa->table, 0xFF, dfa->table_capacity * sizeof(int32_t));
+	dfa->start_states[0] = -1;
+	dfa->start_states[1] = -1;
+	dfa->flush_count += 1;
+}
+
+/* All memory is allocated up front, so searching never fails later */
+static int regexp_dfa_init(RegexpDfa* dfa, const Regexp* regexp, const RegexpProgram* program, int is_unanchored) {
+	memset(dfa, 0, sizeof(RegexpDfa));
+	dfa->program = program;
+	dfa->byte_classes = regexp->byte_classes;
+	dfa->class_count = regexp->class_count;
+	dfa->is_unanchored = is_unanchored;
+	dfa->max_state_count = REGEXP_DFA_CACHE_SIZE / (dfa->class_count * sizeof(int32_t));
+	if (dfa->max_state_count > REGEXP_DFA_MAX_STATES) { dfa->max_state_count = REGEXP_DFA_MAX_STATES; }
+	if (dfa->max_state_count < 16) { dfa->max_state_count = 16; }
+	dfa->table_capacity = 1;
+	while (dfa->table_capacity < dfa->max_state_count * 2) { dfa->table_capacity *= 2; }
+	dfa->sets_capacity = REGEXP_DFA_CACHE_SIZE / sizeof(uint32_t);
+	if (dfa->sets_capacity < program->length * 4) { dfa->sets_capacity = program->length * 4; }
+
+	dfa->transitions = malloc(dfa->max_state_count * dfa->class_count * sizeof(int32_t));
+	dfa->flags = malloc(dfa->max_state_count);
+	dfa->set_offsets = malloc(dfa->max_state_count * sizeof(size_t));
+	dfa->set_lengths = malloc(dfa->max_state_count * sizeof(size_t));
+	dfa->sets = malloc(dfa->sets_capacity * sizeof(uint32_t));
+	dfa->table = malloc(dfa->table_capacity * sizeof(int32_t));
+	dfa->visited = calloc(program->length, sizeof(uint32_t));
+	dfa->stack = malloc((program->length * 2 + 2) * sizeof(uint32_t));
+	dfa->set = malloc(program->length * sizeof(uint32_t));
+	if (dfa->transitions == NULL || dfa->flags == NULL || dfa->set_offsets == NULL || dfa->set_lengths == NULL
+		|| dfa->sets == NULL || dfa->table == NULL || dfa->visited == NULL || dfa->stack == NULL || dfa->set == NULL) {
+		regexp_dfa_free(dfa);
+		return 0;
+	}
+	regexp_dfa_flush(dfa);
+	return 1;
+}
+
+/* Adding instruction and everything reachable without consuming a byte */
+/* Only instructions that consume bytes, match or wait for line end are kept */
+static void regexp_dfa_closure(RegexpDfa* dfa, uint32_t start, int is_line_begin) {
+	const RegexpInstruction* instructions = dfa->program->instructions;
+	size_t stack_length = 0;
+	dfa->stack[stack_length++] = start;
+	while (stack_length > 0) {
+		uint32_t index = dfa->stack[--stack_length];
+		if (dfa->visited[index] == dfa->generation) { continue; }
+		dfa->visited[index] = dfa->generation;
+		const RegexpInstruction* instruction = &instructions[index];
+		switch (instruction->operation) {
+			case REGEXP_BYTE_RANGE:
+			case REGEXP_MATCH:
+			case REGEXP_LINE_END:
+				dfa->set[dfa->set_length++] = index;
+				break;
+			case REGEXP_SPLIT:
+				dfa->stack[stack_length++] = instruction->alternative;
+				dfa->stack[stack_length++] = instruction->next;
+				break;
+			case REGEXP_LINE_BEGIN:
+				if (is_line_begin) { dfa->stack[stack_length++] = instruction->next; }
+				break;
+		}
+	}
+}
+
+/* Checking whether match is reached once line end assertions hold */
+static int regexp_dfa_matches_at_end(RegexpDfa* dfa, size_t set_length) {
+	const RegexpInstruction* instructions = dfa->program->instructions;
+	dfa->generation += 1;
+	size_t stack_length = 0;
+	for (size_t index = 0; index < set_length; index++) {
+		dfa->stack[stack_length++] = dfa->set[index];
+		while (stack_length > 0) {
+			uint32_t instruction_index = dfa->stack[--stack_length];
+			if (dfa->visited[instruction_index] == dfa->generation) { continue; }
+			dfa->visited[instruction_index] = dfa->generation;
+			const RegexpInstruction* instruction = &instructions[instruction_index];
+			if (instruction->operation == REGEXP_MATCH) { return 1; }
+			if (instruction->operation == REGEXP_LINE_END) {
+				dfa->stack[stack_length++] = instruction->next;
+			} else if (instruction->operation == REGEXP_SPLIT) {
+				dfa->stack[stack_length++] = instruction->alternative;
+				dfa->stack[stack_length++] = instruction->next;
+			}
+		}
+	}
+	return 0;
+}
+
+static int regexp_instruction_compare(const void* first, const void* second) {
+	uint32_t first_index = *(const uint32_t*)first;
+	uint32_t second_index = *(const uint32_t*)second;
+	return (first_index > second_index) - (first_index < second_index);
+}
+
+static size_t regexp_dfa_hash(const uint32_t* set, size_t length, uint8_t flags) {
+	size_t hash = 14695981039346656037u ^ flags; // FNV-1a
+	for (size_t index = 0; index < length; index++) {
+		hash = (hash ^ set[index]) * 1099511628211u;
+	}
+	return hash;
+}
+
+/* Finding state with the set in scratch space, adding it when missing */
+/* Cache is flushed when full, which invalidates all earlier indices */
+static int32_t regexp_dfa_state(RegexpDfa* dfa, uint8_t flags) {
+	qsort(dfa->set, dfa->set_length, sizeof(uint32_t), &regexp_instruction_compare);
+	if (dfa->set_length == 0) { flags |= REGEXP_DFA_DEAD; }
+	size_t hash = regexp_dfa_hash(dfa->set, dfa->set_length, flags);
+	size_t slot = hash & (dfa->table_capacity - 1);
+	while (dfa->table[slot] >= 0) {
+		int32_t state = dfa->table[slot];
+		if (dfa->flags[state] == flags && dfa->set_lengths[state] == dfa->set_length
+			&& memcmp(dfa->sets + dfa->set_offsets[state], dfa->set, dfa->set_length * sizeof(uint32_t)) == 0) {
+			return state;
+		}
+		slot = (slot + 1) & (dfa->table_capacity - 1);
+	}
+
+	if (dfa->state_count == dfa->max_state_count || dfa->sets_length + dfa->set_length > dfa->sets_capacity) {
+		regexp_dfa_flush(dfa);
+		slot = hash & (dfa->table_capacity - 1);
+	}
+	int32_t state = (int32_t)dfa->state_count++;
+	dfa->flags[state] = flags;
+	dfa->set_offsets[state] = dfa->sets_length;
+	dfa->set_lengths[state] = dfa->set_length;
+	memcpy(dfa->sets + dfa->sets_length, dfa->set, dfa->set_length * sizeof(uint32_t));
+	dfa->sets_length += dfa->set_length;
+	memset(dfa->transitions + (size_t)state * dfa->class_count, 0xFF, dfa->class_count * sizeof(int32_t));
+	dfa->table[slot] = state;
+	return state;
+}
+
+/* State before first byte, at start of line or anywhere inside it */
+static int32_t regexp_dfa_start(RegexpDfa* dfa, int is_line_begin) {
+	if (dfa->start_states[is_line_begin] >= 0) { return dfa->start_states[is_line_begin]; }
+	dfa->generation += 1;
+	dfa->set_length = 0;
+	regexp_dfa_closure(dfa, dfa->program->start, is_line_begin);
+
+	/* Empty matches only select lines, they never start or end a span */
+	uint8_t flags = 0;
+	for (size_t index = 0; index < dfa->set_length; index++) {
+		if (dfa->program->instructions[dfa->set[index]].operation == REGEXP_MATCH) { flags |= REGEXP_DFA_EMPTY_MATCH; }
+	}
+	if (regexp_dfa_matches_at_end(dfa, dfa->set_length)) { flags |= REGEXP_DFA_EMPTY_AT_END; }
+	int32_t state = regexp_dfa_state(dfa, flags);
+	dfa->start_states[is_line_begin] = state;
+	return state;
+}
+
+/* Computing transition that is not cached yet */
+static int32_t regexp_dfa_compute(RegexpDfa* dfa, int32_t state, uint8_t byte) {
+	const RegexpInstruction* instructions = dfa->program->instructions;
+	const uint32_t* set = dfa->sets + dfa->set_offsets[state];
+	size_t set_length = dfa->set_lengths[state];
+
+	dfa->generation += 1;
+	dfa->set_length = 0;
+	for (size_t index = 0; index < set_length; index++) {
+		const RegexpInstruction* instruction = &instructions[set[index]];
+		if (instruction->operation == REGEXP_BYTE_RANGE && instruction->low <= byte && byte <= instruction->high) {
+			regexp_dfa_closure(dfa, instruction->next, 0);
+		}
+	}
+
+	/* Flags only describe threads that consumed at least one byte */
+	uint8_t flags = 0;
+	size_t consumed_length = dfa->set_length;
+	for (size_t index = 0; index < consumed_length; index++) {
+		if (instructions[dfa->set[index]].operation == REGEXP_MATCH) { flags |= REGEXP_DFA_MATCH; }
+	}
+	if (dfa->is_unanchored) { regexp_dfa_closure(dfa, dfa->program->start, 0); }
+	if (regexp_dfa_matches_at_end(dfa, consumed_length)) { flags |= REGEXP_DFA_MATCH_AT_END; }
+	if (dfa->set_length > consumed_length && regexp_dfa_matches_at_end(dfa, dfa->set_length)) {
+		flags |= REGEXP_DFA_EMPTY_AT_END;
+	}
+
+	size_t flush_count = dfa->flush_count;
+	int32_t next_state = regexp_dfa_state(dfa, flags);
+	if (dfa->flush_count == flush_count) {
+		dfa->transitions[(size_t)state * dfa->class_count + dfa->byte_classes[byte]] = next_state;
+	}
+	return next_state;
+}
+
+static int32_t regexp_dfa_next(RegexpDfa* dfa, int32_t state, uint8_t byte) {
+	int32_t next_state = dfa->transitions[(size_t)state * dfa->class_count + dfa->byte_classes[byte]];
+	return (next_state >= 0) ? next_state : regexp_dfa_compute(dfa, state, byte);
+}
+
+/* Per-thread caches */
+
+static void regexp_cache_free(void* pointer) {
+	RegexpCache* cache = (RegexpCache*)pointer;
+	if (cache == NULL) { return; }
+	regexp_dfa_free(&cache->forward);
+	regexp_dfa_free(&cache->reverse);
+	regexp_dfa_free(&cache->anchored);
+	free(cache->starts);
+	free(cache);
+}
+
+static RegexpCache* regexp_cache(const Regexp* regexp) {
+	RegexpCache* cache = pthread_getspecific(regexp->cache_key);
+	if (cache != NULL) { return cache; }
+	cache = calloc(1, sizeof(RegexpCache));
+	if (cache == NULL || !regexp_dfa_init(&cache->forward, regexp, &regexp->forward, 1)) {
+		abort(); // search can not continue without automata
+	}
+	if (!regexp_dfa_init(&cache->reverse, regexp, &regexp->reverse, 1)
+		|| !regexp_dfa_init(&cache->anchored, regexp, &regexp->forward, 0)) {
+		abort();
+	}
+	pthread_setspecific(regexp->cache_key, cache);
+	return cache;
+}
+
+/* Searching */
+
+/* Running unanchored DFA until first match ends, empty matches count */
+/* Empty match inside a line can't depend on ^ or $, so it also matches */
+/* at line start, only empty matches at line end need reading the line */
+static int regexp_line_matches(RegexpDfa* dfa, const unsigned char* line, size_t line_length) {
+	int32_t state = regexp_dfa_start(dfa, 1);
+	if (dfa->flags[state] & REGEXP_DFA_EMPTY_MATCH) { return 1; }
+	for (size_t index = 0; index < line_length; index++) {
+		state = regexp_dfa_next(dfa, state, line[index]);
+		if (dfa->flags[state] & REGEXP_DFA_MATCH) { return 1; }
+	}
+	return (dfa->flags[state] & (REGEXP_DFA_MATCH_AT_END | REGEXP_DFA_EMPTY_AT_END)) != 0;
+}
+
+/* Reading line backwards from its end, every position where reverse */
+/* DFA matches is a start of some match, whatever matched before it */
+static void regexp_cache_find_starts(RegexpCache* cache, const unsigned char* line, size_t line_length) {
+	if (line_length > cache->starts_capacity) {
+		free(cache->starts);
+		cache->starts = malloc(line_length);
+		if (cache->starts == NULL) { abort(); } // search can not continue without automata
+		cache->starts_capacity = line_length;
+	}
+	RegexpDfa* reverse = &cache->reverse;
+	int32_t state = regexp_dfa_start(reverse, 1);
+	for (size_t index = line_length; index > 0; index--) {
+		state = regexp_dfa_next(reverse, state, line[index - 1]);
+		cache->starts[index - 1] = (reverse->flags[state] & REGEXP_DFA_MATCH) != 0;
+	}
+	if (line_length > 0 && (reverse->flags[state] & REGEXP_DFA_MATCH_AT_END)) { cache->starts[0] = 1; }
+}
+
+static int regexp_cache_find_in_line(RegexpCache* cache, const unsigned char* line, size_t line_length,
+	size_t position, size_t* match_offset, size_t* match_length) {
+	/* Starts are found once for the whole line, later positions reuse them */
+	if (position == 0) { regexp_cache_find_starts(cache, line, line_length); }
+	size_t start = position;
+	while (start < line_length && !cache->starts[start]) { start += 1; }
+	if (start == line_length) { return 0; }
+
+	/* Longest match from leftmost start ends where anchored DFA last matched */
+	RegexpDfa* anchored = &cache->anchored;
+	int32_t state = regexp_dfa_start(anchored, start == 0);
+	size_t end = start;
+	size_t index = start;
+	for (; index < line_length; index++) {
+		state = regexp_dfa_next(anchored, state, line[index]);
+		if (anchored->flags[state] & REGEXP_DFA_DEAD) { break; }
+		if (anchored->flags[state] & REGEXP_DFA_MATCH) { end = index + 1; }
+	}
+	if (index == line_length && (anchored->flags[state] & REGEXP_DFA_MATCH_AT_END)) { end = line_length; }
+	if (end == start) { return 0; }
+
+	*match_offset = start;
+	*match_length = end - start;
+	return 1;
+}
+
+Regexp* regexp_new(const char* pattern, size_t length, int ignore_case, const char** error) {
+	RegexpParser parser = { (const unsigned char*)pattern, length, 0, ignore_case, 0, NULL };
+	RegexpNode* root = regexp_parse_alternate(&parser);
+	if (root != NULL && parser.position < parser.length) { parser.error = "unmatched )"; }
+	if (parser.error != NULL) {
+		regexp_node_free(root);
+		*error = parser.error;
+		return NULL;
+	}
+
+	Regexp* regexp = calloc(1, sizeof(Regexp));
+	if (regexp == NULL || pthread_key_create(&regexp->cache_key, &regexp_cache_free) != 0) {
+		free(regexp);
+		regexp_node_free(root);
+		*error = "out of memory";
+		return NULL;
+	}
+	if (!regexp_compile(&regexp->forward, root, 0, ignore_case)
+		|| !regexp_compile(&regexp->reverse, root, 1, ignore_case)) {
+		regexp_node_free(root);
+		regexp_free(regexp);
+		*error = "expression too large";
+		return NULL;
+	}
+	regexp_compute_byte_classes(regexp);
+
+	/* Lines without any required literal are never given to the DFA */
+	RegexpLiterals literals = regexp_extract_literals(root);
+	if (literals.count == 1) {
+		regexp->literal = literal_new(literals.strings[0], literals.lengths[0], ignore_case);
+	} else if (literals.count > 1) {
+		regexp->literals = aho_corasick_new(literals.strings, literals.lengths, literals.count, ignore_case);
+	}
+	regexp_literals_free(&literals);
+	regexp_node_free(root);
+	return regexp;
+}
+
+const char* regexp_find_line(const Regexp* regexp, const char* text, size_t text_length) {
+	RegexpCache* cache = regexp_cache(regexp);
+	size_t position = 0;
+	while (position < text_length) {
+		/* Jumping to the line with next required literal */
+		size_t line_start = position;
+		if (regexp->literal != NULL || regexp->literals != NULL) {
+			size_t literal_length = 0; // unused
+			size_t pattern_index = 0;
+			const char* candidate = (regexp->literal != NULL)
+				? literal_find(regexp->literal, text + position, text_length - position, &literal_length)
+				: aho_corasick_find(regexp->literals, text + position, text_length - position,
+					&literal_length, &pattern_index);
+			if (candidate == NULL) { return NULL; }
+			const char* newline = memrchr(text + position, '\n', (size_t)(candidate - (text + position)));
+			if (newline != NULL) { line_start = (size_t)(newline - text) + 1; }
+		}
+		const char* newline = memchr(text + line_start, '\n', text_length - line_start);
+		size_t line_end = (newline != NULL) ? (size_t)(newline - text) : text_length;
+
+		if (regexp_line_matches(&cache->forward, (const unsigned char*)text + line_start, line_end - line_start)) {
+			return text + line_start;
+		}
+		position = line_end + 1;
+	}
+	return NULL;
+}
+
+int regexp_matches_line(const Regexp* regexp, const char* line, size_t line_length) {
+	return regexp_line_matches(&regexp_cache(regexp)->forward, (const unsigned char*)line, line_length);
+}
+
+int regexp_find_in_line(const Regexp* regexp, const char* line, size_t line_length, size_t position,
+	size_t* match_offset, size_t* match_length) {
+	if (position >= line_length) { return 0; }
+	return regexp_cache_find_in_line(regexp_cache(regexp), (const unsigned char*)line, line_length, position,
+		match_offset, match_length);
+}
+
+void regexp_free(Regexp* regexp) {
+	if (regexp == NULL) { return; }
+	/* Caches of other threads were freed when they exited */
+	regexp_cache_free(pthread_getspecific(regexp->cache_key));
+	pthread_setspecific(regexp->cache_key, NULL);
+	pthread_key_delete(regexp->cache_key);
+	free(regexp->forward.instructions);
+	free(regexp->reverse.instructions);
+	if (regexp->literal != NULL) { literal_free(regexp->literal); }
+	if (regexp->literals != NULL) { aho_corasick_free(regexp->literals); }
+	free(regexp);
+}
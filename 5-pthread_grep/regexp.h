@@ -0,0 +1,81 @@
+/* All header files need to be protected with preprocessor guards */
+/* Named regexp.h so that it is never confused with POSIX <regex.h> */
+#ifndef REGEXP_H
+#define REGEXP_H
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint8_t, uint32_t
+#include <pthread.h> // pthread_key_t
+#include "literal.h"
+#include "aho_corasick.h"
+
+/* Limits keeping compiled programs and lazily built automata bounded */
+#define REGEXP_MAX_INSTRUCTIONS 100000
+#define REGEXP_MAX_REPEAT 1000
+#define REGEXP_MAX_DEPTH 1000
+/* Required literals with more alternatives are not used as prefilter */
+#define REGEXP_MAX_LITERALS 16
+/* Transition table of each lazy DFA is emptied when it would grow */
+/* past this size or this many states, and built again from scratch */
+#define REGEXP_DFA_CACHE_SIZE (1024 * 1024)
+#define REGEXP_DFA_MAX_STATES 4096
+
+/* Instruction of Thompson NFA, epsilon moves only follow SPLIT and */
+/* line assertions, so matching never backtracks */
+typedef enum RegexpOperation {
+	REGEXP_BYTE_RANGE, // consumes one byte between 'low' and 'high'
+	REGEXP_SPLIT, // continues at both 'next' and 'alternative'
+	REGEXP_LINE_BEGIN, // continues only at start of line
+	REGEXP_LINE_END, // continues only at end of line
+	REGEXP_MATCH,
+} RegexpOperation;
+
+/* Always prefix structs with header name */
+typedef struct RegexpInstruction {
+	RegexpOperation operation;
+	uint8_t low;
+	uint8_t high;
+	uint32_t next;
+	uint32_t alternative;
+} RegexpInstruction;
+
+/* Program matching UTF-8 bytes, reverse program reads lines backwards */
+typedef struct RegexpProgram {
+	RegexpInstruction* instructions;
+	size_t length;
+	size_t capacity;
+	uint32_t start;
+	int is_failed; // too many instructions or no memory
+} RegexpProgram;
+
+/* Compiled regular expression, only read by all threads */
+/* Each thread builds its own DFA from programs on demand, so that */
+/* threads never wait for each other */
+typedef struct Regexp {
+	RegexpProgram forward;
+	RegexpProgram reverse;
+	uint8_t byte_classes[256]; // bytes no instruction tells apart share a class
+	size_t class_count;
+	LiteralPattern* literal; // text every match contains, NULL if unknown
+	AhoCorasick* literals; // used instead when there are alternatives
+	pthread_key_t cache_key; // DFA caches of each thread
+} Regexp;
+
+/* Always prefix functions with header name */
+/* Parses POSIX extended syntax with \d \w \s escapes, sets 'error' */
+/* and returns NULL for invalid expressions */
+Regexp* regexp_new(const char* pattern, size_t length, int ignore_case, const char** error);
+/* Finds start of first line with a match, text may have several lines */
+/* and no match spans a newline */
+const char* regexp_find_line(const Regexp* regexp, const char* text, size_t text_length);
+/* Tells whether a single line has a match, which may be empty */
+int regexp_matches_line(const Regexp* regexp, const char* line, size_t line_length);
+/* Finds leftmost longest non-empty match in a single line starting at */
+/* or after 'position', so that ^ still refers to start of the line */
+/* Line must be searched from position 0 first, later positions reuse */
+/* work done for the whole line then */
+int regexp_find_in_line(const Regexp* regexp, const char* line, size_t line_length, size_t position,
+	size_t* match_offset, size_t* match_length);
+void regexp_free(Regexp* regexp);
+
+#endif
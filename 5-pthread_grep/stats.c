@@ -0,0 +1,91 @@
+#include "stats.h"
+
+#include <stdio.h> // fprintf()
+#include <time.h> // clock_gettime()
+
+/* This file implements --stats counters for stats.h */
+
+/* Initializing global variables declared in stats.h */
+int stats_enabled_G = 0;
+_Thread_local Stats stats_local_G;
+
+uint64_t stats_now(void) {
+	if (!stats_enabled_G) { return 0; }
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+void stats_add(Stats* total, const Stats* stats) {
+	total->file_count += stats->file_count;
+	total->byte_count += stats->byte_count;
+	total->line_count += stats->line_count;
+	total->candidate_count += stats->candidate_count;
+	total->matching_line_count += stats->matching_line_count;
+	total->allocation_count += stats->allocation_count;
+	total->steady_allocation_count += stats->steady_allocation_count;
+	total->queue_wait_nanoseconds += stats->queue_wait_nanoseconds;
+	total->writer_hold_nanoseconds += stats->writer_hold_nanoseconds;
+	total->open_nanoseconds += stats->open_nanoseconds;
+	total->read_nanoseconds += stats->read_nanoseconds;
+	total->search_nanoseconds += stats->search_nanoseconds;
+}
+
+/* Times are summed over threads, so they can exceed elapsed time */
+void stats_print(const Stats* stats, StatsFormat format) {
+	double allocations_per_file = (stats->file_count > 0)
+		? (double)stats->allocation_count / (double)stats->file_count : 0.0;
+	if (format == STATS_FORMAT_JSON) {
+		fprintf(stderr, "{\"threads\": %d, \"elapsed_ns\": %llu, \"files\": %zu, \"bytes\": %zu, "
+			"\"lines\": %zu, \"candidate_lines\": %zu, \"matching_lines\": %zu, "
+			"\"queue_wait_ns\": %llu, \"writer_hold_ns\": %llu, \"open_ns\": %llu, "
+			"\"read_ns\": %llu, \"search_ns\": %llu, \"allocations\": %zu, "
+			"\"allocations_per_file\": %.2f, \"steady_allocations\": %zu}\n",
+			stats->thread_count, (unsigned long long)stats->elapsed_nanoseconds,
+			stats->file_count, stats->byte_count, stats->line_count,
+			stats->candidate_count, stats->matching_line_count,
+			(unsigned long long)stats->queue_wait_nanoseconds,
+			(unsigned long long)stats->writer_hold_nanoseconds,
+			(unsigned long long)stats->open_nanoseconds,
+			(unsigned long long)stats->read_nanoseconds,
+			(unsigned long long)stats->search_nanoseconds,
+			stats->allocation_count, allocations_per_file, stats->steady_allocation_count);
+		return;
+	}
+	fprintf(stderr, "Statistics of %d threads in %.3f ms:\n", stats->thread_count,
+		(double)stats->elapsed_nanoseconds / 1e6);
+	fprintf(stderr, "  files: %zu, bytes: %zu, lines: %zu\n",
+		stats->file_count, stats->byte_count, stats->line_count);
+	fprintf(stderr, "  candidate lines: %zu, matching lines: %zu\n",
+		stats->candidate_count, stats->matching_line_count);
+	fprintf(stderr, "  waiting for jobs: %.3f ms\n", (double)stats->queue_wait_nanoseconds / 1e6);
+	fprintf(stderr, "  holding writer mutex: %.3f ms\n", (double)stats->writer_hold_nanoseconds / 1e6);
+	fprintf(stderr, "  opening files: %.3f ms\n", (double)stats->open_nanoseconds / 1e6);
+	fprintf(stderr, "  reading files: %.3f ms\n", (double)stats->read_nanoseconds / 1e6);
+	fprintf(stderr, "  searching: %.3f ms\n", (double)stats->search_nanoseconds / 1e6);
+	fprintf(stderr, "  allocations: %zu, %.2f per file, %zu after first file of each thread\n",
+		stats->allocation_count, allocations_per_file, stats->steady_allocation_count);
+}
+
+/* Counting allocations by wrapping glibc allocator functions */
+/* Definitions in the program replace those of libc for all callers */
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* pointer, size_t size);
+
+void* malloc(size_t size) {
+	stats_local_G.allocation_count += (size_t)stats_enabled_G;
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+	stats_local_G.allocation_count += (size_t)stats_enabled_G;
+	return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size) {
+	stats_local_G.allocation_count += (size_t)stats_enabled_G;
+	return __libc_realloc(pointer, size);
+}
+#endif
@@ -0,0 +1,47 @@
+/* All header files need to be protected with preprocessor guards */
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint64_t
+
+/* How collected statistics are printed to stderr */
+typedef enum StatsFormat {
+	STATS_FORMAT_NONE, // nothing is collected
+	STATS_FORMAT_TEXT,
+	STATS_FORMAT_JSON,
+} StatsFormat;
+
+/* Always prefix structs with header name */
+/* Counters of a single thread, summed once threads are joined */
+/* Each thread only updates its own copy, so no locking is needed */
+typedef struct Stats {
+	size_t file_count;
+	size_t byte_count; // bytes searched, read() or mapped
+	size_t line_count;
+	size_t candidate_count; // lines found by the fast search
+	size_t matching_line_count; // candidate lines verified by grep_string()
+	size_t allocation_count; // malloc(), calloc() and realloc() calls
+	size_t steady_allocation_count; // allocations of searching threads after their first file
+	uint64_t queue_wait_nanoseconds; // blocked in job_queue_pop()
+	uint64_t writer_hold_nanoseconds; // holding writer mutex
+	uint64_t open_nanoseconds; // open(), fstat() and close()
+	uint64_t read_nanoseconds; // read() and mmap(), page faults are not included
+	uint64_t search_nanoseconds; // searching lines already in memory
+	uint64_t elapsed_nanoseconds; // only set for totals
+	int thread_count; // only set for totals
+} Stats;
+
+/* Declaring global variables, check stats.c */
+/* Set once before searching, counters stay zero without it */
+extern int stats_enabled_G;
+/* Counters of calling thread */
+extern _Thread_local Stats stats_local_G;
+
+/* Always prefix functions with header name */
+/* Monotonic time in nanoseconds, 0 when statistics are disabled */
+uint64_t stats_now(void);
+void stats_add(Stats* total, const Stats* stats);
+void stats_print(const Stats* stats, StatsFormat format);
+
+#endif
@@ -0,0 +1,551 @@
+#include "trigram.h"
+#include "walker.h"
+#include "decompress.h"
+
+#include <stdlib.h> // malloc(), calloc(), realloc(), free(), qsort()
+#include <stdio.h> // fopen(), fwrite(), fclose(), snprintf(), rename(), remove()
+#include <string.h> // memcpy(), memcmp(), strcmp(), strlen(), strdup()
+#include <pthread.h> // pthread_mutex_t, pthread_key_t
+#include <stdatomic.h> // atomic_int
+#include <fcntl.h> // open()
+#include <unistd.h> // close()
+#include <sys/mman.h> // mmap(), munmap()
+#include <sys/stat.h> // stat(), fstat(), S_ISREG()
+
+/* This file implements trigram index for trigram.h */
+/* Other structs and functions declared here are limited to this file! */
+/* Use 'static' to declare local functions and local global variables */
+
+/* Every possible trigram has one bit in set of trigrams seen in a file */
+#define TRIGRAM_COUNT (1u << 24)
+
+/* Index stores ASCII letters in lower case, so that the same index */
+/* serves searches with and without ignoring case */
+static uint32_t trigram_fold(unsigned char c) {
+	return (c >= 'A' && c <= 'Z') ? (uint32_t)(c + 32) : (uint32_t)c;
+}
+
+/* Path relative to indexed directory, NULL if path is outside of it */
+static const char* trigram_relative_path(const char* directory, size_t directory_length, const char* path) {
+	if (strncmp(path, directory, directory_length) != 0) { return NULL; }
+	path += directory_length;
+	while (*path == '/') { path++; }
+	return path;
+}
+
+/* Building */
+
+/* Distinct trigrams of a file, reused by the same walker thread */
+typedef struct TrigramScratch {
+	uint64_t* is_seen; // one bit per trigram, cleared after every file
+	uint32_t* trigrams; // trigrams set in is_seen
+	size_t trigram_capacity;
+} TrigramScratch;
+
+/* File found by walker, id is its position in builder */
+typedef struct TrigramBuildFile {
+	char* path; // relative to indexed directory
+	uint64_t size;
+	int64_t mtime_seconds;
+	int64_t mtime_nanoseconds;
+	uint32_t id; // final id once files are sorted by path
+} TrigramBuildFile;
+
+/* Shared by walker threads, which only hold mutex to append results */
+typedef struct TrigramBuilder {
+	const char* directory;
+	size_t directory_length;
+	pthread_key_t scratch_key;
+	pthread_mutex_t mutex;
+	TrigramBuildFile* files;
+	size_t file_count;
+	size_t file_capacity;
+	uint64_t* postings; // trigram in high half, file id in low half
+	size_t posting_count;
+	size_t posting_capacity;
+	int is_failed;
+} TrigramBuilder;
+
+static void trigram_scratch_free(void* pointer) {
+	TrigramScratch* scratch = (TrigramScratch*)pointer;
+	if (scratch == NULL) { return; }
+	free(scratch->is_seen);
+	free(scratch->trigrams);
+	free(scratch);
+}
+
+static TrigramScratch* trigram_scratch(TrigramBuilder* builder) {
+	TrigramScratch* scratch = pthread_getspecific(builder->scratch_key);
+	if (scratch != NULL) { return scratch; }
+	scratch = calloc(1, sizeof(TrigramScratch));
+	if (scratch == NULL) { return NULL; }
+	scratch->is_seen = calloc(TRIGRAM_COUNT / 64, sizeof(uint64_t));
+	if (scratch->is_seen == NULL || pthread_setspecific(builder->scratch_key, scratch) != 0) {
+		trigram_scratch_free(scratch);
+		return NULL;
+	}
+	return scratch;
+}
+
+/* Collecting distinct trigrams of file contents into scratch */
+static int trigram_scratch_collect(TrigramScratch* scratch, const unsigned char* data, size_t size,
+	size_t* trigram_count) {
+	*trigram_count = 0;
+	if (size < 3) { return 1; }
+	uint32_t trigram = (trigram_fold(data[0]) << 8) | trigram_fold(data[1]);
+	for (size_t index = 2; index < size; index++) {
+		trigram = ((trigram << 8) | trigram_fold(data[index])) & (TRIGRAM_COUNT - 1);
+		uint64_t bit = (uint64_t)1 << (trigram & 63);
+		if (scratch->is_seen[trigram >> 6] & bit) { continue; }
+		scratch->is_seen[trigram >> 6] |= bit;
+		if (*trigram_count == scratch->trigram_capacity) {
+			size_t capacity = (scratch->trigram_capacity > 0) ? scratch->trigram_capacity * 2 : 4096;
+			uint32_t* trigrams_copy = realloc(scratch->trigrams, capacity * sizeof(uint32_t));
+			if (trigrams_copy == NULL) { return 0; }
+			scratch->trigrams = trigrams_copy;
+			scratch->trigram_capacity = capacity;
+		}
+		scratch->trigrams[(*trigram_count)++] = trigram;
+	}
+	return 1;
+}
+
+/* Appending file and its trigrams, holding builder mutex */
+static int trigram_builder_add(TrigramBuilder* builder, TrigramBuildFile* file,
+	const uint32_t* trigrams, size_t trigram_count) {
+	if (builder->file_count == builder->file_capacity) {
+		size_t capacity = (builder->file_capacity > 0) ? builder->file_capacity * 2 : 256;
+		TrigramBuildFile* files_copy = realloc(builder->files, capacity * sizeof(TrigramBuildFile));
+		if (files_copy == NULL) { return 0; }
+		builder->files = files_copy;
+		builder->file_capacity = capacity;
+	}
+	if (builder->posting_count + trigram_count > builder->posting_capacity) {
+		size_t capacity = (builder->posting_capacity > 0) ? builder->posting_capacity : 65536;
+		while (capacity < builder->posting_count + trigram_count) { capacity *= 2; }
+		uint64_t* postings_copy = realloc(builder->postings, capacity * sizeof(uint64_t));
+		if (postings_copy == NULL) { return 0; }
+		builder->postings = postings_copy;
+		builder->posting_capacity = capacity;
+	}
+	uint32_t id = (uint32_t)builder->file_count;
+	file->id = id;
+	builder->files[builder->file_count++] = *file;
+	for (size_t index = 0; index < trigram_count; index++) {
+		builder->postings[builder->posting_count++] = ((uint64_t)trigrams[index] << 32) | id;
+	}
+	return 1;
+}
+
+/* Called from walker threads, reads file and records its trigrams */
+static void trigram_builder_visit(void* context, char* path) {
+	TrigramBuilder* builder = (TrigramBuilder*)context;
+	const char* relative_path = trigram_relative_path(builder->directory, builder->directory_length, path);
+	if (relative_path == NULL || strcmp(relative_path, TRIGRAM_INDEX_FILE_NAME) == 0) {
+		free(path);
+		return;
+	}
+
+	TrigramBuildFile file = {0};
+	int file_descriptor = open(path, O_RDONLY);
+	struct stat file_stat;
+	if (file_descriptor == -1 || fstat(file_descriptor, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+		if (file_descriptor != -1) { close(file_descriptor); }
+		free(path);
+		return; // not indexed, so search reads it
+	}
+	file.size = (uint64_t)file_stat.st_size;
+	file.mtime_seconds = (int64_t)file_stat.st_mtim.tv_sec;
+	file.mtime_nanoseconds = (int64_t)file_stat.st_mtim.tv_nsec;
+	file.path = strdup(relative_path);
+	free(path);
+
+	/* Mapping whole file, trigrams are collected in a single pass */
+	const unsigned char* data = NULL;
+	if (file_stat.st_size > 0) {
+		data = mmap(NULL, (size_t)file_stat.st_size, PROT_READ, MAP_PRIVATE, file_descriptor, 0);
+		if (data == MAP_FAILED) { data = NULL; }
+	}
+	close(file_descriptor);
+	if (file.path == NULL || (file_stat.st_size > 0 && data == NULL)) {
+		if (data != NULL) { munmap((void*)data, (size_t)file_stat.st_size); }
+		free(file.path);
+		return;
+	}
+
+	/* Trigrams of compressed bytes say nothing about decompressed text */
+	if (data != NULL && decompress_detect(data, (size_t)file_stat.st_size) != DECOMPRESS_FORMAT_NONE) {
+		munmap((void*)data, (size_t)file_stat.st_size);
+		free(file.path);
+		return; // not indexed, so search reads it
+	}
+	if (data != NULL) { madvise((void*)data, (size_t)file_stat.st_size, MADV_SEQUENTIAL); }
+
+	TrigramScratch* scratch = trigram_scratch(builder);
+	size_t trigram_count = 0;
+	int is_collected = scratch != NULL
+		&& trigram_scratch_collect(scratch, data, (size_t)file_stat.st_size, &trigram_count);
+	if (data != NULL) { munmap((void*)data, (size_t)file_stat.st_size); }
+
+	pthread_mutex_lock(&builder->mutex);
+	int is_added = is_collected && builder->file_count < UINT32_MAX
+		&& trigram_builder_add(builder, &file, scratch->trigrams, trigram_count);
+	if (!is_added) { builder->is_failed = 1; }
+	pthread_mutex_unlock(&builder->mutex);
+	if (!is_added) { free(file.path); }
+
+	/* Clearing only bits that were set, instead of the whole set */
+	for (size_t index = 0; scratch != NULL && index < trigram_count; index++) {
+		scratch->is_seen[scratch->trigrams[index] >> 6] = 0;
+	}
+}
+
+static int trigram_compare_files(const void* first, const void* second) {
+	return strcmp(((const TrigramBuildFile*)first)->path, ((const TrigramBuildFile*)second)->path);
+}
+
+static int trigram_compare_postings(const void* first, const void* second) {
+	uint64_t a = *(const uint64_t*)first;
+	uint64_t b = *(const uint64_t*)second;
+	return (a > b) - (a < b);
+}
+
+/* Growable byte array for encoded posting lists */
+typedef struct TrigramBytes {
+	uint8_t* data;
+	size_t length;
+	size_t capacity;
+} TrigramBytes;
+
+static int trigram_bytes_push_number(TrigramBytes* bytes, uint32_t number) {
+	if (bytes->length + 5 > bytes->capacity) {
+		size_t capacity = (bytes->capacity > 0) ? bytes->capacity * 2 : 65536;
+		uint8_t* data_copy = realloc(bytes->data, capacity);
+		if (data_copy == NULL) { return 0; }
+		bytes->data = data_copy;
+		bytes->capacity = capacity;
+	}
+	while (number >= 0x80) {
+		bytes->data[bytes->length++] = (uint8_t)(number | 0x80);
+		number >>= 7;
+	}
+	bytes->data[bytes->length++] = (uint8_t)number;
+	return 1;
+}
+
+/* Sorting collected postings and writing all tables next to each other */
+/* Index is written to a temporary file first, so that searches never */
+/* see a partially written index */
+static int trigram_builder_write(TrigramBuilder* builder, const char* index_path) {
+	qsort(builder->files, builder->file_count, sizeof(TrigramBuildFile), &trigram_compare_files);
+	uint32_t* ids = malloc((builder->file_count + 1) * sizeof(uint32_t));
+	if (ids == NULL) { return 0; }
+	for (size_t index = 0; index < builder->file_count; index++) {
+		ids[builder->files[index].id] = (uint32_t)index;
+	}
+	for (size_t index = 0; index < builder->posting_count; index++) {
+		uint64_t posting = builder->postings[index];
+		builder->postings[index] = (posting & 0xFFFFFFFF00000000u) | ids[(uint32_t)posting];
+	}
+	free(ids);
+	qsort(builder->postings, builder->posting_count, sizeof(uint64_t), &trigram_compare_postings);
+
+	/* Encoding file ids of each trigram as differences */
+	size_t trigram_count = 0;
+	for (size_t index = 0; index < builder->posting_count; index++) {
+		if (index == 0 || (builder->postings[index] >> 32) != (builder->postings[index - 1] >> 32)) {
+			trigram_count += 1;
+		}
+	}
+	TrigramIndexEntry* entries = calloc(trigram_count + 1, sizeof(TrigramIndexEntry));
+	TrigramBytes postings = { NULL, 0, 0 };
+	int is_encoded = (entries != NULL);
+	size_t entry_index = 0;
+	uint32_t previous_id = 0;
+	for (size_t index = 0; is_encoded && index < builder->posting_count; index++) {
+		uint32_t trigram = (uint32_t)(builder->postings[index] >> 32);
+		uint32_t id = (uint32_t)builder->postings[index];
+		if (index == 0 || trigram != entries[entry_index - 1].trigram) {
+			entries[entry_index].trigram = trigram;
+			entries[entry_index].postings_offset = postings.length;
+			entry_index += 1;
+			previous_id = 0;
+		}
+		entries[entry_index - 1].file_count += 1;
+		is_encoded = trigram_bytes_push_number(&postings, id - previous_id);
+		previous_id = id;
+	}
+
+	/* Paths are stored last, in order of file table */
+	TrigramIndexFile* files = calloc(builder->file_count + 1, sizeof(TrigramIndexFile));
+	uint64_t paths_size = 0;
+	for (size_t index = 0; files != NULL && index < builder->file_count; index++) {
+		files[index].path_offset = paths_size;
+		files[index].size = builder->files[index].size;
+		files[index].mtime_seconds = builder->files[index].mtime_seconds;
+		files[index].mtime_nanoseconds = builder->files[index].mtime_nanoseconds;
+		paths_size += strlen(builder->files[index].path) + 1;
+	}
+
+	TrigramIndexHeader header;
+	memcpy(header.magic, TRIGRAM_INDEX_MAGIC, sizeof(header.magic));
+	header.file_count = (uint32_t)builder->file_count;
+	header.trigram_count = (uint32_t)trigram_count;
+	header.files_offset = sizeof(TrigramIndexHeader);
+	header.trigrams_offset = header.files_offset + builder->file_count * sizeof(TrigramIndexFile);
+	header.postings_offset = header.trigrams_offset + trigram_count * sizeof(TrigramIndexEntry);
+	header.paths_offset = header.postings_offset + postings.length;
+
+	char temporary_path[4096];
+	int is_written = is_encoded && files != NULL
+		&& snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", index_path) < (int)sizeof(temporary_path);
+	FILE* output = is_written ? fopen(temporary_path, "wb") : NULL;
+	if (output != NULL) {
+		is_written = fwrite(&header, sizeof(header), 1, output) == 1
+			&& fwrite(files, sizeof(TrigramIndexFile), builder->file_count, output) == builder->file_count
+			&& fwrite(entries, sizeof(TrigramIndexEntry), trigram_count, output) == trigram_count
+			&& fwrite(postings.data, 1, postings.length, output) == postings.length;
+		for (size_t index = 0; is_written && index < builder->file_count; index++) {
+			const char* path = builder->files[index].path;
+			is_written = fwrite(path, 1, strlen(path) + 1, output) == strlen(path) + 1;
+		}
+		is_written &= (fclose(output) == 0);
+		if (is_written) { is_written = (rename(temporary_path, index_path) == 0); }
+		if (!is_written) { remove(temporary_path); }
+	} else {
+		is_written = 0;
+	}
+
+	free(entries);
+	free(files);
+	free(postings.data);
+	return is_written;
+}
+
+int trigram_index_build(const char* directory, int thread_count, size_t* file_count) {
+	*file_count = 0;
+	struct stat directory_stat;
+	if (stat(directory, &directory_stat) != 0 || !S_ISDIR(directory_stat.st_mode)) { return 0; }
+
+	TrigramBuilder builder = {0};
+	builder.directory = directory;
+	builder.directory_length = strlen(directory);
+	if (pthread_key_create(&builder.scratch_key, &trigram_scratch_free) != 0) { return 0; }
+	if (pthread_mutex_init(&builder.mutex, NULL) != 0) {
+		pthread_key_delete(builder.scratch_key);
+		return 0;
+	}
+
+	/* Walker threads free their scratch when exiting */
+	atomic_int is_cancelled;
+	atomic_init(&is_cancelled, 0);
+	char* paths[1] = { (char*)directory };
+	int is_built = walker_walk(paths, 1, (thread_count > 0) ? thread_count : 1, 0,
+		&is_cancelled, &trigram_builder_visit, &builder);
+	trigram_scratch_free(pthread_getspecific(builder.scratch_key));
+	pthread_key_delete(builder.scratch_key);
+	pthread_mutex_destroy(&builder.mutex);
+
+	char index_path[4096];
+	is_built = is_built && !builder.is_failed
+		&& snprintf(index_path, sizeof(index_path), "%s/%s", directory, TRIGRAM_INDEX_FILE_NAME)
+			< (int)sizeof(index_path)
+		&& trigram_builder_write(&builder, index_path);
+	if (is_built) { *file_count = builder.file_count; }
+
+	for (size_t index = 0; index < builder.file_count; index++) {
+		free(builder.files[index].path);
+	}
+	free(builder.files);
+	free(builder.postings);
+	return is_built;
+}
+
+/* Searching */
+
+TrigramIndex* trigram_index_open(const char* directory) {
+	char index_path[4096];
+	if (snprintf(index_path, sizeof(index_path), "%s/%s", directory, TRIGRAM_INDEX_FILE_NAME)
+		>= (int)sizeof(index_path)) {
+		return NULL;
+	}
+	int file = open(index_path, O_RDONLY);
+	if (file == -1) { return NULL; }
+	struct stat file_stat;
+	if (fstat(file, &file_stat) != 0 || (size_t)file_stat.st_size < sizeof(TrigramIndexHeader)) {
+		close(file);
+		return NULL;
+	}
+	size_t size = (size_t)file_stat.st_size;
+	const uint8_t* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+	close(file);
+	if (data == MAP_FAILED) { return NULL; }
+
+	/* Tables have to fit in the file, otherwise index is not trusted */
+	const TrigramIndexHeader* header = (const TrigramIndexHeader*)data;
+	int is_valid = memcmp(header->magic, TRIGRAM_INDEX_MAGIC, sizeof(header->magic)) == 0
+		&& header->files_offset + (uint64_t)header->file_count * sizeof(TrigramIndexFile) <= header->trigrams_offset
+		&& header->trigrams_offset + (uint64_t)header->trigram_count * sizeof(TrigramIndexEntry)
+			<= header->postings_offset
+		&& header->postings_offset <= header->paths_offset && header->paths_offset <= size
+		&& (size == header->paths_offset || data[size - 1] == '\0');
+	TrigramIndex* index = is_valid ? calloc(1, sizeof(TrigramIndex)) : NULL;
+	if (index != NULL) { index->is_candidate = malloc((size_t)header->file_count + 1); }
+	if (index == NULL || index->is_candidate == NULL) {
+		if (index != NULL) { free(index); }
+		munmap((void*)data, size);
+		return NULL;
+	}
+	index->data = data;
+	index->size = size;
+	index->directory = directory;
+	index->directory_length = strlen(directory);
+	index->file_count = header->file_count;
+	index->trigram_count = header->trigram_count;
+	index->files = (const TrigramIndexFile*)(data + header->files_offset);
+	index->trigrams = (const TrigramIndexEntry*)(data + header->trigrams_offset);
+	index->paths = (const char*)(data + header->paths_offset);
+	memset(index->is_candidate, 1, (size_t)header->file_count + 1);
+	return index;
+}
+
+static const TrigramIndexEntry* trigram_index_find(const TrigramIndex* index, uint32_t trigram) {
+	size_t low = 0;
+	size_t high = index->trigram_count;
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		if (index->trigrams[middle].trigram < trigram) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return (low < index->trigram_count && index->trigrams[low].trigram == trigram) ? &index->trigrams[low] : NULL;
+}
+
+/* Decoding file ids of one trigram, stopping at anything out of range */
+static size_t trigram_index_decode(const TrigramIndex* index, const TrigramIndexEntry* entry, uint32_t* ids) {
+	const TrigramIndexHeader* header = (const TrigramIndexHeader*)index->data;
+	const uint8_t* position = index->data + header->postings_offset + entry->postings_offset;
+	const uint8_t* end = index->data + header->paths_offset;
+	uint32_t id = 0;
+	size_t count = 0;
+	while (count < entry->file_count && position < end) {
+		uint32_t delta = 0;
+		for (int shift = 0; position < end && shift < 32; shift += 7) {
+			uint8_t byte = *position++;
+			delta |= (uint32_t)(byte & 0x7F) << shift;
+			if ((byte & 0x80) == 0) { break; }
+		}
+		id += delta;
+		if (id >= index->file_count || (count > 0 && delta == 0)) { break; }
+		ids[count++] = id;
+	}
+	return count;
+}
+
+static int trigram_compare_entries(const void* first, const void* second) {
+	uint32_t a = (*(const TrigramIndexEntry* const*)first)->file_count;
+	uint32_t b = (*(const TrigramIndexEntry* const*)second)->file_count;
+	return (a > b) - (a < b);
+}
+
+/* Marking files containing every trigram of string, shortest posting */
+/* lists are intersected first so that the candidate list shrinks fast */
+static int trigram_index_select_string(TrigramIndex* index, const unsigned char* string, size_t length,
+	uint32_t* candidates, uint32_t* ids) {
+	const TrigramIndexEntry** entries = malloc((length - 2) * sizeof(TrigramIndexEntry*));
+	if (entries == NULL) { return 0; }
+	for (size_t position = 0; position + 2 < length; position++) {
+		uint32_t trigram = (trigram_fold(string[position]) << 16) | (trigram_fold(string[position + 1]) << 8)
+			| trigram_fold(string[position + 2]);
+		entries[position] = trigram_index_find(index, trigram);
+		if (entries[position] == NULL) { // no indexed file can match
+			free(entries);
+			return 1;
+		}
+	}
+	qsort(entries, length - 2, sizeof(TrigramIndexEntry*), &trigram_compare_entries);
+
+	size_t candidate_count = trigram_index_decode(index, entries[0], candidates);
+	for (size_t entry = 1; entry < length - 2 && candidate_count > 0; entry++) {
+		size_t id_count = trigram_index_decode(index, entries[entry], ids);
+		size_t kept_count = 0;
+		size_t id_index = 0;
+		for (size_t candidate_index = 0; candidate_index < candidate_count; candidate_index++) {
+			while (id_index < id_count && ids[id_index] < candidates[candidate_index]) { id_index++; }
+			if (id_index < id_count && ids[id_index] == candidates[candidate_index]) {
+				candidates[kept_count++] = candidates[candidate_index];
+			}
+		}
+		candidate_count = kept_count;
+	}
+	for (size_t candidate = 0; candidate < candidate_count; candidate++) {
+		index->is_candidate[candidates[candidate]] = 1;
+	}
+	free(entries);
+	return 1;
+}
+
+int trigram_index_select(TrigramIndex* index, const unsigned char* const* strings, const size_t* lengths,
+	size_t count, int ignore_case) {
+	/* Any string without usable trigrams can match in every file */
+	for (size_t string = 0; string < count; string++) {
+		int is_usable = (lengths[string] >= 3);
+		for (size_t position = 0; ignore_case && position < lengths[string]; position++) {
+			if (strings[string][position] >= 0x80) { is_usable = 0; }
+		}
+		if (!is_usable) { return 1; }
+	}
+
+	memset(index->is_candidate, 0, index->file_count);
+	uint32_t* candidates = malloc(((size_t)index->file_count + 1) * sizeof(uint32_t));
+	uint32_t* ids = malloc(((size_t)index->file_count + 1) * sizeof(uint32_t));
+	int is_selected = (candidates != NULL && ids != NULL);
+	for (size_t string = 0; is_selected && string < count; string++) {
+		is_selected = trigram_index_select_string(index, strings[string], lengths[string], candidates, ids);
+	}
+	if (!is_selected) { memset(index->is_candidate, 1, index->file_count); }
+	free(candidates);
+	free(ids);
+	return is_selected;
+}
+
+TrigramIndexLookup trigram_index_lookup(const TrigramIndex* index, const char* path) {
+	const char* relative_path = trigram_relative_path(index->directory, index->directory_length, path);
+	if (relative_path == NULL) { return TRIGRAM_INDEX_SEARCH; }
+	if (strcmp(relative_path, TRIGRAM_INDEX_FILE_NAME) == 0) { return TRIGRAM_INDEX_SKIP; }
+
+	/* Files created after indexing are not found and always searched */
+	size_t low = 0;
+	size_t high = index->file_count;
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		if (strcmp(index->paths + index->files[middle].path_offset, relative_path) < 0) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	if (low == index->file_count || strcmp(index->paths + index->files[low].path_offset, relative_path) != 0) {
+		return TRIGRAM_INDEX_SEARCH;
+	}
+	if (index->is_candidate[low]) { return TRIGRAM_INDEX_SEARCH; }
+
+	/* Changed files are searched, since their postings are outdated */
+	const TrigramIndexFile* file = &index->files[low];
+	struct stat file_stat;
+	if (stat(path, &file_stat) != 0 || (uint64_t)file_stat.st_size != file->size
+		|| (int64_t)file_stat.st_mtim.tv_sec != file->mtime_seconds
+		|| (int64_t)file_stat.st_mtim.tv_nsec != file->mtime_nanoseconds) {
+		return TRIGRAM_INDEX_SEARCH;
+	}
+	return TRIGRAM_INDEX_NO_MATCH;
+}
+
+void trigram_index_close(TrigramIndex* index) {
+	if (index == NULL) { return; }
+	munmap((void*)index->data, index->size);
+	free(index->is_candidate);
+	free(index);
+}
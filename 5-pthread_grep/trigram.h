@@ -0,0 +1,78 @@
+/* All header files need to be protected with preprocessor guards */
+#ifndef TRIGRAM_H
+#define TRIGRAM_H
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint8_t, uint32_t, uint64_t
+
+/* Index is written into the indexed directory under this name, which */
+/* recursive searches skip, with or without --index */
+#define TRIGRAM_INDEX_FILE_NAME ".grep-index"
+#define TRIGRAM_INDEX_MAGIC "GREPIDX1"
+
+/* Layout of index file, integers are stored in native byte order */
+/* Header is followed by file table sorted by path, trigram table */
+/* sorted by trigram, posting lists and NUL terminated paths */
+typedef struct TrigramIndexHeader {
+	char magic[8];
+	uint32_t file_count;
+	uint32_t trigram_count;
+	uint64_t files_offset;
+	uint64_t trigrams_offset;
+	uint64_t postings_offset;
+	uint64_t paths_offset;
+} TrigramIndexHeader;
+
+/* Indexed file, changed files are searched whatever their postings say */
+typedef struct TrigramIndexFile {
+	uint64_t path_offset; // relative to indexed directory, from paths_offset
+	uint64_t size;
+	int64_t mtime_seconds;
+	int64_t mtime_nanoseconds;
+} TrigramIndexFile;
+
+/* Files containing a trigram are listed by increasing id, each id is */
+/* stored as difference from previous one in 7-bit variable length bytes */
+typedef struct TrigramIndexEntry {
+	uint32_t trigram; // three bytes with ASCII letters in lower case
+	uint32_t file_count;
+	uint64_t postings_offset; // from postings_offset of header
+} TrigramIndexEntry;
+
+/* Index mapped read-only, shared by all threads once files are selected */
+typedef struct TrigramIndex {
+	const uint8_t* data;
+	size_t size;
+	const char* directory; // prefix removed from walked paths
+	size_t directory_length;
+	uint32_t file_count;
+	uint32_t trigram_count;
+	const TrigramIndexFile* files;
+	const TrigramIndexEntry* trigrams;
+	const char* paths;
+	uint8_t* is_candidate; // per file, all set until files are selected
+} TrigramIndex;
+
+/* What searching should do with a walked file */
+typedef enum TrigramIndexLookup {
+	TRIGRAM_INDEX_SEARCH, // candidate, changed or not indexed at all
+	TRIGRAM_INDEX_NO_MATCH, // unchanged and missing some required trigram
+	TRIGRAM_INDEX_SKIP, // index file itself
+} TrigramIndexLookup;
+
+/* Always prefix functions with header name */
+/* Walks directory with several threads and writes its index, */
+/* 'file_count' is set to number of indexed files */
+int trigram_index_build(const char* directory, int thread_count, size_t* file_count);
+/* Maps index written into directory, NULL if missing or invalid */
+TrigramIndex* trigram_index_open(const char* directory);
+/* Keeps files containing every trigram of any of the strings */
+/* Strings shorter than a trigram select all files, as do non-ASCII */
+/* strings when ignoring case, since their case variants are unknown */
+int trigram_index_select(TrigramIndex* index, const unsigned char* const* strings, const size_t* lengths,
+	size_t count, int ignore_case);
+/* Checks walked path, which starts with the indexed directory */
+TrigramIndexLookup trigram_index_lookup(const TrigramIndex* index, const char* path);
+void trigram_index_close(TrigramIndex* index);
+
+#endif
@@ -0,0 +1,57 @@
+#include "utf8.h"
+
+/* Decoding one UTF-8 character, returns how many bytes it occupies */
+size_t utf8_decode(const unsigned char* string, size_t string_length, wchar_t* character) {
+	unsigned char byte = string[0];
+	if (byte < 0x80) { *character = byte; return 1; }
+
+	size_t character_length = 0;
+	wchar_t c = 0;
+	if ((byte & 0xE0) == 0xC0) { character_length = 2; c = byte & 0x1F; }
+	else if ((byte & 0xF0) == 0xE0) { character_length = 3; c = byte & 0x0F; }
+	else if ((byte & 0xF8) == 0xF0) { character_length = 4; c = byte & 0x07; }
+
+	*character = 0xFFFD; // replacement character
+	if (character_length == 0 || character_length > string_length) { return 1; }
+	for (size_t index = 1; index < character_length; index++) {
+		if ((string[index] & 0xC0) != 0x80) { return 1; }
+		c = (c << 6) | (string[index] & 0x3F);
+	}
+	*character = c;
+	return character_length;
+}
+
+/* Decoding character that ends right before 'position' */
+wchar_t utf8_decode_previous(const unsigned char* string, size_t position) {
+	if (position == 0) { return L'\0'; }
+	size_t start = position - 1;
+	while (start > 0 && position - start < UTF8_MAX_LENGTH && (string[start] & 0xC0) == 0x80) { start--; }
+
+	wchar_t character;
+	if (utf8_decode(string + start, position - start, &character) != position - start) {
+		return 0xFFFD; // stray continuation byte
+	}
+	return character;
+}
+
+size_t utf8_encode(wchar_t character, char bytes[UTF8_MAX_LENGTH]) {
+	unsigned int c = (unsigned int)character;
+	if (c < 0x80) {
+		bytes[0] = (char)c;
+		return 1;
+	} else if (c < 0x800) {
+		bytes[0] = (char)(0xC0 | (c >> 6));
+		bytes[1] = (char)(0x80 | (c & 0x3F));
+		return 2;
+	} else if (c < 0x10000) {
+		bytes[0] = (char)(0xE0 | (c >> 12));
+		bytes[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+		bytes[2] = (char)(0x80 | (c & 0x3F));
+		return 3;
+	}
+	bytes[0] = (char)(0xF0 | (c >> 18));
+	bytes[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+	bytes[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+	bytes[3] = (char)(0x80 | (c & 0x3F));
+	return 4;
+}
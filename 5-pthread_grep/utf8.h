@@ -0,0 +1,16 @@
+/* All header files need to be protected with preprocessor guards */
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <stddef.h> // size_t, wchar_t
+
+/* UTF-8 characters are 1 to 4 bytes long */
+#define UTF8_MAX_LENGTH 4
+
+/* Always prefix functions with header name */
+/* Invalid bytes are decoded one at a time as replacement characters */
+size_t utf8_decode(const unsigned char* string, size_t string_length, wchar_t* character);
+wchar_t utf8_decode_previous(const unsigned char* string, size_t position);
+size_t utf8_encode(wchar_t character, char bytes[UTF8_MAX_LENGTH]);
+
+#endif
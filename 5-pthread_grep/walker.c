@@ -0,0 +1,286 @@
+#define _GNU_SOURCE // syscall()
+#include "walker.h"
+#include "job_queue.h"
+#include "trigram.h"
+
+#include <stdlib.h> // malloc(), calloc(), free()
+#include <stdint.h> // uint64_t, int64_t
+#include <stdio.h> // fprintf()
+#include <string.h> // strlen(), strcmp(), memcpy(), strdup(), strerror()
+#include <errno.h> // errno, EINTR
+#include <pthread.h> // pthread_create(), pthread_join()
+#include <fcntl.h> // open(), O_DIRECTORY
+#include <dirent.h> // DT_DIR, DT_REG, DT_LNK, DT_UNKNOWN
+#include <unistd.h> // close(), syscall()
+#include <sys/stat.h> // stat(), fstat(), fstatat()
+#include <sys/syscall.h> // SYS_getdents64
+
+/* This file implements parallel directory walker for walker.h */
+/* Directories are read with getdents64() directly, which returns many */
+/* entries with their types at once, unlike readdir() wrappers */
+
+/* Size of buffer each thread reads directory entries into */
+#define WALKER_BUFFER_SIZE (32 * 1024)
+
+/* Directories are kept open while their subdirectories wait, so that */
+/* those are opened relative to them, at most this many at once */
+/* Beyond that, subdirectories are opened by their full path */
+#define WALKER_MAX_OPEN_DIRECTORIES 256
+
+/* Layout of entries returned by getdents64(), not declared by libc */
+typedef struct WalkerEntry {
+	uint64_t inode;
+	int64_t offset;
+	unsigned short record_length;
+	unsigned char type;
+	char name[];
+} WalkerEntry;
+
+/* State shared by all walker threads */
+typedef struct Walker {
+	JobQueue* queue; // directories waiting to be read
+	atomic_size_t directory_count; // pushed directories not finished yet
+	atomic_int open_count; // directories kept open for their subdirectories
+	int one_file_system;
+	const atomic_int* is_cancelled;
+	WalkerVisit visit;
+	void* context;
+} Walker;
+
+typedef struct WalkerThreadArguments {
+	Walker* walker;
+	int thread_index;
+} WalkerThreadArguments;
+
+/* Joining directory path and entry name into newly allocated path */
+static char* walker_join(const char* directory, const char* name) {
+	size_t directory_length = strlen(directory);
+	size_t name_length = strlen(name);
+	int is_separator_needed = (directory_length > 0 && directory[directory_length - 1] != '/');
+	char* path = malloc(directory_length + is_separator_needed + name_length + 1);
+	if (path == NULL) { return NULL; }
+	memcpy(path, directory, directory_length);
+	if (is_separator_needed) { path[directory_length] = '/'; }
+	memcpy(path + directory_length + is_separator_needed, name, name_length + 1);
+	return path;
+}
+
+/* Dropping reference to directory, freeing ancestors nobody needs */
+/* Directory is closed once no subdirectory can open relative to it */
+static void walker_release(Walker* walker, WalkerDirectory* directory) {
+	while (directory != NULL && atomic_fetch_sub(&directory->reference_count, 1) == 1) {
+		WalkerDirectory* parent = directory->parent;
+		if (directory->file != -1) {
+			close(directory->file);
+			atomic_fetch_sub(&walker->open_count, 1);
+		}
+		free(directory->path);
+		free(directory);
+		directory = parent;
+	}
+}
+
+/* Freeing directory left in queue, which is never read */
+static void walker_directory_free(void* task) {
+	WalkerDirectory* directory = (WalkerDirectory*)task;
+	free(directory->path);
+	free(directory);
+}
+
+/* Queueing directory to be read by any walker thread */
+/* Walker threads push to their own deque, others to shared ring */
+static void walker_push(Walker* walker, WalkerDirectory* parent, char* path, size_t name_offset,
+	dev_t root_device, int thread_index) {
+	WalkerDirectory* directory = calloc(1, sizeof(WalkerDirectory));
+	if (directory == NULL) {
+		free(path);
+		return;
+	}
+	directory->path = path;
+	directory->name_offset = name_offset;
+	directory->file = -1;
+	directory->parent = parent;
+	directory->root_device = root_device;
+	atomic_init(&directory->reference_count, 1);
+	if (parent != NULL) { atomic_fetch_add(&parent->reference_count, 1); }
+
+	atomic_fetch_add(&walker->directory_count, 1);
+	if (thread_index >= 0) {
+		job_queue_push_local(walker->queue, thread_index, directory);
+	} else {
+		job_queue_push(walker->queue, directory);
+	}
+}
+
+/* Finishing directory, last one closes queue so that threads exit */
+static void walker_finish(Walker* walker) {
+	if (atomic_fetch_sub(&walker->directory_count, 1) == 1) {
+		job_queue_close(walker->queue);
+	}
+}
+
+/* Opening directory and checking it is not its own ancestor */
+/* Subdirectories are opened relative to their parent when it is kept */
+/* open, which neither resolves the whole path again nor depends on */
+/* ancestors keeping their names while they are walked */
+static int walker_open(Walker* walker, WalkerDirectory* directory) {
+	const WalkerDirectory* parent = directory->parent;
+	int file = (parent != NULL && parent->file != -1)
+		? openat(parent->file, directory->path + directory->name_offset, O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+		: open(directory->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (file == -1) {
+		fprintf(stderr, "grep: %s: %s\n", directory->path, strerror(errno));
+		return -1;
+	}
+	struct stat file_stat;
+	if (fstat(file, &file_stat) != 0) {
+		close(file);
+		return -1;
+	}
+	directory->device = file_stat.st_dev;
+	directory->inode = file_stat.st_ino;
+
+	/* Staying on file system of command-line argument when requested */
+	if (walker->one_file_system && directory->device != directory->root_device) {
+		close(file);
+		return -1;
+	}
+
+	/* Symbolic links are followed, so directory can contain itself */
+	for (WalkerDirectory* ancestor = directory->parent; ancestor != NULL; ancestor = ancestor->parent) {
+		if (ancestor->device == directory->device && ancestor->inode == directory->inode) {
+			fprintf(stderr, "grep: %s: recursive directory loop\n", directory->path);
+			close(file);
+			return -1;
+		}
+	}
+	return file;
+}
+
+/* Reading all entries of directory, queueing subdirectories and */
+/* visiting files right away */
+static void walker_read(Walker* walker, WalkerDirectory* directory, char* buffer, int thread_index) {
+	int file = walker_open(walker, directory);
+	if (file == -1) { return; }
+
+	/* Keeping directory open is decided before any subdirectory is */
+	/* queued, so that they never see it closing */
+	int is_kept = atomic_fetch_add(&walker->open_count, 1) < WALKER_MAX_OPEN_DIRECTORIES;
+	if (is_kept) {
+		directory->file = file;
+	} else {
+		atomic_fetch_sub(&walker->open_count, 1);
+	}
+
+	while (!atomic_load_explicit(walker->is_cancelled, memory_order_relaxed)) {
+		long read_length = syscall(SYS_getdents64, file, buffer, WALKER_BUFFER_SIZE);
+		if (read_length < 0 && errno == EINTR) { continue; }
+		if (read_length <= 0) { break; }
+
+		for (long position = 0; position < read_length;) {
+			WalkerEntry* entry = (WalkerEntry*)(buffer + position);
+			position += entry->record_length;
+			if (entry->name[0] == '.' && (entry->name[1] == '\0'
+				|| (entry->name[1] == '.' && entry->name[2] == '\0'))) {
+				continue; // skipping '.' and '..'
+			}
+
+			/* Type is unknown for symbolic links and some file systems */
+			unsigned char type = entry->type;
+			if (type == DT_LNK || type == DT_UNKNOWN) {
+				struct stat file_stat;
+				if (fstatat(file, entry->name, &file_stat, 0) != 0) { continue; } // broken link
+				type = S_ISDIR(file_stat.st_mode) ? DT_DIR : S_ISREG(file_stat.st_mode) ? DT_REG : DT_UNKNOWN;
+			}
+			if (type != DT_DIR && type != DT_REG) { continue; } // devices, pipes and sockets
+
+			/* Trigram index only stores paths of the indexed directory, its */
+			/* own text would match them whether index is used or not */
+			if (type == DT_REG && strcmp(entry->name, TRIGRAM_INDEX_FILE_NAME) == 0) { continue; }
+
+			char* path = walker_join(directory->path, entry->name);
+			if (path == NULL) { continue; }
+			if (type == DT_DIR) {
+				size_t name_offset = strlen(path) - strlen(entry->name);
+				walker_push(walker, directory, path, name_offset, directory->root_device, thread_index);
+			} else {
+				walker->visit(walker->context, path);
+			}
+		}
+	}
+	if (!is_kept) { close(file); } // otherwise closed once released
+}
+
+static void* walker_thread(void* arguments) {
+	WalkerThreadArguments* args = (WalkerThreadArguments*)arguments;
+	char* buffer = malloc(WALKER_BUFFER_SIZE);
+
+	WalkerDirectory* directory;
+	while ((directory = job_queue_pop(args->walker->queue, args->thread_index)) != NULL) {
+		/* Remaining directories are only released after cancelling */
+		if (buffer != NULL && !atomic_load_explicit(args->walker->is_cancelled, memory_order_relaxed)) {
+			walker_read(args->walker, directory, buffer, args->thread_index);
+		}
+		walker_release(args->walker, directory);
+		walker_finish(args->walker);
+	}
+
+	free(buffer);
+	free(args);
+	return NULL;
+}
+
+int walker_walk(char** paths, int path_count, int thread_count, int one_file_system,
+	const atomic_int* is_cancelled, WalkerVisit visit, void* context) {
+	Walker walker;
+	walker.queue = job_queue_new(thread_count, &walker_directory_free);
+	if (walker.queue == NULL) { return 0; }
+	atomic_init(&walker.open_count, 0);
+	walker.one_file_system = one_file_system;
+	walker.is_cancelled = is_cancelled;
+	walker.visit = visit;
+	walker.context = context;
+
+	/* Holding one directory count until all arguments are pushed, */
+	/* so that threads can't close queue before that */
+	atomic_init(&walker.directory_count, 1);
+
+	pthread_t* threads = malloc(thread_count * sizeof(pthread_t));
+	int started_count = 0;
+	for (int index = 0; threads != NULL && index < thread_count; index++) {
+		WalkerThreadArguments* args = malloc(sizeof(WalkerThreadArguments));
+		if (args == NULL) { break; }
+		args->walker = &walker;
+		args->thread_index = started_count;
+		if (pthread_create(&threads[started_count], NULL, &walker_thread, (void*)args)) {
+			free(args);
+			continue;
+		}
+		started_count += 1;
+	}
+	if (started_count == 0) {
+		free(threads);
+		job_queue_free(walker.queue);
+		return 0;
+	}
+
+	/* Arguments that are not directories are searched as they are */
+	for (int index = 0; index < path_count; index++) {
+		struct stat file_stat;
+		char* path = strdup(paths[index]);
+		if (path == NULL) { continue; }
+		if (stat(paths[index], &file_stat) == 0 && S_ISDIR(file_stat.st_mode)) {
+			walker_push(&walker, NULL, path, 0, file_stat.st_dev, -1);
+		} else {
+			visit(context, path);
+		}
+	}
+	walker_finish(&walker);
+
+	for (int index = 0; index < started_count; index++) {
+		pthread_join(threads[index], NULL);
+	}
+	free(threads);
+	job_queue_free(walker.queue);
+	return 1;
+}
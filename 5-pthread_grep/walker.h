@@ -0,0 +1,34 @@
+/* All header files need to be protected with preprocessor guards */
+#ifndef WALKER_H
+#define WALKER_H
+
+#include <stddef.h> // size_t
+#include <stdatomic.h> // atomic_int
+#include <sys/types.h> // dev_t, ino_t
+
+/* Directory waiting to be read or still referenced by subdirectories */
+/* Each directory keeps its parent alive, so that the chain of ancestors */
+/* can be checked for symbolic link loops without copying it */
+typedef struct WalkerDirectory {
+	char* path;
+	size_t name_offset; // last path component, opened relative to parent
+	int file; // kept open for subdirectories, -1 when it is not
+	struct WalkerDirectory* parent;
+	dev_t root_device; // file system of walked command-line argument
+	dev_t device; // set once directory is opened
+	ino_t inode;
+	atomic_int reference_count;
+} WalkerDirectory;
+
+/* Called from walker threads for every file found, takes over path */
+typedef void (*WalkerVisit)(void* context, char* path);
+
+/* Always prefix functions with header name */
+/* Walks directories with several threads, calling 'visit' for files */
+/* Arguments that are not directories are visited as they are */
+/* Returns once all directories are read or 'is_cancelled' is set, */
+/* 0 if no thread could start */
+int walker_walk(char** paths, int path_count, int thread_count, int one_file_system,
+	const atomic_int* is_cancelled, WalkerVisit visit, void* context);
+
+#endif
@@ -1,105 +1,419 @@
-#include <stdlib.h> // EXIT_SUCCESS, EXIT_FAILURE, calloc(), mbstowcs(), free()
-#include <stdio.h> // printf(), fopen(), fclose()
+#define _GNU_SOURCE // memmem()
+#include "grep.h"
 
-/* Using same functions designed for wide characters */
-#include <string.h> // strlen()
-#include <locale.h> // setlocale()
-#include <wchar.h> // wcslen(), wcsdup()
-#include <wctype.h> // towupper(), iswalpha()
+#include <stdlib.h> // calloc(), malloc(), realloc(), free()
+#include <string.h> // memcpy(), memmem()
+#include <errno.h> // errno, EINTR, EILSEQ
+#include <fcntl.h> // open()
+#include <unistd.h> // read(), close(), sysconf()
+#include <pthread.h> // pthread_create(), pthread_once(), pthread_mutex_t, pthread_cond_t
+#include <signal.h> // sigfillset(), pthread_sigmask()
+#include <sys/mman.h> // mmap(), munmap()
+#include <sys/stat.h> // fstat(), S_ISREG()
 
-/* Terminal color codes */
-#define ANSI_COLOR_RED "\x1b[31m"
-#define ANSI_COLOR_RESET "\x1b[0m"
+/* Using same functions designed for wide characters, but with explicit */
+/* locale, so that library never depends on locale of calling program */
+#include <locale.h> // newlocale(), freelocale()
+#include <wchar.h> // wchar_t
+#include <wctype.h> // towupper_l(), iswalpha_l()
+
+/* This file implements library API declared in grep.h */
+/* Library never prints anything, only state it keeps is the thread pool */
+/* of grep_search_many(), started on first use and shared by all callers */
 
 /* Use typedef to distinguish variables */
 typedef int bool;
 
-struct Options {
+/* Longest UTF-8 encoded character in bytes */
+#define UTF8_MAX_LENGTH 4
+
+struct GrepPattern {
+	char* bytes; // UTF-8 search string, matched as it is without ignoring case
+	size_t length;
+	wchar_t* characters; // upper case characters when ignoring case
+	size_t character_count;
 	bool ignore_case;
 	bool match_whole_words;
-	wchar_t* search_string;
-	char* file_name;
+	bool is_prefix_alpha;
+	bool is_suffix_alpha;
+	locale_t locale; // character classes of UTF-8, used by *_l() functions
 };
 
-/* Function to convert regular strings to wide character strings */
-wchar_t* convert_string(const char* string) {
-	size_t string_size = strlen(string) + 1;
-	wchar_t* wide_character_string = calloc(string_size, sizeof(wchar_t));
-	if (wide_character_string == NULL) { return NULL; }
-	if (mbstowcs(wide_character_string, string, string_size) == (size_t)-1) {
-		free(wide_character_string);
+/* Decoding one UTF-8 character, returns how many bytes it occupies */
+/* Invalid bytes are decoded one by one as replacement characters */
+static size_t utf8_decode(const unsigned char* string, size_t string_length, wchar_t* character) {
+	unsigned char byte = string[0];
+	if (byte < 0x80) { *character = byte; return 1; }
+
+	size_t character_length = 0;
+	wchar_t c = 0;
+	if ((byte & 0xE0) == 0xC0) { character_length = 2; c = byte & 0x1F; }
+	else if ((byte & 0xF0) == 0xE0) { character_length = 3; c = byte & 0x0F; }
+	else if ((byte & 0xF8) == 0xF0) { character_length = 4; c = byte & 0x07; }
+
+	*character = 0xFFFD; // replacement character
+	if (character_length == 0 || character_length > string_length) { return 1; }
+	for (size_t index = 1; index < character_length; index++) {
+		if ((string[index] & 0xC0) != 0x80) { return 1; }
+		c = (c << 6) | (string[index] & 0x3F);
+	}
+	*character = c;
+	return character_length;
+}
+
+/* Decoding character that ends right before 'position' */
+static wchar_t utf8_decode_previous(const unsigned char* string, size_t position) {
+	if (position == 0) { return L'\0'; }
+	size_t start = position - 1;
+	while (start > 0 && position - start < UTF8_MAX_LENGTH && (string[start] & 0xC0) == 0x80) { start--; }
+
+	wchar_t character;
+	if (utf8_decode(string + start, position - start, &character) != position - start) {
+		return 0xFFFD; // stray continuation byte
+	}
+	return character;
+}
+
+GrepPattern* grep_compile(const char* pattern, size_t pattern_length, int flags) {
+	GrepPattern* grep_pattern = calloc(1, sizeof(GrepPattern));
+	if (grep_pattern == NULL) { return NULL; }
+	grep_pattern->ignore_case = (flags & GREP_IGNORE_CASE) != 0;
+	grep_pattern->match_whole_words = (flags & GREP_MATCH_WHOLE_WORDS) != 0;
+
+	/* Locale object is private to pattern, unlike setlocale() */
+	grep_pattern->locale = newlocale(LC_CTYPE_MASK, "C.UTF-8", (locale_t)0);
+	if (grep_pattern->locale == (locale_t)0) { grep_pattern->locale = newlocale(LC_CTYPE_MASK, "", (locale_t)0); }
+
+	grep_pattern->bytes = malloc(pattern_length + 1);
+	grep_pattern->characters = calloc(pattern_length + 1, sizeof(wchar_t));
+	if (grep_pattern->locale == (locale_t)0 || grep_pattern->bytes == NULL || grep_pattern->characters == NULL) {
+		grep_pattern_free(grep_pattern);
 		return NULL;
 	}
-	return wide_character_string;
+	memcpy(grep_pattern->bytes, pattern, pattern_length);
+	grep_pattern->length = pattern_length;
+
+	/* Decoding search string once, invalid UTF-8 is rejected */
+	const unsigned char* bytes = (const unsigned char*)pattern;
+	for (size_t position = 0; position < pattern_length;) {
+		wchar_t c;
+		size_t character_length = utf8_decode(bytes + position, pattern_length - position, &c);
+		if (c == 0xFFFD && character_length == 1 && bytes[position] >= 0x80) {
+			grep_pattern_free(grep_pattern);
+			errno = EILSEQ;
+			return NULL;
+		}
+		if (grep_pattern->ignore_case) { c = (wchar_t)towupper_l((wint_t)c, grep_pattern->locale); }
+		grep_pattern->characters[grep_pattern->character_count++] = c;
+		position += character_length;
+	}
+	if (grep_pattern->character_count > 0) {
+		grep_pattern->is_prefix_alpha = iswalpha_l((wint_t)grep_pattern->characters[0], grep_pattern->locale) != 0;
+		grep_pattern->is_suffix_alpha = iswalpha_l(
+			(wint_t)grep_pattern->characters[grep_pattern->character_count - 1], grep_pattern->locale) != 0;
+	}
+	return grep_pattern;
+}
+
+/* Comparing characters of text with upper case search string */
+/* Returns length of matched text in bytes, 0 if it does not match */
+static size_t grep_match_folded(const GrepPattern* pattern, const unsigned char* text, size_t text_length) {
+	size_t position = 0;
+	for (size_t index = 0; index < pattern->character_count; index++) {
+		if (position == text_length) { return 0; }
+		wchar_t c;
+		position += utf8_decode(text + position, text_length - position, &c);
+		if ((wchar_t)towupper_l((wint_t)c, pattern->locale) != pattern->characters[index]) { return 0; }
+	}
+	return position;
 }
 
-int grep(const struct Options* options) {
-	FILE* file = fopen(options->file_name, "r");
-	if (file == NULL) {
-		printf("Error: No such file.\n");
-		return EXIT_FAILURE;
+/* Finding next match starting at or after 'position' */
+static const unsigned char* grep_find(const GrepPattern* pattern, const unsigned char* data, size_t size,
+	size_t position, size_t* match_length) {
+	if (!pattern->ignore_case) {
+		/* Exact bytes are found by libc, usually with vector instructions */
+		*match_length = pattern->length;
+		return memmem(data + position, size - position, pattern->bytes, pattern->length);
+	}
+	while (position < size) {
+		*match_length = grep_match_folded(pattern, data + position, size - position);
+		if (*match_length > 0) { return data + position; }
+		wchar_t c;
+		position += utf8_decode(data + position, size - position, &c);
 	}
+	return NULL;
+}
 
-	size_t search_string_length = wcslen(options->search_string);
-	if (search_string_length == 0) { return EXIT_SUCCESS; }
+/* Appending match, array grows geometrically */
+static bool grep_matches_push(GrepMatches* matches, size_t offset, size_t length) {
+	if (matches->length == matches->capacity) {
+		size_t capacity = (matches->capacity > 0) ? matches->capacity * 2 : 16;
+		GrepMatch* matches_copy = realloc(matches->matches, capacity * sizeof(GrepMatch));
+		if (matches_copy == NULL) { return 0; }
+		matches->matches = matches_copy;
+		matches->capacity = capacity;
+	}
+	matches->matches[matches->length].offset = offset;
+	matches->matches[matches->length].length = length;
+	matches->length += 1;
+	return 1;
+}
 
-	wchar_t* matching_substring = wcsdup(options->search_string);
-	if (matching_substring == NULL) { return EXIT_FAILURE; }
-	size_t match_index = 0;
+GrepMatches* grep_search_buffer(const GrepPattern* pattern, const char* data, size_t size) {
+	GrepMatches* matches = calloc(1, sizeof(GrepMatches));
+	if (matches == NULL || pattern->character_count == 0) { return matches; }
 
-	wchar_t* search_string = options->search_string;
-	if (options->ignore_case) {
-		search_string = wcsdup(options->search_string);
-		if (search_string == NULL) {
-			free(matching_substring);
-			return EXIT_FAILURE;
+	/* Matches do not overlap, search continues after each of them */
+	const unsigned char* text = (const unsigned char*)data;
+	size_t position = 0;
+	while (position < size) {
+		size_t match_length = 0;
+		const unsigned char* match = grep_find(pattern, text, size, position, &match_length);
+		if (match == NULL) { break; }
+		position = (size_t)(match - text);
+
+		/* Checking characters around the match only when necessary */
+		if (pattern->match_whole_words) {
+			bool is_matching = 1;
+			if (pattern->is_prefix_alpha) {
+				is_matching = !iswalpha_l((wint_t)utf8_decode_previous(text, position), pattern->locale);
+			}
+			if (is_matching && pattern->is_suffix_alpha && position + match_length < size) {
+				wchar_t c;
+				utf8_decode(text + position + match_length, size - (position + match_length), &c);
+				is_matching = !iswalpha_l((wint_t)c, pattern->locale);
+			}
+			if (!is_matching) {
+				wchar_t c;
+				position += utf8_decode(text + position, size - position, &c);
+				continue;
+			}
 		}
-		for (size_t index = 0; index < search_string_length; index++) {
-			search_string[index] = (wchar_t)towupper(search_string[index]);
+
+		if (!grep_matches_push(matches, position, match_length)) {
+			grep_matches_free(matches);
+			return NULL;
 		}
+		position += match_length;
 	}
+	return matches;
+}
 
-	bool is_before_alpha = 0;
-	bool is_prefix_alpha = iswalpha(search_string[0]);
-	bool is_suffix_alpha = iswalpha(search_string[search_string_length - 1]);
+/* Reading file that can't be mapped, like a pipe, into memory */
+static char* grep_read_file(int file, size_t* size) {
+	size_t capacity = 64 * 1024;
+	char* data = malloc(capacity);
+	*size = 0;
+	while (data != NULL) {
+		if (*size == capacity) {
+			char* data_copy = realloc(data, capacity * 2);
+			if (data_copy == NULL) { break; }
+			data = data_copy;
+			capacity *= 2;
+		}
+		ssize_t read_length = read(file, data + *size, capacity - *size);
+		if (read_length < 0 && errno == EINTR) { continue; }
+		if (read_length < 0) { break; }
+		if (read_length == 0) { return data; }
+		*size += (size_t)read_length;
+	}
+	free(data);
+	return NULL;
+}
 
-	/* Consuming file character by character until 'WEOF' */
-	wint_t c;
-	do {
-		c = fgetwc(file); // fgetwc() returns wint_t instead of wchar_t
-		wchar_t c_toupper = (wchar_t)(options->ignore_case ? towupper(c) : c);
-		bool c_is_alpha = iswalpha(c);
+GrepMatches* grep_search_file(const GrepPattern* pattern, const char* file_name) {
+	int file = open(file_name, O_RDONLY | O_CLOEXEC);
+	if (file == -1) { return NULL; }
 
-		if (match_index > 0 && match_index == search_string_length) {
-			bool is_matching = !(is_before_alpha && is_prefix_alpha);
-			is_matching = is_matching && !(is_suffix_alpha && c_is_alpha);
-			is_matching = options->match_whole_words ? is_matching : 1;
+	/* Regular files are mapped and searched in place */
+	struct stat file_stat;
+	GrepMatches* matches = NULL;
+	if (fstat(file, &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+		size_t size = (size_t)file_stat.st_size;
+		void* data = (size > 0) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0) : NULL;
+		if (data != MAP_FAILED) {
+			matches = grep_search_buffer(pattern, (const char*)data, size);
+			if (data != NULL) { munmap(data, size); }
+		}
+	} else {
+		size_t size = 0;
+		char* data = grep_read_file(file, &size);
+		if (data != NULL) {
+			matches = grep_search_buffer(pattern, data, size);
+			free(data);
+		}
+	}
+	int error = errno;
+	close(file);
+	errno = error;
+	return matches;
+}
+
+/* Files given to one grep_search_many() call */
+typedef struct GrepBatch {
+	const GrepPattern* pattern;
+	const char* const* file_names;
+	size_t file_count;
+	size_t next_index; // next file to be taken by a thread
+	size_t done_count; // files searched so far
+	GrepMatches** matches;
+	int* errors;
+	struct GrepBatch* next;
+} GrepBatch;
 
-			if (is_matching) { printf(ANSI_COLOR_RED); }
-			printf("%ls", matching_substring);
-			if (is_matching) { printf(ANSI_COLOR_RESET); }
+/* Threads live until process exits, batches wait in order of calls */
+typedef struct GrepPool {
+	pthread_mutex_t mutex;
+	pthread_cond_t work_condition; // batch was queued
+	pthread_cond_t done_condition; // file of some batch was searched
+	GrepBatch* head;
+	GrepBatch* tail;
+	int thread_count;
+} GrepPool;
+
+/* Global variables are marked with _G suffix */
+static GrepPool grep_pool_G = {
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0,
+};
+static pthread_once_t grep_pool_once_G = PTHREAD_ONCE_INIT;
 
-			is_before_alpha = is_suffix_alpha;
-			match_index = 0;
+/* Taking next file of batch, batch leaves queue once all are taken */
+/* Called with pool mutex locked */
+static size_t grep_pool_take(GrepPool* pool, GrepBatch* batch) {
+	size_t index = batch->next_index++;
+	if (batch->next_index == batch->file_count) {
+		/* Only head batch can run out, except batch of caller helping */
+		GrepBatch** link = &pool->head;
+		GrepBatch* previous = NULL;
+		while (*link != NULL && *link != batch) { previous = *link; link = &(*link)->next; }
+		if (*link == batch) {
+			*link = batch->next;
+			if (pool->tail == batch) { pool->tail = previous; }
 		}
+	}
+	return index;
+}
 
-		if (c_toupper == search_string[match_index] && c != WEOF) {
-			matching_substring[match_index] = (wchar_t)c;
-			match_index += 1;
-		} else {
-			for (size_t index = 0; index < match_index; index++) {
-				printf("%lc", matching_substring[index]);
-			}
-			if (c != WEOF) { printf("%lc", c); }
+/* Searching one file of batch, mutex is unlocked meanwhile */
+static void grep_pool_search(GrepPool* pool, GrepBatch* batch, size_t index) {
+	pthread_mutex_unlock(&pool->mutex);
+	GrepMatches* matches = grep_search_file(batch->pattern, batch->file_names[index]);
+	int error = (matches == NULL) ? errno : 0;
+	pthread_mutex_lock(&pool->mutex);
+
+	batch->matches[index] = matches;
+	batch->errors[index] = (matches == NULL && error == 0) ? ENOMEM : error;
+	batch->done_count += 1;
+	if (batch->done_count == batch->file_count) { pthread_cond_broadcast(&pool->done_condition); }
+}
 
-			is_before_alpha = c_is_alpha;
-			match_index = 0;
+static void* grep_pool_thread(void* arguments) {
+	GrepPool* pool = arguments;
+	pthread_mutex_lock(&pool->mutex);
+	while (1) {
+		while (pool->head == NULL) { pthread_cond_wait(&pool->work_condition, &pool->mutex); }
+		GrepBatch* batch = pool->head;
+		grep_pool_search(pool, batch, grep_pool_take(pool, batch));
+	}
+	return NULL;
+}
+
+/* Starting one thread per processor, signals stay with caller's threads */
+static void grep_pool_start(void) {
+	long processor_count = sysconf(_SC_NPROCESSORS_ONLN);
+	sigset_t signals, old_signals;
+	sigfillset(&signals);
+	pthread_sigmask(SIG_SETMASK, &signals, &old_signals);
+	for (long index = 0; index < ((processor_count > 0) ? processor_count : 1); index++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, grep_pool_thread, &grep_pool_G) != 0) { break; }
+		pthread_detach(thread);
+		grep_pool_G.thread_count += 1;
+	}
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+}
+
+/* Copying matches of all files into contiguous arrays */
+static GrepManyResult* grep_many_result_new(GrepBatch* batch) {
+	GrepManyResult* result = calloc(1, sizeof(GrepManyResult));
+	if (result == NULL) { return NULL; }
+	result->file_count = batch->file_count;
+	for (size_t index = 0; index < batch->file_count; index++) {
+		if (batch->matches[index] != NULL) { result->match_count += batch->matches[index]->length; }
+	}
+	result->match_counts = calloc(batch->file_count + 1, sizeof(size_t));
+	result->errors = calloc(batch->file_count + 1, sizeof(int));
+	result->matches = malloc((result->match_count + 1) * sizeof(GrepMatch));
+	if (result->match_counts == NULL || result->errors == NULL || result->matches == NULL) {
+		grep_many_result_free(result);
+		return NULL;
+	}
+
+	size_t match_index = 0;
+	for (size_t index = 0; index < batch->file_count; index++) {
+		GrepMatches* matches = batch->matches[index];
+		result->errors[index] = batch->errors[index];
+		if (matches == NULL) { continue; }
+		result->match_counts[index] = matches->length;
+		if (matches->length > 0) {
+			memcpy(result->matches + match_index, matches->matches, matches->length * sizeof(GrepMatch));
 		}
-	} while (c != WEOF);
+		match_index += matches->length;
+	}
+	return result;
+}
 
-	if (options->ignore_case) { free(search_string); }
-	free(matching_substring);
-	fclose(file);
+GrepManyResult* grep_search_many(const GrepPattern* pattern, const char* const* file_names, size_t file_count) {
+	GrepBatch batch = {pattern, file_names, file_count, 0, 0, NULL, NULL, NULL};
+	batch.matches = calloc(file_count + 1, sizeof(GrepMatches*));
+	batch.errors = calloc(file_count + 1, sizeof(int));
+	if (batch.matches == NULL || batch.errors == NULL) {
+		free(batch.matches);
+		free(batch.errors);
+		return NULL;
+	}
+
+	GrepPool* pool = &grep_pool_G;
+	pthread_once(&grep_pool_once_G, grep_pool_start);
+	pthread_mutex_lock(&pool->mutex);
+	if (file_count > 0) {
+		if (pool->tail != NULL) { pool->tail->next = &batch; } else { pool->head = &batch; }
+		pool->tail = &batch;
+		pthread_cond_broadcast(&pool->work_condition);
+	}
 
-	return EXIT_SUCCESS;
-}
\ No newline at end of file
+	/* Caller searches its own files too, so it never waits idle for */
+	/* threads busy with batches of other callers */
+	while (batch.next_index < batch.file_count) { grep_pool_search(pool, &batch, grep_pool_take(pool, &batch)); }
+	while (batch.done_count < batch.file_count) { pthread_cond_wait(&pool->done_condition, &pool->mutex); }
+	pthread_mutex_unlock(&pool->mutex);
+
+	GrepManyResult* result = grep_many_result_new(&batch);
+	for (size_t index = 0; index < file_count; index++) { grep_matches_free(batch.matches[index]); }
+	free(batch.matches);
+	free(batch.errors);
+	return result;
+}
+
+void grep_matches_free(GrepMatches* matches) {
+	if (matches == NULL) { return; }
+	free(matches->matches);
+	free(matches);
+}
+
+void grep_many_result_free(GrepManyResult* result) {
+	if (result == NULL) { return; }
+	free(result->match_counts);
+	free(result->errors);
+	free(result->matches);
+	free(result);
+}
+
+void grep_pattern_free(GrepPattern* pattern) {
+	if (pattern == NULL) { return; }
+	if (pattern->locale != (locale_t)0) { freelocale(pattern->locale); }
+	free(pattern->bytes);
+	free(pattern->characters);
+	free(pattern);
+}
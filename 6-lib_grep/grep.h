@@ -0,0 +1,54 @@
+/* All header files need to be protected with preprocessor guards */
+#ifndef GREP_H
+#define GREP_H
+
+#include <stddef.h> // size_t
+
+/* Flags given to grep_compile() */
+#define GREP_IGNORE_CASE 1
+#define GREP_MATCH_WHOLE_WORDS 2
+
+/* Compiled search string, only read while searching, so one pattern */
+/* can be searched by any number of threads at once */
+/* Contents are private to grep.c, callers only keep the pointer */
+typedef struct GrepPattern GrepPattern;
+
+/* Always prefix structs with header name */
+/* Byte range of a match inside searched buffer or file */
+typedef struct GrepMatch {
+	size_t offset;
+	size_t length;
+} GrepMatch;
+
+/* Matches in order they occur, owned by caller */
+typedef struct GrepMatches {
+	GrepMatch* matches;
+	size_t length;
+	size_t capacity;
+} GrepMatches;
+
+/* Results of searching many files at once, arrays are contiguous so */
+/* they can be wrapped without creating an object for each match */
+typedef struct GrepManyResult {
+	size_t file_count;
+	size_t* match_counts; // matches of each file, 0 for failed files
+	int* errors; // errno of each file, 0 if it was searched
+	size_t match_count; // sum of match counts
+	GrepMatch* matches; // matches of first file, then second and so on
+} GrepManyResult;
+
+/* Always prefix functions with header name */
+/* Search string is UTF-8 encoded, returns NULL if it is not valid */
+GrepPattern* grep_compile(const char* pattern, size_t pattern_length, int flags);
+/* Searches caller's buffer in place, returns NULL only on errors */
+GrepMatches* grep_search_buffer(const GrepPattern* pattern, const char* data, size_t size);
+/* Searches whole file, returns NULL with errno set on errors */
+GrepMatches* grep_search_file(const GrepPattern* pattern, const char* file_name);
+/* Searches files on threads shared by all calls, calling thread helps */
+/* Returns NULL only when memory can't be allocated */
+GrepManyResult* grep_search_many(const GrepPattern* pattern, const char* const* file_names, size_t file_count);
+void grep_matches_free(GrepMatches* matches);
+void grep_many_result_free(GrepManyResult* result);
+void grep_pattern_free(GrepPattern* pattern);
+
+#endif
@@ -1,21 +1,167 @@
 import os, ctypes
 
-libgrep = ctypes.CDLL(os.path.abspath("libgrep.so"))
+# Library calls release the GIL, so threads can search at the same time
+libgrep = ctypes.CDLL(os.path.abspath("libgrep.so"), use_errno=True)
 
-class GrepOptions(ctypes.Structure):
+# Flags of grep_compile(), same as in grep.h
+GREP_IGNORE_CASE = 1
+GREP_MATCH_WHOLE_WORDS = 2
+
+class GrepMatch(ctypes.Structure):
+	_fields_ = [
+		("offset", ctypes.c_size_t),
+		("length", ctypes.c_size_t),
+	]
+
+class GrepMatches(ctypes.Structure):
 	_fields_ = [
-		("ignore_case", ctypes.c_int),
-		("match_whole_words", ctypes.c_int),
-		("search_string", ctypes.c_wchar_p),
-		("file_name", ctypes.c_char_p),
+		("matches", ctypes.POINTER(GrepMatch)),
+		("length", ctypes.c_size_t),
+		("capacity", ctypes.c_size_t),
 	]
 
-libgrep.grep.argtypes = [ctypes.POINTER(GrepOptions)]
-libgrep.grep.restype = ctypes.c_int
+class GrepManyResult(ctypes.Structure):
+	_fields_ = [
+		("file_count", ctypes.c_size_t),
+		("match_counts", ctypes.POINTER(ctypes.c_size_t)),
+		("errors", ctypes.POINTER(ctypes.c_int)),
+		("match_count", ctypes.c_size_t),
+		("matches", ctypes.POINTER(GrepMatch)),
+	]
+
+class PyBuffer(ctypes.Structure):
+	# Py_buffer of Python C API, filled by PyObject_GetBuffer()
+	_fields_ = [
+		("buf", ctypes.c_void_p),
+		("obj", ctypes.c_void_p),
+		("len", ctypes.c_ssize_t),
+		("itemsize", ctypes.c_ssize_t),
+		("readonly", ctypes.c_int),
+		("ndim", ctypes.c_int),
+		("format", ctypes.c_char_p),
+		("shape", ctypes.POINTER(ctypes.c_ssize_t)),
+		("strides", ctypes.POINTER(ctypes.c_ssize_t)),
+		("suboffsets", ctypes.POINTER(ctypes.c_ssize_t)),
+		("internal", ctypes.c_void_p),
+	]
+
+# Simple request only succeeds for contiguous bytes, read-only ones too
+PyBUF_SIMPLE = 0
+ctypes.pythonapi.PyObject_GetBuffer.argtypes = [ctypes.py_object, ctypes.POINTER(PyBuffer), ctypes.c_int]
+ctypes.pythonapi.PyObject_GetBuffer.restype = ctypes.c_int
+ctypes.pythonapi.PyBuffer_Release.argtypes = [ctypes.POINTER(PyBuffer)]
+ctypes.pythonapi.PyBuffer_Release.restype = None
+
+libgrep.grep_compile.argtypes = [ctypes.c_char_p, ctypes.c_size_t, ctypes.c_int]
+libgrep.grep_compile.restype = ctypes.c_void_p
+libgrep.grep_search_buffer.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t]
+libgrep.grep_search_buffer.restype = ctypes.POINTER(GrepMatches)
+libgrep.grep_search_file.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+libgrep.grep_search_file.restype = ctypes.POINTER(GrepMatches)
+libgrep.grep_search_many.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_char_p), ctypes.c_size_t]
+libgrep.grep_search_many.restype = ctypes.POINTER(GrepManyResult)
+libgrep.grep_many_result_free.argtypes = [ctypes.POINTER(GrepManyResult)]
+libgrep.grep_many_result_free.restype = None
+libgrep.grep_matches_free.argtypes = [ctypes.POINTER(GrepMatches)]
+libgrep.grep_matches_free.restype = None
+libgrep.grep_pattern_free.argtypes = [ctypes.c_void_p]
+libgrep.grep_pattern_free.restype = None
+
+def take_matches(matches):
+	# Copying (offset, length) pairs and freeing array of the library
+	if not matches:
+		error = ctypes.get_errno()
+		raise OSError(error, os.strerror(error))
+	try:
+		return [(matches.contents.matches[index].offset, matches.contents.matches[index].length)
+			for index in range(matches.contents.length)]
+	finally:
+		libgrep.grep_matches_free(matches)
+
+class ManyResultOwner:
+	# Frees results once no view of them is left
+	def __init__(self, result):
+		self.result = result
+
+	def __del__(self):
+		libgrep.grep_many_result_free(self.result)
+
+def wrap_array(owner, pointer, length, format, shape):
+	# Memoryview over memory of the library, nothing is copied
+	if length == 0:
+		return memoryview(b"").cast(format)
+	array = ctypes.cast(pointer, ctypes.POINTER(ctypes.c_char * (length * ctypes.sizeof(pointer._type_)))).contents
+	array.owner = owner
+	return memoryview(array).cast("B").cast(format, shape)
+
+class ManyResult:
+	def __init__(self, result):
+		owner = ManyResultOwner(result)
+		contents = result.contents
+		self.match_counts = wrap_array(owner, contents.match_counts, contents.file_count, "N", [contents.file_count])
+		self.errors = wrap_array(owner, contents.errors, contents.file_count, "i", [contents.file_count])
+		# Row for each match with its offset and length
+		self.matches = wrap_array(owner, contents.matches, contents.match_count, "N", [contents.match_count, 2])
+
+class Pattern:
+	def __init__(self, search_string, ignore_case=False, match_whole_words=False):
+		encoded = search_string.encode("utf-8")
+		flags = (GREP_IGNORE_CASE if ignore_case else 0) | (GREP_MATCH_WHOLE_WORDS if match_whole_words else 0)
+		self.handle = libgrep.grep_compile(encoded, len(encoded), flags)
+		if not self.handle:
+			raise ValueError("invalid search string")
+
+	def search(self, data):
+		# Any contiguous buffer, read-only or writable, is searched in place
+		# without copying, it stays exported while library reads it
+		buffer = PyBuffer()
+		ctypes.pythonapi.PyObject_GetBuffer(data, ctypes.byref(buffer), PyBUF_SIMPLE)
+		try:
+			return take_matches(libgrep.grep_search_buffer(self.handle, buffer.buf, buffer.len))
+		finally:
+			ctypes.pythonapi.PyBuffer_Release(ctypes.byref(buffer))
+
+	def search_file(self, file_name):
+		return take_matches(libgrep.grep_search_file(self.handle, os.fsencode(file_name)))
+
+	def search_many(self, file_names):
+		# Files are searched by threads of the library in a single call
+		names = (ctypes.c_char_p * len(file_names))(*[os.fsencode(name) for name in file_names])
+		result = libgrep.grep_search_many(self.handle, names, len(file_names))
+		if not result:
+			raise MemoryError()
+		return ManyResult(result)
+
+	def close(self):
+		if self.handle:
+			libgrep.grep_pattern_free(self.handle)
+			self.handle = None
 
-options = GrepOptions(1, 1,
-	ctypes.c_wchar_p("את"),
-	ctypes.c_char_p("../examples/3-wchar_grep.txt".encode('utf-8')),
-)
+	def __del__(self):
+		self.close()
 
-print("Exit code:", libgrep.grep(ctypes.byref(options)))
+if __name__ == "__main__":
+	# Printing lines with matches, colored the same way as C stages
+	file_name = "../examples/3-wchar_grep.txt"
+	pattern = Pattern("את", ignore_case=True, match_whole_words=True)
+	data = open(file_name, "rb").read()
+	matches = pattern.search(data)
+	assert matches == pattern.search_file(file_name)
+	result = pattern.search_many([file_name])
+	assert result.matches.tolist() == [list(match) for match in matches]
+	line_start, line_end, line = 0, -1, b""
+	for offset, length in matches:
+		if offset > line_end:
+			# Finishing previous line and starting the one with this match
+			if line_end >= 0:
+				print((line + data[line_start:line_end]).decode("utf-8", "replace"))
+			line_start = data.rfind(b"\n", 0, offset) + 1
+			line_end = data.find(b"\n", offset)
+			line_end = len(data) if line_end == -1 else line_end
+			line = b""
+		line += data[line_start:offset] + b"\033[1;31m" + data[offset:offset + length] + b"\033[0m"
+		line_start = offset + length
+	if line_end >= 0:
+		print((line + data[line_start:line_end]).decode("utf-8", "replace"))
+	print("Matches found:", len(matches))
+	pattern.close()
@@ -0,0 +1,223 @@
+# Benchmark comparing grep stages 2 to 6 on generated corpora
+# Every run is a separate process started by measure.c, so peak memory
+# of each run is known (stage 6 includes the Python interpreter)
+# Results are printed as CSV, redirect or use --output to keep them
+import argparse, csv, ctypes, os, random, subprocess, sys
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+BENCHMARK = os.path.join(ROOT, "benchmark")
+EXAMPLES = os.path.join(ROOT, "examples")
+
+# Stages and the commands building them, run from their own directory
+STAGES = {
+	"2-basic_grep": ["main.c"],
+	"3-wchar_grep": ["main.c"],
+	"4-advanced_grep": ["main.c", "grep_string.c", "grep_file.c"],
+	"5-pthread_grep": None, # all *.c files
+	"6-lib_grep": ["grep.c"],
+}
+
+# Libraries linked into stages that need more than pthread
+LIBRARIES = {
+	"5-pthread_grep": ["-lpthread", "-lz", "-llzma", "-ldl"], # decompressing searched files
+}
+
+# Patterns of increasing length for each corpus
+PATTERNS = {
+	"torah": ["the", "LORD", "children", "and the LORD spake unto"],
+	"logs": ["GET", "error", "timeout", "connection reset by peer"],
+	"utf8": ["את", "השמים", "את👋️ואת👋️"],
+	"single_line": ["GET", "timeout", "connection reset by peer"],
+	"tiny_files": ["the", "children"],
+}
+
+LOG_WORDS = ["GET", "POST", "PUT", "DELETE", "200", "404", "500", "error", "warning", "info",
+	"timeout", "connection", "reset", "by", "peer", "user", "session", "cache", "miss", "hit",
+	"request", "response", "upstream", "/api/v1/items", "/static/app.js", "/login"]
+
+def build(stages, build_directory, compiler, cflags):
+	# Building each stage into its own directory outside source tree
+	os.makedirs(build_directory, exist_ok=True)
+	binaries = {"measure": os.path.join(build_directory, "measure")}
+	subprocess.run([compiler, "-O2", "-o", binaries["measure"], "measure.c"], cwd=BENCHMARK, check=True)
+	for stage in stages:
+		source_directory = os.path.join(ROOT, stage)
+		sources = STAGES[stage]
+		if sources is None:
+			sources = sorted(name for name in os.listdir(source_directory) if name.endswith(".c"))
+		output_directory = os.path.join(build_directory, stage)
+		os.makedirs(output_directory, exist_ok=True)
+		if stage == "6-lib_grep":
+			output = os.path.join(output_directory, "libgrep.so")
+			command = [compiler] + cflags + ["-fPIC", "-shared", "-o", output] + sources
+		else:
+			output = os.path.join(output_directory, "grep")
+			command = [compiler] + cflags + sources + LIBRARIES.get(stage, ["-lpthread"]) + ["-o", output]
+		subprocess.run(command, cwd=source_directory, check=True)
+		binaries[stage] = output
+	return binaries
+
+def write_until(path, size, make_chunk):
+	# Appending generated chunks until file has at least 'size' bytes
+	with open(path, "wb") as file:
+		written = 0
+		while written < size:
+			chunk = make_chunk()
+			file.write(chunk)
+			written += len(chunk)
+
+def generate(corpus_directory, size):
+	# Corpora are generated once for each size and reused afterwards
+	directory = os.path.join(corpus_directory, str(size))
+	if os.path.isdir(directory):
+		return directory
+	temporary_directory = directory + ".tmp"
+	os.makedirs(temporary_directory, exist_ok=True)
+	generator = random.Random(1)
+
+	# Replicated books of the Torah
+	books = b"".join(open(os.path.join(EXAMPLES, name), "rb").read() for name in
+		["5-genesis.txt", "5-exodus.txt", "5-leviticus.txt", "5-numbers.txt", "5-deuteronomy.txt"])
+	write_until(os.path.join(temporary_directory, "torah.txt"), size, lambda: books)
+
+	# Random ASCII web server logs
+	def log_lines():
+		lines = []
+		for _ in range(1000):
+			words = [generator.choice(LOG_WORDS) for _ in range(generator.randint(4, 14))]
+			lines.append("%d-%02d-%02d %s" % (2024, generator.randint(1, 12), generator.randint(1, 28), " ".join(words)))
+		return ("\n".join(lines) + "\n").encode("utf-8")
+	write_until(os.path.join(temporary_directory, "logs.txt"), size, log_lines)
+
+	# Hebrew and emoji UTF-8 text like the wide character example
+	sample = open(os.path.join(EXAMPLES, "3-wchar_grep.txt"), "rb").read().decode("utf-8").split()
+	def utf8_lines():
+		lines = [" ".join(generator.choice(sample) for _ in range(generator.randint(3, 12))) for _ in range(1000)]
+		return ("\n".join(lines) + "\n").encode("utf-8")
+	write_until(os.path.join(temporary_directory, "utf8.txt"), size, utf8_lines)
+
+	# One huge line without any newline
+	def single_line():
+		return (" ".join(generator.choice(LOG_WORDS) for _ in range(10000)) + " ").encode("utf-8")
+	write_until(os.path.join(temporary_directory, "single_line.txt"), size, single_line)
+
+	# Many tiny files cut from the books
+	tiny_directory = os.path.join(temporary_directory, "tiny_files")
+	os.makedirs(tiny_directory)
+	tiny_size = 1024
+	for index in range(max(1, size // tiny_size)):
+		offset = (index * tiny_size) % (len(books) - tiny_size)
+		with open(os.path.join(tiny_directory, "%06d.txt" % index), "wb") as file:
+			file.write(books[offset:offset + tiny_size])
+
+	os.rename(temporary_directory, directory)
+	return directory
+
+def corpus_path(directory, corpus):
+	# Directory of tiny files is searched with -r, because naming every
+	# file on command line exceeds argument size limit of large corpora
+	if corpus == "tiny_files":
+		return os.path.join(directory, corpus)
+	return os.path.join(directory, corpus + ".txt")
+
+def corpus_files(directory, corpus):
+	if corpus == "tiny_files":
+		tiny_directory = os.path.join(directory, corpus)
+		return [os.path.join(tiny_directory, name) for name in sorted(os.listdir(tiny_directory))]
+	return [os.path.join(directory, corpus + ".txt")]
+
+def count_bytes_and_lines(files):
+	byte_count = 0
+	line_count = 0
+	for name in files:
+		data = open(name, "rb").read()
+		byte_count += len(data)
+		line_count += data.count(b"\n") + (1 if data and not data.endswith(b"\n") else 0)
+	return byte_count, line_count
+
+def run(measure, command, timeout):
+	# Returns seconds, peak resident memory in kilobytes and exit code
+	output = subprocess.run([measure, str(timeout)] + command, stdout=subprocess.PIPE, check=True).stdout
+	seconds, peak_rss, exit_code = output.split()
+	return float(seconds), int(peak_rss), int(exit_code)
+
+def run_library(library, ignore_case, match_whole_words, pattern, file_name):
+	# Calling shared library of stage 6 the same way as its grep.py
+	# Exit code follows grep, 0 with matches, 1 without and 2 on errors
+	libgrep = ctypes.CDLL(library)
+	libgrep.grep_compile.argtypes = [ctypes.c_char_p, ctypes.c_size_t, ctypes.c_int]
+	libgrep.grep_compile.restype = ctypes.c_void_p
+	libgrep.grep_search_file.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+	libgrep.grep_search_file.restype = ctypes.POINTER(ctypes.c_size_t * 3) # GrepMatches
+	libgrep.grep_matches_free.argtypes = [ctypes.c_void_p]
+	libgrep.grep_pattern_free.argtypes = [ctypes.c_void_p]
+	encoded = pattern.encode("utf-8")
+	handle = libgrep.grep_compile(encoded, len(encoded), ignore_case | (match_whole_words << 1))
+	if not handle:
+		return 2
+	matches = libgrep.grep_search_file(handle, file_name.encode("utf-8"))
+	exit_code = 2 if not matches else (0 if matches.contents[1] > 0 else 1)
+	libgrep.grep_matches_free(matches)
+	libgrep.grep_pattern_free(handle)
+	return exit_code
+
+def stage_command(stage, binary, flags, threads, pattern, path):
+	if stage == "6-lib_grep":
+		return [sys.executable, os.path.abspath(__file__), "--run-library", binary,
+			str(int("-i" in flags)), str(int("-w" in flags)), pattern, path]
+	if stage == "5-pthread_grep":
+		recursive = ["-r"] if os.path.isdir(path) else []
+		return [binary] + flags + recursive + ["-t", str(threads), pattern, path]
+	return [binary] + flags + [pattern, path]
+
+def main():
+	parser = argparse.ArgumentParser(description="Benchmark grep stages on generated corpora.")
+	parser.add_argument("--size-mb", type=int, default=16, help="size of each generated corpus")
+	parser.add_argument("--stages", default=",".join(STAGES), help="comma separated stage directories")
+	parser.add_argument("--corpora", default=",".join(PATTERNS), help="comma separated corpora")
+	parser.add_argument("--threads", default="1,2,4,%d" % os.cpu_count(), help="thread counts of stage 5")
+	parser.add_argument("--repeat", type=int, default=3, help="runs of each case, fastest is reported")
+	parser.add_argument("--timeout", type=float, default=120, help="seconds before a run is killed")
+	parser.add_argument("--cc", default=os.environ.get("CC", "cc"), help="C compiler, $CC by default")
+	parser.add_argument("--cflags", default="-O2", help="compiler flags for every stage")
+	parser.add_argument("--output", help="CSV file instead of standard output")
+	parser.add_argument("--run-library", nargs=5, help=argparse.SUPPRESS)
+	arguments = parser.parse_args()
+
+	if arguments.run_library:
+		library, ignore_case, match_whole_words, pattern, file_name = arguments.run_library
+		sys.exit(run_library(library, int(ignore_case), int(match_whole_words), pattern, file_name))
+
+	stages = arguments.stages.split(",")
+	thread_counts = sorted(set(int(count) for count in arguments.threads.split(",")))
+	binaries = build(stages, os.path.join(BENCHMARK, "build"), arguments.cc, arguments.cflags.split())
+	directory = generate(os.path.join(BENCHMARK, "corpus"), arguments.size_mb * 1024 * 1024)
+
+	output = open(arguments.output, "w", newline="") if arguments.output else sys.stdout
+	writer = csv.writer(output)
+	writer.writerow(["stage", "corpus", "pattern", "pattern_length", "ignore_case", "whole_words",
+		"threads", "bytes", "lines", "seconds", "mb_per_second", "lines_per_second", "peak_rss_kb", "exit_code"])
+
+	for corpus in arguments.corpora.split(","):
+		files = corpus_files(directory, corpus)
+		path = corpus_path(directory, corpus)
+		byte_count, line_count = count_bytes_and_lines(files)
+		for stage in stages:
+			# Only stage 5 searches several files and uses threads
+			if len(files) > 1 and stage != "5-pthread_grep":
+				continue
+			stage_threads = thread_counts if stage == "5-pthread_grep" else [1]
+			for pattern in PATTERNS[corpus]:
+				for flags in [[], ["-i"], ["-w"], ["-i", "-w"]]:
+					for threads in stage_threads:
+						command = stage_command(stage, binaries[stage], flags, threads, pattern, path)
+						runs = [run(binaries["measure"], command, arguments.timeout) for _ in range(arguments.repeat)]
+						seconds, peak_rss, exit_code = min(runs)
+						writer.writerow([stage, corpus, pattern, len(pattern.encode("utf-8")),
+							int("-i" in flags), int("-w" in flags), threads, byte_count, line_count,
+							"%.4f" % seconds, "%.2f" % (byte_count / 1e6 / seconds),
+							"%.0f" % (line_count / seconds), peak_rss, exit_code])
+						output.flush()
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,60 @@
+#include <stdlib.h> // EXIT_SUCCESS, EXIT_FAILURE, atof()
+#include <stdio.h> // printf(), fprintf()
+#include <string.h> // strerror()
+#include <errno.h> // errno, EINTR
+#include <signal.h> // kill(), SIGKILL
+#include <time.h> // clock_gettime()
+#include <fcntl.h> // open()
+#include <unistd.h> // fork(), execvp(), dup2(), alarm()
+#include <sys/resource.h> // struct rusage
+#include <sys/wait.h> // wait4()
+
+/* Runs a command and prints its wall time, peak memory and exit code */
+/* Peak memory reported for a child includes memory of the process it */
+/* was forked from, so commands are started from this small process */
+/* instead of from Python */
+
+static pid_t child_G = 0;
+
+static void kill_child(int signal_number) {
+	(void)signal_number;
+	if (child_G > 0) { kill(child_G, SIGKILL); }
+}
+
+int main(int argc, char **argv) {
+	if (argc < 3) {
+		fprintf(stderr, "Usage: measure TIMEOUT COMMAND [ARGUMENTS]\n");
+		return EXIT_FAILURE;
+	}
+	double timeout = atof(argv[1]);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	child_G = fork();
+	if (child_G == -1) { return EXIT_FAILURE; }
+	if (child_G == 0) {
+		/* Output of measured command is discarded */
+		int null_file = open("/dev/null", O_WRONLY);
+		dup2(null_file, STDOUT_FILENO);
+		dup2(null_file, STDERR_FILENO);
+		execvp(argv[2], argv + 2);
+		_exit(127);
+	}
+
+	signal(SIGALRM, kill_child);
+	alarm((unsigned int)(timeout + 0.999));
+
+	int status;
+	struct rusage usage;
+	while (wait4(child_G, &status, 0, &usage) == -1) {
+		if (errno == EINTR) { continue; } // alarm arrived while waiting
+		fprintf(stderr, "measure: wait4: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+	int exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status);
+	printf("%.6f %ld %d\n", seconds, usage.ru_maxrss, exit_code);
+	return EXIT_SUCCESS;
+}